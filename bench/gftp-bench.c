@@ -0,0 +1,820 @@
+/*****************************************************************************/
+/*  gftp-bench.c - microbenchmarks for the hot paths in libgftp              */
+/*                                                                           */
+/*  This program is free software; you can redistribute it and/or modify     */
+/*  it under the terms of the GNU General Public License as published by     */
+/*  the Free Software Foundation; either version 2 of the License, or        */
+/*  (at your option) any later version.                                      */
+/*                                                                           */
+/*  This program is distributed in the hope that it will be useful,          */
+/*  but WITHOUT ANY WARRANTY; without even the implied warranty of           */
+/*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the            */
+/*  GNU General Public License for more details.                             */
+/*                                                                           */
+/*  You should have received a copy of the GNU General Public License        */
+/*  along with this program; if not, write to the Free Software              */
+/*  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111 USA      */
+/*****************************************************************************/
+
+#include "gftp.h"
+#include <ftw.h>
+
+/* Each benchmark runs over a synthetic corpus of entries (1,000,000 by
+   default, see -n) and prints one JSON object per line:
+
+   {"bench":"parse_unix","ops":1000000,"ns_per_op":812.4,
+    "allocs_per_op":4.00,"mb_per_s":71.3,"ops_per_s":1230921}
+
+   so the output of two commits can be compared line by line. An op is one
+   listing line, file name or cache lookup. allocs_per_op is -1 when the C
+   library does not let the allocator be wrapped. */
+
+typedef struct gftp_bench_tag
+{
+  const char *name;
+  void (*run) (gftp_request * request, long entries);
+} gftp_bench;
+
+static struct timespec bench_start_time;
+static guint bench_start_allocs;
+static int bench_verbose = 0;
+
+#if defined (__GLIBC__) && !defined (GFTP_BENCH_NO_MALLOC_COUNT)
+
+/* Count every allocation made by the program, including the ones glib
+   makes, by wrapping the glibc allocator */
+
+extern void *__libc_malloc (size_t size);
+extern void *__libc_calloc (size_t nmemb, size_t size);
+extern void *__libc_realloc (void *ptr, size_t size);
+extern void __libc_free (void *ptr);
+
+/* The benchmarks run threads, so the count is atomic */
+static volatile gint bench_allocs = 0;
+#define BENCH_COUNTS_ALLOCS 1
+
+void *
+malloc (size_t size)
+{
+  g_atomic_int_inc (&bench_allocs);
+  return (__libc_malloc (size));
+}
+
+
+void *
+calloc (size_t nmemb, size_t size)
+{
+  g_atomic_int_inc (&bench_allocs);
+  return (__libc_calloc (nmemb, size));
+}
+
+
+void *
+realloc (void *ptr, size_t size)
+{
+  g_atomic_int_inc (&bench_allocs);
+  return (__libc_realloc (ptr, size));
+}
+
+
+void
+free (void *ptr)
+{
+  __libc_free (ptr);
+}
+
+#else
+
+static volatile gint bench_allocs = 0;
+#define BENCH_COUNTS_ALLOCS 0
+
+#endif
+
+
+static void
+bench_log (gftp_logging_level level, gftp_request * request,
+           const char *string, ...)
+{
+  va_list argp;
+
+  if (level != gftp_logging_error && !bench_verbose)
+    return;
+
+  va_start (argp, string);
+  vfprintf (stderr, string, argp);
+  va_end (argp);
+}
+
+
+/* UI dependent functions that libgftp needs. Nothing here connects to a
+   server, so they are never asked anything */
+int
+gftpui_protocol_ask_yes_no (gftp_request * request, char *title,
+                            char *question)
+{
+  return (0);
+}
+
+
+char *
+gftpui_protocol_ask_user_input (gftp_request * request, char *title,
+                                char *question, int shown)
+{
+  return (NULL);
+}
+
+
+void
+gftpui_protocol_update_timeout (gftp_request * request)
+{
+}
+
+
+static void
+bench_start (void)
+{
+  bench_start_allocs = g_atomic_int_get (&bench_allocs);
+  clock_gettime (CLOCK_MONOTONIC, &bench_start_time);
+}
+
+
+static void
+bench_stop (const char *name, long ops, size_t bytes)
+{
+  guint allocs;
+  struct timespec now;
+  double elapsed;
+
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  allocs = (guint) g_atomic_int_get (&bench_allocs) - bench_start_allocs;
+
+  elapsed = (now.tv_sec - bench_start_time.tv_sec) +
+            (now.tv_nsec - bench_start_time.tv_nsec) / 1000000000.0;
+  if (elapsed <= 0 || ops <= 0)
+    return;
+
+  printf ("{\"bench\":\"%s\",\"ops\":%ld,\"ns_per_op\":%.1f,"
+          "\"allocs_per_op\":%.2f,\"mb_per_s\":%.1f,\"ops_per_s\":%.0f}\n",
+          name, ops, elapsed * 1000000000.0 / ops,
+          BENCH_COUNTS_ALLOCS ? (double) allocs / ops : -1.0,
+          bytes > 0 ? bytes / elapsed / (1024 * 1024) : 0.0,
+          ops / elapsed);
+  fflush (stdout);
+}
+
+
+/* Synthetic corpora. Every line is NUL terminated and the lines are packed
+   back to back, so the parsers see the same memory layout as the listing
+   buffer */
+
+typedef struct gftp_bench_corpus_tag
+{
+  char *data;
+  size_t len,
+         alloced;
+  long lines;
+} gftp_bench_corpus;
+
+typedef void (*gftp_bench_line_func) (long num, char *buf, size_t len);
+
+static const char *bench_months[] = { "Jan", "Feb", "Mar", "Apr", "May",
+                                      "Jun", "Jul", "Aug", "Sep", "Oct",
+                                      "Nov", "Dec" };
+
+static void
+bench_unix_line (long num, char *buf, size_t len)
+{
+  switch (num % 10)
+    {
+      case 0:
+        g_snprintf (buf, len, "drwxr-xr-x    2 user%ld    group%ld      4096 %s %2ld %02ld:%02ld dir%ld",
+                    num % 7, num % 3, bench_months[num % 12], 1 + num % 28,
+                    num % 24, num % 60, num);
+        break;
+      case 1:
+        g_snprintf (buf, len, "lrwxrwxrwx    1 user%ld    group%ld        11 %s %2ld  %ld link%ld -> target%ld",
+                    num % 7, num % 3, bench_months[num % 12], 1 + num % 28,
+                    1995 + num % 30, num, num);
+        break;
+      case 2:
+        g_snprintf (buf, len, "-rw-r--r--    1 user%ld    group%ld  %10ld %s %2ld  %ld file name %ld.tar.gz",
+                    num % 7, num % 3, num * 7919, bench_months[num % 12],
+                    1 + num % 28, 1995 + num % 30, num);
+        break;
+      default:
+        g_snprintf (buf, len, "-rw-r--r--    1 user%ld    group%ld  %10ld %s %2ld %02ld:%02ld file%ld.txt",
+                    num % 7, num % 3, num * 131, bench_months[num % 12],
+                    1 + num % 28, num % 24, num % 60, num);
+        break;
+    }
+}
+
+
+static void
+bench_eplf_line (long num, char *buf, size_t len)
+{
+  if (num % 10 == 0)
+    g_snprintf (buf, len, "+i8388621.%ld,m%ld,/,\tdir%ld", num,
+                824255902 + num * 60, num);
+  else
+    g_snprintf (buf, len, "+i8388621.%ld,m%ld,r,s%ld,\tfile%ld.txt", num,
+                824255902 + num * 60, num * 131, num);
+}
+
+
+static void
+bench_dos_line (long num, char *buf, size_t len)
+{
+  if (num % 10 == 0)
+    g_snprintf (buf, len, "%02ld-%02ld-%02ld  %02ld:%02ld%s       <DIR>          dir%ld",
+                1 + num % 12, 1 + num % 28, num % 100, 1 + num % 12,
+                num % 60, num % 2 ? "PM" : "AM", num);
+  else
+    g_snprintf (buf, len, "%02ld-%02ld-%02ld  %02ld:%02ld%s %14ld file%ld.txt",
+                1 + num % 12, 1 + num % 28, num % 100, 1 + num % 12,
+                num % 60, num % 2 ? "PM" : "AM", num * 131, num);
+}
+
+
+static void
+bench_mlsd_time (long num, char *buf, size_t len)
+{
+  g_snprintf (buf, len, "%04ld%02ld%02ld%02ld%02ld%02ld file%ld",
+              1995 + num % 30, 1 + num % 12, 1 + num % 28, num % 24,
+              num % 60, (num / 60) % 60, num);
+}
+
+
+static void
+bench_iso_time (long num, char *buf, size_t len)
+{
+  g_snprintf (buf, len, "%04ld-%02ld-%02ld %02ld:%02ld file%ld",
+              1995 + num % 30, 1 + num % 12, 1 + num % 28, num % 24,
+              num % 60, num);
+}
+
+
+static void
+bench_unix_time (long num, char *buf, size_t len)
+{
+  if (num % 4 == 0)
+    g_snprintf (buf, len, "%s %2ld  %ld file%ld", bench_months[num % 12],
+                1 + num % 28, 1995 + num % 30, num);
+  else
+    g_snprintf (buf, len, "%s %2ld %02ld:%02ld file%ld",
+                bench_months[num % 12], 1 + num % 28, num % 24, num % 60, num);
+}
+
+
+static void
+bench_ascii_name (long num, char *buf, size_t len)
+{
+  g_snprintf (buf, len, "report-%ld-final.%s", num,
+              num % 3 == 0 ? "txt" : num % 3 == 1 ? "tar.gz" : "jpg");
+}
+
+
+static void
+bench_latin1_name (long num, char *buf, size_t len)
+{
+  /* "résumé" and "Übersicht" in ISO-8859-1 */
+  g_snprintf (buf, len, num % 2 ? "r\xe9sum\xe9-%ld.txt" : "\xdc" "bersicht-%ld.pdf",
+              num);
+}
+
+
+static void
+bench_corpus_build (gftp_bench_corpus * corpus, long entries,
+                    gftp_bench_line_func line_func, char separator)
+{
+  char buf[512];
+  size_t len;
+  long i;
+
+  memset (corpus, 0, sizeof (*corpus));
+  for (i = 0; i < entries; i++)
+    {
+      line_func (i, buf, sizeof (buf));
+      len = strlen (buf);
+
+      if (corpus->len + len + 1 > corpus->alloced)
+        {
+          corpus->alloced = (corpus->alloced + len + 1) * 2;
+          corpus->data = g_realloc (corpus->data, corpus->alloced);
+        }
+
+      memcpy (corpus->data + corpus->len, buf, len);
+      corpus->len += len;
+      corpus->data[corpus->len++] = separator;
+    }
+
+  corpus->lines = entries;
+}
+
+
+static void
+bench_corpus_free (gftp_bench_corpus * corpus)
+{
+  g_free (corpus->data);
+  memset (corpus, 0, sizeof (*corpus));
+}
+
+
+static void
+bench_parse (gftp_request * request, long entries, const char *name,
+             gftp_bench_line_func line_func)
+{
+  gftp_bench_corpus corpus;
+  gftp_file fle;
+  const char *pos;
+  long i;
+
+  bench_corpus_build (&corpus, entries, line_func, '\0');
+  request->server_type = GFTP_DIRTYPE_OTHER;
+  gftp_set_listing_clock (request);
+  request->listing_type = 0;
+
+  bench_start ();
+  for (i = 0, pos = corpus.data; i < corpus.lines; i++)
+    {
+      gftp_parse_ls (request, pos, &fle, 0);
+      gftp_file_destroy (&fle, 0);
+      pos += strlen (pos) + 1;
+    }
+  bench_stop (name, corpus.lines, corpus.len);
+
+  bench_corpus_free (&corpus);
+}
+
+
+static void
+bench_parse_unix (gftp_request * request, long entries)
+{
+  bench_parse (request, entries, "parse_unix", bench_unix_line);
+}
+
+
+static void
+bench_parse_eplf (gftp_request * request, long entries)
+{
+  bench_parse (request, entries, "parse_eplf", bench_eplf_line);
+}
+
+
+static void
+bench_parse_dos (gftp_request * request, long entries)
+{
+  bench_parse (request, entries, "parse_dos", bench_dos_line);
+}
+
+
+static void
+bench_time (gftp_request * request, long entries, const char *name,
+            gftp_bench_line_func line_func)
+{
+  gftp_bench_corpus corpus;
+  char *pos, *endpos;
+  long i;
+
+  bench_corpus_build (&corpus, entries, line_func, '\0');
+  gftp_set_listing_clock (request);
+
+  bench_start ();
+  for (i = 0, pos = corpus.data; i < corpus.lines; i++)
+    {
+      parse_time (request, pos, &endpos);
+      pos += strlen (pos) + 1;
+    }
+  bench_stop (name, corpus.lines, corpus.len);
+
+  bench_corpus_free (&corpus);
+}
+
+
+static void
+bench_time_unix (gftp_request * request, long entries)
+{
+  bench_time (request, entries, "time_unix", bench_unix_time);
+}
+
+
+static void
+bench_time_iso (gftp_request * request, long entries)
+{
+  bench_time (request, entries, "time_iso", bench_iso_time);
+}
+
+
+static void
+bench_time_mlsd (gftp_request * request, long entries)
+{
+  bench_time (request, entries, "time_mlsd", bench_mlsd_time);
+}
+
+
+static void
+bench_get_line (gftp_request * request, long entries)
+{
+  gftp_getline_buffer * rbuf;
+  gftp_bench_corpus corpus;
+  char tempstr[PATH_MAX];
+  size_t linelen;
+  long lines;
+  char *line;
+  int fd;
+
+  bench_corpus_build (&corpus, entries, bench_unix_line, '\n');
+
+  g_snprintf (tempstr, sizeof (tempstr), "%s/getlineXXXXXX", g_get_tmp_dir ());
+  if ((fd = mkstemp (tempstr)) < 0)
+    {
+      perror (tempstr);
+      bench_corpus_free (&corpus);
+      return;
+    }
+  unlink (tempstr);
+
+  if (gftp_fd_write (request, corpus.data, corpus.len, fd) < 0)
+    {
+      close (fd);
+      bench_corpus_free (&corpus);
+      return;
+    }
+
+  lseek (fd, 0, SEEK_SET);
+  rbuf = NULL;
+  lines = 0;
+
+  bench_start ();
+  while (gftp_get_line_view (request, &rbuf, &line, &linelen, fd) > 0)
+    lines++;
+  bench_stop ("get_line", lines, corpus.len);
+
+  if (rbuf != NULL)
+    gftp_free_getline_buffer (&rbuf);
+  close (fd);
+  bench_corpus_free (&corpus);
+}
+
+
+static void
+bench_match (gftp_request * request, long entries, const char *name,
+             const char *filespec)
+{
+  gftp_bench_corpus corpus;
+  const char *pos;
+  long i;
+
+  bench_corpus_build (&corpus, entries, bench_ascii_name, '\0');
+
+  bench_start ();
+  for (i = 0, pos = corpus.data; i < corpus.lines; i++)
+    {
+      gftp_match_filespec (request, pos, filespec);
+      pos += strlen (pos) + 1;
+    }
+  bench_stop (name, corpus.lines, corpus.len);
+
+  bench_corpus_free (&corpus);
+}
+
+
+static void
+bench_match_suffix (gftp_request * request, long entries)
+{
+  bench_match (request, entries, "match_suffix", "*.gz");
+}
+
+
+static void
+bench_match_infix (gftp_request * request, long entries)
+{
+  bench_match (request, entries, "match_infix", "report-*9*-final.*");
+}
+
+
+static void
+bench_match_multi (gftp_request * request, long entries)
+{
+  bench_match (request, entries, "match_multi",
+               "*.{c,h,cc,cpp,txt,gz,bz2,xz,zip,tar,iso,[Pp][Dd][Ff]}");
+}
+
+
+static GList *
+bench_file_list (long entries)
+{
+  GList * files;
+  gftp_file * fle;
+  long i, num;
+
+  files = NULL;
+  for (i = 0; i < entries; i++)
+    {
+      /* A fixed permutation of the entries, so the sort has work to do */
+      num = (i * 7919) % entries;
+
+      fle = g_malloc0 (sizeof (*fle));
+      fle->file = g_strdup_printf ("file%ld.txt", num);
+      fle->user = g_strdup_printf ("user%ld", num % 7);
+      fle->group = g_strdup_printf ("group%ld", num % 3);
+      fle->size = num * 131;
+      fle->datetime = 824255902 + num * 60;
+      fle->st_mode = num % 10 == 0 ? S_IFDIR | 0755 : S_IFREG | 0644;
+      files = g_list_prepend (files, fle);
+    }
+
+  return (files);
+}
+
+
+static void
+bench_sort (gftp_request * request, long entries, const char *name,
+            int column)
+{
+  GList * files;
+
+  files = bench_file_list (entries);
+
+  bench_start ();
+  files = gftp_sort_filelist (files, column, 1);
+  bench_stop (name, entries, 0);
+
+  free_file_list (files);
+}
+
+
+static void
+bench_sort_name (gftp_request * request, long entries)
+{
+  bench_sort (request, entries, "sort_name", GFTP_SORT_COL_FILE);
+}
+
+
+static void
+bench_sort_size (gftp_request * request, long entries)
+{
+  bench_sort (request, entries, "sort_size", GFTP_SORT_COL_SIZE);
+}
+
+
+static void
+bench_sort_datetime (gftp_request * request, long entries)
+{
+  bench_sort (request, entries, "sort_datetime", GFTP_SORT_COL_DATETIME);
+}
+
+
+static void
+bench_charset (gftp_request * request, long entries, const char *name,
+               gftp_bench_line_func line_func)
+{
+  gftp_bench_corpus corpus;
+  const char *pos;
+  char *utf8;
+  size_t len;
+  long i;
+
+  bench_corpus_build (&corpus, entries, line_func, '\0');
+  gftp_set_request_option (request, "remote_charsets", "ISO-8859-1");
+
+  bench_start ();
+  for (i = 0, pos = corpus.data; i < corpus.lines; i++)
+    {
+      if ((utf8 = gftp_filename_to_utf8 (request, pos, &len)) != NULL)
+        g_free (utf8);
+      pos += strlen (pos) + 1;
+    }
+  bench_stop (name, corpus.lines, corpus.len);
+
+  gftp_set_request_option (request, "remote_charsets", "");
+  bench_corpus_free (&corpus);
+}
+
+
+static void
+bench_charset_ascii (gftp_request * request, long entries)
+{
+  bench_charset (request, entries, "charset_ascii", bench_ascii_name);
+}
+
+
+static void
+bench_charset_latin1 (gftp_request * request, long entries)
+{
+  bench_charset (request, entries, "charset_latin1", bench_latin1_name);
+}
+
+
+#define BENCH_CACHE_DIRS	1000
+#define BENCH_CACHE_FILES	20
+
+static void
+bench_cache_fill (gftp_request * request, long dirs, long files)
+{
+  gftp_file fle;
+  long i, j;
+
+  for (i = 0; i < dirs; i++)
+    {
+      g_free (request->directory);
+      request->directory = g_strdup_printf ("/bench/dir%ld", i);
+      if ((request->cachefd = gftp_new_cache_entry (request)) < 0)
+        return;
+
+      for (j = 0; j < files; j++)
+        {
+          memset (&fle, 0, sizeof (fle));
+          fle.file = g_strdup_printf ("file%ld.txt", j);
+          fle.user = g_strdup ("user");
+          fle.group = g_strdup ("group");
+          fle.size = j * 131;
+          fle.datetime = 824255902 + j * 60;
+          fle.st_mode = S_IFREG | 0644;
+          gftp_cache_add_file (request, &fle);
+          gftp_file_destroy (&fle, 0);
+        }
+
+      gftp_cache_write_listing (request);
+      close (request->cachefd);
+      request->cachefd = -1;
+    }
+}
+
+
+static void
+bench_cache_lookup (gftp_request * request, long entries)
+{
+  long i;
+  int fd;
+
+  gftp_clear_cache_files ();
+  bench_cache_fill (request, BENCH_CACHE_DIRS, BENCH_CACHE_FILES);
+
+  bench_start ();
+  for (i = 0; i < entries; i++)
+    {
+      g_free (request->directory);
+      request->directory = g_strdup_printf ("/bench/dir%ld",
+                                            (i * 7919) % BENCH_CACHE_DIRS);
+      if ((fd = gftp_find_cache_entry (request)) > 0)
+        close (fd);
+    }
+  bench_stop ("cache_lookup", entries, 0);
+}
+
+
+static void
+bench_cache_read (gftp_request * request, long entries)
+{
+  gftp_file fle;
+  long files;
+  int fd;
+
+  gftp_clear_cache_files ();
+  bench_cache_fill (request, 1, entries);
+
+  g_free (request->directory);
+  request->directory = g_strdup ("/bench/dir0");
+  if ((fd = gftp_find_cache_entry (request)) < 0)
+    return;
+
+  files = 0;
+  bench_start ();
+  if (gftp_cache_read_listing (request, fd) == 0)
+    {
+      memset (&fle, 0, sizeof (fle));
+      while (gftp_cache_get_next_file (request, &fle) > 0)
+        {
+          files++;
+          gftp_file_destroy (&fle, 0);
+        }
+    }
+  bench_stop ("cache_read", files, 0);
+
+  close (fd);
+  gftp_cache_free_listing (request);
+}
+
+
+static int
+bench_remove_file (const char *path, const struct stat *st, int flag,
+                   struct FTW *ftw)
+{
+  return (remove (path));
+}
+
+
+static gftp_bench gftp_benchmarks[] = {
+  {"parse_unix",	bench_parse_unix},
+  {"parse_eplf",	bench_parse_eplf},
+  {"parse_dos",		bench_parse_dos},
+  {"time_unix",		bench_time_unix},
+  {"time_iso",		bench_time_iso},
+  {"time_mlsd",		bench_time_mlsd},
+  {"get_line",		bench_get_line},
+  {"match_suffix",	bench_match_suffix},
+  {"match_infix",	bench_match_infix},
+  {"match_multi",	bench_match_multi},
+  {"sort_name",		bench_sort_name},
+  {"sort_size",		bench_sort_size},
+  {"sort_datetime",	bench_sort_datetime},
+  {"charset_ascii",	bench_charset_ascii},
+  {"charset_latin1",	bench_charset_latin1},
+  {"cache_lookup",	bench_cache_lookup},
+  {"cache_read",	bench_cache_read},
+  {NULL, NULL}
+};
+
+
+static void
+bench_usage (void)
+{
+  int i;
+
+  printf (_("usage: gftp-bench [-v] [-n entries] [benchmark ...]\n"));
+  printf (_("Benchmarks:"));
+  for (i = 0; gftp_benchmarks[i].name != NULL; i++)
+    printf (" %s", gftp_benchmarks[i].name);
+  printf ("\n");
+  exit (EXIT_FAILURE);
+}
+
+
+int
+main (int argc, char **argv)
+{
+  char tempdir[PATH_MAX];
+  gftp_request * request;
+  long entries;
+  int i, j, opt;
+
+  entries = 1000000;
+  while ((opt = getopt (argc, argv, "n:v")) != -1)
+    {
+      switch (opt)
+        {
+          case 'n':
+            entries = strtol (optarg, NULL, 10);
+            break;
+          case 'v':
+            bench_verbose = 1;
+            break;
+          default:
+            bench_usage ();
+        }
+    }
+
+  if (entries <= 0)
+    bench_usage ();
+
+  for (i = optind; i < argc; i++)
+    {
+      for (j = 0; gftp_benchmarks[j].name != NULL; j++)
+        if (strcmp (argv[i], gftp_benchmarks[j].name) == 0)
+          break;
+
+      if (gftp_benchmarks[j].name == NULL)
+        bench_usage ();
+    }
+
+  /* Keep the config file and directory cache away from the user's */
+  g_snprintf (tempdir, sizeof (tempdir), "%s/gftp-benchXXXXXX",
+              g_get_tmp_dir ());
+  if (mkdtemp (tempdir) == NULL)
+    {
+      perror (tempdir);
+      return (EXIT_FAILURE);
+    }
+  setenv ("HOME", tempdir, 1);
+
+  gftp_read_config_file (BENCH_SHARE_DIR);
+
+  request = gftp_request_new ();
+  request->logging_function = bench_log;
+  request->url_prefix = "ftp";
+  request->hostname = g_strdup ("bench.example.org");
+  request->username = g_strdup (GFTP_ANONYMOUS_USER);
+  request->port = 21;
+  request->use_cache = 1;
+
+  for (j = 0; gftp_benchmarks[j].name != NULL; j++)
+    {
+      if (optind < argc)
+        {
+          for (i = optind; i < argc; i++)
+            if (strcmp (argv[i], gftp_benchmarks[j].name) == 0)
+              break;
+
+          if (i == argc)
+            continue;
+        }
+
+      gftp_benchmarks[j].run (request, entries);
+    }
+
+  gftp_clear_cache_files ();
+  gftp_request_destroy (request, 1);
+  nftw (tempdir, bench_remove_file, 16, FTW_DEPTH | FTW_PHYS);
+  return (EXIT_SUCCESS);
+}
@@ -0,0 +1,834 @@
+#!/usr/bin/env python3
+#
+# gftp-loopback.py - end to end transfer benchmarks for gftp-text over an
+#                    emulated network on the loopback interface
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111 USA
+#
+# A minimal FTP/FTPS server runs inside this script, and SFTP goes through
+# the local sftp-server, which gftp starts through its ssh_prog_name option.
+# All of them are reached through an emulated link with the round trip
+# time and bandwidth given on the command line. The emulation is done in
+# user space by default, or with tc netem on lo when --netem is given (SFTP
+# runs over pipes, so it is always emulated in user space).
+#
+# gftp-text is then driven through a large file, many small files and a
+# deep directory tree in both directions. Each run prints one JSON line:
+#
+#   {"protocol":"ftp","scenario":"large","direction":"get","ok":true,
+#    "bytes":268435456,"files":1,"seconds":2.91,"mb_per_s":87.9,
+#    "files_per_s":0.3,"cpu_s":0.84,"cpu_s_per_mb":0.0033,
+#    "syscalls_per_mb":212.5}
+#
+# cpu_s is the CPU time used by gftp-text alone. syscalls_per_mb is only
+# measured with --syscalls, which needs strace and repeats each run under it.
+
+import argparse
+import collections
+import json
+import os
+import resource
+import shutil
+import signal
+import socket
+import socketserver
+import ssl
+import stat
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+MB = 1024 * 1024
+CHUNK = 65536
+
+
+class Link:
+    """One direction of an emulated network link. Data passed to send()
+    is written out by a separate thread delay seconds later, no faster than
+    rate bytes per second. At most queue_limit bytes are in flight, which
+    stands in for the socket buffers."""
+
+    def __init__(self, write, finish, delay, rate):
+        self.write = write
+        self.finish = finish
+        self.delay = delay
+        self.rate = rate
+        self.queue = collections.deque()
+        self.queued = 0
+        self.queue_limit = max(4 * MB, int(2 * rate * delay))
+        self.cond = threading.Condition()
+        self.busy_until = 0.0
+        thread = threading.Thread(target=self._run, daemon=True)
+        thread.start()
+
+    def send(self, data):
+        with self.cond:
+            while self.queued > self.queue_limit:
+                self.cond.wait()
+
+            now = time.monotonic()
+            if self.rate > 0:
+                self.busy_until = max(now, self.busy_until) + \
+                    len(data) / self.rate
+                release = self.busy_until + self.delay
+            else:
+                release = now + self.delay
+
+            self.queue.append((release, data))
+            self.queued += len(data)
+            self.cond.notify_all()
+
+    def close(self):
+        self.send(b"")
+
+    def _run(self):
+        while True:
+            with self.cond:
+                while not self.queue:
+                    self.cond.wait()
+                release, data = self.queue.popleft()
+
+            wait = release - time.monotonic()
+            if wait > 0:
+                time.sleep(wait)
+
+            with self.cond:
+                self.queued -= len(data)
+                self.cond.notify_all()
+
+            if not data:
+                self.finish()
+                return
+
+            try:
+                self.write(data)
+            except OSError:
+                self.finish()
+                return
+
+
+def pump(read, link):
+    while True:
+        try:
+            data = read(CHUNK)
+        except OSError:
+            data = b""
+
+        if not data:
+            link.close()
+            return
+
+        link.send(data)
+
+
+def _shutdown_write(sock):
+    try:
+        sock.shutdown(socket.SHUT_WR)
+    except OSError:
+        pass
+
+
+def shape_socket(sock, delay, rate, closed=None):
+    """Puts an emulated link between sock and the returned socket. sock is
+    closed once both directions are drained, and then closed is set."""
+    if delay <= 0 and rate <= 0:
+        return sock
+
+    outer, inner = socket.socketpair()
+    done = threading.Semaphore(0)
+
+    def closer():
+        done.acquire()
+        done.acquire()
+        sock.close()
+        outer.close()
+        if closed is not None:
+            closed.set()
+
+    up = Link(outer.sendall, lambda: (_shutdown_write(outer), done.release()),
+              delay, rate)
+    down = Link(sock.sendall, lambda: (_shutdown_write(sock), done.release()),
+                delay, rate)
+    for args in ((sock.recv, up), (outer.recv, down)):
+        threading.Thread(target=pump, args=args, daemon=True).start()
+    threading.Thread(target=closer, daemon=True).start()
+    return inner
+
+
+# The FTP/FTPS server
+
+MONTHS = ["Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep",
+          "Oct", "Nov", "Dec"]
+
+
+def ls_line(path, name):
+    st = os.lstat(path)
+    tm = time.localtime(st.st_mtime)
+    if abs(time.time() - st.st_mtime) < 180 * 86400:
+        when = "%s %2d %02d:%02d" % (MONTHS[tm.tm_mon - 1], tm.tm_mday,
+                                     tm.tm_hour, tm.tm_min)
+    else:
+        when = "%s %2d  %d" % (MONTHS[tm.tm_mon - 1], tm.tm_mday, tm.tm_year)
+    return "%s %4d bench    bench    %12d %s %s\r\n" % (
+        stat.filemode(st.st_mode), st.st_nlink, st.st_size, when, name)
+
+
+class FTPSession(socketserver.BaseRequestHandler):
+    """Just enough of RFC 959, 2228 and 2428 for gftp"""
+
+    def setup(self):
+        self.opts = self.server.opts
+        self.closed = threading.Event()
+        self.ctrl = shape_socket(self.request, self.opts.delay,
+                                 self.opts.rate, self.closed)
+        self.rfile = self.ctrl.makefile("rb")
+        self.cwd = "/"
+        self.pasv = None
+        self.rest = 0
+        self.rnfr = None
+        self.prot_private = False
+
+    def reply(self, text):
+        self.ctrl.sendall((text + "\r\n").encode("utf-8", "surrogateescape"))
+
+    def real_path(self, path):
+        virt = os.path.normpath(os.path.join(self.cwd, path or "."))
+        virt = "/" + virt.lstrip("/")
+        return virt, os.path.join(self.server.root, virt.lstrip("/"))
+
+    def handle(self):
+        self.reply("220 gftp loopback FTP server ready")
+        while True:
+            line = self.rfile.readline()
+            if not line:
+                break
+
+            line = line.decode("utf-8", "surrogateescape").rstrip("\r\n")
+            cmd, _, arg = line.partition(" ")
+            method = getattr(self, "ftp_" + cmd.upper(), None)
+            if method is None:
+                self.reply("502 Command not implemented")
+                continue
+
+            try:
+                if method(arg) is False:
+                    break
+            except OSError as err:
+                self.reply("550 %s" % err.strerror)
+
+        self.close_pasv()
+
+    def finish(self):
+        # Let the last replies through the emulated link before the server
+        # closes the connection
+        if self.ctrl is not self.request:
+            self.rfile.close()
+            self.ctrl.close()
+            self.closed.wait(60)
+
+    def ftp_USER(self, arg):
+        self.reply("331 Password required")
+
+    def ftp_PASS(self, arg):
+        self.reply("230 Logged in")
+
+    def ftp_ACCT(self, arg):
+        self.reply("230 Logged in")
+
+    def ftp_SYST(self, arg):
+        self.reply("215 UNIX Type: L8")
+
+    def ftp_FEAT(self, arg):
+        self.reply("211-Features:\r\n SIZE\r\n MDTM\r\n REST STREAM\r\n"
+                   " EPSV\r\n AUTH TLS\r\n PBSZ\r\n PROT\r\n UTF8\r\n211 End")
+
+    def ftp_OPTS(self, arg):
+        self.reply("200 OK")
+
+    def ftp_CLNT(self, arg):
+        self.reply("200 OK")
+
+    def ftp_NOOP(self, arg):
+        self.reply("200 OK")
+
+    def ftp_TYPE(self, arg):
+        self.reply("200 Type set to %s" % arg)
+
+    def ftp_MODE(self, arg):
+        self.reply("200 OK")
+
+    def ftp_STRU(self, arg):
+        self.reply("200 OK")
+
+    def ftp_QUIT(self, arg):
+        self.reply("221 Bye")
+        return False
+
+    def ftp_AUTH(self, arg):
+        if self.server.tls is None:
+            self.reply("502 TLS is not available")
+            return
+
+        self.reply("234 AUTH TLS OK")
+        self.ctrl = self.server.tls.wrap_socket(self.ctrl, server_side=True)
+        self.rfile = self.ctrl.makefile("rb")
+
+    def ftp_PBSZ(self, arg):
+        self.reply("200 PBSZ=0")
+
+    def ftp_PROT(self, arg):
+        self.prot_private = arg.upper() == "P"
+        self.reply("200 PROT %s" % arg.upper())
+
+    def ftp_PWD(self, arg):
+        self.reply('257 "%s" is the current directory' % self.cwd)
+
+    def ftp_CWD(self, arg):
+        virt, path = self.real_path(arg)
+        if not os.path.isdir(path):
+            self.reply("550 No such directory")
+            return
+        self.cwd = virt
+        self.reply("250 OK")
+
+    def ftp_CDUP(self, arg):
+        self.ftp_CWD("..")
+
+    def ftp_MKD(self, arg):
+        virt, path = self.real_path(arg)
+        os.mkdir(path)
+        self.reply('257 "%s" created' % virt)
+
+    def ftp_RMD(self, arg):
+        os.rmdir(self.real_path(arg)[1])
+        self.reply("250 OK")
+
+    def ftp_DELE(self, arg):
+        os.unlink(self.real_path(arg)[1])
+        self.reply("250 OK")
+
+    def ftp_RNFR(self, arg):
+        self.rnfr = self.real_path(arg)[1]
+        self.reply("350 Ready for RNTO")
+
+    def ftp_RNTO(self, arg):
+        os.rename(self.rnfr, self.real_path(arg)[1])
+        self.reply("250 OK")
+
+    def ftp_SITE(self, arg):
+        words = arg.split(None, 2)
+        if len(words) == 3 and words[0].upper() == "CHMOD":
+            os.chmod(self.real_path(words[2])[1], int(words[1], 8))
+            self.reply("200 OK")
+        else:
+            self.reply("502 Command not implemented")
+
+    def ftp_SIZE(self, arg):
+        self.reply("213 %d" % os.stat(self.real_path(arg)[1]).st_size)
+
+    def ftp_MDTM(self, arg):
+        st = os.stat(self.real_path(arg)[1])
+        self.reply("213 %s" % time.strftime("%Y%m%d%H%M%S",
+                                            time.gmtime(st.st_mtime)))
+
+    def ftp_REST(self, arg):
+        self.rest = int(arg)
+        self.reply("350 Restarting at %d" % self.rest)
+
+    def open_pasv(self):
+        self.close_pasv()
+        self.pasv = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        self.pasv.bind(("127.0.0.1", 0))
+        self.pasv.listen(1)
+        self.pasv.settimeout(60)
+        return self.pasv.getsockname()[1]
+
+    def close_pasv(self):
+        if self.pasv is not None:
+            self.pasv.close()
+            self.pasv = None
+
+    def ftp_PASV(self, arg):
+        port = self.open_pasv()
+        self.reply("227 Entering Passive Mode (127,0,0,1,%d,%d)" %
+                   (port >> 8, port & 0xff))
+
+    def ftp_EPSV(self, arg):
+        port = self.open_pasv()
+        self.reply("229 Entering Extended Passive Mode (|||%d|)" % port)
+
+    def data_connection(self):
+        if self.pasv is None:
+            self.reply("425 Use PASV or EPSV first")
+            return None
+
+        self.reply("150 Opening data connection")
+        try:
+            conn, _ = self.pasv.accept()
+        except OSError:
+            self.reply("425 Cannot open data connection")
+            return None
+        finally:
+            self.close_pasv()
+
+        conn = shape_socket(conn, self.opts.delay, self.opts.rate)
+        if self.prot_private:
+            conn = self.server.tls.wrap_socket(conn, server_side=True)
+        return conn
+
+    def end_data(self, conn):
+        if isinstance(conn, ssl.SSLSocket):
+            try:
+                conn = conn.unwrap()
+            except (OSError, ValueError):
+                pass
+        conn.close()
+        self.reply("226 Transfer complete")
+
+    def ftp_LIST(self, arg, names_only=False):
+        args = [a for a in arg.split() if not a.startswith("-")]
+        path = self.real_path(args[0] if args else None)[1]
+        conn = self.data_connection()
+        if conn is None:
+            return
+
+        if os.path.isdir(path):
+            entries = sorted(os.listdir(path))
+        else:
+            path, entries = os.path.dirname(path), [os.path.basename(path)]
+
+        out = []
+        for name in entries:
+            if names_only:
+                out.append(name + "\r\n")
+            else:
+                out.append(ls_line(os.path.join(path, name), name))
+        conn.sendall("".join(out).encode("utf-8", "surrogateescape"))
+        self.end_data(conn)
+
+    def ftp_NLST(self, arg):
+        self.ftp_LIST(arg, names_only=True)
+
+    def ftp_RETR(self, arg):
+        path = self.real_path(arg)[1]
+        with open(path, "rb") as src:
+            src.seek(self.rest)
+            self.rest = 0
+            conn = self.data_connection()
+            if conn is None:
+                return
+            while True:
+                data = src.read(CHUNK)
+                if not data:
+                    break
+                conn.sendall(data)
+        self.end_data(conn)
+
+    def ftp_STOR(self, arg, mode="wb"):
+        path = self.real_path(arg)[1]
+        if self.rest:
+            mode = "r+b"
+        with open(path, mode) as dest:
+            if self.rest:
+                dest.seek(self.rest)
+                dest.truncate()
+            self.rest = 0
+            conn = self.data_connection()
+            if conn is None:
+                return
+            while True:
+                data = conn.recv(CHUNK)
+                if not data:
+                    break
+                dest.write(data)
+        self.end_data(conn)
+
+    def ftp_APPE(self, arg):
+        self.ftp_STOR(arg, mode="ab")
+
+
+class FTPServer(socketserver.ThreadingTCPServer):
+    daemon_threads = True
+    allow_reuse_address = True
+
+    def __init__(self, root, opts, tls):
+        self.root = root
+        self.opts = opts
+        self.tls = tls
+        super().__init__(("127.0.0.1", 0), FTPSession)
+
+
+def make_tls_context(workdir):
+    """Self signed certificate for FTPS, or None without the openssl tool"""
+    if shutil.which("openssl") is None:
+        return None
+
+    cert = os.path.join(workdir, "cert.pem")
+    subprocess.run(["openssl", "req", "-x509", "-newkey", "rsa:2048",
+                    "-nodes", "-days", "1", "-subj", "/CN=127.0.0.1",
+                    "-keyout", cert, "-out", cert],
+                   check=True, stdout=subprocess.DEVNULL,
+                   stderr=subprocess.DEVNULL)
+    ctx = ssl.SSLContext(ssl.PROTOCOL_TLS_SERVER)
+    ctx.load_cert_chain(cert)
+    return ctx
+
+
+# SFTP: gftp runs this script in place of ssh, and it relays the SFTP
+# stream to sftp-server through the emulated link
+
+def sftp_relay(args):
+    child = subprocess.Popen(args.command, stdin=subprocess.PIPE,
+                             stdout=subprocess.PIPE, bufsize=0)
+    stdin = os.fdopen(0, "rb", buffering=0)
+    stdout = os.fdopen(1, "wb", buffering=0)
+
+    up = Link(child.stdin.write, child.stdin.close, args.delay, args.rate)
+    down = Link(stdout.write, stdout.close, args.delay, args.rate)
+    threading.Thread(target=pump, args=(stdin.read, up), daemon=True).start()
+    threading.Thread(target=pump, args=(child.stdout.read, down),
+                     daemon=True).start()
+
+    child.wait()
+    time.sleep(args.delay + 0.1)
+
+    if args.rusage:
+        used = 0.0
+        for who in (resource.RUSAGE_SELF, resource.RUSAGE_CHILDREN):
+            ru = resource.getrusage(who)
+            used += ru.ru_utime + ru.ru_stime
+        with open(args.rusage, "a") as out:
+            out.write("%f\n" % used)
+    return 0
+
+
+# Driving gftp-text
+
+class Harness:
+    def __init__(self, opts):
+        self.opts = opts
+        self.workdir = opts.workdir or tempfile.mkdtemp(prefix="gftp-loop")
+        self.root = os.path.join(self.workdir, "root")
+        self.home = os.path.join(self.workdir, "home")
+        self.client = os.path.join(self.workdir, "client")
+        self.rusage = os.path.join(self.workdir, "relay-rusage")
+        self.uploads = 0
+        self.ftp = None
+        self.netem = False
+
+    def make_datasets(self):
+        data = os.path.join(self.root, "data")
+        for name in ("large", "small", "tree"):
+            os.makedirs(os.path.join(data, name), exist_ok=True)
+
+        block = os.urandom(MB)
+        with open(os.path.join(data, "large", "large.bin"), "wb") as out:
+            for _ in range(self.opts.large_mb):
+                out.write(block)
+
+        small = block[:self.opts.small_kb * 1024]
+        for i in range(self.opts.small_files):
+            with open(os.path.join(data, "small", "file%05d" % i),
+                      "wb") as out:
+                out.write(small)
+
+        def tree(path, depth):
+            for i in range(self.opts.tree_files):
+                with open(os.path.join(path, "f%d" % i), "wb") as out:
+                    out.write(small)
+            if depth == 0:
+                return
+            for i in range(self.opts.tree_fanout):
+                sub = os.path.join(path, "d%d" % i)
+                os.mkdir(sub)
+                tree(sub, depth - 1)
+
+        tree(os.path.join(data, "tree"), self.opts.tree_depth)
+
+    def write_config(self):
+        confdir = os.path.join(self.home, ".gftp")
+        os.makedirs(confdir, exist_ok=True)
+
+        wrapper = os.path.join(self.workdir, "ssh")
+        with open(wrapper, "w") as out:
+            out.write("#!/bin/sh\nexec %s %s sftp-relay --delay %f "
+                      "--rate %f --rusage %s -- %s\n" %
+                      (sys.executable, os.path.abspath(__file__),
+                       self.opts.delay, self.opts.rate, self.rusage,
+                       self.opts.sftp_server))
+        os.chmod(wrapper, 0o755)
+
+        master = os.path.join(self.opts.share_dir, "gftprc")
+        with open(master) as src, \
+                open(os.path.join(confdir, "gftprc"), "w") as out:
+            out.write(src.read())
+            out.write("\n# gftp-loopback.py\n"
+                      "passive_transfer=1\n"
+                      "verify_ssl_peer=0\n"
+                      "ssh_prog_name=%s\n"
+                      "ssh_batch_mode=1\n"
+                      "ssh_need_userpass=0\n"
+                      "ssh_use_control_master=0\n"
+                      "ssh_use_libssh2=0\n"
+                      "cache_ttl=0\n" % wrapper)
+
+    def start(self):
+        os.makedirs(self.root, exist_ok=True)
+        self.make_datasets()
+        self.write_config()
+
+        if self.opts.netem:
+            self.netem = subprocess.run(
+                ["tc", "qdisc", "replace", "dev", "lo", "root", "netem",
+                 "delay", "%.3fms" % (self.opts.delay * 1000)] +
+                (["rate", "%dbit" % (self.opts.rate * 8)]
+                 if self.opts.rate > 0 else []),
+                check=False).returncode == 0
+            if not self.netem:
+                sys.exit("tc netem failed, are you root?")
+
+        tls = make_tls_context(self.workdir) \
+            if "ftps" in self.opts.protocols else None
+        self.ftp = FTPServer(self.root, self.server_opts(), tls)
+        threading.Thread(target=self.ftp.serve_forever, daemon=True).start()
+
+    def server_opts(self):
+        # With netem the kernel delays the FTP traffic already
+        if self.opts.netem:
+            return argparse.Namespace(delay=0, rate=0)
+        return argparse.Namespace(delay=self.opts.delay, rate=self.opts.rate)
+
+    def stop(self):
+        if self.ftp is not None:
+            self.ftp.shutdown()
+        if self.netem:
+            subprocess.run(["tc", "qdisc", "del", "dev", "lo", "root"],
+                           check=False)
+        if not self.opts.keep:
+            shutil.rmtree(self.workdir, ignore_errors=True)
+
+    def url(self, protocol):
+        if protocol == "sftp":
+            return "ssh2://bench@127.0.0.1%s" % self.root
+        return "%s://bench:bench@127.0.0.1:%d/" % (
+            protocol, self.ftp.server_address[1])
+
+    def script(self, protocol, scenario, direction, localdir):
+        # sftp-server sees the real filesystem, the FTP server only the root
+        base = self.root if protocol == "sftp" else ""
+        name = "large.bin" if scenario == "large" else "*"
+        if direction == "get":
+            cmds = ["cd %s/data/%s" % (base, scenario), "lcd %s" % localdir,
+                    "mget %s" % name]
+        else:
+            self.uploads += 1
+            remote = "%s/upload%d" % (base, self.uploads)
+            cmds = ["mkdir %s" % remote, "cd %s" % remote,
+                    "lcd %s" % os.path.join(self.root, "data", scenario),
+                    "mput %s" % name]
+
+        return "\n".join(["open %s" % self.url(protocol)] + cmds +
+                         ["quit", ""])
+
+    def gftp_env(self):
+        env = dict(os.environ)
+        env["HOME"] = self.home
+        env["GFTP_SHARE_DIR"] = self.opts.share_dir
+        env["LC_ALL"] = "C"
+        return env
+
+    def run_gftp(self, script, strace_prefix=None):
+        cmd = [self.opts.gftp_text]
+        if strace_prefix is not None:
+            cmd = ["strace", "-f", "-ff", "-o", strace_prefix] + cmd
+
+        if os.path.exists(self.rusage):
+            os.unlink(self.rusage)
+
+        start = time.monotonic()
+        proc = subprocess.Popen(cmd, stdin=subprocess.PIPE,
+                                stdout=subprocess.DEVNULL,
+                                stderr=subprocess.DEVNULL,
+                                env=self.gftp_env())
+        proc.stdin.write(script.encode())
+        proc.stdin.close()
+        _, status, ru = os.wait4(proc.pid, 0)
+        proc.returncode = os.waitstatus_to_exitcode(status)
+        seconds = time.monotonic() - start
+
+        cpu = ru.ru_utime + ru.ru_stime
+        if os.path.exists(self.rusage):
+            # The relay and sftp-server are children of gftp-text
+            with open(self.rusage) as src:
+                cpu -= sum(float(line) for line in src if line.strip())
+        return seconds, max(cpu, 0.0), proc.returncode
+
+    @staticmethod
+    def tree_size(path):
+        total = files = 0
+        for dirpath, _, filenames in os.walk(path):
+            for name in filenames:
+                total += os.path.getsize(os.path.join(dirpath, name))
+                files += 1
+        return total, files
+
+    def count_syscalls(self, prefix):
+        """Syscalls made by gftp-text, leaving out the processes it runs"""
+        total = 0
+        for name in os.listdir(self.workdir):
+            path = os.path.join(self.workdir, name)
+            if not path.startswith(prefix + "."):
+                continue
+            with open(path, errors="replace") as src:
+                lines = src.readlines()
+            os.unlink(path)
+            if any("execve(" in line and "gftp-text" not in line
+                   for line in lines[:5]):
+                continue
+            total += sum(1 for line in lines
+                         if not line.startswith(("+++", "---")) and
+                         "resumed>" not in line)
+        return total
+
+    def run(self, protocol, scenario, direction):
+        localdir = os.path.join(self.client, "%s-%s-%s" %
+                                (protocol, scenario, direction))
+        os.makedirs(localdir)
+        expected = self.tree_size(os.path.join(self.root, "data", scenario))
+
+        uploads_before = self.uploads
+        seconds, cpu, code = self.run_gftp(
+            self.script(protocol, scenario, direction, localdir))
+        if direction == "get":
+            got = self.tree_size(localdir)
+        else:
+            got = self.tree_size(os.path.join(self.root,
+                                              "upload%d" % self.uploads))
+
+        result = collections.OrderedDict()
+        result["protocol"] = protocol
+        result["scenario"] = scenario
+        result["direction"] = direction
+        result["ok"] = code == 0 and got == expected
+        result["bytes"] = got[0]
+        result["files"] = got[1]
+        result["seconds"] = round(seconds, 3)
+        result["mb_per_s"] = round(got[0] / MB / seconds, 2)
+        result["files_per_s"] = round(got[1] / seconds, 1)
+        result["cpu_s"] = round(cpu, 3)
+        result["cpu_s_per_mb"] = round(cpu / max(got[0] / MB, 1e-9), 5)
+
+        if self.opts.syscalls:
+            shutil.rmtree(localdir)
+            os.makedirs(localdir)
+            self.uploads = uploads_before
+            prefix = os.path.join(self.workdir, "strace")
+            self.run_gftp(self.script(protocol, scenario, direction,
+                                      localdir), strace_prefix=prefix)
+            result["syscalls_per_mb"] = round(
+                self.count_syscalls(prefix) / max(got[0] / MB, 1e-9), 1)
+
+        shutil.rmtree(localdir, ignore_errors=True)
+        print(json.dumps(result, separators=(",", ":")), flush=True)
+        return result["ok"]
+
+
+def main():
+    here = os.path.dirname(os.path.abspath(__file__))
+    parser = argparse.ArgumentParser(
+        description="End to end gftp-text transfer benchmarks over an "
+                    "emulated network on the loopback interface")
+    parser.add_argument("--gftp-text",
+                        default=os.path.join(here, "..", "src", "text",
+                                             "gftp-text"))
+    parser.add_argument("--share-dir",
+                        default=os.path.join(here, "..", "docs",
+                                             "sample.gftp"),
+                        help="directory with the master gftprc")
+    parser.add_argument("--rtt", type=float, default=0,
+                        help="round trip time to add, in milliseconds")
+    parser.add_argument("--rate", type=float, default=0,
+                        help="bandwidth limit in Mbit/s (0 = none)")
+    parser.add_argument("--netem", action="store_true",
+                        help="emulate the link with tc netem on lo")
+    parser.add_argument("--protocols", default="ftp,ftps,sftp")
+    parser.add_argument("--scenarios", default="large,small,tree")
+    parser.add_argument("--directions", default="get,put")
+    parser.add_argument("--large-mb", type=int, default=256)
+    parser.add_argument("--small-files", type=int, default=1000)
+    parser.add_argument("--small-kb", type=int, default=4)
+    parser.add_argument("--tree-depth", type=int, default=4)
+    parser.add_argument("--tree-fanout", type=int, default=4)
+    parser.add_argument("--tree-files", type=int, default=4)
+    parser.add_argument("--sftp-server",
+                        default=next((p for p in
+                                      ("/usr/lib/openssh/sftp-server",
+                                       "/usr/libexec/openssh/sftp-server",
+                                       "/usr/libexec/sftp-server",
+                                       "/usr/lib/ssh/sftp-server")
+                                      if os.path.exists(p)), None))
+    parser.add_argument("--syscalls", action="store_true",
+                        help="also count syscalls, with strace")
+    parser.add_argument("--workdir")
+    parser.add_argument("--keep", action="store_true",
+                        help="keep the work directory")
+
+    sub = sys.argv[1:2] == ["sftp-relay"]
+    if sub:
+        relay = argparse.ArgumentParser(prog="gftp-loopback.py sftp-relay")
+        relay.add_argument("--delay", type=float, default=0)
+        relay.add_argument("--rate", type=float, default=0)
+        relay.add_argument("--rusage")
+        relay.add_argument("command", nargs="+")
+        return sftp_relay(relay.parse_args(sys.argv[2:]))
+
+    opts = parser.parse_args()
+    opts.delay = opts.rtt / 2000.0
+    opts.rate = opts.rate * 1000000 / 8
+    opts.protocols = opts.protocols.split(",")
+    opts.gftp_text = os.path.abspath(opts.gftp_text)
+    opts.share_dir = os.path.abspath(opts.share_dir)
+
+    if not os.access(opts.gftp_text, os.X_OK):
+        sys.exit("%s is not built" % opts.gftp_text)
+    if opts.syscalls and shutil.which("strace") is None:
+        sys.exit("--syscalls needs strace")
+    if "sftp" in opts.protocols and opts.sftp_server is None:
+        print("sftp-server not found, skipping SFTP", file=sys.stderr)
+        opts.protocols.remove("sftp")
+
+    harness = Harness(opts)
+    signal.signal(signal.SIGTERM, lambda *_: sys.exit(1))
+    ok = True
+    try:
+        harness.start()
+        if "ftps" in opts.protocols and harness.ftp.tls is None:
+            print("openssl not found, skipping FTPS", file=sys.stderr)
+            opts.protocols.remove("ftps")
+
+        for protocol in opts.protocols:
+            for scenario in opts.scenarios.split(","):
+                for direction in opts.directions.split(","):
+                    ok = harness.run(protocol, scenario, direction) and ok
+    finally:
+        harness.stop()
+
+    return 0 if ok else 1
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,309 @@
+#!/usr/bin/env python3
+#
+# gftp-sshd-test.py - checks gftp-text's built in (libssh2) SSH transport
+#                     against a private sshd on the loopback interface
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111 USA
+#
+# An sshd is started as the current user on a free port with throw away
+# host and user keys. The user key is handed to gftp through an ssh-agent,
+# and gftp checks host keys against a known_hosts file in the work
+# directory, so nothing under ~/.ssh is read or changed. gftp-text must be
+# built with libssh2 support.
+#
+# Each check prints one JSON line:
+#
+#   {"check":"accept","ok":true,"detail":""}
+#
+# refuse    an unknown host key is refused, so nothing is transferred
+# accept    an unknown host key is accepted and saved, then a file is
+#           downloaded and uploaded
+# known     the saved key is matched without asking
+# mismatch  a different key in known_hosts makes the connection fail
+
+import argparse
+import filecmp
+import getpass
+import json
+import os
+import shutil
+import signal
+import socket
+import subprocess
+import sys
+import tempfile
+import time
+
+
+class Harness:
+    def __init__(self, opts):
+        self.opts = opts
+        self.workdir = opts.workdir or tempfile.mkdtemp(prefix="gftp-sshd")
+        self.home = os.path.join(self.workdir, "home")
+        self.remote = os.path.join(self.workdir, "remote")
+        self.client = os.path.join(self.workdir, "client")
+        self.known_hosts = os.path.join(self.workdir, "known_hosts")
+        self.agent_sock = os.path.join(self.workdir, "agent.sock")
+        self.sshd = None
+        self.agent = None
+        self.port = None
+
+    def keygen(self, name):
+        path = os.path.join(self.workdir, name)
+        subprocess.run(["ssh-keygen", "-q", "-t", "ed25519", "-N", "",
+                        "-f", path], check=True)
+        return path
+
+    @staticmethod
+    def free_port():
+        with socket.socket() as sock:
+            sock.bind(("127.0.0.1", 0))
+            return sock.getsockname()[1]
+
+    @staticmethod
+    def wait_for(check, what, timeout=10):
+        end = time.monotonic() + timeout
+        while time.monotonic() < end:
+            if check():
+                return
+            time.sleep(0.1)
+        sys.exit("%s did not start" % what)
+
+    def port_open(self):
+        try:
+            socket.create_connection(("127.0.0.1", self.port), 1).close()
+            return True
+        except OSError:
+            return False
+
+    def start_sshd(self):
+        host_key = self.keygen("host_key")
+        user_key = self.keygen("user_key")
+        self.other_key = self.keygen("other_host_key")
+
+        authorized = os.path.join(self.workdir, "authorized_keys")
+        shutil.copy(user_key + ".pub", authorized)
+
+        self.port = self.free_port()
+        config = os.path.join(self.workdir, "sshd_config")
+        with open(config, "w") as out:
+            out.write("Port %d\n"
+                      "ListenAddress 127.0.0.1\n"
+                      "HostKey %s\n"
+                      "PidFile %s\n"
+                      "AuthorizedKeysFile %s\n"
+                      "StrictModes no\n"
+                      "UsePAM no\n"
+                      "PasswordAuthentication no\n"
+                      "KbdInteractiveAuthentication no\n"
+                      "Subsystem sftp %s\n" %
+                      (self.port, host_key,
+                       os.path.join(self.workdir, "sshd.pid"), authorized,
+                       self.opts.sftp_server))
+
+        # sshd has to be run by its full path
+        self.sshd = subprocess.Popen([os.path.abspath(self.opts.sshd), "-D",
+                                      "-e", "-f", config],
+                                     stderr=open(os.path.join(self.workdir,
+                                                              "sshd.log"),
+                                                 "w"))
+        self.wait_for(self.port_open, "sshd")
+
+        self.agent = subprocess.Popen(["ssh-agent", "-D", "-a",
+                                       self.agent_sock],
+                                      stdout=subprocess.DEVNULL)
+        self.wait_for(lambda: os.path.exists(self.agent_sock), "ssh-agent")
+        subprocess.run(["ssh-add", "-q", user_key], env=self.gftp_env(),
+                       check=True)
+
+    def write_config(self):
+        confdir = os.path.join(self.home, ".gftp")
+        os.makedirs(confdir, exist_ok=True)
+
+        master = os.path.join(self.opts.share_dir, "gftprc")
+        with open(master) as src, \
+                open(os.path.join(confdir, "gftprc"), "w") as out:
+            out.write(src.read())
+            out.write("\n# gftp-sshd-test.py\n"
+                      "ssh_use_libssh2=1\n"
+                      "ssh_known_hosts=%s\n"
+                      "ssh_need_userpass=0\n"
+                      "cache_ttl=0\n" % self.known_hosts)
+
+    def start(self):
+        for path in (self.home, self.remote, self.client):
+            os.makedirs(path, exist_ok=True)
+        with open(os.path.join(self.remote, "data.bin"), "wb") as out:
+            out.write(os.urandom(1024 * 1024 + 17))
+        with open(os.path.join(self.client, "upload.bin"), "wb") as out:
+            out.write(os.urandom(512 * 1024 + 3))
+        open(self.known_hosts, "w").close()
+
+        self.write_config()
+        self.start_sshd()
+
+    def stop(self):
+        for proc in (self.sshd, self.agent):
+            if proc is not None:
+                proc.terminate()
+                proc.wait()
+        if not self.opts.keep:
+            shutil.rmtree(self.workdir, ignore_errors=True)
+
+    def gftp_env(self):
+        env = dict(os.environ)
+        env["HOME"] = self.home
+        env["GFTP_SHARE_DIR"] = self.opts.share_dir
+        env["SSH_AUTH_SOCK"] = self.agent_sock
+        env["LC_ALL"] = "C"
+        return env
+
+    def run_gftp(self, answer, commands):
+        lines = ["open ssh2://%s@127.0.0.1:%d%s" %
+                 (getpass.getuser(), self.port, self.remote)]
+        if answer is not None:
+            lines.append(answer)
+        lines += ["lcd %s" % self.client] + commands + ["quit", ""]
+
+        proc = subprocess.run([self.opts.gftp_text],
+                              input="\n".join(lines).encode(),
+                              stdout=subprocess.PIPE,
+                              stderr=subprocess.STDOUT,
+                              env=self.gftp_env(), timeout=120)
+        return proc.stdout.decode(errors="replace")
+
+    def fetched(self):
+        return os.path.exists(os.path.join(self.client, "data.bin"))
+
+    def clean_client(self):
+        if self.fetched():
+            os.unlink(os.path.join(self.client, "data.bin"))
+
+    def saved_key(self):
+        with open(self.known_hosts) as src:
+            return "[127.0.0.1]:%d " % self.port in src.read()
+
+    def check_refuse(self):
+        output = self.run_gftp("no", ["get data.bin"])
+        if self.fetched():
+            return False, "transferred after the host key was refused"
+        if os.path.getsize(self.known_hosts) != 0:
+            return False, "known_hosts changed after the key was refused"
+        if "was not accepted" not in output:
+            return False, "no refusal was logged"
+        return True, ""
+
+    def check_accept(self):
+        self.run_gftp("yes", ["get data.bin", "put upload.bin"])
+        if not self.saved_key():
+            return False, "the accepted key was not saved"
+        if not self.fetched() or \
+                not filecmp.cmp(os.path.join(self.remote, "data.bin"),
+                                os.path.join(self.client, "data.bin"),
+                                shallow=False):
+            return False, "download differs"
+        if not os.path.exists(os.path.join(self.remote, "upload.bin")) or \
+                not filecmp.cmp(os.path.join(self.client, "upload.bin"),
+                                os.path.join(self.remote, "upload.bin"),
+                                shallow=False):
+            return False, "upload differs"
+        return True, ""
+
+    def check_known(self):
+        output = self.run_gftp(None, ["get data.bin"])
+        if "authenticity of host" in output:
+            return False, "asked about a saved key"
+        if not self.fetched():
+            return False, "download failed"
+        return True, ""
+
+    def check_mismatch(self):
+        with open(self.other_key + ".pub") as src:
+            key = " ".join(src.read().split()[:2])
+        with open(self.known_hosts, "w") as out:
+            out.write("[127.0.0.1]:%d %s\n" % (self.port, key))
+        output = self.run_gftp("yes", ["get data.bin"])
+        if self.fetched():
+            return False, "transferred with a mismatched host key"
+        if "does not match" not in output:
+            return False, "no mismatch was logged"
+        return True, ""
+
+    def run(self, check):
+        self.clean_client()
+        try:
+            ok, detail = getattr(self, "check_" + check)()
+        except subprocess.TimeoutExpired:
+            ok, detail = False, "gftp-text timed out"
+        print(json.dumps({"check": check, "ok": ok, "detail": detail},
+                         separators=(",", ":")), flush=True)
+        return ok
+
+
+def main():
+    here = os.path.dirname(os.path.abspath(__file__))
+    parser = argparse.ArgumentParser(
+        description="Checks gftp-text's built in SSH transport against a "
+                    "private sshd on the loopback interface")
+    parser.add_argument("--gftp-text",
+                        default=os.path.join(here, "..", "src", "text",
+                                             "gftp-text"))
+    parser.add_argument("--share-dir",
+                        default=os.path.join(here, "..", "docs",
+                                             "sample.gftp"),
+                        help="directory with the master gftprc")
+    parser.add_argument("--sshd",
+                        default=shutil.which("sshd") or "/usr/sbin/sshd")
+    parser.add_argument("--sftp-server",
+                        default=next((p for p in
+                                      ("/usr/lib/openssh/sftp-server",
+                                       "/usr/libexec/openssh/sftp-server",
+                                       "/usr/libexec/sftp-server",
+                                       "/usr/lib/ssh/sftp-server")
+                                      if os.path.exists(p)), None))
+    parser.add_argument("--checks", default="refuse,accept,known,mismatch")
+    parser.add_argument("--workdir")
+    parser.add_argument("--keep", action="store_true",
+                        help="keep the work directory")
+
+    opts = parser.parse_args()
+    opts.gftp_text = os.path.abspath(opts.gftp_text)
+    opts.share_dir = os.path.abspath(opts.share_dir)
+
+    if not os.access(opts.gftp_text, os.X_OK):
+        sys.exit("%s is not built" % opts.gftp_text)
+    if not os.access(opts.sshd, os.X_OK):
+        sys.exit("sshd not found, use --sshd")
+    if opts.sftp_server is None:
+        sys.exit("sftp-server not found, use --sftp-server")
+    for prog in ("ssh-keygen", "ssh-agent", "ssh-add"):
+        if shutil.which(prog) is None:
+            sys.exit("%s not found" % prog)
+
+    harness = Harness(opts)
+    signal.signal(signal.SIGTERM, lambda *_: sys.exit(1))
+    ok = True
+    try:
+        harness.start()
+        for check in opts.checks.split(","):
+            ok = harness.run(check) and ok
+    finally:
+        harness.stop()
+
+    return 0 if ok else 1
+
+
+if __name__ == "__main__":
+    sys.exit(main())
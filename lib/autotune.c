@@ -0,0 +1,475 @@
+/*****************************************************************************/
+/*  autotune.c - tune the block size and SFTP pipeline depth of transfers    */
+/*                                                                           */
+/*  This program is free software; you can redistribute it and/or modify     */
+/*  it under the terms of the GNU General Public License as published by     */
+/*  the Free Software Foundation; either version 2 of the License, or        */
+/*  (at your option) any later version.                                      */
+/*                                                                           */
+/*  This program is distributed in the hope that it will be useful,          */
+/*  but WITHOUT ANY WARRANTY; without even the implied warranty of           */
+/*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the            */
+/*  GNU General Public License for more details.                             */
+/*                                                                           */
+/*  You should have received a copy of the GNU General Public License        */
+/*  along with this program; if not, write to the Free Software              */
+/*  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111 USA      */
+/*****************************************************************************/
+
+#include "gftp.h"
+
+/* When transfer_autotune is set, the throughput of a transfer is measured
+   over windows of at least half a second, and the block size, then the
+   number of SFTP requests in flight, are searched one at a time. A setting
+   keeps doubling (or halving, if doubling did not help) while every step is
+   more than 5% faster, and goes back to its best value when a step is not.
+
+   Once the search is done the settings are saved for the host in
+   ~/.gftp/autotune, and later transfers to the same host start from them.
+   If the throughput falls more than 30% below what it settled at, the
+   search starts over, since the link has changed. */
+
+#define AUTOTUNE_FILE			BASE_CONF_DIR "/autotune"
+#define GFTP_AUTOTUNE_WINDOW		(G_USEC_PER_SEC / 2)
+#define GFTP_AUTOTUNE_MIN_BLOCKS	8
+#define GFTP_AUTOTUNE_GAIN		1.05
+#define GFTP_AUTOTUNE_DROP		0.70
+
+enum
+{
+  GFTP_AUTOTUNE_BLKSIZE,
+  GFTP_AUTOTUNE_DEPTH,
+  GFTP_AUTOTUNE_NUM_KNOBS
+};
+
+static const int autotune_min[GFTP_AUTOTUNE_NUM_KNOBS] = { 4096, 1 },
+                 autotune_max[GFTP_AUTOTUNE_NUM_KNOBS] = { 1048576, 64 };
+
+typedef struct gftp_autotune_saved_tag
+{
+  int values[GFTP_AUTOTUNE_NUM_KNOBS],
+      kbs;
+} gftp_autotune_saved;
+
+struct gftp_autotune_tag
+{
+  char *key;
+
+  int values[GFTP_AUTOTUNE_NUM_KNOBS],
+      best_values[GFTP_AUTOTUNE_NUM_KNOBS],
+      num_knobs,		/* The pipeline depth is only tuned for SFTP */
+      knob,			/* Being searched, num_knobs once settled */
+      direction,		/* 1 to double the value, -1 to halve it */
+      moved;			/* A step in this direction was faster */
+
+  double best_kbs,		/* Best window while searching */
+         best_latency,		/* Time per block in that window */
+         settled_kbs;		/* Average of the windows since settling */
+
+  gint64 window_start,		/* 0 until the first block at new settings */
+         window_usecs;		/* Time spent inside the blocks */
+  off_t window_bytes;
+  int window_blocks;
+};
+
+static GMutex autotune_saved_lock,
+              autotune_file_lock;
+static GHashTable * autotune_saved = NULL;
+static guint autotune_generation = 0,	/* Bumped for every change */
+             autotune_written = 0;	/* Generation that is on disk */
+
+
+static void
+_gftp_autotune_load (void)
+{
+  int blksize, depth, kbs, pos;
+  gftp_autotune_saved * saved;
+  char *filename, buf[1024];
+  size_t len;
+  FILE *fd;
+
+  autotune_saved = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                          g_free);
+
+  if ((filename = gftp_expand_path (NULL, AUTOTUNE_FILE)) == NULL)
+    return;
+
+  fd = fopen (filename, "r");
+  g_free (filename);
+  if (fd == NULL)
+    return;
+
+  while (fgets (buf, sizeof (buf), fd) != NULL)
+    {
+      if (*buf == '#')
+        continue;
+
+      len = strlen (buf);
+      if (len > 0 && buf[len - 1] == '\n')
+        buf[len - 1] = '\0';
+
+      pos = 0;
+      if (sscanf (buf, "%d %d %d %n", &blksize, &depth, &kbs, &pos) < 3 ||
+          pos == 0 || buf[pos] == '\0')
+        continue;
+
+      saved = g_malloc0 (sizeof (*saved));
+      saved->values[GFTP_AUTOTUNE_BLKSIZE] = blksize;
+      saved->values[GFTP_AUTOTUNE_DEPTH] = depth;
+      saved->kbs = kbs;
+      g_hash_table_replace (autotune_saved, g_strdup (buf + pos), saved);
+    }
+
+  fclose (fd);
+}
+
+
+static void
+_gftp_autotune_write_entry (gpointer key, gpointer value, gpointer data)
+{
+  gftp_autotune_saved * saved;
+
+  saved = value;
+  g_string_append_printf (data, "%d %d %d %s\n", saved->values[GFTP_AUTOTUNE_BLKSIZE],
+           saved->values[GFTP_AUTOTUNE_DEPTH], saved->kbs, (char *) key);
+}
+
+
+/* The contents are built with autotune_saved_lock held, and written after
+   it is let go so that other transfers are not held up by the disk. Writers
+   take turns, and a snapshot older than the one on disk is dropped. The file
+   is replaced in one step so that a crash cannot leave half of it behind */
+static void
+_gftp_autotune_write (const char *contents, guint generation)
+{
+  char *filename, *tempname;
+  FILE *fd;
+
+  g_mutex_lock (&autotune_file_lock);
+  if (generation <= autotune_written ||
+      (filename = gftp_expand_path (NULL, AUTOTUNE_FILE)) == NULL)
+    {
+      g_mutex_unlock (&autotune_file_lock);
+      return;
+    }
+
+  tempname = g_strconcat (filename, ".tmp", NULL);
+  if ((fd = fopen (tempname, "w")) != NULL)
+    {
+      fputs (contents, fd);
+
+      if (fclose (fd) == 0)
+        rename (tempname, filename);
+      else
+        unlink (tempname);
+    }
+
+  autotune_written = generation;
+  g_mutex_unlock (&autotune_file_lock);
+
+  g_free (tempname);
+  g_free (filename);
+}
+
+
+static char *
+_gftp_autotune_key (gftp_transfer * tdata)
+{
+  gftp_request * request;
+  char *direction;
+
+  if (tdata->fromreq->protonum == GFTP_LOCAL_NUM)
+    {
+      request = tdata->toreq;
+      direction = "put";
+    }
+  else
+    {
+      request = tdata->fromreq;
+      direction = tdata->toreq->protonum == GFTP_LOCAL_NUM ? "get" : "fxp";
+    }
+
+  return (g_strdup_printf ("%s %s://%s@%s:%d", direction,
+                           request->url_prefix,
+                           request->username == NULL ? "" : request->username,
+                           request->hostname == NULL ? "" : request->hostname,
+                           request->port));
+}
+
+
+static void
+_gftp_autotune_apply (gftp_transfer * tdata, gftp_autotune * tune)
+{
+  guint depth;
+
+  if (tune->num_knobs <= GFTP_AUTOTUNE_DEPTH)
+    return;
+
+  depth = tune->values[GFTP_AUTOTUNE_DEPTH];
+  if (tdata->fromreq->protonum == GFTP_SSHV2_NUM)
+    sshv2_set_pipeline_depth (tdata->fromreq, depth);
+  if (tdata->toreq->protonum == GFTP_SSHV2_NUM)
+    sshv2_set_pipeline_depth (tdata->toreq, depth);
+}
+
+
+static void
+_gftp_autotune_settle (gftp_transfer * tdata, gftp_autotune * tune)
+{
+  gftp_autotune_saved * saved;
+  GString * contents;
+  guint generation;
+
+  memcpy (tune->values, tune->best_values, sizeof (tune->values));
+  tune->knob = tune->num_knobs;
+  tune->settled_kbs = tune->best_kbs;
+
+  if (tune->num_knobs > GFTP_AUTOTUNE_DEPTH)
+    tdata->fromreq->logging_function (gftp_logging_misc, tdata->fromreq,
+                   _("Tuned the transfer to %d byte blocks and %d requests in flight: %.2f KB/s, %.1f ms per block\n"),
+                   tune->values[GFTP_AUTOTUNE_BLKSIZE],
+                   tune->values[GFTP_AUTOTUNE_DEPTH], tune->best_kbs,
+                   tune->best_latency / 1000.0);
+  else
+    tdata->fromreq->logging_function (gftp_logging_misc, tdata->fromreq,
+                   _("Tuned the transfer to %d byte blocks: %.2f KB/s, %.1f ms per block\n"),
+                   tune->values[GFTP_AUTOTUNE_BLKSIZE], tune->best_kbs,
+                   tune->best_latency / 1000.0);
+
+  GFTP_PROBE3 (autotune__settle, tune->values[GFTP_AUTOTUNE_BLKSIZE],
+               tune->values[GFTP_AUTOTUNE_DEPTH], (long) tune->best_kbs);
+
+  saved = g_malloc0 (sizeof (*saved));
+  memcpy (saved->values, tune->values, sizeof (saved->values));
+  saved->kbs = tune->best_kbs;
+
+  contents = g_string_new ("# Written by gFTP. Block size, SFTP requests in flight, KB/s and the host\n");
+
+  g_mutex_lock (&autotune_saved_lock);
+  g_hash_table_replace (autotune_saved, g_strdup (tune->key), saved);
+  g_hash_table_foreach (autotune_saved, _gftp_autotune_write_entry, contents);
+  generation = ++autotune_generation;
+  g_mutex_unlock (&autotune_saved_lock);
+
+  _gftp_autotune_write (contents->str, generation);
+  g_string_free (contents, TRUE);
+}
+
+
+/* Takes the next step of the search from the best values so far, or
+   settles when there is nothing left to try */
+static void
+_gftp_autotune_step (gftp_transfer * tdata, gftp_autotune * tune)
+{
+  int value;
+
+  while (tune->knob < tune->num_knobs)
+    {
+      value = tune->best_values[tune->knob];
+      value = tune->direction > 0 ? value * 2 : value / 2;
+
+      if (value >= autotune_min[tune->knob] &&
+          value <= autotune_max[tune->knob])
+        {
+          memcpy (tune->values, tune->best_values, sizeof (tune->values));
+          tune->values[tune->knob] = value;
+          return;
+        }
+
+      if (tune->direction > 0 && !tune->moved)
+        tune->direction = -1;
+      else
+        {
+          tune->knob++;
+          tune->direction = 1;
+          tune->moved = 0;
+        }
+    }
+
+  _gftp_autotune_settle (tdata, tune);
+}
+
+
+static void
+_gftp_autotune_search (gftp_transfer * tdata, gftp_autotune * tune,
+                       double kbs, double latency)
+{
+  if (tune->knob == tune->num_knobs)
+    {
+      if (tune->settled_kbs == 0)
+        tune->settled_kbs = kbs;
+      else if (kbs < tune->settled_kbs * GFTP_AUTOTUNE_DROP)
+        {
+          tdata->fromreq->logging_function (gftp_logging_misc, tdata->fromreq,
+                         _("The transfer slowed down to %.2f KB/s, tuning it again\n"),
+                         kbs);
+
+          tune->knob = 0;
+          tune->direction = 1;
+          tune->moved = 0;
+          tune->best_kbs = kbs;
+          tune->best_latency = latency;
+          memcpy (tune->best_values, tune->values, sizeof (tune->values));
+          _gftp_autotune_step (tdata, tune);
+        }
+      else
+        tune->settled_kbs = tune->settled_kbs * 0.75 + kbs * 0.25;
+
+      return;
+    }
+
+  if (tune->best_kbs == 0 || kbs > tune->best_kbs * GFTP_AUTOTUNE_GAIN)
+    {
+      if (tune->best_kbs != 0)
+        tune->moved = 1;
+
+      tune->best_kbs = kbs;
+      tune->best_latency = latency;
+      memcpy (tune->best_values, tune->values, sizeof (tune->values));
+    }
+  else if (tune->direction > 0 && !tune->moved)
+    tune->direction = -1;
+  else
+    {
+      tune->knob++;
+      tune->direction = 1;
+      tune->moved = 0;
+    }
+
+  _gftp_autotune_step (tdata, tune);
+}
+
+
+/* Returns NULL unless transfer_autotune is set for the transfer */
+gftp_autotune *
+gftp_autotune_new (gftp_transfer * tdata)
+{
+  intptr_t autotune, trans_blksize, depth;
+  gftp_autotune_saved * saved;
+  gftp_autotune * tune;
+  int i;
+
+  g_return_val_if_fail (tdata != NULL, NULL);
+  g_return_val_if_fail (tdata->fromreq != NULL, NULL);
+  g_return_val_if_fail (tdata->toreq != NULL, NULL);
+
+  gftp_lookup_request_option (tdata->fromreq, "transfer_autotune", &autotune);
+  if (!autotune)
+    return (NULL);
+
+  tune = g_malloc0 (sizeof (*tune));
+  tune->key = _gftp_autotune_key (tdata);
+
+  gftp_lookup_request_option (tdata->fromreq, "trans_blksize", &trans_blksize);
+  tune->values[GFTP_AUTOTUNE_BLKSIZE] = trans_blksize;
+
+  tune->num_knobs = GFTP_AUTOTUNE_DEPTH;
+  tune->values[GFTP_AUTOTUNE_DEPTH] = 1;
+  if (tdata->fromreq->protonum == GFTP_SSHV2_NUM ||
+      tdata->toreq->protonum == GFTP_SSHV2_NUM)
+    {
+      gftp_lookup_request_option (tdata->fromreq->protonum == GFTP_SSHV2_NUM ?
+                                  tdata->fromreq : tdata->toreq,
+                                  "ssh_pipeline_depth", &depth);
+      tune->values[GFTP_AUTOTUNE_DEPTH] = depth;
+      tune->num_knobs = GFTP_AUTOTUNE_NUM_KNOBS;
+    }
+
+  g_mutex_lock (&autotune_saved_lock);
+
+  if (autotune_saved == NULL)
+    _gftp_autotune_load ();
+
+  if ((saved = g_hash_table_lookup (autotune_saved, tune->key)) != NULL)
+    {
+      for (i = 0; i < tune->num_knobs; i++)
+        tune->values[i] = saved->values[i];
+    }
+
+  g_mutex_unlock (&autotune_saved_lock);
+
+  for (i = 0; i < GFTP_AUTOTUNE_NUM_KNOBS; i++)
+    tune->values[i] = CLAMP (tune->values[i], autotune_min[i],
+                             autotune_max[i]);
+  memcpy (tune->best_values, tune->values, sizeof (tune->values));
+
+  /* Settings that were found before are only searched again if the
+     transfer is a lot slower than they should give */
+  if (saved != NULL)
+    tune->knob = tune->num_knobs;
+  tune->direction = 1;
+
+  _gftp_autotune_apply (tdata, tune);
+  return (tune);
+}
+
+
+size_t
+gftp_autotune_get_blksize (gftp_autotune * tune)
+{
+  return (tune->values[GFTP_AUTOTUNE_BLKSIZE]);
+}
+
+
+/* Called after every block with the bytes moved and how long the block
+   took. Returns the block size to use for the next block */
+size_t
+gftp_autotune_block_done (gftp_transfer * tdata, ssize_t num_trans,
+                          gint64 usecs)
+{
+  int old_values[GFTP_AUTOTUNE_NUM_KNOBS];
+  double kbs, latency;
+  gftp_autotune * tune;
+  gint64 now;
+
+  tune = tdata->autotune;
+  now = g_get_monotonic_time ();
+
+  /* The first block after a change can still be using the old settings,
+     since SFTP requests were already in flight */
+  if (tune->window_start == 0)
+    {
+      tune->window_start = now;
+      return (tune->values[GFTP_AUTOTUNE_BLKSIZE]);
+    }
+
+  tune->window_bytes += num_trans;
+  tune->window_usecs += usecs;
+  tune->window_blocks++;
+
+  if (now - tune->window_start < GFTP_AUTOTUNE_WINDOW ||
+      tune->window_blocks < GFTP_AUTOTUNE_MIN_BLOCKS)
+    return (tune->values[GFTP_AUTOTUNE_BLKSIZE]);
+
+  kbs = (double) tune->window_bytes / 1024.0 /
+        ((double) (now - tune->window_start) / G_USEC_PER_SEC);
+  latency = (double) tune->window_usecs / tune->window_blocks;
+
+  GFTP_PROBE3 (autotune__window, tune->values[GFTP_AUTOTUNE_BLKSIZE],
+               tune->values[GFTP_AUTOTUNE_DEPTH], (long) kbs);
+
+  memcpy (old_values, tune->values, sizeof (old_values));
+  _gftp_autotune_search (tdata, tune, kbs, latency);
+
+  if (memcmp (old_values, tune->values, sizeof (old_values)) != 0)
+    {
+      _gftp_autotune_apply (tdata, tune);
+      tune->window_start = 0;
+    }
+  else
+    tune->window_start = now;
+
+  tune->window_bytes = 0;
+  tune->window_usecs = 0;
+  tune->window_blocks = 0;
+
+  return (tune->values[GFTP_AUTOTUNE_BLKSIZE]);
+}
+
+
+void
+gftp_autotune_free (gftp_autotune * tune)
+{
+  g_free (tune->key);
+  g_free (tune);
+}
@@ -19,29 +19,122 @@
 
 #include "gftp.h"
 
-struct gftp_cache_entry_tag
+/* The cache index is a fixed layout open addressed hash table that is mmap'd
+   from ~/.gftp/cache/index.bin. Every slot holds the cache description (the
+   url), the name of the file that has the listing, the server type and the
+   expiration date. The table always has at least twice as many slots as the
+   maximum number of entries (cache_max_entries), so probes stay short. The
+   used slots are also kept on a doubly linked list in the order they were
+   last used, so when the table is full the least recently used entry is
+   found without a scan. The whole file is protected by a fcntl() lock so
+   that several gftp processes can share it. The file stays open and mapped
+   for the life of the process, and is only mapped again when another
+   process resized or replaced it. */
+
+#define GFTP_CACHE_INDEX_MAGIC		"gFTPci02"
+#define GFTP_CACHE_URL_LEN		448
+#define GFTP_CACHE_FILE_LEN		32
+#define GFTP_CACHE_MIN_SLOTS		64
+#define GFTP_CACHE_EXPIRE_INTERVAL	300
+
+/* Descriptions too long for a slot are stored as their first
+   GFTP_CACHE_KEY_PREFIX_LEN characters, a '#' and the SHA-1 of the whole
+   description */
+#define GFTP_CACHE_KEY_PREFIX_LEN	(GFTP_CACHE_URL_LEN - 42)
+
+#define GFTP_CACHE_SLOT_EMPTY		0
+#define GFTP_CACHE_SLOT_USED		1
+#define GFTP_CACHE_SLOT_DELETED		2
+
+#define GFTP_CACHE_NO_SLOT		0xffffffff
+
+typedef struct gftp_cache_index_header_tag
+{
+  char magic[8];
+  guint32 num_slots,
+          num_used,
+          num_deleted,
+          lru_head,		/* Most recently used slot */
+          lru_tail,		/* Least recently used slot */
+          reserved;
+  gint64 last_expire;		/* Last time expired entries were removed */
+  char pad[24];
+} gftp_cache_index_header;
+
+typedef struct gftp_cache_slot_tag
+{
+  guint64 hash;
+  gint64 expiration_date;
+  gint32 server_type;
+  guint32 state,
+          lru_prev,		/* Towards lru_head */
+          lru_next;		/* Towards lru_tail */
+  char file[GFTP_CACHE_FILE_LEN];	/* Relative to the cache directory */
+  char url[GFTP_CACHE_URL_LEN];
+} gftp_cache_slot;
+
+typedef struct gftp_cache_index_tag
+{
+  int fd;
+  size_t size;
+  char *cachedir,
+       *indexfile;
+  gftp_cache_index_header * header;
+  gftp_cache_slot * slots;
+} gftp_cache_index;
+
+/* The listings themselves are stored already parsed. A cache file is a
+   header, an array of fixed size records and a string table that the
+   records point into, so loading one is a single read */
+
+#define GFTP_CACHE_LISTING_MAGIC	"gFTPcl01"
+#define GFTP_CACHE_NO_STRING		0xffffffff
+
+#define GFTP_CACHE_FILE_UTF8		1
+
+typedef struct gftp_cache_listing_header_tag
+{
+  char magic[8];
+  guint32 num_files,
+          strings_len;
+} gftp_cache_listing_header;
+
+typedef struct gftp_cache_file_record_tag
 {
-  char *url,
-       *file;
-  int server_type;
-  time_t expiration_date;
+  gint64 datetime;
+  guint64 size;
+  guint32 st_mode,
+          file,			/* Offsets into the string table */
+          user,
+          group,
+          flags,
+          reserved;
+} gftp_cache_file_record;
 
-  char *pos1,
-       *pos2,
-       *pos3;
+struct gftp_cache_listing_tag
+{
+  gftp_cache_file_record * records;
+  char *strings;
+  guint32 num_files,
+          max_files,
+          strings_len,
+          max_strings,
+          cur_file;
+  char *buffer;			/* The whole cache file when it was read in */
 };
-  
-typedef struct gftp_cache_entry_tag gftp_cache_entry;
+
+/* fcntl() locks are per process, so this keeps the threads apart. It also
+   protects gftp_cache_idx */
+static GMutex gftp_cache_mutex;
+static gftp_cache_index gftp_cache_idx = { -1, 0, NULL, NULL, NULL, NULL };
 
 
 static int
-gftp_parse_cache_line (gftp_request * request, /*@out@*/ gftp_cache_entry * centry, 
+gftp_parse_cache_line (gftp_request * request, /*@out@*/ char **file,
                        char *line)
 {
   char *pos;
 
-  memset (centry, 0, sizeof (*centry));
-
   if ((pos = strchr (line, '\t')) == NULL || *(pos + 1) == '\0')
     {
       if (request != NULL)
@@ -51,342 +144,1603 @@ gftp_parse_cache_line (gftp_request * request, /*@out@*/ gftp_cache_entry * cent
       return (-1);
     }
 
-  centry->pos1 = pos;
-  *pos++ = '\0';
-  centry->url = line;
-  centry->file = pos;
-  
-  if ((pos = strchr (pos, '\t')) == NULL || *(pos + 1) == '\0')
+  *file = pos + 1;
+  if ((pos = strchr (*file, '\t')) != NULL)
+    *pos = '\0';
+
+  return (0);
+}
+
+
+/* Older versions kept a text index in index.db, or a binary index with a
+   different layout. The listings they point to are simply thrown away */
+static void
+gftp_remove_old_cache_index (gftp_cache_index * idx)
+{
+  char *indexfile, *file, buf[BUFSIZ];
+  gftp_getline_buffer * rbuf;
+  const char *name;
+  GDir * dir;
+  int indexfd;
+
+  indexfile = gftp_expand_path (NULL, BASE_CONF_DIR "/cache/index.db");
+  if ((indexfd = gftp_fd_open (NULL, indexfile, O_RDONLY, 0)) != -1)
     {
-      if (request != NULL)
-        request->logging_function (gftp_logging_error, request,
-                            _("Error: Invalid line %s in cache index file\n"), 
-                            line);
-      return (-1);
+      rbuf = NULL;
+      while (gftp_get_line (NULL, &rbuf, buf, sizeof (buf), indexfd) > 0)
+        {
+          if (gftp_parse_cache_line (NULL, &file, buf) == 0)
+            unlink (file);
+        }
+
+      gftp_free_getline_buffer (&rbuf);
+      close (indexfd);
+      unlink (indexfile);
     }
+  g_free (indexfile);
 
-  centry->pos2 = pos;
-  *pos++ = '\0';
-  centry->server_type = strtol (pos, NULL, 10);
+  if (idx == NULL || (dir = g_dir_open (idx->cachedir, 0, NULL)) == NULL)
+    return;
 
-  if ((pos = strchr (pos, '\t')) == NULL || *(pos + 1) == '\0')
+  while ((name = g_dir_read_name (dir)) != NULL)
     {
-      if (request != NULL)
-        request->logging_function (gftp_logging_error, request,
-                            _("Error: Invalid line %s in cache index file\n"), 
-                            line);
-      return (-1);
+      if (strncmp (name, "cache.", 6) != 0)
+        continue;
+
+      file = g_strdup_printf ("%s/%s", idx->cachedir, name);
+      unlink (file);
+      g_free (file);
     }
 
-  centry->pos3 = pos;
-  *pos++ = '\0';
-  centry->expiration_date = strtol (pos, NULL, 10);
+  g_dir_close (dir);
+}
+
 
-  return (0);
+static guint64
+gftp_cache_hash (const char *str)
+{
+  guint64 hash;
+
+  /* FNV-1a */
+  hash = G_GUINT64_CONSTANT (14695981039346656037);
+  for (; *str != '\0'; str++)
+    {
+      hash ^= (guchar) *str;
+      hash *= G_GUINT64_CONSTANT (1099511628211);
+    }
+
+  return (hash);
 }
 
 
-static void
-gftp_restore_cache_line (gftp_cache_entry * centry)
+/* Stores the key that description is kept under in the index in key, which
+   must have room for GFTP_CACHE_URL_LEN bytes, and returns its hash */
+static guint64
+gftp_cache_index_key (const char *description, char *key)
 {
-  if (centry->pos1 != NULL)
-    *centry->pos1 = '\t';
+  gchar *digest;
+  size_t len;
 
-  if (centry->pos2 != NULL)
-    *centry->pos2 = '\t';
+  len = strlen (description);
+  if (len < GFTP_CACHE_KEY_PREFIX_LEN)
+    memcpy (key, description, len + 1);
+  else
+    {
+      digest = g_compute_checksum_for_string (G_CHECKSUM_SHA1, description,
+                                              len);
+      memcpy (key, description, GFTP_CACHE_KEY_PREFIX_LEN);
+      g_snprintf (key + GFTP_CACHE_KEY_PREFIX_LEN,
+                  GFTP_CACHE_URL_LEN - GFTP_CACHE_KEY_PREFIX_LEN, "#%s",
+                  digest);
+      g_free (digest);
+    }
 
-  if (centry->pos3 != NULL)
-    *centry->pos3 = '\t';
+  return (gftp_cache_hash (key));
 }
 
 
-void
-gftp_generate_cache_description (gftp_request * request,
-                                 char *description,
-                                 size_t len, int ignore_directory)
+/* Returns whether the slot's url is description or is below it */
+static int
+gftp_cache_slot_below (gftp_cache_slot * slot, const char *description,
+                       size_t len)
 {
-  g_snprintf (description, len, "%s://%s@%s:%d%s",
-              request->url_prefix,
-              request->username == NULL ? "" : request->username,
-              request->hostname == NULL ? "" : request->hostname,
-              request->port, 
-              ignore_directory || request->directory == NULL ? "" : request->directory);
+  /* Long urls only keep their beginning, so anything that might be below
+     description matches */
+  if (len >= GFTP_CACHE_KEY_PREFIX_LEN)
+    return (strncmp (slot->url, description, GFTP_CACHE_KEY_PREFIX_LEN) == 0);
+
+  return (strncmp (slot->url, description, len) == 0 &&
+          (slot->url[len] == '\0' || slot->url[len] == '/'));
 }
 
 
-int
-gftp_new_cache_entry (gftp_request * request)
+static guint32
+gftp_cache_num_slots (void)
 {
-  char *cachedir, *tempstr, *temp1str;
-  int cache_fd, fd;
-  intptr_t cache_ttl;
-  ssize_t ret;
-  time_t t;
+  intptr_t max_entries;
+  guint32 num_slots;
 
-  gftp_lookup_request_option (request, "cache_ttl", &cache_ttl);
-  time (&t);
-  t += cache_ttl;
+  gftp_lookup_global_option ("cache_max_entries", &max_entries);
+  if (max_entries <= 0)
+    max_entries = 1;
 
-  cachedir = gftp_expand_path (NULL, BASE_CONF_DIR "/cache");
-  if (access (cachedir, F_OK) == -1)
-    {
-      if (mkdir (cachedir, S_IRUSR | S_IWUSR | S_IXUSR) < 0)
-        {
-          if (request != NULL)
-            request->logging_function (gftp_logging_error, request,
-                                 _("Error: Could not make directory %s: %s\n"),
-                                 cachedir, g_strerror (errno));
+  for (num_slots = GFTP_CACHE_MIN_SLOTS; 
+       num_slots < max_entries * 2 && num_slots < 0x40000000;
+       num_slots <<= 1);
 
-          g_free (cachedir);
-          return (-1);
-        }
-    }
+  return (num_slots);
+}
 
-  tempstr = g_strdup_printf ("%s/index.db", cachedir);
-  if ((fd = gftp_fd_open (request, tempstr, O_WRONLY | O_APPEND | O_CREAT, 
-                          S_IRUSR | S_IWUSR)) == -1)
-    {
-      g_free (tempstr);
-      g_free (cachedir);
-      return (-1);
-    }
 
-  g_free (tempstr);
+static char *
+gftp_cache_slot_path (gftp_cache_index * idx, gftp_cache_slot * slot)
+{
+  return (g_strdup_printf ("%s/%s", idx->cachedir, slot->file));
+}
 
-  tempstr = g_strdup_printf ("%s/cache.XXXXXX", cachedir);
-  if ((cache_fd = mkstemp (tempstr)) < 0)
-    {
-      g_free (tempstr);
-      g_free (cachedir);
-      if (request != NULL)
-        request->logging_function (gftp_logging_error, request,
-                                 _("Error: Cannot create temporary file: %s\n"),
-                                 g_strerror (errno));
-      return (-1);
-    }
-  g_free (cachedir);
 
-  lseek (fd, 0, SEEK_END);
-  temp1str = g_strdup_printf ("%s://%s@%s:%d%s\t%s\t%d\t%ld\n", 
-                           request->url_prefix,
-                           request->username == NULL ? "" : request->username,
-                           request->hostname == NULL ? "" : request->hostname,
-                           request->port, 
-                           request->directory == NULL ? "" : request->directory,
-                           tempstr, request->server_type, t);
-  g_free (tempstr);
-  ret = gftp_fd_write (NULL, temp1str, strlen (temp1str), fd);
-  g_free (temp1str);
+static void
+gftp_cache_lru_unlink (gftp_cache_index * idx, gftp_cache_slot * slot)
+{
+  if (slot->lru_prev == GFTP_CACHE_NO_SLOT)
+    idx->header->lru_head = slot->lru_next;
+  else
+    idx->slots[slot->lru_prev].lru_next = slot->lru_next;
 
-  if (close (fd) != 0 || ret < 0)
-    {
-      if (request != NULL)
-        request->logging_function (gftp_logging_error, request,
-                                   _("Error closing file descriptor: %s\n"),
-                                   g_strerror (errno));
+  if (slot->lru_next == GFTP_CACHE_NO_SLOT)
+    idx->header->lru_tail = slot->lru_prev;
+  else
+    idx->slots[slot->lru_next].lru_prev = slot->lru_prev;
 
-      close (cache_fd);
-      return (-1);
-    }
+  slot->lru_prev = slot->lru_next = GFTP_CACHE_NO_SLOT;
+}
 
-  return (cache_fd);
+
+static void
+gftp_cache_lru_push (gftp_cache_index * idx, gftp_cache_slot * slot)
+{
+  guint32 num;
+
+  num = slot - idx->slots;
+  slot->lru_prev = GFTP_CACHE_NO_SLOT;
+  slot->lru_next = idx->header->lru_head;
+
+  if (idx->header->lru_head == GFTP_CACHE_NO_SLOT)
+    idx->header->lru_tail = num;
+  else
+    idx->slots[idx->header->lru_head].lru_prev = num;
+
+  idx->header->lru_head = num;
 }
 
 
-int
-gftp_find_cache_entry (gftp_request * request)
+static void
+gftp_cache_lru_touch (gftp_cache_index * idx, gftp_cache_slot * slot)
 {
-  char *indexfile, buf[BUFSIZ], description[BUFSIZ];
-  gftp_getline_buffer * rbuf;
-  gftp_cache_entry centry;
-  int indexfd, cachefd;
-  time_t now;
+  if (idx->header->lru_head == (guint32) (slot - idx->slots))
+    return;
 
-  time (&now);
+  gftp_cache_lru_unlink (idx, slot);
+  gftp_cache_lru_push (idx, slot);
+}
 
-  *description = '\0';
-  gftp_generate_cache_description (request, description, sizeof (description),
-                                   0);
 
-  indexfile = gftp_expand_path (NULL, BASE_CONF_DIR "/cache/index.db");
-  if ((indexfd = gftp_fd_open (NULL, indexfile, O_RDONLY, 0)) == -1)
+static void
+gftp_cache_remove_slot (gftp_cache_index * idx, gftp_cache_slot * slot)
+{
+  char *tempstr;
+
+  tempstr = gftp_cache_slot_path (idx, slot);
+  unlink (tempstr);
+  g_free (tempstr);
+
+  gftp_cache_lru_unlink (idx, slot);
+  slot->state = GFTP_CACHE_SLOT_DELETED;
+  idx->header->num_used--;
+  idx->header->num_deleted++;
+}
+
+
+/* Returns the slot holding key. If for_insert is set and key is not in the
+   table, the slot that it should be stored in is returned instead */
+static gftp_cache_slot *
+gftp_cache_lookup_slot (gftp_cache_index * idx, const char *key, 
+                        guint64 hash, int for_insert)
+{
+  gftp_cache_slot * slot, * deleted_slot;
+  guint32 mask, i, n;
+
+  mask = idx->header->num_slots - 1;
+  deleted_slot = NULL;
+
+  for (i = hash & mask, n = 0; n <= mask; i = (i + 1) & mask, n++)
     {
-      g_free (indexfile);
-      return (-1);
+      slot = &idx->slots[i];
+      if (slot->state == GFTP_CACHE_SLOT_EMPTY)
+        {
+          if (!for_insert)
+            return (NULL);
+
+          return (deleted_slot != NULL ? deleted_slot : slot);
+        }
+      else if (slot->state == GFTP_CACHE_SLOT_DELETED)
+        {
+          if (deleted_slot == NULL)
+            deleted_slot = slot;
+        }
+      else if (slot->hash == hash && strcmp (slot->url, key) == 0)
+        return (slot);
     }
-  g_free (indexfile);
 
-  rbuf = NULL;
-  while (gftp_get_line (NULL, &rbuf, buf, sizeof (buf), indexfd) > 0)
-    {
-      if (gftp_parse_cache_line (request, &centry, buf) < 0)
-        continue;
+  return (for_insert ? deleted_slot : NULL);
+}
 
-      /* See if this entry is still valid... */
-      if (centry.expiration_date < now)
-        continue;
 
-      if (strcmp (description, centry.url) == 0)
-	{
-	  if (close (indexfd) != 0)
-            {
-              if (request != NULL)
-                request->logging_function (gftp_logging_error, request,
-                                       _("Error closing file descriptor: %s\n"),
-                                       g_strerror (errno));
-              return (-1);
-            }
+static int
+gftp_cache_map_index (gftp_cache_index * idx, size_t size)
+{
+  void *addr;
 
-	  if ((cachefd = gftp_fd_open (request, centry.file, O_RDONLY, 0)) == -1)
-            return (-1);
+  addr = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, idx->fd, 0);
+  if (addr == MAP_FAILED)
+    return (-1);
 
-          if (lseek (cachefd, 0, SEEK_END) == 0)
-            { 
-              close (cachefd); 
-              return (-1);
-            } 
+  idx->size = size;
+  idx->header = addr;
+  idx->slots = (gftp_cache_slot *) (idx->header + 1);
+  return (0);
+}
 
-          if (lseek (cachefd, 0, SEEK_SET) == -1)
-            {
-              if (request != NULL)
-                request->logging_function (gftp_logging_error, request,
-                                       _("Error: Cannot seek on file %s: %s\n"),
-                                       centry.file, g_strerror (errno));
 
-            }
+static void
+gftp_cache_unmap_index (gftp_cache_index * idx)
+{
+  if (idx->header != NULL)
+    munmap (idx->header, idx->size);
 
-          request->server_type = centry.server_type;
-	  return (cachefd);
-	}
-    }
-  close (indexfd);
-  return (-1);
+  idx->header = NULL;
+  idx->slots = NULL;
+  idx->size = 0;
 }
 
 
-void
-gftp_clear_cache_files (void)
+/* (Re)creates the table with num_slots slots, keeping the most recently used
+   of the entries that are currently in it. This is also how the tombstones
+   left by deleted entries are cleaned up */
+static int
+gftp_cache_rebuild_index (gftp_request * request, gftp_cache_index * idx,
+                          guint32 num_slots)
 {
-  char *indexfile, buf[BUFSIZ];
-  gftp_getline_buffer * rbuf;
-  gftp_cache_entry centry;
-  int indexfd;
+  gftp_cache_slot * old_slots, * slot;
+  guint32 num_old, max_entries, i;
+  char *tempstr;
+  size_t size;
 
-  indexfile = gftp_expand_path (NULL, BASE_CONF_DIR "/cache/index.db");
-  if ((indexfd = gftp_fd_open (NULL, indexfile, O_RDONLY, 0)) == -1)
+  num_old = 0;
+  old_slots = NULL;
+  if (idx->header != NULL)
     {
-      g_free (indexfile);
-      return;
+      /* Walk the LRU list first so the entries come out most recently used
+         first. Anything the list lost track of (say gftp was killed while
+         changing it) is picked up after that. The old table is thrown away,
+         so the state of the copied slots is used to mark them */
+      old_slots = g_new (gftp_cache_slot, idx->header->num_slots);
+      for (i = idx->header->lru_head;
+           i < idx->header->num_slots && num_old < idx->header->num_slots &&
+           idx->slots[i].state == GFTP_CACHE_SLOT_USED;
+           i = old_slots[num_old - 1].lru_next)
+        {
+          old_slots[num_old++] = idx->slots[i];
+          idx->slots[i].state = GFTP_CACHE_SLOT_DELETED;
+        }
+
+      for (i = 0; i < idx->header->num_slots; i++)
+        if (idx->slots[i].state == GFTP_CACHE_SLOT_USED)
+          old_slots[num_old++] = idx->slots[i];
+
+      gftp_cache_unmap_index (idx);
     }
 
-  *buf = '\0';
-  rbuf = NULL;
-  while (gftp_get_line (NULL, &rbuf, buf, sizeof (buf), indexfd) > 0)
+  size = sizeof (gftp_cache_index_header) + 
+         (size_t) num_slots * sizeof (gftp_cache_slot);
+  if (ftruncate (idx->fd, 0) == -1 || ftruncate (idx->fd, size) == -1 ||
+      gftp_cache_map_index (idx, size) == -1)
     {
-      if (gftp_parse_cache_line (NULL, &centry, buf) < 0)
-        continue;
+      if (request != NULL)
+        request->logging_function (gftp_logging_error, request,
+                                   _("Error: Cannot map the cache index: %s\n"),
+                                   g_strerror (errno));
+      g_free (old_slots);
+      return (-1);
+    }
 
-      unlink (centry.file);
+  memcpy (idx->header->magic, GFTP_CACHE_INDEX_MAGIC, 
+          sizeof (idx->header->magic));
+  idx->header->num_slots = num_slots;
+  idx->header->lru_head = idx->header->lru_tail = GFTP_CACHE_NO_SLOT;
+  idx->header->last_expire = time (NULL);
+
+  max_entries = num_slots / 2;
+  for (i = max_entries; i < num_old; i++)
+    {
+      tempstr = gftp_cache_slot_path (idx, &old_slots[i]);
+      unlink (tempstr);
+      g_free (tempstr);
     }
 
-  close (indexfd);
-  unlink (indexfile);
-  g_free (indexfile);
+  /* Least recently used first, so that each one can go on the front of the
+     list */
+  for (i = MIN (num_old, max_entries); i > 0; i--)
+    {
+      slot = gftp_cache_lookup_slot (idx, old_slots[i - 1].url,
+                                     old_slots[i - 1].hash, 1);
+      *slot = old_slots[i - 1];
+      gftp_cache_lru_push (idx, slot);
+      idx->header->num_used++;
+    }
+
+  g_free (old_slots);
+  return (0);
 }
 
 
-void
-gftp_delete_cache_entry (gftp_request * request, char *descr, 
-                         int ignore_directory)
+static void
+gftp_cache_close_index (gftp_cache_index * idx)
 {
-  char *oldindexfile, *newindexfile, buf[BUFSIZ], description[BUFSIZ];
-  int indexfd, newfd, del_entry;
-  gftp_getline_buffer * rbuf;
-  gftp_cache_entry centry;
-  size_t len;
-  time_t now;
- 
-  g_return_if_fail (request != NULL || descr != NULL);
+  struct flock lck;
 
-  time (&now);
-  if (request != NULL)
+  memset (&lck, 0, sizeof (lck));
+  lck.l_type = F_UNLCK;
+  lck.l_whence = SEEK_SET;
+  fcntl (idx->fd, F_SETLK, &lck);
+
+  g_mutex_unlock (&gftp_cache_mutex);
+}
+
+
+/* Locks the index and makes sure that it is mapped. Returns NULL if there is
+   no index and create isn't set. Every successful call must be followed by
+   gftp_cache_close_index () */
+static gftp_cache_index *
+gftp_cache_open_index (gftp_request * request, int create)
+{
+  gftp_cache_index * idx;
+  struct stat st, fst;
+  struct flock lck;
+  guint32 num_slots;
+  int flags;
+
+  g_mutex_lock (&gftp_cache_mutex);
+
+  idx = &gftp_cache_idx;
+  if (idx->cachedir == NULL)
     {
-      *description = '\0';
-      gftp_generate_cache_description (request, description, sizeof (description),
-                                       ignore_directory);
-    }
-  else if (descr != NULL)
-    { 
-      strncpy (description, descr, sizeof (description));
-      description[sizeof (description) - 1] = '\0';
+      idx->cachedir = gftp_expand_path (NULL, BASE_CONF_DIR "/cache");
+      idx->indexfile = g_strdup_printf ("%s/index.bin", idx->cachedir);
     }
-  else
-    return;
 
-  oldindexfile = gftp_expand_path (NULL, BASE_CONF_DIR "/cache/index.db");
-  if ((indexfd = gftp_fd_open (NULL, oldindexfile, O_RDONLY, 0)) == -1)
+  if (create && access (idx->cachedir, F_OK) == -1)
     {
-      g_free (oldindexfile);
-      return;
+      if (mkdir (idx->cachedir, S_IRUSR | S_IWUSR | S_IXUSR) < 0)
+        {
+          if (request != NULL)
+            request->logging_function (gftp_logging_error, request,
+                                 _("Error: Could not make directory %s: %s\n"),
+                                 idx->cachedir, g_strerror (errno));
+
+          g_mutex_unlock (&gftp_cache_mutex);
+          return (NULL);
+        }
     }
 
-  newindexfile = gftp_expand_path (NULL, BASE_CONF_DIR "/cache/index.db.new");
-  if ((newfd = gftp_fd_open (request, newindexfile, O_WRONLY | O_CREAT, 
-                             S_IRUSR | S_IWUSR)) == -1)
+  /* The index may have been removed or replaced since it was opened */
+  if (idx->fd != -1 &&
+      (stat (idx->indexfile, &st) != 0 || fstat (idx->fd, &fst) != 0 ||
+       st.st_dev != fst.st_dev || st.st_ino != fst.st_ino))
     {
-      g_free (oldindexfile);
-      g_free (newindexfile);
-      return;
+      gftp_cache_unmap_index (idx);
+      close (idx->fd);
+      idx->fd = -1;
     }
 
-  *buf = '\0';
-  rbuf = NULL;
-  while (gftp_get_line (NULL, &rbuf, buf, sizeof (buf) - 1, indexfd) > 0)
+  if (idx->fd == -1)
     {
-      if (gftp_parse_cache_line (request, &centry, buf) < 0)
-        continue;
-
-      del_entry = 0;
-      if (centry.expiration_date < now)
-        del_entry = 1;
-      else if (ignore_directory)
-        {
-          if (strncmp (centry.url, description, strlen (description)) == 0)
-            del_entry = 1;
-        }
-      else
+      flags = create ? O_RDWR | O_CREAT : O_RDWR;
+      if ((idx->fd = open (idx->indexfile, flags, S_IRUSR | S_IWUSR)) == -1)
         {
-          if (strcmp (centry.url, description) == 0)
-            del_entry = 1;
+          g_mutex_unlock (&gftp_cache_mutex);
+          return (NULL);
         }
+      fcntl (idx->fd, F_SETFD, FD_CLOEXEC);
+    }
 
- 
-      if (del_entry)
-        unlink (centry.file);
-      else
+  memset (&lck, 0, sizeof (lck));
+  lck.l_type = F_WRLCK;
+  lck.l_whence = SEEK_SET;
+  while (fcntl (idx->fd, F_SETLKW, &lck) == -1)
+    {
+      if (errno != EINTR)
         {
-          /* Make sure we put the tabs back in the line. I do it this way 
-             so that I don't have to allocate memory again for each line 
-             as we read it */
-          gftp_restore_cache_line (&centry);
-
-          /* Make sure when we call gftp_get_line() that we pass the read size
-             as sizeof(buf) - 1 so that we'll have room to put the newline */
-          len = strlen (buf);
-          buf[len--] = '\n';
-
-          if (gftp_fd_write (NULL, buf, len, newfd) < 0)
-            break;
+          if (request != NULL)
+            request->logging_function (gftp_logging_error, request,
+                                       _("Error: Cannot lock the cache index: %s\n"),
+                                       g_strerror (errno));
+          g_mutex_unlock (&gftp_cache_mutex);
+          return (NULL);
         }
     }
 
-  close (indexfd);
-  close (newfd);
+  /* Another process may have resized the file, which needs a new mapping.
+     Changes made in place show up through the shared mapping */
+  if (fstat (idx->fd, &st) != 0)
+    st.st_size = 0;
+  if (idx->header != NULL && idx->size != (size_t) st.st_size)
+    gftp_cache_unmap_index (idx);
 
-  unlink (oldindexfile);
-  rename (newindexfile, oldindexfile);
+  num_slots = gftp_cache_num_slots ();
+  if ((size_t) st.st_size > sizeof (gftp_cache_index_header) &&
+      (idx->header != NULL || gftp_cache_map_index (idx, st.st_size) == 0))
+    {
+      if (memcmp (idx->header->magic, GFTP_CACHE_INDEX_MAGIC,
+                  sizeof (idx->header->magic)) != 0 ||
+          idx->size != sizeof (gftp_cache_index_header) + 
+                       (size_t) idx->header->num_slots * sizeof (gftp_cache_slot))
+        gftp_cache_unmap_index (idx);
+      else if (!create || (idx->header->num_slots == num_slots &&
+                           idx->header->num_deleted < num_slots / 4))
+        return (idx);
+    }
+  else if (!create)
+    {
+      gftp_cache_close_index (idx);
+      return (NULL);
+    }
+
+  if (idx->header == NULL)
+    gftp_remove_old_cache_index (idx);
+
+  if (gftp_cache_rebuild_index (request, idx, num_slots) < 0)
+    {
+      gftp_cache_close_index (idx);
+      return (NULL);
+    }
 
-  g_free (oldindexfile);
-  g_free (newindexfile);
+  return (idx);
 }
 
+
+static void
+gftp_cache_expire_entries (gftp_cache_index * idx, time_t now)
+{
+  guint32 i;
+
+  for (i = 0; i < idx->header->num_slots; i++)
+    {
+      if (idx->slots[i].state == GFTP_CACHE_SLOT_USED &&
+          idx->slots[i].expiration_date < now)
+        gftp_cache_remove_slot (idx, &idx->slots[i]);
+    }
+
+  idx->header->last_expire = now;
+}
+
+
+static void
+gftp_cache_evict_lru (gftp_cache_index * idx)
+{
+  if (idx->header->lru_tail < idx->header->num_slots)
+    gftp_cache_remove_slot (idx, &idx->slots[idx->header->lru_tail]);
+}
+
+
+static void
+gftp_cache_dir_description (gftp_request * request, const char *dir,
+                            char *description, size_t len)
+{
+  g_snprintf (description, len, "%s://%s@%s:%d%s",
+              request->url_prefix,
+              request->username == NULL ? "" : request->username,
+              request->hostname == NULL ? "" : request->hostname,
+              request->port, dir == NULL ? "" : dir);
+}
+
+
+void
+gftp_generate_cache_description (gftp_request * request,
+                                 char *description,
+                                 size_t len, int ignore_directory)
+{
+  gftp_cache_dir_description (request, 
+                              ignore_directory ? NULL : request->directory,
+                              description, len);
+}
+
+
+int
+gftp_new_cache_entry (gftp_request * request)
+{
+  char description[BUFSIZ], key[GFTP_CACHE_URL_LEN], *tempstr;
+  gftp_cache_slot * slot;
+  gftp_cache_index * idx;
+  intptr_t cache_ttl;
+  int cache_fd;
+  guint64 hash;
+  time_t now;
+
+  *description = '\0';
+  gftp_generate_cache_description (request, description, sizeof (description),
+                                   0);
+  hash = gftp_cache_index_key (description, key);
+
+  gftp_lookup_request_option (request, "cache_ttl", &cache_ttl);
+  time (&now);
+
+  if ((idx = gftp_cache_open_index (request, 1)) == NULL)
+    return (-1);
+
+  /* Expired entries are thrown out every few minutes instead of on every
+     lookup */
+  if (now - idx->header->last_expire > GFTP_CACHE_EXPIRE_INTERVAL)
+    gftp_cache_expire_entries (idx, now);
+
+  if ((slot = gftp_cache_lookup_slot (idx, key, hash, 0)) != NULL)
+    gftp_cache_remove_slot (idx, slot);
+
+  if (idx->header->num_used >= idx->header->num_slots / 2)
+    gftp_cache_evict_lru (idx);
+
+  tempstr = g_strdup_printf ("%s/cache.XXXXXX", idx->cachedir);
+  if ((cache_fd = mkstemp (tempstr)) < 0)
+    {
+      g_free (tempstr);
+      gftp_cache_close_index (idx);
+      if (request != NULL)
+        request->logging_function (gftp_logging_error, request,
+                                 _("Error: Cannot create temporary file: %s\n"),
+                                 g_strerror (errno));
+      return (-1);
+    }
+
+  slot = gftp_cache_lookup_slot (idx, key, hash, 1);
+  if (slot->state == GFTP_CACHE_SLOT_DELETED)
+    idx->header->num_deleted--;
+
+  memset (slot, 0, sizeof (*slot));
+  slot->hash = hash;
+  slot->expiration_date = now + cache_ttl;
+  slot->server_type = request->server_type;
+  slot->state = GFTP_CACHE_SLOT_USED;
+  g_strlcpy (slot->file, strrchr (tempstr, '/') + 1, sizeof (slot->file));
+  g_strlcpy (slot->url, key, sizeof (slot->url));
+  gftp_cache_lru_push (idx, slot);
+  idx->header->num_used++;
+
+  g_free (tempstr);
+  gftp_cache_close_index (idx);
+
+  return (cache_fd);
+}
+
+
+int
+gftp_find_cache_entry (gftp_request * request)
+{
+  char description[BUFSIZ], key[GFTP_CACHE_URL_LEN], *filename;
+  gftp_cache_slot * slot;
+  gftp_cache_index * idx;
+  int cachefd, server_type;
+  guint64 hash;
+  time_t now;
+
+  time (&now);
+
+  *description = '\0';
+  gftp_generate_cache_description (request, description, sizeof (description),
+                                   0);
+  hash = gftp_cache_index_key (description, key);
+
+  if ((idx = gftp_cache_open_index (request, 0)) == NULL)
+    return (-1);
+
+  slot = gftp_cache_lookup_slot (idx, key, hash, 0);
+  if (slot == NULL)
+    {
+      gftp_cache_close_index (idx);
+      GFTP_PROBE2 (cache__miss, description, 0);
+      return (-1);
+    }
+  else if (slot->expiration_date < now)
+    {
+      gftp_cache_remove_slot (idx, slot);
+      gftp_cache_close_index (idx);
+      GFTP_PROBE2 (cache__miss, description, 1);
+      return (-1);
+    }
+
+  gftp_cache_lru_touch (idx, slot);
+  server_type = slot->server_type;
+  filename = gftp_cache_slot_path (idx, slot);
+  gftp_cache_close_index (idx);
+
+  if ((cachefd = gftp_fd_open (request, filename, O_RDONLY, 0)) == -1)
+    {
+      g_free (filename);
+      return (-1);
+    }
+
+  if (lseek (cachefd, 0, SEEK_END) == 0)
+    { 
+      g_free (filename);
+      close (cachefd); 
+      return (-1);
+    } 
+
+  if (lseek (cachefd, 0, SEEK_SET) == -1)
+    {
+      if (request != NULL)
+        request->logging_function (gftp_logging_error, request,
+                               _("Error: Cannot seek on file %s: %s\n"),
+                               filename, g_strerror (errno));
+
+    }
+
+  g_free (filename);
+  request->server_type = server_type;
+  GFTP_PROBE1 (cache__hit, description);
+  return (cachefd);
+}
+
+
+void
+gftp_clear_cache_files (void)
+{
+  gftp_cache_index * idx;
+  guint32 i;
+
+  gftp_remove_old_cache_index (NULL);
+
+  if ((idx = gftp_cache_open_index (NULL, 0)) == NULL)
+    return;
+
+  for (i = 0; i < idx->header->num_slots; i++)
+    {
+      if (idx->slots[i].state == GFTP_CACHE_SLOT_USED)
+        gftp_cache_remove_slot (idx, &idx->slots[i]);
+    }
+
+  /* The next gftp_cache_open_index () sees that the file is gone */
+  unlink (idx->indexfile);
+
+  gftp_cache_close_index (idx);
+}
+
+
+void
+gftp_delete_cache_entry (gftp_request * request, char *descr, 
+                         int ignore_directory)
+{
+  char description[BUFSIZ], key[GFTP_CACHE_URL_LEN];
+  gftp_cache_slot * slot;
+  gftp_cache_index * idx;
+  guint64 hash;
+  size_t len;
+  guint32 i;
+ 
+  g_return_if_fail (request != NULL || descr != NULL);
+
+  if (request != NULL)
+    {
+      *description = '\0';
+      gftp_generate_cache_description (request, description, sizeof (description),
+                                       ignore_directory);
+    }
+  else if (descr != NULL)
+    { 
+      strncpy (description, descr, sizeof (description));
+      description[sizeof (description) - 1] = '\0';
+    }
+  else
+    return;
+
+  hash = gftp_cache_index_key (description, key);
+
+  if ((idx = gftp_cache_open_index (request, 0)) == NULL)
+    return;
+
+  if (ignore_directory)
+    {
+      len = MIN (strlen (description), GFTP_CACHE_KEY_PREFIX_LEN);
+      for (i = 0; i < idx->header->num_slots; i++)
+        {
+          slot = &idx->slots[i];
+          if (slot->state == GFTP_CACHE_SLOT_USED &&
+              strncmp (slot->url, description, len) == 0)
+            gftp_cache_remove_slot (idx, slot);
+        }
+    }
+  else if ((slot = gftp_cache_lookup_slot (idx, key, hash, 0)) != NULL)
+    gftp_cache_remove_slot (idx, slot);
+
+  gftp_cache_close_index (idx);
+}
+
+
+static guint32
+gftp_cache_add_string (gftp_cache_listing * listing, const char *str)
+{
+  guint32 offset;
+  size_t len;
+
+  if (str == NULL)
+    return (GFTP_CACHE_NO_STRING);
+
+  len = strlen (str) + 1;
+  if (listing->strings_len + len > listing->max_strings)
+    {
+      listing->max_strings = (listing->max_strings + len) * 2;
+      listing->strings = g_realloc (listing->strings, listing->max_strings);
+    }
+
+  offset = listing->strings_len;
+  memcpy (listing->strings + offset, str, len);
+  listing->strings_len += len;
+  return (offset);
+}
+
+
+static void
+gftp_cache_listing_add (gftp_cache_listing * listing, const gftp_file * fle)
+{
+  gftp_cache_file_record * rec;
+
+  if (listing->num_files == listing->max_files)
+    {
+      listing->max_files = listing->max_files == 0 ? 64 : 
+                                                     listing->max_files * 2;
+      listing->records = g_realloc (listing->records, 
+                                    listing->max_files * sizeof (*rec));
+    }
+
+  rec = &listing->records[listing->num_files++];
+  memset (rec, 0, sizeof (*rec));
+  rec->datetime = fle->datetime;
+  rec->size = fle->size;
+  rec->st_mode = fle->st_mode;
+  rec->file = gftp_cache_add_string (listing, fle->file);
+  rec->user = gftp_cache_add_string (listing, fle->user);
+  rec->group = gftp_cache_add_string (listing, fle->group);
+  if (fle->filename_utf8_encoded)
+    rec->flags |= GFTP_CACHE_FILE_UTF8;
+}
+
+
+static char *
+gftp_cache_listing_to_buffer (gftp_cache_listing * listing, size_t *len)
+{
+  gftp_cache_listing_header * header;
+  size_t records_len;
+  char *buf;
+
+  records_len = listing == NULL ? 0 : 
+                listing->num_files * sizeof (gftp_cache_file_record);
+  *len = sizeof (*header) + records_len + 
+         (listing == NULL ? 0 : listing->strings_len);
+
+  buf = g_malloc0 (*len);
+  header = (gftp_cache_listing_header *) buf;
+  memcpy (header->magic, GFTP_CACHE_LISTING_MAGIC, sizeof (header->magic));
+  if (listing != NULL)
+    {
+      header->num_files = listing->num_files;
+      header->strings_len = listing->strings_len;
+      memcpy (buf + sizeof (*header), listing->records, records_len);
+      memcpy (buf + sizeof (*header) + records_len, listing->strings,
+              listing->strings_len);
+    }
+
+  return (buf);
+}
+
+
+static gftp_cache_listing *
+gftp_cache_listing_load (int fd)
+{
+  gftp_cache_listing_header * header;
+  gftp_cache_listing * listing;
+  size_t records_len;
+  struct stat st;
+  ssize_t ret;
+  char *buf;
+  off_t pos;
+
+  if (fstat (fd, &st) == -1 || 
+      (size_t) st.st_size < sizeof (gftp_cache_listing_header))
+    return (NULL);
+
+  buf = g_malloc (st.st_size);
+  for (pos = 0; pos < st.st_size; pos += ret)
+    {
+      if ((ret = read (fd, buf + pos, st.st_size - pos)) <= 0)
+        {
+          if (ret < 0 && errno == EINTR)
+            {
+              ret = 0;
+              continue;
+            }
+
+          g_free (buf);
+          return (NULL);
+        }
+    }
+
+  header = (gftp_cache_listing_header *) buf;
+  records_len = (size_t) header->num_files * sizeof (gftp_cache_file_record);
+  if (memcmp (header->magic, GFTP_CACHE_LISTING_MAGIC,
+              sizeof (header->magic)) != 0 ||
+      (size_t) st.st_size != sizeof (*header) + records_len + 
+                             header->strings_len ||
+      (header->strings_len > 0 && buf[st.st_size - 1] != '\0'))
+    {
+      g_free (buf);
+      return (NULL);
+    }
+
+  listing = g_malloc0 (sizeof (*listing));
+  listing->buffer = buf;
+  listing->records = (gftp_cache_file_record *) (buf + sizeof (*header));
+  listing->num_files = header->num_files;
+  listing->strings = buf + sizeof (*header) + records_len;
+  listing->strings_len = header->strings_len;
+
+  return (listing);
+}
+
+
+static char *
+gftp_cache_get_string (gftp_cache_listing * listing, guint32 offset)
+{
+  if (offset >= listing->strings_len)
+    return (NULL);
+
+  return (g_strdup (listing->strings + offset));
+}
+
+
+static int
+gftp_cache_listing_get_file (gftp_cache_listing * listing,
+                             gftp_cache_file_record * rec, gftp_file * fle)
+{
+  if ((fle->file = gftp_cache_get_string (listing, rec->file)) == NULL)
+    return (GFTP_EFATAL);
+
+  /* Most listings only have a handful of owners */
+  if (rec->user < listing->strings_len)
+    fle->user = (char *) g_intern_string (listing->strings + rec->user);
+  if (rec->group < listing->strings_len)
+    fle->group = (char *) g_intern_string (listing->strings + rec->group);
+  fle->names_interned = 1;
+  fle->datetime = rec->datetime;
+  fle->size = rec->size;
+  fle->st_mode = rec->st_mode;
+  fle->filename_utf8_encoded = (rec->flags & GFTP_CACHE_FILE_UTF8) != 0;
+
+  return (1);
+}
+
+
+static void
+gftp_cache_listing_destroy (gftp_cache_listing * listing)
+{
+  if (listing->buffer != NULL)
+    g_free (listing->buffer);
+  else
+    {
+      g_free (listing->records);
+      g_free (listing->strings);
+    }
+
+  g_free (listing);
+}
+
+
+void
+gftp_cache_add_file (gftp_request * request, gftp_file * fle)
+{
+  g_return_if_fail (request != NULL);
+  g_return_if_fail (fle != NULL && fle->file != NULL);
+
+  if (request->cache_listing == NULL)
+    request->cache_listing = g_malloc0 (sizeof (gftp_cache_listing));
+
+  gftp_cache_listing_add (request->cache_listing, fle);
+}
+
+
+int
+gftp_cache_write_listing (gftp_request * request)
+{
+  ssize_t ret;
+  size_t len;
+  char *buf;
+
+  g_return_val_if_fail (request != NULL, GFTP_EFATAL);
+  g_return_val_if_fail (request->cachefd > 0, GFTP_EFATAL);
+
+  buf = gftp_cache_listing_to_buffer (request->cache_listing, &len);
+  ret = gftp_fd_write (request, buf, len, request->cachefd);
+  g_free (buf);
+
+  gftp_cache_free_listing (request);
+  return (ret < 0 ? (int) ret : 0);
+}
+
+
+int
+gftp_cache_read_listing (gftp_request * request, int fd)
+{
+  g_return_val_if_fail (request != NULL, GFTP_EFATAL);
+
+  gftp_cache_free_listing (request);
+
+  if ((request->cache_listing = gftp_cache_listing_load (fd)) == NULL)
+    return (-1);
+
+  return (0);
+}
+
+
+int
+gftp_cache_get_next_file (gftp_request * request, gftp_file * fle)
+{
+  gftp_cache_listing * listing;
+
+  g_return_val_if_fail (request != NULL, GFTP_EFATAL);
+  g_return_val_if_fail (fle != NULL, GFTP_EFATAL);
+
+  listing = request->cache_listing;
+  if (listing == NULL || listing->cur_file >= listing->num_files)
+    return (0);
+
+  return (gftp_cache_listing_get_file (listing,
+                                       &listing->records[listing->cur_file++],
+                                       fle));
+}
+
+
+void
+gftp_cache_free_listing (gftp_request * request)
+{
+  g_return_if_fail (request != NULL);
+
+  if (request->cache_listing == NULL)
+    return;
+
+  gftp_cache_listing_destroy (request->cache_listing);
+  request->cache_listing = NULL;
+}
+
+
+/* When a file is uploaded, removed, renamed or has its attributes changed
+   on the server, the cached listing of the directory that it is in is
+   patched instead of being thrown away, so the next refresh does not have
+   to go back to the server. The record that is patched is handed to a
+   gftp_cache_patch_func, which returns 1 to keep it (possibly changed), 0 to
+   drop it or -1 if the listing cannot be patched and has to be thrown out.
+   found is 0 when the directory is cached but the file is not in it.
+
+   A delete or an upload of many files would read and write the same
+   listing once per file, so between gftp_cache_begin_batch () and
+   gftp_cache_end_batch () the changes are queued on the request and each
+   listing is patched once at the end. */
+
+typedef int (*gftp_cache_patch_func) (gftp_file * fle, int found,
+                                      gpointer data);
+
+static int
+gftp_cache_split_path (gftp_request * request, const char *path,
+                       char **dir, const char **name)
+{
+  const char *pos;
+  char *tempstr;
+  size_t len;
+
+  if ((pos = strrchr (path, '/')) == NULL)
+    {
+      if (request->directory == NULL)
+        return (-1);
+
+      *dir = g_strdup (request->directory);
+      *name = path;
+      return (0);
+    }
+
+  *name = pos + 1;
+  if (**name == '\0')
+    return (-1);
+
+  if (pos == path)
+    tempstr = g_strdup ("/");
+  else
+    tempstr = g_strndup (path, pos - path);
+
+  if (*tempstr != '/')
+    {
+      if (request->directory == NULL)
+        {
+          g_free (tempstr);
+          return (-1);
+        }
+
+      *dir = gftp_build_path (request, request->directory, tempstr, NULL);
+      g_free (tempstr);
+    }
+  else
+    *dir = tempstr;
+
+  /* The listing is cached under the directory name the way the user typed
+     it, so /pub and /pub/ have to be the same */
+  if (request->directory != NULL)
+    {
+      len = strlen (request->directory);
+      if (len > 1 && request->directory[len - 1] == '/')
+        len--;
+
+      if (strncmp (*dir, request->directory, len) == 0 &&
+          ((*dir)[len] == '\0' || strcmp (*dir + len, "/") == 0))
+        {
+          g_free (*dir);
+          *dir = g_strdup (request->directory);
+        }
+    }
+
+  return (0);
+}
+
+
+static int
+gftp_cache_write_patched_listing (gftp_cache_index * idx,
+                                  gftp_cache_slot * slot,
+                                  gftp_cache_listing * listing)
+{
+  char *tempstr, *oldfile, *buf;
+  size_t len, pos;
+  ssize_t ret;
+  int fd;
+
+  /* The new listing goes into a new file, so a listing that is being read
+     at the same time is never seen half written */
+  tempstr = g_strdup_printf ("%s/cache.XXXXXX", idx->cachedir);
+  if ((fd = mkstemp (tempstr)) < 0)
+    {
+      g_free (tempstr);
+      return (-1);
+    }
+
+  buf = gftp_cache_listing_to_buffer (listing, &len);
+  for (pos = 0; pos < len; pos += ret)
+    {
+      if ((ret = write (fd, buf + pos, len - pos)) <= 0)
+        {
+          if (ret < 0 && errno == EINTR)
+            {
+              ret = 0;
+              continue;
+            }
+          break;
+        }
+    }
+  g_free (buf);
+
+  if (close (fd) != 0 || pos < len)
+    {
+      unlink (tempstr);
+      g_free (tempstr);
+      return (-1);
+    }
+
+  oldfile = gftp_cache_slot_path (idx, slot);
+  unlink (oldfile);
+  g_free (oldfile);
+
+  g_strlcpy (slot->file, strrchr (tempstr, '/') + 1, sizeof (slot->file));
+  g_free (tempstr);
+  return (0);
+}
+
+
+/* One change to a cached listing. Changes made while a batch is open are
+   queued on the request with their data copied into the patch */
+typedef struct gftp_cache_patch_tag
+{
+  char *dir,
+       *name;
+  gftp_cache_patch_func func;
+  gpointer data;
+  gftp_file fle;
+  mode_t mode;
+  time_t datetime;
+} gftp_cache_patch;
+
+
+static gftp_cache_patch *
+gftp_cache_patch_new (gftp_cache_patch_func func, gpointer data)
+{
+  gftp_cache_patch * patch;
+
+  patch = g_malloc0 (sizeof (*patch));
+  patch->func = func;
+  patch->data = data;
+  return (patch);
+}
+
+
+static void
+gftp_cache_patch_free (gftp_cache_patch * patch)
+{
+  g_free (patch->dir);
+  g_free (patch->name);
+  gftp_file_destroy (&patch->fle, 0);
+  g_free (patch);
+}
+
+
+/* Applies patches, which all belong to the listing of dir, in order. The
+   listing is read and written once no matter how many there are */
+static void
+gftp_cache_patch_listing (gftp_request * request, const char *dir,
+                          GList * patches)
+{
+  gftp_cache_listing * listing, * newlisting;
+  char description[BUFSIZ], key[GFTP_CACHE_URL_LEN], *filename;
+  gftp_cache_patch * patch;
+  GHashTable * positions;
+  gftp_cache_slot * slot;
+  gftp_cache_index * idx;
+  gftp_file * fle;
+  GPtrArray * files;
+  GList * templist;
+  guint pos, i;
+  int fd, keep;
+  guint64 hash;
+  time_t now;
+
+  gftp_cache_dir_description (request, dir, description, sizeof (description));
+  hash = gftp_cache_index_key (description, key);
+
+  if ((idx = gftp_cache_open_index (request, 0)) == NULL)
+    return;
+
+  slot = gftp_cache_lookup_slot (idx, key, hash, 0);
+  if (slot == NULL)
+    {
+      gftp_cache_close_index (idx);
+      return;
+    }
+
+  time (&now);
+  listing = NULL;
+  if (slot->expiration_date >= now)
+    {
+      filename = gftp_cache_slot_path (idx, slot);
+      if ((fd = open (filename, O_RDONLY)) >= 0)
+        {
+          listing = gftp_cache_listing_load (fd);
+          close (fd);
+        }
+      g_free (filename);
+    }
+
+  if (listing == NULL)
+    {
+      gftp_cache_remove_slot (idx, slot);
+      gftp_cache_close_index (idx);
+      return;
+    }
+
+  /* Listing order is kept. positions maps a name to its index in files
+     plus one, and files has a NULL where a file was dropped */
+  files = g_ptr_array_sized_new (listing->num_files + g_list_length (patches));
+  positions = g_hash_table_new (g_str_hash, g_str_equal);
+  for (i = 0; i < listing->num_files; i++)
+    {
+      fle = g_malloc0 (sizeof (*fle));
+      if (gftp_cache_listing_get_file (listing, &listing->records[i], fle) > 0)
+        {
+          g_ptr_array_add (files, fle);
+          g_hash_table_insert (positions, fle->file,
+                               GUINT_TO_POINTER (files->len));
+        }
+      else
+        gftp_file_destroy (fle, 1);
+    }
+  gftp_cache_listing_destroy (listing);
+
+  keep = 0;
+  for (templist = patches; templist != NULL; templist = templist->next)
+    {
+      patch = templist->data;
+      pos = GPOINTER_TO_UINT (g_hash_table_lookup (positions, patch->name));
+      if (pos > 0)
+        fle = files->pdata[pos - 1];
+      else
+        {
+          fle = g_malloc0 (sizeof (*fle));
+          fle->file = g_strdup (patch->name);
+        }
+
+      if ((keep = patch->func (fle, pos > 0, patch->data)) < 0)
+        {
+          if (pos == 0)
+            gftp_file_destroy (fle, 1);
+          break;
+        }
+      else if (keep == 0)
+        {
+          if (pos > 0)
+            {
+              g_hash_table_remove (positions, patch->name);
+              files->pdata[pos - 1] = NULL;
+            }
+          gftp_file_destroy (fle, 1);
+        }
+      else if (pos == 0)
+        {
+          g_ptr_array_add (files, fle);
+          g_hash_table_insert (positions, fle->file,
+                               GUINT_TO_POINTER (files->len));
+        }
+    }
+  g_hash_table_destroy (positions);
+
+  newlisting = NULL;
+  if (keep >= 0)
+    {
+      newlisting = g_malloc0 (sizeof (*newlisting));
+      for (i = 0; i < files->len; i++)
+        if (files->pdata[i] != NULL)
+          gftp_cache_listing_add (newlisting, files->pdata[i]);
+    }
+
+  if (newlisting == NULL ||
+      gftp_cache_write_patched_listing (idx, slot, newlisting) < 0)
+    gftp_cache_remove_slot (idx, slot);
+  else
+    gftp_cache_lru_touch (idx, slot);
+
+  gftp_cache_close_index (idx);
+
+  for (i = 0; i < files->len; i++)
+    if (files->pdata[i] != NULL)
+      gftp_file_destroy (files->pdata[i], 1);
+  g_ptr_array_free (files, TRUE);
+
+  if (newlisting != NULL)
+    gftp_cache_listing_destroy (newlisting);
+}
+
+
+/* Throws out the cached listings of a directory that was removed or renamed
+   and of everything below it */
+static void
+gftp_cache_forget_directory (gftp_request * request, const char *path)
+{
+  char description[BUFSIZ], *dir;
+  gftp_cache_slot * slot;
+  gftp_cache_index * idx;
+  size_t len;
+  guint32 i;
+
+  if (*path == '/' || request->directory == NULL)
+    dir = g_strdup (path);
+  else
+    dir = gftp_build_path (request, request->directory, path, NULL);
+
+  gftp_cache_dir_description (request, dir, description, sizeof (description));
+  g_free (dir);
+
+  len = strlen (description);
+  if (len > 1 && description[len - 1] == '/')
+    description[--len] = '\0';
+
+  if ((idx = gftp_cache_open_index (request, 0)) == NULL)
+    return;
+
+  for (i = 0; i < idx->header->num_slots; i++)
+    {
+      slot = &idx->slots[i];
+      if (slot->state == GFTP_CACHE_SLOT_USED &&
+          gftp_cache_slot_below (slot, description, len))
+        gftp_cache_remove_slot (idx, slot);
+    }
+
+  gftp_cache_close_index (idx);
+}
+
+
+static void
+gftp_cache_patch_file (gftp_request * request, const char *path,
+                       gftp_cache_patch * patch, int queue)
+{
+  const char *name;
+  GList * patches;
+  char *dir;
+
+  if (gftp_cache_split_path (request, path, &dir, &name) < 0)
+    {
+      /* Not sure which listing has the file, so none of this site's
+         listings can be trusted */
+      gftp_delete_cache_entry (request, NULL, 1);
+      gftp_cache_patch_free (patch);
+      return;
+    }
+
+  patch->dir = dir;
+  patch->name = g_strdup (name);
+
+  if (queue && request->cache_batch)
+    {
+      request->cache_patches = g_list_prepend (request->cache_patches, patch);
+      return;
+    }
+
+  patches = g_list_append (NULL, patch);
+  gftp_cache_patch_listing (request, patch->dir, patches);
+  g_list_free (patches);
+  gftp_cache_patch_free (patch);
+}
+
+
+void
+gftp_cache_begin_batch (gftp_request * request)
+{
+  g_return_if_fail (request != NULL);
+
+  request->cache_batch = 1;
+}
+
+
+static void
+gftp_cache_patch_queued_dir (gpointer key, gpointer value, gpointer data)
+{
+  gftp_cache_patch_listing (data, key, value);
+  g_list_free (value);
+}
+
+
+/* Applies the changes queued so far, patching every listing that was
+   touched once. The batch goes on */
+void
+gftp_cache_flush_batch (gftp_request * request)
+{
+  GList * templist, * patches;
+  gftp_cache_patch * patch;
+  GHashTable * dirs;
+
+  g_return_if_fail (request != NULL);
+
+  if (request->cache_patches == NULL)
+    return;
+
+  /* The queue is newest first, so prepending puts each directory's patches
+     back in the order they were made */
+  dirs = g_hash_table_new (g_str_hash, g_str_equal);
+  for (templist = request->cache_patches; 
+       templist != NULL; 
+       templist = templist->next)
+    {
+      patch = templist->data;
+      patches = g_hash_table_lookup (dirs, patch->dir);
+      g_hash_table_insert (dirs, patch->dir, g_list_prepend (patches, patch));
+    }
+
+  g_hash_table_foreach (dirs, gftp_cache_patch_queued_dir, request);
+  g_hash_table_destroy (dirs);
+
+  for (templist = request->cache_patches; 
+       templist != NULL; 
+       templist = templist->next)
+    gftp_cache_patch_free (templist->data);
+  g_list_free (request->cache_patches);
+  request->cache_patches = NULL;
+}
+
+
+/* Applies the changes queued since gftp_cache_begin_batch () */
+void
+gftp_cache_end_batch (gftp_request * request)
+{
+  g_return_if_fail (request != NULL);
+
+  request->cache_batch = 0;
+  gftp_cache_flush_batch (request);
+}
+
+
+static int
+gftp_cache_patch_remove (gftp_file * fle, int found, gpointer data)
+{
+  if (found && data != NULL)
+    {
+      /* Hand the old record to the caller, which will add it somewhere
+         else */
+      memcpy (data, fle, sizeof (*fle));
+      memset (fle, 0, sizeof (*fle));
+    }
+
+  return (0);
+}
+
+
+static int
+gftp_cache_patch_invalidate (gftp_file * fle, int found, gpointer data)
+{
+  return (-1);
+}
+
+
+static int
+gftp_cache_patch_add (gftp_file * fle, int found, gpointer data)
+{
+  gftp_file * newfle;
+  char *file;
+
+  newfle = data;
+  file = fle->file;
+  fle->file = NULL;
+  gftp_file_destroy (fle, 0);
+
+  fle->file = file;
+  fle->user = g_strdup (newfle->user != NULL ? newfle->user : "");
+  fle->group = g_strdup (newfle->group != NULL ? newfle->group : "");
+  fle->datetime = newfle->datetime;
+  fle->size = newfle->size;
+  fle->st_mode = newfle->st_mode;
+  fle->filename_utf8_encoded = newfle->filename_utf8_encoded;
+
+  return (1);
+}
+
+
+static int
+gftp_cache_patch_mode (gftp_file * fle, int found, gpointer data)
+{
+  mode_t mode;
+
+  if (!found)
+    return (-1);
+
+  mode = *(mode_t *) data;
+  fle->st_mode = (fle->st_mode & ~(S_IRWXU | S_IRWXG | S_IRWXO | S_ISUID | 
+                                   S_ISGID | S_ISVTX)) | mode;
+  return (1);
+}
+
+
+static int
+gftp_cache_patch_time (gftp_file * fle, int found, gpointer data)
+{
+  if (!found)
+    return (-1);
+
+  fle->datetime = *(time_t *) data;
+  return (1);
+}
+
+
+/* fle is NULL if the file was changed in a way that is not known, such as
+   an upload that failed part way through */
+void
+gftp_cache_file_added (gftp_request * request, const char *path,
+                       gftp_file * fle)
+{
+  gftp_cache_patch * patch;
+
+  g_return_if_fail (request != NULL);
+  g_return_if_fail (path != NULL);
+
+  if (fle == NULL)
+    patch = gftp_cache_patch_new (gftp_cache_patch_invalidate, NULL);
+  else
+    {
+      patch = gftp_cache_patch_new (gftp_cache_patch_add, NULL);
+      patch->data = &patch->fle;
+      patch->fle.user = g_strdup (fle->user);
+      patch->fle.group = g_strdup (fle->group);
+      patch->fle.datetime = fle->datetime;
+      patch->fle.size = fle->size;
+      patch->fle.st_mode = fle->st_mode;
+      patch->fle.filename_utf8_encoded = fle->filename_utf8_encoded;
+    }
+
+  gftp_cache_patch_file (request, path, patch, 1);
+}
+
+
+void
+gftp_cache_file_removed (gftp_request * request, const char *path,
+                         int is_directory)
+{
+  g_return_if_fail (request != NULL);
+  g_return_if_fail (path != NULL);
+
+  gftp_cache_patch_file (request, path,
+                         gftp_cache_patch_new (gftp_cache_patch_remove, NULL),
+                         1);
+  if (is_directory)
+    gftp_cache_forget_directory (request, path);
+}
+
+
+void
+gftp_cache_file_renamed (gftp_request * request, const char *oldpath,
+                         const char *newpath)
+{
+  gftp_file fle;
+
+  g_return_if_fail (request != NULL);
+  g_return_if_fail (oldpath != NULL);
+  g_return_if_fail (newpath != NULL);
+
+  /* The old record is needed right away, so whatever is queued has to go
+     in first */
+  if (request->cache_patches != NULL)
+    {
+      gftp_cache_end_batch (request);
+      request->cache_batch = 1;
+    }
+
+  memset (&fle, 0, sizeof (fle));
+  gftp_cache_patch_file (request, oldpath,
+                         gftp_cache_patch_new (gftp_cache_patch_remove, &fle),
+                         0);
+
+  if (fle.file == NULL)
+    {
+      /* The file was not in the cache, so there is nothing to add to the
+         new listing if that one is cached */
+      gftp_cache_patch_file (request, newpath,
+                             gftp_cache_patch_new (gftp_cache_patch_invalidate,
+                                                   NULL), 0);
+      gftp_cache_forget_directory (request, oldpath);
+      return;
+    }
+
+  gftp_cache_patch_file (request, newpath,
+                         gftp_cache_patch_new (gftp_cache_patch_add, &fle), 0);
+  if (S_ISDIR (fle.st_mode))
+    gftp_cache_forget_directory (request, oldpath);
+
+  gftp_file_destroy (&fle, 0);
+}
+
+
+void
+gftp_cache_file_mode_changed (gftp_request * request, const char *path,
+                              mode_t mode)
+{
+  gftp_cache_patch * patch;
+
+  g_return_if_fail (request != NULL);
+  g_return_if_fail (path != NULL);
+
+  patch = gftp_cache_patch_new (gftp_cache_patch_mode, NULL);
+  patch->mode = mode;
+  patch->data = &patch->mode;
+  gftp_cache_patch_file (request, path, patch, 1);
+}
+
+
+void
+gftp_cache_file_time_changed (gftp_request * request, const char *path,
+                              time_t datetime)
+{
+  gftp_cache_patch * patch;
+
+  g_return_if_fail (request != NULL);
+  g_return_if_fail (path != NULL);
+
+  patch = gftp_cache_patch_new (gftp_cache_patch_time, NULL);
+  patch->datetime = datetime;
+  patch->data = &patch->datetime;
+  gftp_cache_patch_file (request, path, patch, 1);
+}
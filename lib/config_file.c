@@ -665,18 +665,7 @@ gftp_read_config_file (char *global_data_path)
 	}
     }
 
-  if ((tempstr = gftp_expand_path (NULL, LOG_FILE)) == NULL)
-    {
-      printf (_("gFTP Error: Bad log file name %s\n"), LOG_FILE);
-      exit (EXIT_FAILURE);
-    }
-
-  if ((gftp_logfd = fopen (tempstr, "w")) == NULL)
-    {
-      printf (_("gFTP Warning: Cannot open %s for writing: %s\n"),
-              tempstr, g_strerror (errno));
-    }
-  g_free (tempstr);
+  gftp_log_file_open ();
 
   gftp_bookmarks = g_malloc0 (sizeof (*gftp_bookmarks));
   gftp_bookmarks->isfolder = 1;
@@ -0,0 +1,750 @@
+/*****************************************************************************/
+/*  filesort.c - sorting of file listings                                    */
+/*                                                                           */
+/*  This program is free software; you can redistribute it and/or modify     */
+/*  it under the terms of the GNU General Public License as published by     */
+/*  the Free Software Foundation; either version 2 of the License, or        */
+/*  (at your option) any later version.                                      */
+/*                                                                           */
+/*  This program is distributed in the hope that it will be useful,          */
+/*  but WITHOUT ANY WARRANTY; without even the implied warranty of           */
+/*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the            */
+/*  GNU General Public License for more details.                             */
+/*                                                                           */
+/*  You should have received a copy of the GNU General Public License        */
+/*  along with this program; if not, write to the Free Software              */
+/*  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111 USA      */
+/*****************************************************************************/
+
+#include "gftp.h"
+
+/* The list is copied once into a gftp_sort_array, which keeps the GList
+   nodes and, for each column that has been sorted on, the sort keys of
+   every file. A sort fills a contiguous array of items (a 64 bit prefix of
+   the key, the full key and the file index), merge sorts it and then links
+   the GList nodes again in the new order. So a sort never calls strcasecmp
+   and never follows a list pointer, and sorting the same listing by another
+   column reuses the array.
+
+   Names, users and groups are compared like strcasecmp () did, by folding
+   ASCII upper case letters once and then comparing bytes. The sort is
+   stable. Big lists are split into chunks that are sorted by separate
+   threads and then merged pairwise.
+
+   A listing that is still coming in is added in batches. When the array
+   is already sorted the same way, only the new files are sorted, and then
+   merged into the current order in one pass. */
+
+#define FILESORT_NUM_COLUMNS		(GFTP_SORT_COL_ATTRIBS + 1)
+#define FILESORT_INSERTION_RUN		32
+#define FILESORT_PARALLEL_MIN		65536
+#define FILESORT_MAX_THREADS		8
+#define FILESORT_SIGN_BIT		G_GUINT64_CONSTANT (0x8000000000000000)
+
+typedef struct gftp_sort_item_tag
+{
+  guint64 prefix;		/* First 8 bytes of the key, or the number */
+  const char *key;		/* NULL for the numeric columns */
+  guint32 idx;			/* Index into the gftp_sort_array */
+} gftp_sort_item;
+
+struct gftp_sort_array_tag
+{
+  GList ** nodes;
+  gftp_file ** files;
+  guint32 * order,		/* Current order of the list */
+          num_files,
+          size;			/* Allocated entries of each array */
+  gint64 dotdot;		/* Index of .., or -1 */
+  int sorted_column,		/* How order is sorted, or -1 */
+      sorted_asds,
+      sorted_dirs_first;
+  guint64 * prefixes[FILESORT_NUM_COLUMNS];
+  const char ** keys[FILESORT_NUM_COLUMNS];
+};
+
+typedef struct gftp_sort_job_tag
+{
+  gftp_sort_item * items,
+                 * tmp;
+  size_t lo,
+         mid,
+         hi;
+  int sign;
+} gftp_sort_job;
+
+
+gftp_sort_array *
+gftp_sort_array_new (GList * filelist)
+{
+  gftp_sort_array * sarr;
+  GList * templist;
+  guint32 i, num;
+
+  num = 0;
+  for (templist = filelist; templist != NULL; templist = templist->next)
+    num++;
+
+  sarr = g_malloc0 (sizeof (*sarr));
+  sarr->num_files = num;
+  sarr->nodes = g_malloc ((num + 1) * sizeof (*sarr->nodes));
+  sarr->files = g_malloc ((num + 1) * sizeof (*sarr->files));
+  sarr->order = g_malloc ((num + 1) * sizeof (*sarr->order));
+  sarr->size = num + 1;
+  sarr->dotdot = -1;
+  sarr->sorted_column = -1;
+
+  for (i = 0, templist = filelist; templist != NULL;
+       i++, templist = templist->next)
+    {
+      sarr->nodes[i] = templist;
+      sarr->files[i] = templist->data;
+      sarr->order[i] = i;
+
+      if (sarr->dotdot == -1 && strcmp (sarr->files[i]->file, "..") == 0)
+        sarr->dotdot = i;
+    }
+
+  return (sarr);
+}
+
+
+void
+gftp_sort_array_free (gftp_sort_array * sarr)
+{
+  guint32 i;
+  int col;
+
+  if (sarr == NULL)
+    return;
+
+  for (col = 0; col < FILESORT_NUM_COLUMNS; col++)
+    {
+      if (sarr->keys[col] != NULL)
+        {
+          for (i = 0; i < sarr->num_files; i++)
+            {
+              /* Keys that needed no folding point into the gftp_file */
+              if (sarr->keys[col][i] != NULL &&
+                  sarr->keys[col][i] != sarr->files[i]->file &&
+                  sarr->keys[col][i] != sarr->files[i]->user &&
+                  sarr->keys[col][i] != sarr->files[i]->group)
+                g_free ((char *) sarr->keys[col][i]);
+            }
+          g_free (sarr->keys[col]);
+        }
+
+      if (sarr->prefixes[col] != NULL)
+        g_free (sarr->prefixes[col]);
+    }
+
+  g_free (sarr->nodes);
+  g_free (sarr->files);
+  g_free (sarr->order);
+  g_free (sarr);
+}
+
+
+GList *
+gftp_sort_array_get_list (gftp_sort_array * sarr)
+{
+  g_return_val_if_fail (sarr != NULL, NULL);
+
+  if (sarr->num_files == 0)
+    return (NULL);
+
+  return (sarr->nodes[sarr->order[0]]);
+}
+
+
+static const char *
+_sort_fold_key (const char *str)
+{
+  const char *pos;
+
+  if (str == NULL)
+    return (g_strdup (""));
+
+  for (pos = str; *pos != '\0'; pos++)
+    {
+      if (g_ascii_isupper (*pos))
+        return (g_ascii_strdown (str, -1));
+    }
+
+  return (str);
+}
+
+
+static guint64
+_sort_key_prefix (const char *key)
+{
+  guint64 prefix;
+  int i;
+
+  prefix = 0;
+  for (i = 0; i < 8; i++)
+    {
+      prefix <<= 8;
+      if (*key != '\0')
+        prefix |= (unsigned char) *key++;
+    }
+
+  return (prefix);
+}
+
+
+static void
+_sort_array_build_keys (gftp_sort_array * sarr, int column, guint32 first)
+{
+  const char *str;
+  gftp_file * fle;
+  guint64 num;
+  guint32 i;
+
+  if (sarr->prefixes[column] == NULL)
+    {
+      sarr->prefixes[column] = g_malloc (sarr->size *
+                                         sizeof (*sarr->prefixes[column]));
+      if (column == GFTP_SORT_COL_FILE || column == GFTP_SORT_COL_USER ||
+          column == GFTP_SORT_COL_GROUP)
+        sarr->keys[column] = g_malloc (sarr->size *
+                                       sizeof (*sarr->keys[column]));
+      first = 0;
+    }
+
+  for (i = first; i < sarr->num_files; i++)
+    {
+      fle = sarr->files[i];
+      switch (column)
+        {
+          case GFTP_SORT_COL_FILE:
+          case GFTP_SORT_COL_USER:
+          case GFTP_SORT_COL_GROUP:
+            if (column == GFTP_SORT_COL_FILE)
+              str = fle->file;
+            else if (column == GFTP_SORT_COL_USER)
+              str = fle->user;
+            else
+              str = fle->group;
+
+            sarr->keys[column][i] = _sort_fold_key (str);
+            num = _sort_key_prefix (sarr->keys[column][i]);
+            break;
+          case GFTP_SORT_COL_SIZE:
+            /* Flip the sign bit so the signed values sort as unsigned */
+            num = (guint64) (gint64) fle->size ^ FILESORT_SIGN_BIT;
+            break;
+          case GFTP_SORT_COL_DATETIME:
+            num = (guint64) (gint64) fle->datetime ^ FILESORT_SIGN_BIT;
+            break;
+          default:
+            num = fle->st_mode;
+            break;
+        }
+
+      sarr->prefixes[column][i] = num;
+    }
+}
+
+
+static inline int
+_sort_item_cmp (const gftp_sort_item * a, const gftp_sort_item * b)
+{
+  if (a->prefix != b->prefix)
+    return (a->prefix < b->prefix ? -1 : 1);
+  else if (a->key == NULL)
+    return (0);
+  else
+    return (strcmp (a->key, b->key));
+}
+
+
+static void
+_sort_merge (const gftp_sort_item * src, gftp_sort_item * dest, size_t lo,
+             size_t mid, size_t hi, int sign)
+{
+  size_t left, right, out;
+
+  left = lo;
+  right = mid;
+  out = lo;
+
+  /* Only take from the right run when it sorts strictly before the left
+     one, which keeps the sort stable in both directions */
+  while (left < mid && right < hi)
+    {
+      if (sign * _sort_item_cmp (&src[right], &src[left]) < 0)
+        dest[out++] = src[right++];
+      else
+        dest[out++] = src[left++];
+    }
+
+  if (left < mid)
+    memcpy (&dest[out], &src[left], (mid - left) * sizeof (*dest));
+  else if (right < hi)
+    memcpy (&dest[out], &src[right], (hi - right) * sizeof (*dest));
+}
+
+
+static void
+_sort_items (gftp_sort_item * items, gftp_sort_item * tmp, size_t num,
+             int sign)
+{
+  gftp_sort_item * src, * dest, * swap, item;
+  size_t lo, hi, width, i, j;
+
+  for (lo = 0; lo < num; lo += FILESORT_INSERTION_RUN)
+    {
+      hi = MIN (lo + FILESORT_INSERTION_RUN, num);
+      for (i = lo + 1; i < hi; i++)
+        {
+          item = items[i];
+          for (j = i; j > lo && sign * _sort_item_cmp (&item, &items[j - 1]) < 0;
+               j--)
+            items[j] = items[j - 1];
+          items[j] = item;
+        }
+    }
+
+  src = items;
+  dest = tmp;
+  for (width = FILESORT_INSERTION_RUN; width < num; width *= 2)
+    {
+      for (lo = 0; lo < num; lo += 2 * width)
+        {
+          if (lo + width >= num)
+            memcpy (&dest[lo], &src[lo], (num - lo) * sizeof (*dest));
+          else
+            _sort_merge (src, dest, lo, lo + width, MIN (lo + 2 * width, num),
+                         sign);
+        }
+
+      swap = src;
+      src = dest;
+      dest = swap;
+    }
+
+  if (src != items)
+    memcpy (items, src, num * sizeof (*items));
+}
+
+
+static gpointer
+_sort_chunk_thread (gpointer data)
+{
+  gftp_sort_job * job;
+
+  job = data;
+  _sort_items (job->items + job->lo, job->tmp + job->lo, job->hi - job->lo,
+               job->sign);
+  return (NULL);
+}
+
+
+static gpointer
+_sort_merge_thread (gpointer data)
+{
+  gftp_sort_job * job;
+
+  job = data;
+  _sort_merge (job->items, job->tmp, job->lo, job->mid, job->hi, job->sign);
+  return (NULL);
+}
+
+
+static unsigned int
+_sort_num_threads (size_t num)
+{
+  unsigned int num_threads, cpus;
+
+  if (num < FILESORT_PARALLEL_MIN)
+    return (1);
+
+#if GLIB_CHECK_VERSION(2,36,0)
+  cpus = g_get_num_processors ();
+#else
+  cpus = sysconf (_SC_NPROCESSORS_ONLN);
+#endif
+
+  for (num_threads = 1;
+       num_threads * 2 <= cpus && num_threads * 2 <= FILESORT_MAX_THREADS &&
+       num / (num_threads * 2) >= FILESORT_PARALLEL_MIN / 2;
+       num_threads *= 2);
+
+  return (num_threads);
+}
+
+
+static void
+_sort_items_parallel (gftp_sort_item * items, gftp_sort_item * tmp,
+                      size_t num, int sign)
+{
+  gftp_sort_job jobs[FILESORT_MAX_THREADS];
+  GThread * threads[FILESORT_MAX_THREADS];
+  size_t bounds[FILESORT_MAX_THREADS + 1];
+  unsigned int num_threads, width, i, j;
+  gftp_sort_item * src, * dest, * swap;
+
+  num_threads = _sort_num_threads (num);
+  if (num_threads == 1)
+    {
+      _sort_items (items, tmp, num, sign);
+      return;
+    }
+
+  for (i = 0; i <= num_threads; i++)
+    bounds[i] = num * i / num_threads;
+
+  for (i = 0; i < num_threads; i++)
+    {
+      jobs[i].items = items;
+      jobs[i].tmp = tmp;
+      jobs[i].lo = bounds[i];
+      jobs[i].hi = bounds[i + 1];
+      jobs[i].sign = sign;
+      threads[i] = g_thread_new ("gftp-sort", _sort_chunk_thread, &jobs[i]);
+    }
+
+  for (i = 0; i < num_threads; i++)
+    g_thread_join (threads[i]);
+
+  /* num_threads is a power of 2, so every round merges pairs of chunks */
+  src = items;
+  dest = tmp;
+  for (width = 1; width < num_threads; width *= 2)
+    {
+      for (i = 0, j = 0; i < num_threads; i += 2 * width, j++)
+        {
+          jobs[j].items = src;
+          jobs[j].tmp = dest;
+          jobs[j].lo = bounds[i];
+          jobs[j].mid = bounds[i + width];
+          jobs[j].hi = bounds[i + 2 * width];
+          jobs[j].sign = sign;
+          threads[j] = g_thread_new ("gftp-sort", _sort_merge_thread, &jobs[j]);
+        }
+
+      while (j > 0)
+        g_thread_join (threads[--j]);
+
+      swap = src;
+      src = dest;
+      dest = swap;
+    }
+
+  if (src != items)
+    memcpy (items, src, num * sizeof (*items));
+}
+
+
+static void
+_sort_array_link (gftp_sort_array * sarr)
+{
+  GList * prev, * node;
+  guint32 i;
+
+  prev = NULL;
+  for (i = 0; i < sarr->num_files; i++)
+    {
+      node = sarr->nodes[sarr->order[i]];
+      node->prev = prev;
+      if (prev != NULL)
+        prev->next = node;
+      prev = node;
+    }
+  prev->next = NULL;
+}
+
+
+static void
+_sort_array_order (gftp_sort_array * sarr, int column, int asds,
+                   int sort_dirs_first)
+{
+  gftp_sort_item * items, * tmp;
+  guint32 i, idx, num_items, num_dirs;
+  gftp_file * fle;
+  int pass;
+
+  if (sarr->prefixes[column] == NULL)
+    _sort_array_build_keys (sarr, column, 0);
+
+  items = g_malloc ((sarr->num_files + 1) * sizeof (*items));
+  tmp = g_malloc ((sarr->num_files + 1) * sizeof (*tmp));
+
+  /* Split into .., the directories and the files, keeping the current
+     order of each part so that ties stay where they were */
+  num_items = num_dirs = 0;
+  for (pass = sort_dirs_first ? 0 : 1; pass < 2; pass++)
+    {
+      for (i = 0; i < sarr->num_files; i++)
+        {
+          idx = sarr->order[i];
+          if (idx == sarr->dotdot)
+            continue;
+
+          fle = sarr->files[idx];
+          if (sort_dirs_first && (pass == 0) != (S_ISDIR (fle->st_mode) != 0))
+            continue;
+
+          items[num_items].prefix = sarr->prefixes[column][idx];
+          items[num_items].key = sarr->keys[column] != NULL ?
+                                   sarr->keys[column][idx] : NULL;
+          items[num_items].idx = idx;
+          num_items++;
+        }
+
+      if (pass == 0)
+        num_dirs = num_items;
+    }
+
+  _sort_items_parallel (items, tmp, num_dirs, asds ? 1 : -1);
+  _sort_items_parallel (items + num_dirs, tmp + num_dirs, num_items - num_dirs,
+                        asds ? 1 : -1);
+
+  i = 0;
+  if (sarr->dotdot != -1)
+    sarr->order[i++] = sarr->dotdot;
+  for (idx = 0; idx < num_items; idx++)
+    sarr->order[i++] = items[idx].idx;
+
+  g_free (items);
+  g_free (tmp);
+
+  sarr->sorted_column = column;
+  sarr->sorted_asds = asds;
+  sarr->sorted_dirs_first = sort_dirs_first;
+}
+
+
+GList *
+gftp_sort_array_sort (gftp_sort_array * sarr, int column, int asds)
+{
+  intptr_t sort_dirs_first;
+
+  g_return_val_if_fail (sarr != NULL, NULL);
+
+  if (sarr->num_files == 0)
+    return (NULL);
+
+  if (column < GFTP_SORT_COL_FILE || column > GFTP_SORT_COL_ATTRIBS)
+    return (gftp_sort_array_get_list (sarr)); /* Don't sort */
+
+  sort_dirs_first = 1;
+  gftp_lookup_global_option ("sort_dirs_first", &sort_dirs_first);
+
+  _sort_array_order (sarr, column, asds, sort_dirs_first);
+  _sort_array_link (sarr);
+
+  return (sarr->nodes[sarr->order[0]]);
+}
+
+
+static void
+_sort_array_grow (gftp_sort_array * sarr, guint32 num)
+{
+  int col;
+
+  if (num < sarr->size)
+    return;
+
+  sarr->size = MAX (num + 1, sarr->size * 2);
+  sarr->nodes = g_realloc (sarr->nodes, sarr->size * sizeof (*sarr->nodes));
+  sarr->files = g_realloc (sarr->files, sarr->size * sizeof (*sarr->files));
+  sarr->order = g_realloc (sarr->order, sarr->size * sizeof (*sarr->order));
+
+  for (col = 0; col < FILESORT_NUM_COLUMNS; col++)
+    {
+      if (sarr->prefixes[col] != NULL)
+        sarr->prefixes[col] = g_realloc (sarr->prefixes[col], sarr->size *
+                                         sizeof (*sarr->prefixes[col]));
+      if (sarr->keys[col] != NULL)
+        sarr->keys[col] = g_realloc (sarr->keys[col], sarr->size *
+                                     sizeof (*sarr->keys[col]));
+    }
+}
+
+
+/* Merges the files from first on into the current order, which must be
+   sorted by column. The new files are sorted on their own, and then both
+   parts are walked once. A new file goes after the files that compare
+   equal to it, like a stable sort of the whole array would put it. */
+static void
+_sort_array_merge_new (gftp_sort_array * sarr, guint32 first, int column,
+                       int asds)
+{
+  gftp_sort_item * items, * tmp, olditem;
+  guint32 i, idx, out, pos, num_items, num_dirs, end, * order;
+  int pass, sign, take_old;
+  gftp_file * fle;
+
+  items = g_malloc ((sarr->num_files - first + 1) * sizeof (*items));
+  tmp = g_malloc ((sarr->num_files - first + 1) * sizeof (*tmp));
+
+  num_items = num_dirs = 0;
+  for (pass = sarr->sorted_dirs_first ? 0 : 1; pass < 2; pass++)
+    {
+      for (idx = first; idx < sarr->num_files; idx++)
+        {
+          if (idx == sarr->dotdot)
+            continue;
+
+          fle = sarr->files[idx];
+          if (sarr->sorted_dirs_first &&
+              (pass == 0) != (S_ISDIR (fle->st_mode) != 0))
+            continue;
+
+          items[num_items].prefix = sarr->prefixes[column][idx];
+          items[num_items].key = sarr->keys[column] != NULL ?
+                                   sarr->keys[column][idx] : NULL;
+          items[num_items].idx = idx;
+          num_items++;
+        }
+
+      if (pass == 0)
+        num_dirs = num_items;
+    }
+
+  sign = asds ? 1 : -1;
+  _sort_items_parallel (items, tmp, num_dirs, sign);
+  _sort_items_parallel (items + num_dirs, tmp + num_dirs, num_items - num_dirs,
+                        sign);
+  g_free (tmp);
+
+  order = g_malloc (sarr->size * sizeof (*order));
+  out = 0;
+  if (sarr->dotdot != -1)
+    order[out++] = sarr->dotdot;
+
+  pos = 0;
+  i = 0;
+  for (pass = sarr->sorted_dirs_first ? 0 : 1; pass < 2; pass++)
+    {
+      end = pass == 0 ? num_dirs : num_items;
+      for (;;)
+        {
+          while (pos < first && sarr->order[pos] == sarr->dotdot)
+            pos++;
+
+          take_old = pos < first &&
+                     (pass == 1 ||
+                      S_ISDIR (sarr->files[sarr->order[pos]]->st_mode));
+
+          if (take_old && i < end)
+            {
+              idx = sarr->order[pos];
+              olditem.prefix = sarr->prefixes[column][idx];
+              olditem.key = sarr->keys[column] != NULL ?
+                              sarr->keys[column][idx] : NULL;
+              take_old = sign * _sort_item_cmp (&items[i], &olditem) >= 0;
+            }
+          else if (i >= end && !take_old)
+            break;
+
+          if (take_old)
+            order[out++] = sarr->order[pos++];
+          else
+            order[out++] = items[i++].idx;
+        }
+    }
+
+  g_free (items);
+  g_free (sarr->order);
+  sarr->order = order;
+}
+
+
+/* Returns nonzero when gftp_sort_array_add () will merge new files into the
+   current order, so the files that are already there keep their order */
+int
+gftp_sort_array_keeps_order (gftp_sort_array * sarr, int column, int asds)
+{
+  intptr_t sort_dirs_first;
+
+  g_return_val_if_fail (sarr != NULL, 0);
+
+  if (column < GFTP_SORT_COL_FILE || column > GFTP_SORT_COL_ATTRIBS)
+    return (0);
+
+  sort_dirs_first = 1;
+  gftp_lookup_global_option ("sort_dirs_first", &sort_dirs_first);
+
+  return (sarr->num_files > 0 && sarr->sorted_column == column &&
+          sarr->sorted_asds == asds &&
+          sarr->sorted_dirs_first == sort_dirs_first);
+}
+
+
+/* Adds filelist, a batch of a listing that is still coming in, to the
+   array and returns the whole list sorted by column. */
+GList *
+gftp_sort_array_add (gftp_sort_array * sarr, GList * filelist, int column,
+                     int asds)
+{
+  intptr_t sort_dirs_first;
+  GList * templist;
+  int keeps_order;
+  guint32 first, i;
+  int col;
+
+  g_return_val_if_fail (sarr != NULL, NULL);
+
+  first = sarr->num_files;
+  i = first;
+  for (templist = filelist; templist != NULL; templist = templist->next)
+    i++;
+
+  if (i == first)
+    return (gftp_sort_array_get_list (sarr));
+
+  keeps_order = gftp_sort_array_keeps_order (sarr, column, asds);
+  _sort_array_grow (sarr, i);
+
+  for (i = first, templist = filelist; templist != NULL;
+       i++, templist = templist->next)
+    {
+      sarr->nodes[i] = templist;
+      sarr->files[i] = templist->data;
+      sarr->order[i] = i;
+
+      if (sarr->dotdot == -1 && strcmp (sarr->files[i]->file, "..") == 0)
+        sarr->dotdot = i;
+    }
+  sarr->num_files = i;
+
+  for (col = 0; col < FILESORT_NUM_COLUMNS; col++)
+    {
+      if (sarr->prefixes[col] != NULL)
+        _sort_array_build_keys (sarr, col, first);
+    }
+
+  if (keeps_order)
+    _sort_array_merge_new (sarr, first, column, asds);
+  else if (column >= GFTP_SORT_COL_FILE && column <= GFTP_SORT_COL_ATTRIBS)
+    {
+      sort_dirs_first = 1;
+      gftp_lookup_global_option ("sort_dirs_first", &sort_dirs_first);
+      _sort_array_order (sarr, column, asds, sort_dirs_first);
+    }
+  else
+    sarr->sorted_column = -1;
+
+  _sort_array_link (sarr);
+
+  return (sarr->nodes[sarr->order[0]]);
+}
+
+
+GList *
+gftp_sort_filelist (GList * filelist, int column, int asds)
+{
+  gftp_sort_array * sarr;
+
+  if (filelist == NULL) /* nothing to sort */
+    return (filelist);
+
+  sarr = gftp_sort_array_new (filelist);
+  filelist = gftp_sort_array_sort (sarr, column, asds);
+  gftp_sort_array_free (sarr);
+
+  return (filelist);
+}
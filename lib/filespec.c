@@ -0,0 +1,592 @@
+/*****************************************************************************/
+/*  filespec.c - compiled wildcard matching of file names                    */
+/*                                                                           */
+/*  This program is free software; you can redistribute it and/or modify     */
+/*  it under the terms of the GNU General Public License as published by     */
+/*  the Free Software Foundation; either version 2 of the License, or        */
+/*  (at your option) any later version.                                      */
+/*                                                                           */
+/*  This program is distributed in the hope that it will be useful,          */
+/*  but WITHOUT ANY WARRANTY; without even the implied warranty of           */
+/*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the            */
+/*  GNU General Public License for more details.                             */
+/*                                                                           */
+/*  You should have received a copy of the GNU General Public License        */
+/*  along with this program; if not, write to the Free Software              */
+/*  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111 USA      */
+/*****************************************************************************/
+
+#include "gftp.h"
+
+/* A filespec is a list of shell style patterns: * ? [a-z] [!a-z] \x and
+   {a,b,c}. All of the patterns are compiled into a single NFA with one
+   position per pattern character, and the NFA is run with one bit per
+   position. So one pass over a file name tests every pattern, and the cost
+   does not depend on how many * there are.
+
+   For each position there is a bit in:
+     masks[word * 256 + c] - c moves from this position to the next one
+     stars                 - a * is here: any character stays here, and the
+                             next position is reached without a character
+     starts                - first position of a pattern
+     accepts               - end of a pattern, ids has the pattern id
+
+   Matching is byte based, like the old matcher, so ? and [] only see single
+   bytes of UTF-8 names. Case folding only folds ASCII letters. */
+
+#define FILESPEC_MAX_EXPANSIONS		1024
+#define FILESPEC_STACK_WORDS		16
+
+#define FILESPEC_BIT(pos)	((guint64) 1 << ((pos) % 64))
+#define FILESPEC_SET(arr,pos)	((arr)[(pos) / 64] |= FILESPEC_BIT (pos))
+
+struct gftp_filespec_tag
+{
+  guint64 * masks,
+          * stars,
+          * starts,
+          * accepts;
+  int * ids;
+  unsigned int num_positions,
+               num_words,
+               serial;
+  char *filespec;		/* What gftp_filespec_compile () was given */
+  unsigned int casefold : 1,	/* Compiled with filespec_ignore_case */
+               hide_dotfiles : 1, /* Compiled without show_hidden_files */
+               match_all : 1;	/* Empty filespec */
+};
+
+static volatile gint filespec_serial = 0;
+
+static GMutex extensions_mutex;
+static gftp_filespec * extensions_spec = NULL;
+static GList * extensions_list = NULL;
+static unsigned int extensions_num_items = 0;
+
+
+gftp_filespec *
+gftp_filespec_new (void)
+{
+  gftp_filespec * spec;
+
+  spec = g_malloc0 (sizeof (*spec));
+  spec->serial = g_atomic_int_add (&filespec_serial, 1) + 1;
+  return (spec);
+}
+
+
+void
+gftp_filespec_free (gftp_filespec * spec)
+{
+  if (spec == NULL)
+    return;
+
+  g_free (spec->masks);
+  g_free (spec->stars);
+  g_free (spec->starts);
+  g_free (spec->accepts);
+  g_free (spec->ids);
+  g_free (spec->filespec);
+  g_free (spec);
+}
+
+
+static unsigned int
+_filespec_new_position (gftp_filespec * spec)
+{
+  unsigned int words;
+
+  if (spec->num_positions == spec->num_words * 64)
+    {
+      words = spec->num_words + 1;
+      spec->masks = g_realloc (spec->masks, words * 256 * sizeof (guint64));
+      memset (spec->masks + spec->num_words * 256, 0, 256 * sizeof (guint64));
+
+      spec->stars = g_realloc (spec->stars, words * sizeof (guint64));
+      spec->starts = g_realloc (spec->starts, words * sizeof (guint64));
+      spec->accepts = g_realloc (spec->accepts, words * sizeof (guint64));
+      spec->stars[spec->num_words] = 0;
+      spec->starts[spec->num_words] = 0;
+      spec->accepts[spec->num_words] = 0;
+
+      spec->ids = g_realloc (spec->ids, words * 64 * sizeof (int));
+      spec->num_words = words;
+    }
+
+  return (spec->num_positions++);
+}
+
+
+static void
+_filespec_add_char (gftp_filespec * spec, const guchar * set)
+{
+  unsigned int pos, c;
+
+  pos = _filespec_new_position (spec);
+  for (c = 0; c < 256; c++)
+    if (set[c / 8] & (1 << (c % 8)))
+      spec->masks[(pos / 64) * 256 + c] |= FILESPEC_BIT (pos);
+}
+
+
+static void
+_filespec_set_char (gftp_filespec * spec, guchar * set, guchar c)
+{
+  set[c / 8] |= 1 << (c % 8);
+  if (spec->casefold)
+    {
+      c = g_ascii_isupper (c) ? g_ascii_tolower (c) : g_ascii_toupper (c);
+      set[c / 8] |= 1 << (c % 8);
+    }
+}
+
+
+/* Parses the [...] at pos into set. Returns where the class ends, or NULL
+   if the [ is not closed and should be taken literally */
+static const char *
+_filespec_parse_class (gftp_filespec * spec, const char *pos, guchar * set)
+{
+  int negate, first, c, last;
+
+  pos++;
+  negate = *pos == '!' || *pos == '^';
+  if (negate)
+    pos++;
+
+  memset (set, 0, 32);
+  for (first = 1; *pos != '\0' && (first || *pos != ']'); first = 0)
+    {
+      if (*pos == '\\' && pos[1] != '\0')
+        pos++;
+
+      c = (guchar) *pos++;
+      last = c;
+      if (*pos == '-' && pos[1] != ']' && pos[1] != '\0')
+        {
+          pos++;
+          if (*pos == '\\' && pos[1] != '\0')
+            pos++;
+          last = (guchar) *pos++;
+        }
+
+      for (; c <= last; c++)
+        _filespec_set_char (spec, set, c);
+    }
+
+  if (*pos != ']')
+    return (NULL);
+
+  if (negate)
+    for (c = 0; c < 32; c++)
+      set[c] = ~set[c];
+
+  return (pos + 1);
+}
+
+
+static void
+_filespec_add_pattern (gftp_filespec * spec, const char *pattern, int id)
+{
+  unsigned int pos, start;
+  const char *end;
+  guchar set[32];
+  int last_star;
+
+  start = spec->num_positions;
+  last_star = 0;
+  for (; *pattern != '\0'; pattern++)
+    {
+      if (*pattern == '*')
+        {
+          /* Several *s in a row are the same as one */
+          if (!last_star)
+            {
+              pos = _filespec_new_position (spec);
+              FILESPEC_SET (spec->stars, pos);
+            }
+          last_star = 1;
+          continue;
+        }
+
+      last_star = 0;
+      memset (set, 0, sizeof (set));
+      if (*pattern == '?')
+        memset (set, 0xff, sizeof (set));
+      else if (*pattern == '[' &&
+               (end = _filespec_parse_class (spec, pattern, set)) != NULL)
+        pattern = end - 1;
+      else
+        {
+          if (*pattern == '\\' && pattern[1] != '\0')
+            pattern++;
+          memset (set, 0, sizeof (set));
+          _filespec_set_char (spec, set, *pattern);
+        }
+
+      _filespec_add_char (spec, set);
+    }
+
+  pos = _filespec_new_position (spec);
+  FILESPEC_SET (spec->accepts, pos);
+  spec->ids[pos] = id;
+  FILESPEC_SET (spec->starts, start);
+}
+
+
+/* Finds the first {...} at the top level of pattern that has a , in it */
+static int
+_filespec_find_braces (const char *pattern, const char **open,
+                       const char **close)
+{
+  const char *pos, *end;
+  int depth, comma;
+
+  for (pos = pattern; *pos != '\0'; pos++)
+    {
+      if (*pos == '\\' && pos[1] != '\0')
+        pos++;
+      else if (*pos == '{')
+        {
+          depth = 0;
+          comma = 0;
+          for (end = pos; *end != '\0'; end++)
+            {
+              if (*end == '\\' && end[1] != '\0')
+                end++;
+              else if (*end == '{')
+                depth++;
+              else if (*end == ',' && depth == 1)
+                comma = 1;
+              else if (*end == '}' && --depth == 0)
+                break;
+            }
+
+          if (*end == '}' && comma)
+            {
+              *open = pos;
+              *close = end;
+              return (1);
+            }
+        }
+    }
+
+  return (0);
+}
+
+
+static void
+_filespec_add_expanded (gftp_filespec * spec, const char *pattern, int id,
+                        int *expansions)
+{
+  const char *open, *close, *alt, *pos;
+  char *newpattern;
+  int depth;
+
+  if (*expansions >= FILESPEC_MAX_EXPANSIONS ||
+      !_filespec_find_braces (pattern, &open, &close))
+    {
+      (*expansions)++;
+      _filespec_add_pattern (spec, pattern, id);
+      return;
+    }
+
+  alt = open + 1;
+  depth = 0;
+  for (pos = alt; pos <= close; pos++)
+    {
+      if (*pos == '\\' && pos < close)
+        pos++;
+      else if (*pos == '{')
+        depth++;
+      else if (*pos == '}' && depth > 0)
+        depth--;
+      else if ((*pos == ',' && depth == 0) || pos == close)
+        {
+          newpattern = g_strdup_printf ("%.*s%.*s%s", (int) (open - pattern),
+                                        pattern, (int) (pos - alt), alt,
+                                        close + 1);
+          _filespec_add_expanded (spec, newpattern, id, expansions);
+          g_free (newpattern);
+          alt = pos + 1;
+        }
+    }
+}
+
+
+void
+gftp_filespec_add_glob (gftp_filespec * spec, const char *glob, int id)
+{
+  int expansions;
+
+  g_return_if_fail (spec != NULL);
+  g_return_if_fail (glob != NULL);
+
+  expansions = 0;
+  _filespec_add_expanded (spec, glob, id, &expansions);
+}
+
+
+void
+gftp_filespec_add_suffix (gftp_filespec * spec, const char *suffix, int id)
+{
+  guchar set[32];
+  unsigned int pos;
+
+  g_return_if_fail (spec != NULL);
+  g_return_if_fail (suffix != NULL);
+
+  pos = _filespec_new_position (spec);
+  FILESPEC_SET (spec->stars, pos);
+  FILESPEC_SET (spec->starts, pos);
+
+  for (; *suffix != '\0'; suffix++)
+    {
+      memset (set, 0, sizeof (set));
+      _filespec_set_char (spec, set, *suffix);
+      _filespec_add_char (spec, set);
+    }
+
+  pos = _filespec_new_position (spec);
+  FILESPEC_SET (spec->accepts, pos);
+  spec->ids[pos] = id;
+}
+
+
+gftp_filespec *
+gftp_filespec_compile (gftp_request * request, const char *filespec)
+{
+  intptr_t show_hidden_files, filespec_ignore_case;
+  gftp_filespec * spec;
+
+  g_return_val_if_fail (request != NULL, NULL);
+
+  gftp_lookup_request_option (request, "show_hidden_files",
+                              &show_hidden_files);
+  gftp_lookup_request_option (request, "filespec_ignore_case",
+                              &filespec_ignore_case);
+
+  spec = gftp_filespec_new ();
+  spec->casefold = filespec_ignore_case != 0;
+  spec->hide_dotfiles = !show_hidden_files;
+  spec->filespec = g_strdup (filespec != NULL ? filespec : "");
+
+  if (*spec->filespec == '\0')
+    spec->match_all = 1;
+  else
+    gftp_filespec_add_glob (spec, spec->filespec, 0);
+
+  return (spec);
+}
+
+
+/* Returns spec if it was compiled from filespec with the current options,
+   or else frees it and compiles filespec again */
+gftp_filespec *
+gftp_filespec_update (gftp_request * request, gftp_filespec * spec,
+                      const char *filespec)
+{
+  intptr_t show_hidden_files, filespec_ignore_case;
+
+  if (spec != NULL)
+    {
+      gftp_lookup_request_option (request, "show_hidden_files",
+                                  &show_hidden_files);
+      gftp_lookup_request_option (request, "filespec_ignore_case",
+                                  &filespec_ignore_case);
+
+      if (strcmp (gftp_filespec_get_string (spec),
+                  filespec != NULL ? filespec : "") == 0 &&
+          spec->casefold == (filespec_ignore_case != 0) &&
+          spec->hide_dotfiles == !show_hidden_files)
+        return (spec);
+
+      gftp_filespec_free (spec);
+    }
+
+  return (gftp_filespec_compile (request, filespec));
+}
+
+
+const char *
+gftp_filespec_get_string (gftp_filespec * spec)
+{
+  g_return_val_if_fail (spec != NULL, NULL);
+
+  return (spec->filespec != NULL ? spec->filespec : "");
+}
+
+
+static int
+_filespec_find_id (gftp_filespec * spec, unsigned int word, guint64 bits)
+{
+  unsigned int bit;
+
+  for (bit = 0; !(bits & FILESPEC_BIT (bit)); bit++);
+  return (spec->ids[word * 64 + bit]);
+}
+
+
+/* The same as the loop in gftp_filespec_match_id (), for filespecs of up to
+   64 positions, which is almost all of them */
+static int
+_filespec_match_word (gftp_filespec * spec, const guchar * pos)
+{
+  guint64 state, stars, bits;
+  const guint64 * masks;
+
+  masks = spec->masks;
+  stars = spec->stars[0];
+  state = spec->starts[0] | ((spec->starts[0] & stars) << 1);
+
+  for (; *pos != '\0' && state != 0; pos++)
+    {
+      bits = ((state & masks[*pos]) << 1) | (state & stars);
+      state = bits | ((bits & stars) << 1);
+    }
+
+  bits = state & spec->accepts[0];
+  return (bits != 0 ? _filespec_find_id (spec, 0, bits) : -1);
+}
+
+
+/* Returns the id of the first pattern that matches all of filename, or -1 */
+int
+gftp_filespec_match_id (gftp_filespec * spec, const char *filename)
+{
+  guint64 stackstate[FILESPEC_STACK_WORDS], *state, *masks, bits, carry,
+          starcarry, any;
+  const guchar *pos;
+  unsigned int w;
+  int ret;
+
+  g_return_val_if_fail (spec != NULL, -1);
+  g_return_val_if_fail (filename != NULL, -1);
+
+  if (spec->match_all)
+    return (0);
+
+  if (spec->hide_dotfiles && *filename == '.' && strcmp (filename, "..") != 0)
+    return (-1);
+
+  if (spec->num_words == 0)
+    return (-1);
+  else if (spec->num_words == 1)
+    return (_filespec_match_word (spec, (const guchar *) filename));
+
+  if (spec->num_words <= FILESPEC_STACK_WORDS)
+    state = stackstate;
+  else
+    state = g_malloc (spec->num_words * sizeof (*state));
+
+  /* Start every pattern, and step past the *s that begin a pattern */
+  for (w = 0, carry = 0; w < spec->num_words; w++)
+    {
+      bits = spec->starts[w] & spec->stars[w];
+      state[w] = spec->starts[w] | (bits << 1) | carry;
+      carry = bits >> 63;
+    }
+
+  any = 1;
+  for (pos = (const guchar *) filename; *pos != '\0' && any; pos++)
+    {
+      masks = spec->masks + *pos;
+      any = 0;
+      carry = starcarry = 0;
+      for (w = 0; w < spec->num_words; w++)
+        {
+          bits = state[w] & masks[w * 256];
+          state[w] = (bits << 1) | carry | (state[w] & spec->stars[w]);
+          carry = bits >> 63;
+
+          /* A * that was just reached also lets the next position match */
+          bits = state[w] & spec->stars[w];
+          state[w] |= (bits << 1) | starcarry;
+          starcarry = bits >> 63;
+
+          any |= state[w];
+        }
+    }
+
+  ret = -1;
+  for (w = 0; w < spec->num_words && any; w++)
+    if ((bits = state[w] & spec->accepts[w]) != 0)
+      {
+        ret = _filespec_find_id (spec, w, bits);
+        break;
+      }
+
+  if (state != stackstate)
+    g_free (state);
+
+  return (ret);
+}
+
+
+int
+gftp_filespec_match (gftp_filespec * spec, const char *filename)
+{
+  return (gftp_filespec_match_id (spec, filename) >= 0);
+}
+
+
+/* Like gftp_filespec_match (), but remembers the answer in fle until a
+   different filespec is used */
+int
+gftp_filespec_match_file (gftp_filespec * spec, gftp_file * fle)
+{
+  g_return_val_if_fail (spec != NULL, 0);
+  g_return_val_if_fail (fle != NULL, 0);
+
+  if (fle->filespec_serial != spec->serial)
+    {
+      fle->filespec_matched = gftp_filespec_match (spec, fle->file);
+      fle->filespec_serial = spec->serial;
+    }
+
+  return (fle->filespec_matched);
+}
+
+
+/* Finds the entry of the ext list that filename ends with. The list is
+   compiled into a filespec the first time it is used, and again when it
+   changes. */
+gftp_file_extensions *
+gftp_lookup_file_extension (const char *filename)
+{
+  gftp_config_list_vars * tmplistvar;
+  gftp_file_extensions * tempext;
+  GList * templist;
+  int id;
+
+  g_return_val_if_fail (filename != NULL, NULL);
+
+  gftp_lookup_global_option ("ext", &tmplistvar);
+
+  g_mutex_lock (&extensions_mutex);
+
+  if (extensions_spec == NULL || extensions_list != tmplistvar->list ||
+      extensions_num_items != tmplistvar->num_items)
+    {
+      gftp_filespec_free (extensions_spec);
+      extensions_spec = gftp_filespec_new ();
+      extensions_list = tmplistvar->list;
+      extensions_num_items = tmplistvar->num_items;
+
+      for (templist = tmplistvar->list, id = 0;
+           templist != NULL;
+           templist = templist->next, id++)
+        {
+          tempext = templist->data;
+          gftp_filespec_add_suffix (extensions_spec, tempext->ext, id);
+        }
+    }
+
+  id = gftp_filespec_match_id (extensions_spec, filename);
+
+  g_mutex_unlock (&extensions_mutex);
+
+  if (id < 0)
+    return (NULL);
+
+  return (g_list_nth_data (tmplistvar->list, id));
+}
@@ -23,44 +23,6 @@
 
 #ifdef USE_SSL
 
-static int
-ftps_get_next_file (gftp_request * request, gftp_file * fle, int fd)
-{
-  rfc959_parms * params;
-  int resetptr = 0, resetdata = 0;
-  size_t ret;
-
-  params = request->protocol_data;
-  if (request->cached &&
-     request->read_function == gftp_ssl_read)
-    {
-      request->read_function = gftp_fd_read;
-      request->write_function = gftp_fd_write;
-      resetptr = 1;
-      if (params->data_conn_read == gftp_ssl_read)
-	{
-	  params->data_conn_read = gftp_fd_read;
-	  params->data_conn_write = gftp_fd_write;
-	  resetdata = 1;
-	}
-    }
-
-  ret = rfc959_get_next_file (request, fle, fd);
-
-  if (resetptr)
-    {
-      request->read_function = gftp_ssl_read;
-      request->write_function = gftp_ssl_write;
-      if (resetdata)
-	{
-	  params->data_conn_read = gftp_ssl_read;
-	  params->data_conn_write = gftp_ssl_write;
-	}
-    }
-
-  return (ret);
-}
-
 static int 
 ftps_data_conn_tls_start (gftp_request * request)
 {
@@ -168,7 +130,6 @@ ftps_init (gftp_request * request)
   request->init = ftps_init;
   request->connect = ftps_connect;
   params->auth_tls_start = ftps_auth_tls_start;
-  request->get_next_file = ftps_get_next_file;
   request->post_connect = NULL;
   request->url_prefix = g_strdup ("ftps");
 
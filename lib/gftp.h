@@ -48,6 +48,7 @@
 #include <sys/ioctl.h>
 #endif
 #include <sys/wait.h>
+#include <sys/mman.h>
 #include <sys/utsname.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -82,6 +83,24 @@
 #include <openssl/x509v3.h>
 #endif
 
+/* Static tracepoints for SystemTap, bpftrace and DTrace. Each one is a single
+   nop that a tracer can attach to, but its arguments are still evaluated
+   every time, so only pass values that are already at hand. The probes and
+   some scripts that use them are in docs/probes/ */
+#ifdef USE_SDT_PROBES
+#include <sys/sdt.h>
+#define GFTP_PROBE1(name, a1) \
+  DTRACE_PROBE1 (gftp, name, a1)
+#define GFTP_PROBE2(name, a1, a2) \
+  DTRACE_PROBE2 (gftp, name, a1, a2)
+#define GFTP_PROBE3(name, a1, a2, a3) \
+  DTRACE_PROBE3 (gftp, name, a1, a2, a3)
+#else
+#define GFTP_PROBE1(name, a1) do { } while (0)
+#define GFTP_PROBE2(name, a1, a2) do { } while (0)
+#define GFTP_PROBE3(name, a1, a2, a3) do { } while (0)
+#endif
+
 #ifdef ENABLE_NLS
 #include <libintl.h>
 #include <locale.h>
@@ -196,6 +215,9 @@ typedef enum gftp_logging_level_tag
 } gftp_logging_level;
 
 typedef struct gftp_file_tag gftp_file;
+typedef struct gftp_cache_listing_tag gftp_cache_listing;
+typedef struct gftp_filespec_tag gftp_filespec;
+typedef struct gftp_sort_array_tag gftp_sort_array;
 
 #define GFTP_TRANS_ACTION_OVERWRITE		1
 #define GFTP_TRANS_ACTION_RESUME		2
@@ -238,10 +260,16 @@ struct gftp_file_tag
                done_rm : 1,	/* Remove the file when done */
                transfer_done : 1, /* Is current file transfer done? */
                retry_transfer : 1, /* Is current file transfer done? */
+               transfer_failed : 1, /* Did the last try of this file fail? */
                exists_other_side : 1, /* The file exists on the other side
                                          during the file transfer */
-               filename_utf8_encoded : 1; /* Is the filename properly UTF8
+               filename_utf8_encoded : 1, /* Is the filename properly UTF8
                                              encoded? */
+               names_interned : 1, /* user and group are from
+                                      g_intern_string() and are not freed */
+               filespec_matched : 1; /* Cached gftp_filespec_match_file ()
+                                        result for filespec_serial */
+  unsigned int filespec_serial;	/* Filespec that filespec_matched is for */
 
   char transfer_action;		/* See the GFTP_TRANS_ACTION_* vars above */
   /*@null@*/ void *user_data;
@@ -336,6 +364,26 @@ typedef struct gftp_textcomboedt_data_tag
 } gftp_textcomboedt_data;
 
 
+#define GFTP_LISTING_CLOCK_DAYS	64
+
+typedef struct gftp_listing_day_tag
+{
+  int date;			/* yyyymmdd, 0 if the slot is unused */
+  unsigned int uniform : 1;	/* No DST change during this day */
+  time_t start;			/* Local midnight of the day */
+} gftp_listing_day;
+
+/* State kept by parse_time () for the directory listing being read */
+typedef struct gftp_listing_clock_tag
+{
+  int year,			/* Local year and month (0-11) when the */
+      month;			/* listing started, for dates without a year */
+  gftp_listing_day days[GFTP_LISTING_CLOCK_DAYS]; /* Recently converted days */
+  char lc_time[32],		/* remote_lc_time the month names are from */
+       month_names[12][16];	/* Abbreviated month names in lc_time */
+} gftp_listing_clock;
+
+
 typedef struct gftp_request_tag gftp_request;
 
 typedef void (*gftp_logging_func)		( gftp_logging_level level, 
@@ -356,23 +404,31 @@ struct gftp_request_tag
        *account,		/* Account for host (FTP only) */
        *directory,		/* Current working directory */
        *url_prefix,		/* URL Prefix (ex: ftp) */
-       *last_ftp_response,	/* Last response from server */
-       *last_dir_entry;		/* Last dir entry from server */
-  size_t last_dir_entry_len;	/* Length of last_dir_entry */
+       *last_ftp_response;	/* Last response from server */
 
   unsigned int port;		/* Port of remote site */
 
   int datafd,			/* Data connection */
       cachefd;			/* For the directory cache */
+  gftp_cache_listing * cache_listing; /* Parsed listing read from or about
+                                         to be written to the cache */
+  GList * cache_patches;	/* Cached listing changes queued by
+                                   gftp_cache_begin_batch () */
   int wakeup_main_thread[2];	/* FD that gets written to by the threads
                                    to wakeup the parent */
 
-  void *remote_addr;
+  void *remote_addr;		/* sockaddr of the control connection */
   size_t remote_addr_len;
   int ai_family;
 
   int server_type;		/* The type of server we are connected to.
                                    See GFTP_DIRTYPE_* above */
+  int listing_type;		/* Listing format found on the first line of
+                                   the current listing when server_type does
+                                   not say */
+  gftp_listing_clock listing_clock;
+  gftp_filespec * filespec;	/* Last filespec given to
+                                   gftp_match_filespec () */
   unsigned int use_proxy : 1,
                always_connected : 1,
                need_hostport : 1,
@@ -380,6 +436,7 @@ struct gftp_request_tag
                need_password : 1,
                use_cache : 1,           /* Enable or disable the cache */
                cached : 1,              /* Is this directory listing cached? */
+               cache_batch : 1,         /* Queue changes to cached listings */
                cancel : 1,		/* If a signal is received, should
 					   we cancel this operation */
                stopable : 1,
@@ -389,6 +446,11 @@ struct gftp_request_tag
   off_t gotbytes;
  
   void *protocol_data;
+
+#ifdef USE_SSL
+  SSL * ssl,			/* TLS state of the connection on datafd */
+      * data_ssl;		/* TLS state of the current data connection */
+#endif
    
   gftp_logging_func logging_function;
   void *user_data;
@@ -480,6 +542,8 @@ struct gftp_request_tag
 };
 
 
+typedef struct gftp_autotune_tag gftp_autotune;
+
 typedef struct gftp_transfer_tag
 {
   gftp_request * fromreq,
@@ -490,7 +554,6 @@ typedef struct gftp_transfer_tag
                started : 1,
                done : 1,
                show : 1,
-               stalled : 1,
                conn_error_no_timeout : 1,
                next_file : 1,
                skip_file : 1;
@@ -499,6 +562,7 @@ typedef struct gftp_transfer_tag
                  lasttime;
 
   double kbs;
+  gftp_autotune * autotune;	/* NULL unless transfer_autotune is set */
   
   GList * files,
         * curfle,
@@ -522,8 +586,17 @@ typedef struct gftp_transfer_tag
   void * fromwdata,
        * towdata;
 
-  GMutex statmutex,
-         structmutex;
+  /* The transfer thread changes curtrans, curresumed, trans_bytes,
+     resumed_bytes, kbs and lasttime between gftp_transfer_stats_begin ()
+     and gftp_transfer_stats_end (). Other threads read them with
+     gftp_transfer_get_stats () and do not take a lock. */
+  volatile gint stats_seq,	/* Odd while the counters are changed */
+                progress_pending, /* Counters changed since the UI showed
+                                     them */
+                stalled;	/* No data came in for a while. Set by the
+                                   UI and cleared by the transfer thread */
+
+  GMutex structmutex;
 
   void *user_data;
   void *thread_id;
@@ -531,6 +604,21 @@ typedef struct gftp_transfer_tag
 } gftp_transfer;
 
 
+typedef struct gftp_transfer_stats_tag
+{
+  off_t curtrans,
+        tot_file_trans,
+        curresumed,
+        trans_bytes,
+        total_bytes,
+        resumed_bytes;
+  double kbs;
+  struct timeval starttime,
+                 lasttime;
+  long current_file_number;
+} gftp_transfer_stats;
+
+
 typedef struct gftp_log_tag
 {
   char *msg;
@@ -601,19 +689,21 @@ typedef struct gftp_color_tag
 } gftp_color;
 
 
+#define GFTP_GETLINE_BUFSIZE	65536
+
 typedef struct gftp_getline_buffer_tag
 {
   char *buffer,
-       *curpos;
+       *curpos;			/* Start of the data that is not returned yet */
   size_t max_bufsize,
-         cur_bufsize;
+         cur_bufsize,		/* Bytes after curpos */
+         scanned;		/* Bytes after curpos known to have no '\n' */
   unsigned int eof : 1;
 } gftp_getline_buffer;
 
 
 /* Global config options. These are defined in options.h */
-/*@null@*/ extern GList * gftp_file_transfers, * gftp_file_transfer_logs,
-                        * gftp_options_list;
+/*@null@*/ extern GList * gftp_file_transfers, * gftp_options_list;
 /*@null@*/ extern GHashTable * gftp_global_options_htable, * gftp_bookmarks_htable, 
                              * gftp_config_list_htable;
 /*@null@*/ extern gftp_bookmarks_var * gftp_bookmarks;
@@ -627,6 +717,17 @@ extern int gftp_configuration_changed;
 
 extern gftp_option_type_var gftp_option_types[];
 
+/* autotune.c */
+gftp_autotune * gftp_autotune_new	( gftp_transfer * tdata );
+
+size_t gftp_autotune_get_blksize	( gftp_autotune * tune );
+
+size_t gftp_autotune_block_done		( gftp_transfer * tdata,
+					  ssize_t num_trans,
+					  gint64 usecs );
+
+void gftp_autotune_free			( gftp_autotune * tune );
+
 /* cache.c */
 void gftp_generate_cache_description 	( gftp_request * request, 
 					  /*@out@*/ char *description,
@@ -643,6 +744,45 @@ void gftp_delete_cache_entry 		( gftp_request * request,
 					  char *descr,
 					  int ignore_directory );
 
+void gftp_cache_add_file 		( gftp_request * request,
+					  gftp_file * fle );
+
+int gftp_cache_write_listing 		( gftp_request * request );
+
+int gftp_cache_read_listing 		( gftp_request * request,
+					  int fd );
+
+int gftp_cache_get_next_file 		( gftp_request * request,
+					  gftp_file * fle );
+
+void gftp_cache_free_listing 		( gftp_request * request );
+
+void gftp_cache_file_added 		( gftp_request * request,
+					  const char *path,
+					  gftp_file * fle );
+
+void gftp_cache_file_removed 		( gftp_request * request,
+					  const char *path,
+					  int is_directory );
+
+void gftp_cache_file_renamed 		( gftp_request * request,
+					  const char *oldpath,
+					  const char *newpath );
+
+void gftp_cache_file_mode_changed 	( gftp_request * request,
+					  const char *path,
+					  mode_t mode );
+
+void gftp_cache_file_time_changed 	( gftp_request * request,
+					  const char *path,
+					  time_t datetime );
+
+void gftp_cache_begin_batch 		( gftp_request * request );
+
+void gftp_cache_flush_batch 		( gftp_request * request );
+
+void gftp_cache_end_batch 		( gftp_request * request );
+
 /* charset-conv.c */
 /*@null@*/ char * gftp_string_to_utf8	( gftp_request * request, 
 					  const char *str,
@@ -721,6 +861,80 @@ void gftp_free_proxy_hosts 		( GList * proxy_hosts );
 
 GList * gftp_copy_proxy_hosts 		( GList * proxy_hosts );
 
+/* filesort.c */
+gftp_sort_array * gftp_sort_array_new	( GList * filelist );
+
+void gftp_sort_array_free		( gftp_sort_array * sarr );
+
+GList * gftp_sort_array_get_list	( gftp_sort_array * sarr );
+
+GList * gftp_sort_array_sort		( gftp_sort_array * sarr,
+					  int column,
+					  int asds );
+
+int gftp_sort_array_keeps_order		( gftp_sort_array * sarr,
+					  int column,
+					  int asds );
+
+GList * gftp_sort_array_add		( gftp_sort_array * sarr,
+					  GList * filelist,
+					  int column,
+					  int asds );
+
+GList * gftp_sort_filelist 		( GList * filelist,
+					  int column,
+					  int asds );
+
+/* logging.c */
+int gftp_logging_wanted			( gftp_logging_level level );
+
+void gftp_log_queue			( gftp_logging_level level,
+					  char *msg );
+
+GList * gftp_log_get_queued		( void );
+
+void gftp_log_file_open			( void );
+
+void gftp_log_file_write		( gftp_logging_level level,
+					  const char *str );
+
+void gftp_log_file_flush		( void );
+
+void gftp_log_file_close		( void );
+
+/* filespec.c */
+gftp_filespec * gftp_filespec_new	( void );
+
+void gftp_filespec_free			( gftp_filespec * spec );
+
+void gftp_filespec_add_glob		( gftp_filespec * spec,
+					  const char *glob,
+					  int id );
+
+void gftp_filespec_add_suffix		( gftp_filespec * spec,
+					  const char *suffix,
+					  int id );
+
+gftp_filespec * gftp_filespec_compile	( gftp_request * request,
+					  const char *filespec );
+
+gftp_filespec * gftp_filespec_update	( gftp_request * request,
+					  gftp_filespec * spec,
+					  const char *filespec );
+
+const char *gftp_filespec_get_string	( gftp_filespec * spec );
+
+int gftp_filespec_match_id		( gftp_filespec * spec,
+					  const char *filename );
+
+int gftp_filespec_match			( gftp_filespec * spec,
+					  const char *filename );
+
+int gftp_filespec_match_file		( gftp_filespec * spec,
+					  gftp_file * fle );
+
+gftp_file_extensions * gftp_lookup_file_extension ( const char *filename );
+
 /* misc.c */
 /*@null@*/ char *insert_commas 		( off_t number, 
 					  char *dest_str, 
@@ -766,10 +980,6 @@ void free_tdata 			( gftp_transfer * tdata );
 
 gftp_request * gftp_copy_request 	( gftp_request * req );
 
-GList * gftp_sort_filelist 		( GList * filelist, 
-					  int column, 
-					  int asds );
-
 char * gftp_gen_ls_string 		( gftp_request * request,
 					  gftp_file * fle, 
 					  char *file_prefixstr, 
@@ -806,9 +1016,16 @@ int mkstemps 				( char *template,
 					  int suffix_len );
 
 /* parse-dir-listing.c */
-time_t parse_time 			( char *str,
+const char *gftp_set_listing_clock	( gftp_request * request );
+
+time_t parse_time 			( gftp_request * request,
+					  char *str,
 					  char **endpos );
 
+int gftp_get_listing_type		( gftp_request * request,
+					  const char *str,
+					  size_t len );
+
 int gftp_parse_ls 			( gftp_request * request,
 					  const char *lsoutput, 
 					  gftp_file *fle,
@@ -853,6 +1070,11 @@ int sshv2_init 				( gftp_request * request );
 
 void sshv2_register_module		( void );
 
+void sshv2_shutdown			( void );
+
+void sshv2_set_pipeline_depth		( gftp_request * request,
+					  guint depth );
+
 void ssl_register_module		( void );
 
 int bookmark_init 			( gftp_request * request );
@@ -988,6 +1210,13 @@ void gftp_swap_socks 			( gftp_request * dest,
 void gftp_calc_kbs 			( gftp_transfer * tdata, 
 					  ssize_t num_read );
 
+void gftp_transfer_stats_begin		( gftp_transfer * tdata );
+
+void gftp_transfer_stats_end		( gftp_transfer * tdata );
+
+void gftp_transfer_get_stats		( gftp_transfer * tdata,
+					  gftp_transfer_stats * stats );
+
 int gftp_get_transfer_status 		( gftp_transfer * tdata, 
 					  ssize_t num_read );
 
@@ -1009,6 +1238,11 @@ pid_t gftp_exec 			( gftp_request * request,
 					  int *ptymfd,
 					  char **args );
 
+pid_t gftp_exec_without_pty 		( gftp_request * request,
+					  int *fdm,
+					  int *errfd,
+					  char **args );
+
 char *gftp_convert_attributes_from_mode_t ( mode_t mode );
 
 mode_t gftp_convert_attributes_to_mode_t ( char *attribs );
@@ -1038,6 +1272,11 @@ void gftp_ssl_session_close_ex          ( gftp_request * request,
 					  int fd );
 
 void gftp_ssl_session_close             ( gftp_request * request );
+
+void gftp_ssl_shutdown                  ( void );
+
+void gftp_ssl_swap_socks                ( gftp_request * dest,
+					  gftp_request * source );
 #endif /* USE_SSL */
 
 /* UI dependent functions that must be implemented */
@@ -1061,6 +1300,12 @@ int gftp_connect_server 		( gftp_request * request,
 					  unsigned int proxy_port );
 
 /* sockutils.c */
+ssize_t gftp_get_line_view 		( gftp_request * request, 
+					  /*@out@*/ gftp_getline_buffer ** rbuf,
+					  /*@out@*/ char ** line, 
+					  /*@out@*/ size_t * linelen, 
+					  int fd );
+
 ssize_t gftp_get_line 			( gftp_request * request, 
 					  /*@out@*/ gftp_getline_buffer ** rbuf,
 					  /*@out@*/ char * str, 
@@ -1091,6 +1336,14 @@ int gftp_fd_set_sockblocking 		( gftp_request * request,
 					  int fd, 
 					  int non_blocking );
 
+void gftp_set_socket_options 		( gftp_request * request,
+					  int fd,
+					  int control );
+
+void gftp_log_socket_options 		( gftp_request * request,
+					  int fd,
+					  const char *descr );
+
 struct servent * r_getservbyname	( const char *name,
 					  const char *proto,
 					  struct servent *result_buf,
@@ -19,13 +19,65 @@
 
 #include "gftp.h"
 
+#ifdef HAVE_SYS_VFS_H
+#include <sys/vfs.h>
+#endif
+
+#define LOCAL_STAT_BATCH		256
+#define LOCAL_MAX_STAT_THREADS		32
+
+typedef struct local_dir_entry_tag
+{
+  char *name;
+  struct stat st,		/* The entry itself */
+              fst;		/* What it points to, for symlinks */
+  int ret;
+} local_dir_entry;
+
 typedef struct local_protocol_data_tag
 {
   DIR *dir;
+  char *dirname;
   GHashTable *userhash, *grouphash;
+
+  /* On network filesystems every stat is a round trip to the server. The
+     entries are read in batches there, and several threads stat them */
+  local_dir_entry * batch;
+  guint batch_len,
+        batch_pos,
+        stat_threads;
+  gint batch_next;
 } local_protocol_data;
 
 
+static void
+local_close_dir (local_protocol_data * lpd)
+{
+  guint i;
+
+  if (lpd->dir != NULL)
+    {
+      closedir (lpd->dir);
+      lpd->dir = NULL;
+    }
+
+  if (lpd->batch != NULL)
+    {
+      for (i = lpd->batch_pos; i < lpd->batch_len; i++)
+        g_free (lpd->batch[i].name);
+
+      g_free (lpd->batch);
+      lpd->batch = NULL;
+    }
+
+  if (lpd->dirname != NULL)
+    {
+      g_free (lpd->dirname);
+      lpd->dirname = NULL;
+    }
+}
+
+
 static void
 local_remove_key (gpointer key, gpointer value, gpointer user_data)
 {
@@ -42,6 +94,7 @@ local_destroy (gftp_request * request)
   g_return_if_fail (request->protonum == GFTP_LOCAL_NUM);
 
   lpd = request->protocol_data;
+  local_close_dir (lpd);
   g_hash_table_foreach (lpd->userhash, local_remove_key, NULL);
   g_hash_table_destroy (lpd->userhash);
   g_hash_table_foreach (lpd->grouphash, local_remove_key, NULL);
@@ -258,11 +311,7 @@ local_end_transfer (gftp_request * request)
   local_protocol_data * lpd;
 
   lpd = request->protocol_data;
-  if (lpd->dir)
-    {
-      closedir (lpd->dir);
-      lpd->dir = NULL;
-    }
+  local_close_dir (lpd);
 
   if (request->datafd > 0)
     {
@@ -306,11 +355,122 @@ local_stat_filename (gftp_request * request, const char *filename,
 }
 
 
+/* Only symlinks need the second stat, the lstat () of anything else already
+   describes it. The names are looked up relative to the directory being
+   listed, which does not have to be the current directory */
+static int
+local_stat_entry (local_protocol_data * lpd, const char *name,
+                  struct stat *st, struct stat *fst)
+{
+#ifdef HAVE_FSTATAT
+  int fd;
+
+  fd = dirfd (lpd->dir);
+  if (fstatat (fd, name, st, AT_SYMLINK_NOFOLLOW) != 0)
+    return (-1);
+
+  if (!S_ISLNK (st->st_mode))
+    {
+      memcpy (fst, st, sizeof (*fst));
+      return (0);
+    }
+
+  return (fstatat (fd, name, fst, 0));
+#else
+  char *path;
+  int ret;
+
+  path = g_strconcat (lpd->dirname, name, NULL);
+  if ((ret = lstat (path, st)) == 0)
+    {
+      if (!S_ISLNK (st->st_mode))
+        memcpy (fst, st, sizeof (*fst));
+      else
+        ret = stat (path, fst);
+    }
+
+  g_free (path);
+  return (ret);
+#endif
+}
+
+
+static int
+local_is_network_fs (DIR * dir)
+{
+#ifdef HAVE_SYS_VFS_H
+  struct statfs sfs;
+
+  if (fstatfs (dirfd (dir), &sfs) != 0)
+    return (0);
+
+  switch ((guint32) sfs.f_type)
+    {
+      case 0x6969:		/* NFS */
+      case 0x517b:		/* SMB */
+      case 0xff534d42:		/* CIFS */
+      case 0xfe534d42:		/* SMB2 */
+      case 0x65735546:		/* FUSE, such as sshfs */
+      case 0x00c36400:		/* Ceph */
+      case 0x5346414f:		/* AFS */
+      case 0x01021997:		/* 9P */
+        return (1);
+    }
+#endif
+
+  return (0);
+}
+
+
+static gpointer
+local_stat_thread (gpointer data)
+{
+  local_protocol_data * lpd;
+  local_dir_entry * entry;
+  gint i;
+
+  lpd = data;
+  while ((i = g_atomic_int_add (&lpd->batch_next, 1)) < (gint) lpd->batch_len)
+    {
+      entry = &lpd->batch[i];
+      entry->ret = local_stat_entry (lpd, entry->name, &entry->st,
+                                     &entry->fst);
+    }
+
+  return (NULL);
+}
+
+
+static guint
+local_fill_batch (local_protocol_data * lpd)
+{
+  GThread * threads[LOCAL_MAX_STAT_THREADS];
+  struct dirent *dirp;
+  guint i, num_threads;
+
+  lpd->batch_len = lpd->batch_pos = 0;
+  while (lpd->batch_len < LOCAL_STAT_BATCH &&
+         (dirp = readdir (lpd->dir)) != NULL)
+    lpd->batch[lpd->batch_len++].name = g_strdup (dirp->d_name);
+
+  lpd->batch_next = 0;
+  num_threads = MIN (lpd->stat_threads, lpd->batch_len);
+  for (i = 0; i < num_threads; i++)
+    threads[i] = g_thread_new ("gftp-stat", local_stat_thread, lpd);
+
+  for (i = 0; i < num_threads; i++)
+    g_thread_join (threads[i]);
+
+  return (lpd->batch_len);
+}
+
+
 static int
 local_get_next_file (gftp_request * request, gftp_file * fle, int fd)
 {
+  struct stat stbuf, fstbuf, *st, *fst;
   local_protocol_data * lpd;
-  struct stat st, fst;
+  local_dir_entry * entry;
   struct dirent *dirp;
   char *user, *group;
   struct passwd *pw;
@@ -329,57 +489,76 @@ local_get_next_file (gftp_request * request, gftp_file * fle, int fd)
 
   memset (fle, 0, sizeof (*fle));
 
-  if ((dirp = readdir (lpd->dir)) == NULL)
+  if (lpd->batch != NULL)
     {
-      closedir (lpd->dir);
-      lpd->dir = NULL;
-      return (GFTP_EFATAL);
+      if (lpd->batch_pos == lpd->batch_len && local_fill_batch (lpd) == 0)
+        {
+          local_close_dir (lpd);
+          return (GFTP_EFATAL);
+        }
+
+      entry = &lpd->batch[lpd->batch_pos++];
+      fle->file = entry->name;
+      entry->name = NULL;
+      if (entry->ret != 0)
+        return (GFTP_ERETRYABLE);
+
+      st = &entry->st;
+      fst = &entry->fst;
     }
+  else
+    {
+      if ((dirp = readdir (lpd->dir)) == NULL)
+        {
+          local_close_dir (lpd);
+          return (GFTP_EFATAL);
+        }
 
-  fle->file = g_strdup (dirp->d_name);
-  if (lstat (fle->file, &st) != 0)
-    return (GFTP_ERETRYABLE);
+      fle->file = g_strdup (dirp->d_name);
+      if (local_stat_entry (lpd, fle->file, &stbuf, &fstbuf) != 0)
+        return (GFTP_ERETRYABLE);
 
-  if (stat (fle->file, &fst) != 0)
-    return (GFTP_ERETRYABLE);
+      st = &stbuf;
+      fst = &fstbuf;
+    }
 
   if ((user = g_hash_table_lookup (lpd->userhash, 
-                                   GUINT_TO_POINTER(st.st_uid))) != NULL)
+                                   GUINT_TO_POINTER(st->st_uid))) != NULL)
     fle->user = g_strdup (user);
   else
     {
-      if ((pw = getpwuid (st.st_uid)) == NULL)
-        fle->user = g_strdup_printf ("%u", st.st_uid); 
+      if ((pw = getpwuid (st->st_uid)) == NULL)
+        fle->user = g_strdup_printf ("%u", st->st_uid); 
       else
         fle->user = g_strdup (pw->pw_name);
 
       user = g_strdup (fle->user);
-      g_hash_table_insert (lpd->userhash, GUINT_TO_POINTER (st.st_uid), user);
+      g_hash_table_insert (lpd->userhash, GUINT_TO_POINTER (st->st_uid), user);
     }
 
   if ((group = g_hash_table_lookup (lpd->grouphash, 
-                                    GUINT_TO_POINTER(st.st_gid))) != NULL)
+                                    GUINT_TO_POINTER(st->st_gid))) != NULL)
     fle->group = g_strdup (group);
   else
     {
-      if ((gr = getgrgid (st.st_gid)) == NULL)
-        fle->group = g_strdup_printf ("%u", st.st_gid); 
+      if ((gr = getgrgid (st->st_gid)) == NULL)
+        fle->group = g_strdup_printf ("%u", st->st_gid); 
       else
         fle->group = g_strdup (gr->gr_name);
 
       group = g_strdup (fle->group);
-      g_hash_table_insert (lpd->grouphash, GUINT_TO_POINTER (st.st_gid), group);
+      g_hash_table_insert (lpd->grouphash, GUINT_TO_POINTER (st->st_gid), group);
     }
 
-  fle->st_dev = fst.st_dev;
-  fle->st_ino = fst.st_ino;
-  fle->st_mode = fst.st_mode;
-  fle->datetime = st.st_mtime;
+  fle->st_dev = fst->st_dev;
+  fle->st_ino = fst->st_ino;
+  fle->st_mode = fst->st_mode;
+  fle->datetime = st->st_mtime;
 
   if (GFTP_IS_SPECIAL_DEVICE (fle->st_mode))
-    fle->size = (off_t) st.st_rdev;
+    fle->size = (off_t) st->st_rdev;
   else
-    fle->size = fst.st_size;
+    fle->size = fst->st_size;
 
   return (1);
 }
@@ -389,6 +568,7 @@ static int
 local_list_files (gftp_request * request)
 {
   local_protocol_data *lpd;
+  intptr_t stat_threads;
   char *dir, *utf8;
   size_t destlen;
 
@@ -400,32 +580,41 @@ local_list_files (gftp_request * request)
 
   g_return_val_if_fail (lpd != NULL, GFTP_EFATAL);
 
+  local_close_dir (lpd);
+
   if (request->directory[strlen (request->directory) - 1] != '/')
     dir = g_strconcat (request->directory, "/", NULL);
   else
-    dir = request->directory;
+    dir = g_strdup (request->directory);
 
   utf8 = gftp_filename_from_utf8 (request, dir, &destlen);
   if (utf8 != NULL)
     {
-      lpd->dir = opendir (utf8);
-      g_free (utf8);
+      g_free (dir);
+      dir = utf8;
     }
-  else
-    lpd->dir = opendir (dir);
-
-  if (dir != request->directory)
-    g_free (dir);
 
+  lpd->dir = opendir (dir);
   if (lpd->dir == NULL)
     {
+      g_free (dir);
       request->logging_function (gftp_logging_error, request,
                            _("Could not get local directory listing %s: %s\n"),
                            request->directory, g_strerror (errno));
       return (GFTP_ECANIGNORE);
     }
-  else
-    return (0);
+
+  lpd->dirname = dir;
+
+  gftp_lookup_request_option (request, "local_stat_threads", &stat_threads);
+  if (stat_threads > 1 && local_is_network_fs (lpd->dir))
+    {
+      lpd->stat_threads = MIN (stat_threads, LOCAL_MAX_STAT_THREADS);
+      lpd->batch = g_malloc0 (sizeof (*lpd->batch) * LOCAL_STAT_BATCH);
+      lpd->batch_len = lpd->batch_pos = 0;
+    }
+
+  return (0);
 }
 
 
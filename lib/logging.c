@@ -0,0 +1,307 @@
+/*****************************************************************************/
+/*  logging.c - log queue and log file                                       */
+/*                                                                           */
+/*  This program is free software; you can redistribute it and/or modify     */
+/*  it under the terms of the GNU General Public License as published by     */
+/*  the Free Software Foundation; either version 2 of the License, or        */
+/*  (at your option) any later version.                                      */
+/*                                                                           */
+/*  This program is distributed in the hope that it will be useful,          */
+/*  but WITHOUT ANY WARRANTY; without even the implied warranty of           */
+/*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the            */
+/*  GNU General Public License for more details.                             */
+/*                                                                           */
+/*  You should have received a copy of the GNU General Public License        */
+/*  along with this program; if not, write to the Free Software              */
+/*  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111 USA      */
+/*****************************************************************************/
+
+#include "gftp.h"
+
+/* The messages that threads other than the UI thread log are put into a
+   ring, and the UI takes them out in batches. Every slot has a sequence
+   number that says whether it is free for the writer of a position or
+   holds the message of a position. A writer claims a position with one
+   compare and swap on the tail, stores the message and then publishes the
+   slot, so writers never take a lock and never wait for the UI.
+
+   When the ring is full the messages go to an overflow list under a
+   mutex instead, and keep going there until the UI has emptied it, so
+   nothing is lost and the messages of a thread stay in order.
+
+   The log_commands, log_replies and log_status options are checked before
+   a message is formatted. Errors are always logged. */
+
+#define GFTP_LOG_RING_SIZE	4096	/* Must be a power of 2 */
+#define GFTP_LOG_RING_MASK	(GFTP_LOG_RING_SIZE - 1)
+#define GFTP_LOG_FILE_BACKUPS	3	/* gftp.log.1 to gftp.log.3 */
+
+typedef struct gftp_log_slot_tag
+{
+  gint seq;
+  gftp_log * log;
+} gftp_log_slot;
+
+static gftp_log_slot log_ring[GFTP_LOG_RING_SIZE];
+static gint log_ring_tail = 0,		/* Next position to write */
+            log_ring_head = 0;		/* Next position to read */
+static gint log_overflowing = 0;
+static GMutex log_overflow_lock;
+static GList * log_overflow = NULL;	/* Newest first */
+
+/* The text port writes the log file from any thread, so the file, its
+   size and the rotation are all kept under log_file_lock */
+static GMutex log_file_lock;
+static char * log_file_name = NULL;
+static off_t log_file_size = 0;
+
+
+static void
+_gftp_log_ring_init (void)
+{
+  static gsize initialized = 0;
+  guint i;
+
+  if (g_once_init_enter (&initialized))
+    {
+      for (i = 0; i < GFTP_LOG_RING_SIZE; i++)
+        log_ring[i].seq = i;
+      g_once_init_leave (&initialized, 1);
+    }
+}
+
+
+int
+gftp_logging_wanted (gftp_logging_level level)
+{
+  gftp_config_vars * cv;
+  char *option;
+
+  switch (level)
+    {
+      case gftp_logging_send:
+        option = "log_commands";
+        break;
+      case gftp_logging_recv:
+        option = "log_replies";
+        break;
+      case gftp_logging_misc:
+        option = "log_status";
+        break;
+      default:
+        return (1);
+    }
+
+  /* Messages can come before the options are read */
+  if (gftp_global_options_htable == NULL ||
+      (cv = g_hash_table_lookup (gftp_global_options_htable, option)) == NULL)
+    return (1);
+
+  return (GPOINTER_TO_INT (cv->value) != 0);
+}
+
+
+static int
+_gftp_log_ring_put (gftp_log * log)
+{
+  gftp_log_slot * slot;
+  guint pos, seq;
+
+  pos = g_atomic_int_get (&log_ring_tail);
+  for (;;)
+    {
+      slot = &log_ring[pos & GFTP_LOG_RING_MASK];
+      seq = g_atomic_int_get (&slot->seq);
+
+      if (seq == pos)
+        {
+          if (g_atomic_int_compare_and_exchange (&log_ring_tail, pos, pos + 1))
+            break;
+        }
+      else if ((gint) (seq - pos) < 0)
+        return (0); /* Full */
+
+      pos = g_atomic_int_get (&log_ring_tail);
+    }
+
+  slot->log = log;
+  g_atomic_int_set (&slot->seq, pos + 1);
+  return (1);
+}
+
+
+/* Takes msg, which must be allocated with g_malloc () */
+void
+gftp_log_queue (gftp_logging_level level, char *msg)
+{
+  gftp_log * newlog;
+
+  _gftp_log_ring_init ();
+
+  newlog = g_malloc0 (sizeof (*newlog));
+  newlog->type = level;
+  newlog->msg = msg;
+
+  if (!g_atomic_int_get (&log_overflowing) && _gftp_log_ring_put (newlog))
+    return;
+
+  g_mutex_lock (&log_overflow_lock);
+  g_atomic_int_set (&log_overflowing, 1);
+  log_overflow = g_list_prepend (log_overflow, newlog);
+  g_mutex_unlock (&log_overflow_lock);
+}
+
+
+/* Returns the gftp_log's that were queued, oldest first. Only one thread
+   may take them out */
+GList *
+gftp_log_get_queued (void)
+{
+  GList * logs, * overflow;
+  gftp_log_slot * slot;
+  guint head;
+
+  _gftp_log_ring_init ();
+
+  logs = NULL;
+  head = log_ring_head;
+  for (;;)
+    {
+      slot = &log_ring[head & GFTP_LOG_RING_MASK];
+      if ((guint) g_atomic_int_get (&slot->seq) != head + 1)
+        break;
+
+      logs = g_list_prepend (logs, slot->log);
+      g_atomic_int_set (&slot->seq, head + GFTP_LOG_RING_SIZE);
+      head++;
+    }
+  log_ring_head = head;
+
+  if (g_atomic_int_get (&log_overflowing))
+    {
+      g_mutex_lock (&log_overflow_lock);
+      overflow = log_overflow;
+      log_overflow = NULL;
+      g_atomic_int_set (&log_overflowing, 0);
+      g_mutex_unlock (&log_overflow_lock);
+
+      logs = g_list_concat (overflow, logs);
+    }
+
+  return (g_list_reverse (logs));
+}
+
+
+void
+gftp_log_file_open (void)
+{
+  if ((log_file_name = gftp_expand_path (NULL, LOG_FILE)) == NULL)
+    {
+      printf (_("gFTP Error: Bad log file name %s\n"), LOG_FILE);
+      exit (EXIT_FAILURE);
+    }
+
+  g_mutex_lock (&log_file_lock);
+  if ((gftp_logfd = fopen (log_file_name, "w")) == NULL)
+    {
+      printf (_("gFTP Warning: Cannot open %s for writing: %s\n"),
+              log_file_name, g_strerror (errno));
+    }
+  log_file_size = 0;
+  g_mutex_unlock (&log_file_lock);
+}
+
+
+/* Called with log_file_lock held */
+static void
+_gftp_log_file_rotate (void)
+{
+  char *oldname, *newname;
+  int i;
+
+  fclose (gftp_logfd);
+
+  for (i = GFTP_LOG_FILE_BACKUPS; i > 0; i--)
+    {
+      newname = g_strdup_printf ("%s.%d", log_file_name, i);
+      if (i > 1)
+        oldname = g_strdup_printf ("%s.%d", log_file_name, i - 1);
+      else
+        oldname = g_strdup (log_file_name);
+
+      rename (oldname, newname);
+      g_free (oldname);
+      g_free (newname);
+    }
+
+  gftp_logfd = fopen (log_file_name, "w");
+  log_file_size = 0;
+}
+
+
+/* The caller flushes the file with gftp_log_file_flush () once it is done
+   writing, which may be after a batch of messages */
+void
+gftp_log_file_write (gftp_logging_level level, const char *str)
+{
+  intptr_t max_log_file_size;
+  size_t len;
+
+  if (level == gftp_logging_misc_nolog)
+    return;
+
+  gftp_lookup_global_option ("max_log_file_size", &max_log_file_size);
+  len = strlen (str);
+
+  g_mutex_lock (&log_file_lock);
+  if (gftp_logfd == NULL)
+    {
+      g_mutex_unlock (&log_file_lock);
+      return;
+    }
+
+  if (fwrite (str, len, 1, gftp_logfd) != 1)
+    {
+      fclose (gftp_logfd);
+      gftp_logfd = NULL;
+      g_mutex_unlock (&log_file_lock);
+      return;
+    }
+  log_file_size += len;
+
+  if (max_log_file_size > 0 && log_file_size >= max_log_file_size * 1024 &&
+      log_file_name != NULL)
+    _gftp_log_file_rotate ();
+  g_mutex_unlock (&log_file_lock);
+}
+
+
+void
+gftp_log_file_flush (void)
+{
+  g_mutex_lock (&log_file_lock);
+  if (gftp_logfd != NULL)
+    {
+      fflush (gftp_logfd);
+      if (ferror (gftp_logfd))
+        {
+          fclose (gftp_logfd);
+          gftp_logfd = NULL;
+        }
+    }
+  g_mutex_unlock (&log_file_lock);
+}
+
+
+void
+gftp_log_file_close (void)
+{
+  g_mutex_lock (&log_file_lock);
+  if (gftp_logfd != NULL)
+    fclose (gftp_logfd);
+  gftp_logfd = NULL;
+
+  g_free (log_file_name);
+  log_file_name = NULL;
+  g_mutex_unlock (&log_file_lock);
+}
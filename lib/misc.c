@@ -245,56 +245,25 @@ make_nonnull (char **str)
 }
 
 
-/* FIXME - Possible use the libpcre library. If it isn't used, then clean
-   this function up some more. */
+/* The compiled filespec is kept in the request, so matching a whole listing
+   against the same filespec compiles it once. gftp_list_files () drops it,
+   so option changes are seen by the next listing. */
 int
 gftp_match_filespec (gftp_request * request, const char *filename,
                      const char *filespec)
 {
-  const char *filepos, *wcpos, *pos;
-  char search_str[20], *newpos;
-  intptr_t show_hidden_files;
-  size_t len, curlen;
-  
   if (filename == NULL || *filename == '\0' || 
       filespec == NULL || *filespec == '\0') 
     return (1);
 
-  gftp_lookup_request_option (request, "show_hidden_files", &show_hidden_files);
-  if (!show_hidden_files && *filename == '.' && strcmp (filename, "..") != 0)
-    return (0);
-
-  filepos = filename;
-  wcpos = filespec;
-  while (1)
+  if (request->filespec == NULL ||
+      strcmp (gftp_filespec_get_string (request->filespec), filespec) != 0)
     {
-      if (*wcpos == '\0') 
-        return (1);
-      else if (*filepos == '\0') 
-        return (0);
-      else if (*wcpos == '?') 
-        {
-          wcpos++;
-          filepos++;
-        }
-      else if (*wcpos == '*' && *(wcpos+1) == '\0') 
-        return (1);
-      else if (*wcpos == '*') 
-        {
-          len = sizeof (search_str);
-          for (pos = wcpos + 1, newpos = search_str, curlen = 0;
-               *pos != '*' && *pos != '?' && *pos != '\0' && curlen < len;
-               curlen++, *newpos++ = *pos++);
-          *newpos = '\0';
-
-          if ((filepos = strstr (filepos, search_str)) == NULL)
-            return (0);
-          wcpos += curlen + 1;
-          filepos += curlen;
-        }
-      else if(*wcpos++ != *filepos++) 
-        return (0);
+      gftp_filespec_free (request->filespec);
+      request->filespec = gftp_filespec_compile (request, filespec);
     }
+
+  return (gftp_filespec_match (request->filespec, filename));
 }
 
 
@@ -466,10 +435,10 @@ copy_fdata (gftp_file * fle)
   if (fle->file)
     newfle->file = g_strdup (fle->file);
 
-  if (fle->user)
+  if (fle->user && !fle->names_interned)
     newfle->user = g_strdup (fle->user);
 
-  if (fle->group)
+  if (fle->group && !fle->names_interned)
     newfle->group = g_strdup (fle->group);
 
   if (fle->destfile)
@@ -533,7 +502,6 @@ gftp_tdata_new (void)
 
   tdata = g_malloc0 (sizeof (*tdata));
 
-  g_mutex_init (&tdata->statmutex);
   g_mutex_init (&tdata->structmutex);
 
   return (tdata);
@@ -548,6 +516,8 @@ free_tdata (gftp_transfer * tdata)
   if (tdata->toreq != NULL)
     gftp_request_destroy (tdata->toreq, 1);
   free_file_list (tdata->files);
+  if (tdata->autotune != NULL)
+    gftp_autotune_free (tdata->autotune);
   if (tdata->thread_id != NULL)
     g_free (tdata->thread_id);
   g_free (tdata);
@@ -608,253 +578,6 @@ gftp_copy_request (gftp_request * req)
 }
 
 
-static gint
-gftp_file_sort_function_as (gconstpointer a, gconstpointer b)
-{
-  const gftp_file * f1, * f2;
-
-  f1 = a;
-  f2 = b;
-  return (strcasecmp (f1->file, f2->file));
-}
-
-
-static gint
-gftp_file_sort_function_ds (gconstpointer a, gconstpointer b)
-{
-  const gftp_file * f1, * f2;
-  gint ret;
-
-  f1 = a;
-  f2 = b;
-  ret = strcasecmp (f1->file, f2->file);
-  return (ret * -1);
-}
-
-
-static gint
-gftp_user_sort_function_as (gconstpointer a, gconstpointer b)
-{
-  const gftp_file * f1, * f2;
-
-  f1 = a;
-  f2 = b;
-  return (strcasecmp (f1->user, f2->user));
-}
-
-
-static gint
-gftp_user_sort_function_ds (gconstpointer a, gconstpointer b)
-{
-  const gftp_file * f1, * f2;
-  gint ret;
-
-  f1 = a;
-  f2 = b;
-  ret = strcasecmp (f1->user, f2->user);
-  return (ret * -1);
-}
-
-
-static gint
-gftp_group_sort_function_as (gconstpointer a, gconstpointer b)
-{
-  const gftp_file * f1, * f2;
-
-  f1 = a;
-  f2 = b;
-  return (strcasecmp (f1->group, f2->group));
-}
-
-
-static gint
-gftp_group_sort_function_ds (gconstpointer a, gconstpointer b)
-{
-  const gftp_file * f1, * f2;
-  gint ret;
-
-  f1 = a;
-  f2 = b;
-  ret = strcasecmp (f1->group, f2->group);
-  return (ret * -1);
-}
-
-
-static gint
-gftp_attribs_sort_function_as (gconstpointer a, gconstpointer b)
-{
-  const gftp_file * f1, * f2;
-
-  f1 = a;
-  f2 = b;
-  if (f1->st_mode < f2->st_mode)
-    return (-1);
-  else if (f1->st_mode == f2->st_mode)
-    return (0);
-  else
-    return (1);
-}
-
-
-static gint
-gftp_attribs_sort_function_ds (gconstpointer a, gconstpointer b)
-{
-  const gftp_file * f1, * f2;
-
-  f1 = a;
-  f2 = b;
-  if (f1->st_mode < f2->st_mode)
-    return (1);
-  else if (f1->st_mode == f2->st_mode)
-    return (0);
-  else
-    return (-1);
-}
-
-
-static gint
-gftp_size_sort_function_as (gconstpointer a, gconstpointer b)
-{
-  const gftp_file * f1, * f2;
-
-  f1 = a;
-  f2 = b;
-  if (f1->size < f2->size)
-    return (-1);
-  else if (f1->size == f2->size)
-    return (0);
-  else
-    return (1);
-}
-
-
-static gint
-gftp_size_sort_function_ds (gconstpointer a, gconstpointer b)
-{
-  const gftp_file * f1, * f2;
-
-  f1 = a;
-  f2 = b;
-  if (f1->size < f2->size)
-    return (1);
-  else if (f1->size == f2->size)
-    return (0);
-  else
-    return (-1);
-}
-
-
-static gint
-gftp_datetime_sort_function_as (gconstpointer a, gconstpointer b)
-{
-  const gftp_file * f1, * f2;
-
-  f1 = a;
-  f2 = b;
-  if (f1->datetime < f2->datetime)
-    return (-1);
-  else if (f1->datetime == f2->datetime)
-    return (0);
-  else
-    return (1);
-}
-
-
-static gint
-gftp_datetime_sort_function_ds (gconstpointer a, gconstpointer b)
-{
-  const gftp_file * f1, * f2;
-
-  f1 = a;
-  f2 = b;
-  if (f1->datetime < f2->datetime)
-    return (1);
-  else if (f1->datetime == f2->datetime)
-    return (0);
-  else
-    return (-1);
-}
-
-
-GList *
-gftp_sort_filelist (GList * filelist, int column, int asds)
-{
-  GList * files, * dirs, * dotdot, * tempitem, * insitem;
-  GCompareFunc sortfunc;
-  gftp_file * tempfle;
-  intptr_t sort_dirs_first;
-
-  if (filelist == NULL) /* nothing to sort */
-    return (filelist);
-
-  files = dirs = dotdot = NULL;
-
-  if (column == GFTP_SORT_COL_FILE)
-    sortfunc = asds ?  gftp_file_sort_function_as : gftp_file_sort_function_ds;
-  else if (column == GFTP_SORT_COL_SIZE)
-    sortfunc = asds ?  gftp_size_sort_function_as : gftp_size_sort_function_ds;
-  else if (column == GFTP_SORT_COL_USER)
-    sortfunc = asds ?  gftp_user_sort_function_as : gftp_user_sort_function_ds;
-  else if (column == GFTP_SORT_COL_GROUP)
-    sortfunc = asds ?
-                gftp_group_sort_function_as : gftp_group_sort_function_ds;
-  else if (column == GFTP_SORT_COL_DATETIME)
-    sortfunc = asds ?
-                gftp_datetime_sort_function_as : gftp_datetime_sort_function_ds;
-  else if (column == GFTP_SORT_COL_ATTRIBS)
-    sortfunc = asds ? 
-                gftp_attribs_sort_function_as : gftp_attribs_sort_function_ds;
-  else /* Don't sort */
-   return (filelist);
-
-  sort_dirs_first = 1;
-  gftp_lookup_global_option ("sort_dirs_first", &sort_dirs_first);
-
-  for (tempitem = filelist; tempitem != NULL; )
-    {
-      tempfle = tempitem->data;
-      insitem = tempitem;
-      tempitem = tempitem->next;
-      insitem->next = NULL;
-
-      if (dotdot == NULL && strcmp (tempfle->file, "..") == 0)
-        dotdot = insitem;
-      else if (sort_dirs_first && S_ISDIR (tempfle->st_mode))
-        {
-          insitem->next = dirs;
-          dirs = insitem;
-        }
-      else
-        {
-          insitem->next = files;
-          files = insitem;
-        }
-    }
-
-  if (dirs != NULL)
-    dirs = g_list_sort (dirs, sortfunc);
-  if (files != NULL)
-    files = g_list_sort (files, sortfunc);
-
-  filelist = dotdot;
-
-  if (filelist == NULL)
-    filelist = dirs;
-  else
-    filelist = g_list_concat (filelist, dirs);
-
-  if (filelist == NULL)
-    filelist = files;
-  else
-    filelist = g_list_concat (filelist, files);
-
-  /* I haven't check this, but I'm pretty sure some older versions of glib
-     had a bug that the prev pointer wasn't being sent to NULL */
-  filelist->prev = NULL;
-  return (filelist);
-}
-
-
 char *
 gftp_gen_ls_string (gftp_request * request, gftp_file * fle,
                     char *file_prefixstr, char *file_suffixstr)
@@ -1010,11 +733,16 @@ gftp_shutdown (void)
   GList * templist;
 #endif
 
-  if (gftp_logfd != NULL)
-    fclose (gftp_logfd);
+  gftp_log_file_close ();
 
   gftp_clear_cache_files ();
 
+  sshv2_shutdown ();
+
+#ifdef USE_SSL
+  gftp_ssl_shutdown ();
+#endif
+
   if (gftp_configuration_changed)
     gftp_write_config_file ();
 
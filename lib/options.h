@@ -49,19 +49,36 @@ gftp_config_vars gftp_global_config_vars[] =
    gftp_option_type_int, 0, NULL, 0, 
    N_("The maximum size of the log window in bytes for the GTK+ port"), 
    GFTP_PORT_GTK, NULL},
+  {"max_log_file_size", N_("Max Log File Size:"), 
+   gftp_option_type_int, GINT_TO_POINTER(0), NULL, 0, 
+   N_("The size in KB at which the log file is moved to gftp.log.1 and a new one is started. (Set to 0 to disable)"), 
+   GFTP_PORT_ALL, NULL},
+  {"log_commands", N_("Log commands"), 
+   gftp_option_type_checkbox, GINT_TO_POINTER(1), NULL, 0,
+   N_("Log the commands that are sent to the server"), GFTP_PORT_ALL, NULL},
+  {"log_replies", N_("Log replies"), 
+   gftp_option_type_checkbox, GINT_TO_POINTER(1), NULL, 0,
+   N_("Log the replies of the server"), GFTP_PORT_ALL, NULL},
+  {"log_status", N_("Log status messages"), 
+   gftp_option_type_checkbox, GINT_TO_POINTER(1), NULL, 0,
+   N_("Log the status messages. Errors are always logged"), GFTP_PORT_ALL, NULL},
   {"remote_charsets", N_("Remote Character Sets:"), 
    gftp_option_type_text, "", NULL, GFTP_CVARS_FLAGS_SHOW_BOOKMARK,
    N_("This is a comma separated list of charsets to try to convert the remote messages to the current locale"), 
    GFTP_PORT_ALL, NULL},
   {"remote_lc_time", N_("Remote LC_TIME:"), 
    gftp_option_type_text, "", NULL, GFTP_CVARS_FLAGS_SHOW_BOOKMARK,
-   N_("This is the value of LC_TIME for the remote site. This is so that dates can be parsed properly in the directory listings."), 
+   N_("This is the value of LC_TIME for the remote site, so that month names in its directory listings can be parsed. English month names are always understood."), 
    GFTP_PORT_ALL, NULL},
   {"cache_ttl", N_("Cache TTL:"), 
    gftp_option_type_int, GINT_TO_POINTER(3600), NULL, 
    GFTP_CVARS_FLAGS_SHOW_BOOKMARK,
    N_("The number of seconds to keep cache entries before they expire."), 
    GFTP_PORT_ALL, NULL},
+  {"cache_max_entries", N_("Max Cache Entries:"), 
+   gftp_option_type_int, GINT_TO_POINTER(2000), NULL, 0,
+   N_("The maximum number of directory listings to keep in the cache. The least recently used listings are removed first."), 
+   GFTP_PORT_ALL, NULL},
 
   {"append_transfers", N_("Append file transfers"), 
   gftp_option_type_checkbox, GINT_TO_POINTER(1), NULL, 0,
@@ -84,6 +101,16 @@ gftp_config_vars gftp_global_config_vars[] =
    GFTP_CVARS_FLAGS_SHOW_BOOKMARK,
    N_("Preserve file times of transferred files"), GFTP_PORT_ALL,
    NULL},
+  {"prefetch_subdirs", N_("Prefetch subdirectories:"), 
+   gftp_option_type_int, GINT_TO_POINTER(0), NULL, 
+   GFTP_CVARS_FLAGS_SHOW_BOOKMARK,
+   N_("The number of subdirectories of a remote directory to list in the background and store in the cache. The prefetch stops while files are being transferred. (Set to 0 to disable)"), 
+   GFTP_PORT_GTK, NULL},
+  {"prefetch_max_kbs", N_("Prefetch Max KB/S:"), 
+   gftp_option_type_int, GINT_TO_POINTER(64), NULL, 
+   GFTP_CVARS_FLAGS_SHOW_BOOKMARK,
+   N_("The maximum KB/s that the subdirectory prefetch can use. (Set to 0 to disable)"), 
+   GFTP_PORT_GTK, NULL},
   {"refresh_files", N_("Refresh after each file transfer"), 
    gftp_option_type_checkbox, GINT_TO_POINTER(0), NULL, 
    GFTP_CVARS_FLAGS_SHOW_BOOKMARK,
@@ -97,6 +124,21 @@ gftp_config_vars gftp_global_config_vars[] =
    gftp_option_type_checkbox, GINT_TO_POINTER(1), NULL, 
    GFTP_CVARS_FLAGS_SHOW_BOOKMARK,
    N_("Show hidden files in the listboxes"), GFTP_PORT_ALL, NULL},
+  {"filespec_ignore_case", N_("Ignore case in filespecs"), 
+   gftp_option_type_checkbox, GINT_TO_POINTER(0), NULL, 
+   GFTP_CVARS_FLAGS_SHOW_BOOKMARK,
+   N_("Ignore the case of letters when matching file names against a filespec"), GFTP_PORT_ALL, NULL},
+  {"stream_listings", N_("Show listings as they arrive"), 
+   gftp_option_type_checkbox, GINT_TO_POINTER(1), NULL, 
+   GFTP_CVARS_FLAGS_SHOW_BOOKMARK,
+   N_("Show the files of a directory listing while it is still being received"), GFTP_PORT_GTK, NULL},
+  {"text_stream_listings", N_("Print ls output as it arrives"), 
+   gftp_option_type_checkbox, GINT_TO_POINTER(0), NULL, 
+   GFTP_CVARS_FLAGS_SHOW_BOOKMARK,
+   N_("Print the files of ls while the listing is still being received. The output is then only sorted a piece at a time"), GFTP_PORT_TEXT, NULL},
+  {"local_stat_threads", N_("Local Stat Threads:"), 
+   gftp_option_type_int, GINT_TO_POINTER(8), NULL, 0,
+   N_("The number of threads that look up the details of local files at once when listing a directory on a network filesystem such as NFS. Set to 1 to look them up one at a time"), GFTP_PORT_ALL, NULL},
   {"show_trans_in_title", N_("Show transfer status in title"), 
    gftp_option_type_checkbox, GINT_TO_POINTER(0), NULL, 0,
    N_("Show the file transfer status in the titlebar"), GFTP_PORT_GTK, NULL},
@@ -143,6 +185,11 @@ gftp_config_vars gftp_global_config_vars[] =
    GFTP_CVARS_FLAGS_SHOW_BOOKMARK,
    N_("The block size that is used when transferring files. This should be a multiple of 1024."),  
    GFTP_PORT_ALL, NULL},
+  {"transfer_autotune", N_("Tune transfers automatically"), 
+   gftp_option_type_checkbox, GINT_TO_POINTER(0), NULL, 
+   GFTP_CVARS_FLAGS_SHOW_BOOKMARK,
+   N_("Adjust the block size, and the number of SFTP requests in flight, while a transfer runs to get the best throughput. The best settings for each host are remembered for the next transfer"),  
+   GFTP_PORT_ALL, NULL},
 
   {"default_protocol", N_("Default Protocol:"),
    gftp_option_type_textcombo, "FTP", NULL, 0,
@@ -151,6 +198,40 @@ gftp_config_vars gftp_global_config_vars[] =
    gftp_option_type_checkbox, GINT_TO_POINTER(1), NULL, 
    GFTP_CVARS_FLAGS_SHOW_BOOKMARK,
    N_("Enable IPv6 support"), GFTP_PORT_ALL, NULL},
+  {"dns_cache_ttl", N_("DNS cache time:"), 
+   gftp_option_type_int, GINT_TO_POINTER(300), NULL, 0,
+   N_("The number of seconds the addresses of a host are remembered after it is looked up. (Set to 0 to disable)"), 
+   GFTP_PORT_ALL, NULL},
+  {"socket_send_buffer", N_("Socket send buffer (KB):"), 
+   gftp_option_type_int, GINT_TO_POINTER(0), NULL, 
+   GFTP_CVARS_FLAGS_SHOW_BOOKMARK,
+   N_("The size of the kernel send buffer of the connections. Links with a lot of bandwidth and a long round trip time need at least bandwidth * round trip time. (Set to 0 to use the system default)"), 
+   GFTP_PORT_ALL, NULL},
+  {"socket_receive_buffer", N_("Socket receive buffer (KB):"), 
+   gftp_option_type_int, GINT_TO_POINTER(0), NULL, 
+   GFTP_CVARS_FLAGS_SHOW_BOOKMARK,
+   N_("The size of the kernel receive buffer of the connections. (Set to 0 to use the system default)"), 
+   GFTP_PORT_ALL, NULL},
+  {"tcp_nodelay", N_("Send commands without delay (TCP_NODELAY)"), 
+   gftp_option_type_checkbox, GINT_TO_POINTER(1), NULL, 
+   GFTP_CVARS_FLAGS_SHOW_BOOKMARK,
+   N_("Send the commands on the control connection right away instead of waiting to fill a packet"), 
+   GFTP_PORT_ALL, NULL},
+  {"tcp_notsent_lowat", N_("Unsent data limit (KB):"), 
+   gftp_option_type_int, GINT_TO_POINTER(0), NULL, 
+   GFTP_CVARS_FLAGS_SHOW_BOOKMARK,
+   N_("The amount of data that is queued in the kernel but not sent yet before a connection stops accepting more (TCP_NOTSENT_LOWAT). (Set to 0 to use the system default)"), 
+   GFTP_PORT_ALL, NULL},
+  {"tcp_congestion", N_("TCP congestion control:"), 
+   gftp_option_type_text, "", NULL, 
+   GFTP_CVARS_FLAGS_SHOW_BOOKMARK,
+   N_("The TCP congestion control algorithm of the connections, for example bbr or cubic. Leave this empty to use the system default"), 
+   GFTP_PORT_ALL, NULL},
+  {"tcp_keepalive", N_("TCP keepalive interval:"), 
+   gftp_option_type_int, GINT_TO_POINTER(0), NULL, 
+   GFTP_CVARS_FLAGS_SHOW_BOOKMARK,
+   N_("The number of seconds a connection can be idle before keepalive probes are sent, and the time between them. (Set to 0 to disable)"), 
+   GFTP_PORT_ALL, NULL},
 
   {"list_dblclk_action", "", 
    gftp_option_type_int, GINT_TO_POINTER(0), NULL, 0,
@@ -272,7 +353,6 @@ GHashTable * gftp_global_options_htable = NULL,
 char gftp_version[] = "gFTP " VERSION;
 
 GList * gftp_file_transfers = NULL, 
-      * gftp_file_transfer_logs = NULL,
       * gftp_options_list = NULL;
       
 gftp_bookmarks_var * gftp_bookmarks = NULL;
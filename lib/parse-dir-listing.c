@@ -19,6 +19,8 @@
 /*****************************************************************************/
 
 #include "gftp.h"
+#include <langinfo.h>
+#include <locale.h>
 
 static char *
 copy_token (/*@out@*/ char **dest, char *source)
@@ -61,101 +63,388 @@ goto_next_token (char *pos)
 }
 
 
-static time_t
-parse_vms_time (char *str, char **endpos)
+/* The listings are parsed the same way whatever the locale of the client is.
+   Month names are always matched in English, and also in the locale given
+   in remote_lc_time for that site */
+static const char *gftp_month_abbrevs[] = { "jan", "feb", "mar", "apr", "may",
+                                            "jun", "jul", "aug", "sep", "oct",
+                                            "nov", "dec" };
+
+const char *
+gftp_set_listing_clock (gftp_request * request)
 {
+  gftp_listing_clock * clock;
+  char *remote_lc_time;
   struct tm curtime;
-  time_t ret;
+  locale_t loc;
+  time_t t;
+  int i;
 
-  /* 8-JUN-2004 13:04:14 */
-  memset (&curtime, 0, sizeof (curtime));
+  g_return_val_if_fail (request != NULL, NULL);
 
-  *endpos = strptime (str, "%d-%b-%Y %H:%M:%S", &curtime);
-  if (*endpos == NULL)
-    *endpos = strptime (str, "%d-%b-%Y %H:%M", &curtime);
-  
-  if (*endpos != NULL)
+  clock = &request->listing_clock;
+
+  /* Dates without a year are from the last 12 months. Work out the current
+     year once here instead of for every file in the listing */
+  t = time (NULL);
+  localtime_r (&t, &curtime);
+  clock->year = curtime.tm_year + 1900;
+  clock->month = curtime.tm_mon;
+  memset (clock->days, 0, sizeof (clock->days));
+
+  gftp_lookup_request_option (request, "remote_lc_time", &remote_lc_time);
+  if (remote_lc_time == NULL)
+    remote_lc_time = "";
+
+  if (strcmp (clock->lc_time, remote_lc_time) != 0)
     {
-      ret = mktime (&curtime);
-      for (; **endpos == ' ' || **endpos == '\t'; (*endpos)++);
+      memset (clock->month_names, 0, sizeof (clock->month_names));
+      g_strlcpy (clock->lc_time, remote_lc_time, sizeof (clock->lc_time));
+
+      if (*remote_lc_time != '\0')
+        {
+          loc = newlocale (LC_TIME_MASK, remote_lc_time, (locale_t) 0);
+          if (loc == (locale_t) 0)
+            request->logging_function (gftp_logging_error, request,
+                                       _("Error setting LC_TIME to '%s'. Falling back to '%s'\n"),
+                                       remote_lc_time, "C");
+          else
+            {
+              for (i = 0; i < 12; i++)
+                g_strlcpy (clock->month_names[i],
+                           nl_langinfo_l (ABMON_1 + i, loc),
+                           sizeof (clock->month_names[i]));
+              freelocale (loc);
+            }
+        }
     }
-  else
+
+  return (*clock->month_names[0] != '\0' ? clock->lc_time : "C");
+}
+
+
+static int
+parse_number (const char *str, int maxdigits, const char **endpos)
+{
+  int num, i;
+
+  num = 0;
+  for (i = 0; i < maxdigits && isdigit ((int) str[i]); i++)
+    num = num * 10 + str[i] - '0';
+
+  if (i == 0)
+    return (-1);
+
+  *endpos = str + i;
+  return (num);
+}
+
+
+static int
+parse_month (gftp_request * request, const char *str, const char **endpos)
+{
+  const char *pos;
+  size_t len, namelen;
+  int i;
+
+  for (pos = str;
+       *pos != ' ' && *pos != '\t' && *pos != '-' && *pos != '\0' &&
+        !isdigit ((int) *pos);
+       pos++);
+  len = pos - str;
+
+  if (request != NULL && *request->listing_clock.month_names[0] != '\0')
     {
-      ret = 0;
-      *endpos = goto_next_token (str);
-      if (*endpos != NULL)
-        *endpos = goto_next_token (*endpos);
+      for (i = 0; i < 12; i++)
+        {
+          namelen = strlen (request->listing_clock.month_names[i]);
+          if (namelen > 0 && namelen <= len &&
+              g_ascii_strncasecmp (str, request->listing_clock.month_names[i],
+                                   namelen) == 0)
+            {
+              *endpos = pos;
+              return (i);
+            }
+        }
     }
 
-  return (ret);
+  if (len < 3)
+    return (-1);
+
+  for (i = 0; i < 12; i++)
+    {
+      if (g_ascii_strncasecmp (str, gftp_month_abbrevs[i], 3) == 0)
+        {
+          *endpos = pos;
+          return (i);
+        }
+    }
+
+  return (-1);
 }
 
 
-time_t
-parse_time (char *str, char **endpos)
+/* Parses HH:MM, with optional seconds */
+static const char *
+parse_clock_time (const char *str, int *hour, int *min, int *sec)
 {
-  struct tm curtime, *loctime;
-  time_t t, ret;
-  char *tmppos;
-  size_t slen;
-  int i, num;
+  const char *pos;
+  int h, m, s;
+
+  s = 0;
+  if ((h = parse_number (str, 2, &pos)) < 0 || *pos != ':' ||
+      (m = parse_number (pos + 1, 2, &pos)) < 0)
+    return (NULL);
+
+  if (*pos == ':' && (s = parse_number (pos + 1, 2, &pos)) < 0)
+    return (NULL);
+
+  *hour = h;
+  *min = m;
+  *sec = s;
+  return (pos);
+}
+
+
+static const char *
+skip_blanks (const char *str)
+{
+  while (*str == ' ' || *str == '\t')
+    str++;
+  return (str);
+}
+
+
+static time_t
+gftp_utc_time (int year, int month, int day, int hour, int min, int sec)
+{
+  int y, m, era, yoe, doy, doe;
+
+  /* Days since the epoch of a date in the proleptic Gregorian calendar */
+  y = year - (month < 2);
+  m = month + 1;
+  era = (y >= 0 ? y : y - 399) / 400;
+  yoe = y - era * 400;
+  doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + day - 1;
+  doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+
+  return (((time_t) era * 146097 + doe - 719468) * 86400 +
+          hour * 3600 + min * 60 + sec);
+}
+
+
+static time_t
+gftp_mktime (int year, int month, int day, int hour, int min, int sec)
+{
+  struct tm curtime;
 
-  slen = strlen (str);
   memset (&curtime, 0, sizeof (curtime));
+  curtime.tm_year = year - 1900;
+  curtime.tm_mon = month;
+  curtime.tm_mday = day;
+  curtime.tm_hour = hour;
+  curtime.tm_min = min;
+  curtime.tm_sec = sec;
   curtime.tm_isdst = -1;
+  return (mktime (&curtime));
+}
+
+
+static time_t
+gftp_local_time (gftp_request * request, int year, int month, int day,
+                 int hour, int min, int sec)
+{
+  gftp_listing_day * cached;
+  time_t t;
+  int date;
+
+  if (request == NULL)
+    t = gftp_mktime (year, month, day, hour, min, sec);
+  else
+    {
+      /* mktime () is slow. Local midnight is looked up once per day, and
+         any time in a day without a DST change is an offset from it */
+      date = year * 10000 + (month + 1) * 100 + day;
+      cached = &request->listing_clock.days[date % GFTP_LISTING_CLOCK_DAYS];
+      if (cached->date != date)
+        {
+          cached->date = date;
+          cached->start = gftp_mktime (year, month, day, 0, 0, 0);
+          cached->uniform = cached->start != (time_t) -1 &&
+                            gftp_mktime (year, month, day + 1, 0, 0, 0) -
+                              cached->start == 86400;
+        }
+
+      if (cached->uniform)
+        t = cached->start + hour * 3600 + min * 60 + sec;
+      else
+        t = gftp_mktime (year, month, day, hour, min, sec);
+    }
 
-  if (slen > 4 && isdigit ((int) str[0]) && str[2] == '-' && 
-      isdigit ((int) str[3]))
+  return (t == (time_t) -1 ? 0 : t);
+}
+
+
+time_t
+parse_time (gftp_request * request, char *str, char **endpos)
+{
+  int year, month, day, hour, min, sec, offset, utc, num, i;
+  const char *pos, *numpos, *zone;
+  struct tm curtime;
+  time_t t;
+
+  year = month = day = -1;
+  hour = min = sec = 0;
+  offset = 0;
+  utc = 0;
+  pos = NULL;
+
+  if (isdigit ((int) str[0]) && isdigit ((int) str[1]) &&
+      str[2] == '-' && isdigit ((int) str[3]))
     {
       /* This is how DOS will return the date/time */
       /* 07-06-99  12:57PM */
-
-      tmppos = strptime (str, "%m-%d-%y %I:%M%p", &curtime);
+      month = parse_number (str, 2, &pos) - 1;
+      if ((day = parse_number (pos + 1, 2, &pos)) >= 0 && *pos == '-' &&
+          (year = parse_number (pos + 1, 4, &numpos)) >= 0 &&
+          (numpos - pos) <= 3)
+        year += year < 69 ? 2000 : 1900;
+
+      if (year < 0 ||
+          (pos = parse_clock_time (skip_blanks (numpos), &hour, &min,
+                                   &sec)) == NULL)
+        pos = NULL;
+      else if (g_ascii_strncasecmp (pos, "PM", 2) == 0)
+        {
+          if (hour < 12)
+            hour += 12;
+          pos += 2;
+        }
+      else if (g_ascii_strncasecmp (pos, "AM", 2) == 0)
+        {
+          if (hour == 12)
+            hour = 0;
+          pos += 2;
+        }
     }
-  else if (slen > 4 && isdigit ((int) str[0]) && str[2] == '-' && 
-           isalpha (str[3]))
+  else if (isdigit ((int) str[0]) &&
+           (str[1] == '-' || (isdigit ((int) str[1]) && str[2] == '-')))
     {
-      /* 10-Jan-2003 09:14 */
-      tmppos = strptime (str, "%d-%h-%Y %H:%M", &curtime);
+      /* 10-Jan-2003 09:14 or VMS 8-JUN-2004 13:04:14 */
+      if ((day = parse_number (str, 2, &pos)) >= 0 && *pos == '-' &&
+          (month = parse_month (request, pos + 1, &pos)) >= 0 &&
+          *pos == '-' && (year = parse_number (pos + 1, 4, &pos)) >= 0)
+        {
+          numpos = skip_blanks (pos);
+          if ((numpos = parse_clock_time (numpos, &hour, &min, &sec)) != NULL)
+            pos = numpos;
+        }
+      else
+        pos = NULL;
+    }
+  else if ((year = parse_number (str, 4, &pos)) >= 0 && pos - str == 4 &&
+           (*pos == '/' || *pos == '-'))
+    {
+      /* 2003/12/25, or ISO 8601 2003-12-25 13:04 and
+         2003-12-25 13:04:05.000000000 +0100 */
+      if ((month = parse_number (pos + 1, 2, &numpos) - 1) >= 0 &&
+          *numpos == *pos &&
+          (day = parse_number (numpos + 1, 2, &pos)) >= 0)
+        {
+          numpos = pos;
+          if (*numpos == 'T')
+            numpos++;
+          else
+            numpos = skip_blanks (numpos);
+
+          if ((numpos = parse_clock_time (numpos, &hour, &min, &sec)) != NULL)
+            {
+              pos = numpos;
+              if (*pos == '.' && isdigit ((int) pos[1]))
+                {
+                  for (pos++; isdigit ((int) *pos); pos++);
+
+                  /* A timezone only follows the fractional seconds */
+                  zone = skip_blanks (pos);
+                  if ((*zone == '+' || *zone == '-') &&
+                      (num = parse_number (zone + 1, 4, &numpos)) >= 0 &&
+                      numpos - zone == 5)
+                    {
+                      offset = (num / 100) * 3600 + (num % 100) * 60;
+                      if (*zone == '-')
+                        offset = -offset;
+                      utc = 1;
+                      pos = numpos;
+                    }
+                }
+              else if (*pos == 'Z')
+                {
+                  utc = 1;
+                  pos++;
+                }
+            }
+        }
+      else
+        pos = NULL;
     }
-  else if (slen > 4 && isdigit ((int) str[0]) && str[4] == '/')
+  else if (strspn (str, "0123456789") == 14)
     {
-      /* 2003/12/25 */
-      tmppos = strptime (str, "%Y/%m/%d", &curtime);
+      /* MLSD style YYYYMMDDHHMMSS[.sss], which is always in UTC */
+      year = parse_number (str, 4, &pos);
+      month = parse_number (str + 4, 2, &pos) - 1;
+      day = parse_number (str + 6, 2, &pos);
+      hour = parse_number (str + 8, 2, &pos);
+      min = parse_number (str + 10, 2, &pos);
+      sec = parse_number (str + 12, 2, &pos);
+      if (*pos == '.')
+        for (pos++; isdigit ((int) *pos); pos++);
+      utc = 1;
     }
   else
     {
       /* This is how most UNIX, Novell, and MacOS ftp servers send their time */
       /* Jul 06 12:57 or Jul  6  1999 */
-
-      if (strchr (str, ':') != NULL)
+      if ((month = parse_month (request, str, &pos)) >= 0 &&
+          (day = parse_number (skip_blanks (pos), 2, &pos)) >= 0)
         {
-          tmppos = strptime (str, "%h %d %H:%M", &curtime);
-          t = time (NULL);
-          loctime = localtime (&t);
-
-          if (curtime.tm_mon > loctime->tm_mon)
-            curtime.tm_year = loctime->tm_year - 1;
-          else
-            curtime.tm_year = loctime->tm_year;
+          pos = skip_blanks (pos);
+          if ((numpos = parse_clock_time (pos, &hour, &min, &sec)) != NULL)
+            {
+              pos = numpos;
+              if (request == NULL || request->listing_clock.year == 0)
+                {
+                  t = time (NULL);
+                  localtime_r (&t, &curtime);
+                  year = curtime.tm_year + 1900;
+                  num = curtime.tm_mon;
+                }
+              else
+                {
+                  year = request->listing_clock.year;
+                  num = request->listing_clock.month;
+                }
+
+              if (month > num)
+                year--;
+            }
+          else if ((year = parse_number (pos, 4, &pos)) < 0)
+            pos = NULL;
         }
       else
-        tmppos = strptime (str, "%h %d %Y", &curtime);
+        pos = NULL;
     }
 
-  if (tmppos != NULL)
-    ret = mktime (&curtime);
-  else
-    ret = 0;
+  if (pos != NULL && (month < 0 || month > 11 || day < 1 || day > 31 ||
+                      hour > 23 || min > 59 || sec > 60))
+    pos = NULL;
 
-  if (endpos != NULL)
+  if (pos == NULL)
     {
-      if (tmppos == NULL)
+      /* We cannot parse this date format. So, just skip this date field
+         and continue to the next token. This is mainly for the HTTP 
+         support */
+      if (endpos != NULL)
         {
-          /* We cannot parse this date format. So, just skip this date field
-             and continue to the next token. This is mainly for the HTTP 
-             support */
-
           *endpos = str;
           for (num = 0; num < 2 && **endpos != '\0'; num++)
             {
@@ -169,10 +458,29 @@ parse_time (char *str, char **endpos)
               *endpos += i;
             }
         }
-      else
-        *endpos = tmppos;
+
+      return (0);
     }
 
+  if (endpos != NULL)
+    *endpos = (char *) pos;
+
+  if (utc)
+    return (gftp_utc_time (year, month, day, hour, min, sec) - offset);
+  else
+    return (gftp_local_time (request, year, month, day, hour, min, sec));
+}
+
+
+static time_t
+parse_vms_time (gftp_request * request, char *str, char **endpos)
+{
+  time_t ret;
+
+  /* 8-JUN-2004 13:04:14 */
+  ret = parse_time (request, str, endpos);
+  for (; **endpos == ' ' || **endpos == '\t'; (*endpos)++);
+
   return (ret);
 }
 
@@ -256,7 +564,7 @@ gftp_parse_ls_vms (gftp_request * request, int fd, char *str, gftp_file * fle)
 
   curpos = goto_next_token (curpos);
 
-  fle->datetime = parse_vms_time (curpos, &curpos);
+  fle->datetime = parse_vms_time (request, curpos, &curpos);
 
   if (*curpos != '[')
     return (GFTP_EFATAL);
@@ -281,7 +589,7 @@ gftp_parse_ls_vms (gftp_request * request, int fd, char *str, gftp_file * fle)
 
 
 static int
-gftp_parse_ls_mvs (char *str, gftp_file * fle)
+gftp_parse_ls_mvs (gftp_request * request, char *str, gftp_file * fle)
 {
   char *curpos;
 
@@ -297,7 +605,7 @@ gftp_parse_ls_mvs (char *str, gftp_file * fle)
   if (curpos == NULL)
     return (GFTP_EFATAL);
 
-  fle->datetime = parse_time (curpos, &curpos);
+  fle->datetime = parse_time (request, curpos, &curpos);
 
   curpos = goto_next_token (curpos);
   if (curpos == NULL)
@@ -381,89 +689,116 @@ gftp_parse_ls_eplf (char *str, gftp_file * fle)
 }
 
 
+#define GFTP_LS_MAX_TOKENS	8
+
+static size_t
+token_len (const char *pos)
+{
+  const char *endpos;
+
+  for (endpos = pos; *endpos != ' ' && *endpos != '\t' && *endpos != '\0';
+       endpos++);
+
+  return (endpos - pos);
+}
+
+
+/* The same few users and groups show up on every line, so they are interned
+   instead of being copied for every file */
+static char *
+intern_token (const char *pos)
+{
+  char tempstr[256];
+  size_t len;
+
+  len = token_len (pos);
+  if (len >= sizeof (tempstr))
+    len = sizeof (tempstr) - 1;
+
+  memcpy (tempstr, pos, len);
+  tempstr[len] = '\0';
+  return ((char *) g_intern_string (tempstr));
+}
+
+
+/* drwxr-xr-x    2 user     group        4096 Jul  6 12:57 name
+
+   The line is walked once to find where each column starts, and is neither
+   modified nor copied. */
 static int
-gftp_parse_ls_unix (gftp_request * request, char *str, size_t slen,
-                    gftp_file * fle)
+gftp_parse_ls_unix (gftp_request * request, int dirtype, const char *str,
+                    size_t slen, gftp_file * fle)
 {
-  char *endpos, *startpos, *pos, *attribs;
-  int cols;
+  const char *tokens[GFTP_LS_MAX_TOKENS], *pos, *endpos, *startpos, 
+             *fileend, *strend;
+  int cols, numtokens, next;
+  char *datepos;
+
+  /* The attributes are always the first 10 characters. Whatever is right
+     after them (an ACL marker, or no space at all) is skipped. */
+  if (slen <= 10 || token_len (str) < 10)
+    return (GFTP_EFATAL);
 
-  /* If there is no space between the attribs and links field, just make one */
-  if (slen > 10)
-    str[10] = ' ';
+  fle->st_mode = gftp_convert_attributes_to_mode_t ((char *) str);
 
-  /* Determine the number of columns */
-  cols = 0;
-  pos = str;
-  while (*pos != '\0')
+  /* Find the start of each column up to the time. If there isn't a time,
+     all of the columns are counted. */
+  strend = str + slen;
+  cols = 1;
+  numtokens = 0;
+  for (pos = str + 11; pos < strend && (*pos == ' ' || *pos == '\t'); pos++);
+  while (pos < strend)
     {
-      while (*pos != '\0' && *pos != ' ' && *pos != '\t')
-        {
-          if (*pos == ':')
-            break;
-          pos++;
-        }
-
+      if (numtokens < GFTP_LS_MAX_TOKENS)
+        tokens[numtokens] = pos;
+      numtokens++;
       cols++;
 
-      if (*pos == ':')
+      while (pos < strend && *pos != ' ' && *pos != '\t' && *pos != ':')
+        pos++;
+
+      if (pos < strend && *pos == ':')
         {
           cols++;
           break;
         }
 
-      while (*pos == ' ' || *pos == '\t')
+      while (pos < strend && (*pos == ' ' || *pos == '\t'))
         pos++;
     }
 
-  startpos = str;
-  /* Copy file attributes */
-  if ((startpos = copy_token (&attribs, startpos)) == NULL)
-    return (GFTP_EFATAL);
-
-  if (strlen (attribs) < 10)
-    return (GFTP_EFATAL);
-
-  fle->st_mode = gftp_convert_attributes_to_mode_t (attribs);
-  g_free (attribs);
-
+  fle->names_interned = 1;
   if (cols >= 9)
     {
       /* Skip the number of links */
-      startpos = goto_next_token (startpos);
-
-      /* Copy the user that owns this file */
-      if ((startpos = copy_token (&fle->user, startpos)) == NULL)
-        return (GFTP_EFATAL);
-
-      /* Copy the group that owns this file */
-      if ((startpos = copy_token (&fle->group, startpos)) == NULL)
-        return (GFTP_EFATAL);
+      fle->user = intern_token (tokens[1]);
+      fle->group = intern_token (tokens[2]);
+      next = 3;
     }
   else
     {
-      fle->group = g_strdup (_("unknown"));
+      fle->group = (char *) g_intern_string (_("unknown"));
       if (cols == 8)
         {
-          if ((startpos = copy_token (&fle->user, startpos)) == NULL)
-            return (GFTP_EFATAL);
+          fle->user = intern_token (tokens[0]);
+          next = 2;
         }
       else
-        fle->user = g_strdup (_("unknown"));
-      startpos = goto_next_token (startpos);
-    }
-
-  if (request->server_type == GFTP_DIRTYPE_CRAY)
-    {
-      /* See if this is a Cray directory listing. It has the following format:
-      drwx------     2 feiliu    g913     DK  common      4096 Sep 24  2001 wv */
-      if (cols == 11 && strstr (str, "->") == NULL)
         {
-          startpos = goto_next_token (startpos);
-          startpos = goto_next_token (startpos);
+          fle->user = (char *) g_intern_string (_("unknown"));
+          next = 1;
         }
     }
 
+  /* See if this is a Cray directory listing. It has the following format:
+     drwx------     2 feiliu    g913     DK  common      4096 Sep 24  2001 wv */
+  if (dirtype == GFTP_DIRTYPE_CRAY && cols == 11 && strstr (str, "->") == NULL)
+    next += 2;
+
+  if (next >= numtokens || next >= GFTP_LS_MAX_TOKENS)
+    return (GFTP_EFATAL);
+  startpos = tokens[next];
+
   /* See if this is a block or character device. We will store the major number
      in the high word and the minor number in the low word.  */
   if (GFTP_IS_SPECIAL_DEVICE (fle->st_mode) &&
@@ -493,16 +828,19 @@ gftp_parse_ls_unix (gftp_request * request, char *str, size_t slen,
   while (*startpos == ' ')
     startpos++;
 
-  fle->datetime = parse_time (startpos, &startpos);
+  fle->datetime = parse_time (request, (char *) startpos, &datepos);
 
   /* Skip the blanks till we get to the next entry */
-  startpos = goto_next_token (startpos);
+  startpos = goto_next_token (datepos);
 
   /* Parse the filename. If this file is a symbolic link, remove the -> part */
+  fileend = strend;
   if (S_ISLNK (fle->st_mode) && ((endpos = strstr (startpos, "->")) != NULL))
-    *(endpos - 1) = '\0';
+    fileend = endpos > startpos ? endpos - 1 : endpos;
 
-  fle->file = g_strdup (startpos);
+  if (fileend < startpos)
+    fileend = startpos;
+  fle->file = g_strndup (startpos, fileend - startpos);
 
   /* Uncomment this if you want to strip the spaces off of the end of the file.
      I don't want to do this by default since there are valid filenames with
@@ -518,12 +856,12 @@ gftp_parse_ls_unix (gftp_request * request, char *str, size_t slen,
 
 
 static int
-gftp_parse_ls_nt (char *str, gftp_file * fle)
+gftp_parse_ls_nt (gftp_request * request, char *str, gftp_file * fle)
 {
   char *startpos;
 
   startpos = str;
-  fle->datetime = parse_time (startpos, &startpos);
+  fle->datetime = parse_time (request, startpos, &startpos);
 
   fle->user = g_strdup (_("unknown"));
   fle->group = g_strdup (_("unknown"));
@@ -545,7 +883,7 @@ gftp_parse_ls_nt (char *str, gftp_file * fle)
 
 
 static int
-gftp_parse_ls_novell (char *str, gftp_file * fle)
+gftp_parse_ls_novell (gftp_request * request, char *str, gftp_file * fle)
 {
   char *startpos;
 
@@ -570,7 +908,7 @@ gftp_parse_ls_novell (char *str, gftp_file * fle)
   fle->size = gftp_parse_file_size (startpos);
 
   startpos = goto_next_token (startpos);
-  fle->datetime = parse_time (startpos, &startpos);
+  fle->datetime = parse_time (request, startpos, &startpos);
 
   startpos = goto_next_token (startpos);
   fle->file = g_strdup (startpos);
@@ -578,77 +916,97 @@ gftp_parse_ls_novell (char *str, gftp_file * fle)
 }
 
 
+/* Works out the listing format from the first line that parses, and uses
+   that for the rest of the listing */
+int
+gftp_get_listing_type (gftp_request * request, const char *str, size_t len)
+{
+  const char *endpos;
+
+  switch (request->server_type)
+    {
+      case GFTP_DIRTYPE_CRAY:
+      case GFTP_DIRTYPE_UNIX:
+      case GFTP_DIRTYPE_EPLF:
+      case GFTP_DIRTYPE_NOVELL:
+      case GFTP_DIRTYPE_DOS:
+      case GFTP_DIRTYPE_VMS:
+      case GFTP_DIRTYPE_MVS:
+        return (request->server_type);
+    }
+
+  if (request->listing_type != 0)
+    return (request->listing_type);
+
+  if (*str == '+')
+    return (GFTP_DIRTYPE_EPLF);
+  else if (len > 2 && isdigit ((int) str[0]) && str[2] == '-')
+    return (GFTP_DIRTYPE_DOS);
+  else if (len > 2 && str[1] == ' ' && str[2] == '[')
+    return (GFTP_DIRTYPE_NOVELL);
+
+  /* If the first token in the string has a ; in it, then */
+  /* we'll assume that this is a VMS directory listing    */
+  if ((endpos = memchr (str, ' ', len)) != NULL &&
+      memchr (str, ';', endpos - str) != NULL)
+    return (GFTP_DIRTYPE_VMS);
+
+  return (GFTP_DIRTYPE_UNIX);
+}
+
+
 int
 gftp_parse_ls (gftp_request * request, const char *lsoutput, gftp_file * fle,
                int fd)
 {
-  char *str, *endpos, tmpchar;
-  int result, is_vms;
+  int result, dirtype;
   size_t len;
+  char *str;
 
   g_return_val_if_fail (lsoutput != NULL, GFTP_EFATAL);
   g_return_val_if_fail (fle != NULL, GFTP_EFATAL);
 
-  str = g_strdup (lsoutput);
   memset (fle, 0, sizeof (*fle));
+  GFTP_PROBE1 (list__parse__start, lsoutput);
 
-  len = strlen (str);
-  if (len > 0 && str[len - 1] == '\n')
-    str[--len] = '\0';
-  if (len > 0 && str[len - 1] == '\r')
-    str[--len] = '\0';
+  len = strlen (lsoutput);
+  if (len > 0 && lsoutput[len - 1] == '\n')
+    len--;
+  if (len > 0 && lsoutput[len - 1] == '\r')
+    len--;
 
-  switch (request->server_type)
+  dirtype = gftp_get_listing_type (request, lsoutput, len);
+  if (dirtype == GFTP_DIRTYPE_UNIX || dirtype == GFTP_DIRTYPE_CRAY)
+    result = gftp_parse_ls_unix (request, dirtype, lsoutput, len, fle);
+  else
     {
-      case GFTP_DIRTYPE_CRAY:
-      case GFTP_DIRTYPE_UNIX:
-        result = gftp_parse_ls_unix (request, str, len, fle);
-        break;
-      case GFTP_DIRTYPE_EPLF:
-        result = gftp_parse_ls_eplf (str, fle);
-        break;
-      case GFTP_DIRTYPE_NOVELL:
-        result = gftp_parse_ls_novell (str, fle);
-        break;
-      case GFTP_DIRTYPE_DOS:
-        result = gftp_parse_ls_nt (str, fle);
-        break;
-      case GFTP_DIRTYPE_VMS:
-        result = gftp_parse_ls_vms (request, fd, str, fle);
-        break;
-      case GFTP_DIRTYPE_MVS:
-        result = gftp_parse_ls_mvs (str, fle);
-        break;
-      default: /* autodetect */
-        if (*lsoutput == '+')
-          result = gftp_parse_ls_eplf (str, fle);
-        else if (isdigit ((int) str[0]) && str[2] == '-')
-          result = gftp_parse_ls_nt (str, fle);
-        else if (str[1] == ' ' && str[2] == '[')
-          result = gftp_parse_ls_novell (str, fle);
-        else
-          {
-            if ((endpos = strchr (str, ' ')) != NULL)
-              {
-                /* If the first token in the string has a ; in it, then */
-                /* we'll assume that this is a VMS directory listing    */
-                tmpchar = *endpos;
-                *endpos = '\0';
-                is_vms = strchr (str, ';') != NULL;
-                *endpos = tmpchar;
-              }
-            else
-              is_vms = 0;
-
-            if (is_vms)
-              result = gftp_parse_ls_vms (request, fd, str, fle);
-            else
-              result = gftp_parse_ls_unix (request, str, len, fle);
-          }
-        break;
+      /* These parsers modify the line */
+      str = g_strndup (lsoutput, len);
+      switch (dirtype)
+        {
+          case GFTP_DIRTYPE_EPLF:
+            result = gftp_parse_ls_eplf (str, fle);
+            break;
+          case GFTP_DIRTYPE_NOVELL:
+            result = gftp_parse_ls_novell (request, str, fle);
+            break;
+          case GFTP_DIRTYPE_DOS:
+            result = gftp_parse_ls_nt (request, str, fle);
+            break;
+          case GFTP_DIRTYPE_VMS:
+            result = gftp_parse_ls_vms (request, fd, str, fle);
+            break;
+          default:
+            result = gftp_parse_ls_mvs (request, str, fle);
+            break;
+        }
+      g_free (str);
     }
-  g_free (str);
 
+  if (result == 0 && dirtype != request->server_type)
+    request->listing_type = dirtype;
+
+  GFTP_PROBE2 (list__parse__done, result, dirtype);
   return (result);
 }
 
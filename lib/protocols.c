@@ -37,6 +37,7 @@ gftp_request_destroy (gftp_request * request, int free_request)
 {
   g_return_if_fail (request != NULL);
 
+  gftp_cache_end_batch (request);
   gftp_disconnect (request);
 
   if (request->destroy != NULL)
@@ -54,6 +55,8 @@ gftp_request_destroy (gftp_request * request, int free_request)
     g_free (request->directory);
   if (request->last_ftp_response)
     g_free (request->last_ftp_response);
+  gftp_cache_free_listing (request);
+  gftp_filespec_free (request->filespec);
   if (request->protocol_data)
     g_free (request->protocol_data);
 
@@ -103,9 +106,9 @@ gftp_file_destroy (gftp_file * file, int free_it)
 
   if (file->file)
     g_free (file->file);
-  if (file->user)
+  if (file->user && !file->names_interned)
     g_free (file->user);
-  if (file->group)
+  if (file->group && !file->names_interned)
     g_free (file->group);
   if (file->destfile)
     g_free (file->destfile);
@@ -266,26 +269,40 @@ put_file:
 ssize_t 
 gftp_get_next_file_chunk (gftp_request * request, char *buf, size_t size)
 {
+  ssize_t ret;
+
   g_return_val_if_fail (request != NULL, GFTP_EFATAL);
   g_return_val_if_fail (buf != NULL, GFTP_EFATAL);
 
+  GFTP_PROBE2 (block__read__start, request->hostname, size);
+
   if (request->get_next_file_chunk != NULL)
-    return (request->get_next_file_chunk (request, buf, size));
+    ret = request->get_next_file_chunk (request, buf, size);
+  else
+    ret = request->read_function (request, buf, size, request->datafd);
 
-  return (request->read_function (request, buf, size, request->datafd));
+  GFTP_PROBE2 (block__read__done, request->hostname, ret);
+  return (ret);
 }
 
 
 ssize_t 
 gftp_put_next_file_chunk (gftp_request * request, char *buf, size_t size)
 {
+  ssize_t ret;
+
   g_return_val_if_fail (request != NULL, GFTP_EFATAL);
   g_return_val_if_fail (buf != NULL, GFTP_EFATAL);
 
+  GFTP_PROBE2 (block__write__start, request->hostname, size);
+
   if (request->put_next_file_chunk != NULL)
-    return (request->put_next_file_chunk (request, buf, size));
+    ret = request->put_next_file_chunk (request, buf, size);
+  else
+    ret = request->write_function (request, buf, size, request->datafd);
 
-  return (request->write_function (request, buf, size, request->datafd));
+  GFTP_PROBE2 (block__write__done, request->hostname, ret);
+  return (ret);
 }
 
 
@@ -308,12 +325,7 @@ gftp_end_transfer (gftp_request * request)
       request->cachefd = -1;
     }
 
-  if (request->last_dir_entry)
-    {
-      g_free (request->last_dir_entry);
-      request->last_dir_entry = NULL;
-      request->last_dir_entry_len = 0;
-    }
+  gftp_cache_free_listing (request);
 
   return (ret);
 }
@@ -349,41 +361,41 @@ gftp_stat_filename (gftp_request * request, const char *filename, mode_t * mode,
 int
 gftp_list_files (gftp_request * request)
 {
-  char *remote_lc_time, *locret;
-  int fd;
+  const char *locret;
+  int fd, ret;
 
   g_return_val_if_fail (request != NULL, GFTP_EFATAL);
 
-#if ENABLE_NLS
-  gftp_lookup_request_option (request, "remote_lc_time", &remote_lc_time);
-  if (remote_lc_time != NULL && *remote_lc_time != '\0')
-    locret = setlocale (LC_TIME, remote_lc_time);
-  else
-    locret = setlocale (LC_TIME, NULL);
-
-  if (locret == NULL)
-    {
-      locret = setlocale (LC_TIME, NULL);
-      request->logging_function (gftp_logging_error, request,
-                                 _("Error setting LC_TIME to '%s'. Falling back to '%s'\n"),
-                                 remote_lc_time, locret);
-    }
-#else
-  locret = _("<unknown>");
-#endif
+  locret = gftp_set_listing_clock (request);
 
   request->cached = 0;
+  request->listing_type = 0;
+
+  /* Compiled again with the current show_hidden_files and
+     filespec_ignore_case */
+  gftp_filespec_free (request->filespec);
+  request->filespec = NULL;
+
   if (request->use_cache && (fd = gftp_find_cache_entry (request)) > 0)
     {
-      request->logging_function (gftp_logging_misc, request,
-                                 _("Loading directory listing %s from cache (LC_TIME=%s)\n"),
-                                 request->directory, locret);
+      ret = gftp_cache_read_listing (request, fd);
+      close (fd);
 
-      request->cachefd = fd;
-      request->cached = 1;
-      return (0);
+      if (ret == 0)
+        {
+          request->logging_function (gftp_logging_misc, request,
+                                     _("Loading directory listing %s from cache (LC_TIME=%s)\n"),
+                                     request->directory, locret);
+
+          request->cached = 1;
+          return (0);
+        }
+
+      /* Unreadable, or written by an older version */
+      gftp_delete_cache_entry (request, NULL, 0);
     }
-  else if (request->use_cache)
+
+  if (request->use_cache)
     {
       request->logging_function (gftp_logging_misc, request,
                                  _("Loading directory listing %s from server (LC_TIME=%s)\n"),
@@ -413,12 +425,22 @@ gftp_get_next_file (gftp_request * request, const char *filespec,
   if (request->get_next_file == NULL)
     return (GFTP_EFATAL);
 
-  if (request->cached && request->cachefd > 0)
-    fd = request->cachefd;
-  else
-    fd = request->datafd;
-
   memset (fle, 0, sizeof (*fle));
+
+  /* Cached listings are stored already parsed and converted */
+  if (request->cached)
+    {
+      do
+        {
+          gftp_file_destroy (fle, 0);
+          ret = gftp_cache_get_next_file (request, fle);
+        }
+      while (ret > 0 && !gftp_match_filespec (request, fle->file, filespec));
+
+      return (ret);
+    }
+
+  fd = request->datafd;
   do
     {
       gftp_file_destroy (fle, 0);
@@ -460,18 +482,18 @@ gftp_get_next_file (gftp_request * request, const char *filespec,
             }
         }
 
-      if (ret >= 0 && !request->cached && request->cachefd > 0 && 
-          request->last_dir_entry != NULL)
+      /* The listing is only written to the cache once all of it has been
+         read, so an aborted listing is never cached */
+      if (request->cachefd > 0 && ret > 0 && fle->file != NULL)
+        gftp_cache_add_file (request, fle);
+      else if (request->cachefd > 0 && ret == 0)
         {
-          if (gftp_fd_write (request, request->last_dir_entry,
-                          request->last_dir_entry_len, request->cachefd) < 0)
-            {
-              request->logging_function (gftp_logging_error, request,
-                                        _("Error: Cannot write to cache: %s\n"),
-                                        g_strerror (errno));
-              close (request->cachefd);
-              request->cachefd = -1;
-            }
+          if (gftp_cache_write_listing (request) < 0)
+            request->logging_function (gftp_logging_error, request,
+                                      _("Error: Cannot write to cache: %s\n"),
+                                      g_strerror (errno));
+          close (request->cachefd);
+          request->cachefd = -1;
         }
     } while (ret > 0 && !gftp_match_filespec (request, fle->file, filespec));
 
@@ -814,34 +836,62 @@ gftp_set_port (gftp_request * request, unsigned int port)
 int
 gftp_remove_directory (gftp_request * request, const char *directory)
 {
+  int ret;
+
   g_return_val_if_fail (request != NULL, GFTP_EFATAL);
 
   if (request->rmdir == NULL)
     return (GFTP_EFATAL);
-  return (request->rmdir (request, directory));
+
+  ret = request->rmdir (request, directory);
+  if (ret >= 0 && request->use_cache)
+    gftp_cache_file_removed (request, directory, 1);
+
+  return (ret);
 }
 
 
 int
 gftp_remove_file (gftp_request * request, const char *file)
 {
+  int ret;
+
   g_return_val_if_fail (request != NULL, GFTP_EFATAL);
 
   if (request->rmfile == NULL)
     return (GFTP_EFATAL);
-  return (request->rmfile (request, file));
+
+  ret = request->rmfile (request, file);
+  if (ret >= 0 && request->use_cache)
+    gftp_cache_file_removed (request, file, 0);
+
+  return (ret);
 }
 
 
 int
 gftp_make_directory (gftp_request * request, const char *directory)
 {
+  gftp_file fle;
+  int ret;
+
   g_return_val_if_fail (request != NULL, GFTP_EFATAL);
 
   if (request->mkdir == NULL)
     return (GFTP_EFATAL);
 
-  return (request->mkdir (request, directory));
+  ret = request->mkdir (request, directory);
+  if (ret >= 0 && request->use_cache)
+    {
+      /* The server does not tell us the owner or permissions of the new
+         directory. This is close enough until the listing expires. */
+      memset (&fle, 0, sizeof (fle));
+      fle.st_mode = S_IFDIR | S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH;
+      fle.datetime = time (NULL);
+      gftp_cache_file_added (request, directory, &fle);
+    }
+
+  return (ret);
 }
 
 
@@ -849,36 +899,55 @@ int
 gftp_rename_file (gftp_request * request, const char *oldname,
                   const char *newname)
 {
+  int ret;
+
   g_return_val_if_fail (request != NULL, GFTP_EFATAL);
 
   if (request->rename == NULL)
     return (GFTP_EFATAL);
 
-  return (request->rename (request, oldname, newname));
+  ret = request->rename (request, oldname, newname);
+  if (ret >= 0 && request->use_cache)
+    gftp_cache_file_renamed (request, oldname, newname);
+
+  return (ret);
 }
 
 
 int
 gftp_chmod (gftp_request * request, const char *file, mode_t mode)
 {
+  int ret;
+
   g_return_val_if_fail (request != NULL, GFTP_EFATAL);
 
   if (request->chmod == NULL)
     return (GFTP_EFATAL);
 
   mode &= S_IRWXU | S_IRWXG | S_IRWXO | S_ISUID | S_ISGID | S_ISVTX;
-  return (request->chmod (request, file, mode));
+  ret = request->chmod (request, file, mode);
+  if (ret >= 0 && request->use_cache)
+    gftp_cache_file_mode_changed (request, file, mode);
+
+  return (ret);
 }
 
 
 int
 gftp_set_file_time (gftp_request * request, const char *file, time_t datetime)
 {
+  int ret;
+
   g_return_val_if_fail (request != NULL, GFTP_EFATAL);
 
   if (request->set_file_time == NULL)
     return (GFTP_EFATAL);
-  return (request->set_file_time (request, file, datetime));
+
+  ret = request->set_file_time (request, file, datetime);
+  if (ret >= 0 && request->use_cache)
+    gftp_cache_file_time_changed (request, file, datetime);
+
+  return (ret);
 }
 
 
@@ -1390,11 +1459,17 @@ gftp_swap_socks (gftp_request * dest, gftp_request * source)
 
   dest->datafd = source->datafd;
   dest->cached = 0;
+#ifdef USE_SSL
+  gftp_ssl_swap_socks (dest, source);
+#endif
 
   if (!source->always_connected)
     {
       source->datafd = -1;
       source->cached = 1;
+#ifdef USE_SSL
+      source->ssl = NULL;
+#endif
     }
 
   if (dest->swap_socks != NULL)
@@ -1414,14 +1489,14 @@ gftp_calc_kbs (gftp_transfer * tdata, ssize_t num_read)
 
   gftp_lookup_request_option (tdata->fromreq, "maxkbs", &maxkbs.f);
 
-  if (g_thread_supported ())
-    g_mutex_lock (&tdata->statmutex);
-
   gettimeofday (&tv, NULL);
 
+  gftp_transfer_stats_begin (tdata);
+
   tdata->trans_bytes += num_read;
   tdata->curtrans += num_read;
-  tdata->stalled = 0;
+  if (g_atomic_int_get (&tdata->stalled))
+    g_atomic_int_set (&tdata->stalled, 0);
 
   start_difftime = (tv.tv_sec - tdata->starttime.tv_sec) + ((double) (tv.tv_usec - tdata->starttime.tv_usec) / 1000000.0);
 
@@ -1437,14 +1512,12 @@ gftp_calc_kbs (gftp_transfer * tdata, ssize_t num_read)
 
       if (waitusecs > 0)
         {
-          if (g_thread_supported ())
-            g_mutex_unlock (&tdata->statmutex);
+          gftp_transfer_stats_end (tdata);
 
           waited = 1;
           usleep (waitusecs);
 
-          if (g_thread_supported ())
-            g_mutex_lock (&tdata->statmutex);
+          gftp_transfer_stats_begin (tdata);
         }
 
     }
@@ -1454,8 +1527,54 @@ gftp_calc_kbs (gftp_transfer * tdata, ssize_t num_read)
   else
     memcpy (&tdata->lasttime, &tv, sizeof (tdata->lasttime));
 
-  if (g_thread_supported ())
-    g_mutex_unlock (&tdata->statmutex);
+  gftp_transfer_stats_end (tdata);
+}
+
+
+/* The counters are only changed by the transfer thread, so a sequence
+   count is enough: it is odd while they change, and a reader copies them
+   again if the count was odd or moved while it was copying. */
+
+void
+gftp_transfer_stats_begin (gftp_transfer * tdata)
+{
+  g_atomic_int_inc (&tdata->stats_seq);
+}
+
+
+void
+gftp_transfer_stats_end (gftp_transfer * tdata)
+{
+  g_atomic_int_inc (&tdata->stats_seq);
+  g_atomic_int_set (&tdata->progress_pending, 1);
+}
+
+
+void
+gftp_transfer_get_stats (gftp_transfer * tdata, gftp_transfer_stats * stats)
+{
+  gint seq;
+
+  g_return_if_fail (tdata != NULL);
+  g_return_if_fail (stats != NULL);
+
+  do
+    {
+      while ((seq = g_atomic_int_get (&tdata->stats_seq)) & 1)
+        g_thread_yield ();
+
+      stats->curtrans = tdata->curtrans;
+      stats->tot_file_trans = tdata->tot_file_trans;
+      stats->curresumed = tdata->curresumed;
+      stats->trans_bytes = tdata->trans_bytes;
+      stats->total_bytes = tdata->total_bytes;
+      stats->resumed_bytes = tdata->resumed_bytes;
+      stats->kbs = tdata->kbs;
+      stats->starttime = tdata->starttime;
+      stats->lasttime = tdata->lasttime;
+      stats->current_file_number = tdata->current_file_number;
+    }
+  while (g_atomic_int_get (&tdata->stats_seq) != seq);
 }
 
 
@@ -1538,6 +1657,10 @@ gftp_get_transfer_status (gftp_transfer * tdata, ssize_t num_read)
         _do_sleep (sleep_time);
 
       tdata->current_file_retries++;
+      GFTP_PROBE2 (reconnect, tdata->fromreq->hostname != NULL ?
+                                tdata->fromreq->hostname :
+                                tdata->toreq->hostname,
+                   tdata->current_file_retries);
 
       ret1 = ret2 = 0;
       if ((ret1 = gftp_connect (tdata->fromreq)) == 0 &&
@@ -1546,6 +1669,8 @@ gftp_get_transfer_status (gftp_transfer * tdata, ssize_t num_read)
           if (g_thread_supported ())
             g_mutex_lock (&tdata->structmutex);
 
+          gftp_transfer_stats_begin (tdata);
+
           tdata->resumed_bytes = tdata->resumed_bytes + tdata->trans_bytes - tdata->curresumed - tdata->curtrans;
           tdata->trans_bytes = 0;
           if (tdata->skip_file)
@@ -1574,6 +1699,8 @@ gftp_get_transfer_status (gftp_transfer * tdata, ssize_t num_read)
 
           gettimeofday (&tdata->starttime, NULL);
 
+          gftp_transfer_stats_end (tdata);
+
           if (g_thread_supported ())
             g_mutex_unlock (&tdata->structmutex);
 
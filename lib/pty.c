@@ -356,3 +356,70 @@ gftp_exec (gftp_request * request, int *fdm, int *ptymfd, char **args)
     }
 }
 
+
+pid_t
+gftp_exec_without_pty (gftp_request * request, int *fdm, int *errfd,
+                       char **args)
+{
+  pid_t child;
+  int s[2], e[2];
+
+  if (socketpair (AF_LOCAL, SOCK_STREAM, 0, s) < 0)
+    {
+      request->logging_function (gftp_logging_error, request->user_data,
+                                 _("Cannot create a socket pair: %s\n"),
+                                 g_strerror (errno));
+      return (-1);
+    }
+
+  /* Without a pty, whatever the child prints on stderr is read back from
+     this pipe so that it ends up in the log */
+  if (pipe (e) < 0)
+    {
+      request->logging_function (gftp_logging_error, request->user_data,
+                                 _("Cannot create a pipe: %s\n"),
+                                 g_strerror (errno));
+      close (s[0]);
+      close (s[1]);
+      return (-1);
+    }
+
+  if ((child = fork ()) == 0)
+    {
+      setsid ();
+
+      close (s[0]);
+      close (e[0]);
+
+      dup2 (s[1], 0);
+      dup2 (s[1], 1);
+      dup2 (e[1], 2);
+      _gftp_close_all_fds (-1);
+
+      execvp (args[0], args);
+
+      fprintf (stderr, _("Error: Cannot execute ssh: %s\n"),
+               g_strerror (errno));
+      _exit (1);
+    }
+  else if (child > 0)
+    {
+      close (s[1]);
+      close (e[1]);
+      fcntl (e[0], F_SETFL, O_NONBLOCK);
+      *fdm = s[0];
+      *errfd = e[0];
+      return (child);
+    }
+  else
+    {
+      close (s[0]);
+      close (s[1]);
+      close (e[0]);
+      close (e[1]);
+      request->logging_function (gftp_logging_error, request->user_data,
+                                 _("Cannot fork another process: %s\n"),
+                                 g_strerror (errno));
+      return (-1);
+    }
+}
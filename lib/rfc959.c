@@ -97,9 +97,10 @@ static gftp_config_vars config_vars[] =
 static int
 rfc959_read_response (gftp_request * request, int disconnect_on_42x)
 {
-  char tempstr[255], code[4];
+  char *line, code[4];
   rfc959_parms * parms;
   ssize_t num_read;
+  size_t linelen;
 
   g_return_val_if_fail (request != NULL, GFTP_EFATAL);
   g_return_val_if_fail (request->datafd > 0, GFTP_EFATAL);
@@ -113,32 +114,41 @@ rfc959_read_response (gftp_request * request, int disconnect_on_42x)
 
   parms = request->protocol_data;
 
+  line = NULL;
   do
     {
-      if ((num_read = gftp_get_line (request, &parms->datafd_rbuf, tempstr, 
-                                     sizeof (tempstr), request->datafd)) <= 0)
+      if ((num_read = gftp_get_line_view (request, &parms->datafd_rbuf, &line,
+                                          &linelen, request->datafd)) <= 0)
 	break;
 
-      if (isdigit ((int) *tempstr) && isdigit ((int) *(tempstr + 1))
-	  && isdigit ((int) *(tempstr + 2)))
+      if (isdigit ((int) *line) && isdigit ((int) *(line + 1))
+	  && isdigit ((int) *(line + 2)))
 	{
-	  strncpy (code, tempstr, 3);
+	  strncpy (code, line, 3);
 	  code[3] = ' ';
 	}
 
-      if (*tempstr == '4' || *tempstr == '5')
+      if (*line == '4' || *line == '5')
         request->logging_function (gftp_logging_error, request,
-  				   "%s\n", tempstr);
+  				   "%s\n", line);
       else
         request->logging_function (gftp_logging_recv, request,
-  				   "%s\n", tempstr);
+  				   "%s\n", line);
     }
-  while (strncmp (code, tempstr, 4) != 0);
+  while (strncmp (code, line, 4) != 0);
 
   if (num_read < 0)
     return ((int) num_read);
+  else if (num_read == 0)
+    {
+      /* The line buffer is gone along with the connection */
+      gftp_disconnect (request);
+      return (GFTP_ERETRYABLE);
+    }
 
-  request->last_ftp_response = g_strdup (tempstr);
+  request->last_ftp_response = g_strdup (line);
+  GFTP_PROBE2 (command__reply, request->hostname,
+               request->last_ftp_response);
 
   if (request->last_ftp_response[0] == '4' &&
       request->last_ftp_response[1] == '2' &&
@@ -157,6 +167,7 @@ rfc959_send_command (gftp_request * request, const char *command,
                      ssize_t command_len, int read_response,
                      int dont_try_to_reconnect)
 {
+  const char *shown;
   int ret;
 
   g_return_val_if_fail (request != NULL, GFTP_EFATAL);
@@ -164,20 +175,14 @@ rfc959_send_command (gftp_request * request, const char *command,
   g_return_val_if_fail (request->datafd > 0, GFTP_EFATAL);
 
   if (strncmp (command, "PASS", 4) == 0)
-    {
-      request->logging_function (gftp_logging_send, request, 
-                                 "PASS xxxx\n");
-    }
+    shown = "PASS xxxx\n";
   else if (strncmp (command, "ACCT", 4) == 0)
-    {
-      request->logging_function (gftp_logging_send, request, 
-                                 "ACCT xxxx\n");
-    }
+    shown = "ACCT xxxx\n";
   else
-    {
-      request->logging_function (gftp_logging_send, request, "%s",
-                                 command);
-    }
+    shown = command;
+
+  request->logging_function (gftp_logging_send, request, "%s", shown);
+  GFTP_PROBE2 (command__send, request->hostname, shown);
 
   if (command_len == -1)
     command_len = strlen (command);
@@ -191,6 +196,7 @@ rfc959_send_command (gftp_request * request, const char *command,
       ret = rfc959_read_response (request, 1);
       if (ret == GFTP_ETIMEDOUT && !dont_try_to_reconnect)
         {
+          GFTP_PROBE2 (reconnect, request->hostname, ret);
           ret = gftp_connect (request);
           if (ret < 0)
             return (ret);
@@ -667,6 +673,7 @@ rfc959_close_data_connection (gftp_request * request)
       if(parms->data_conn_tls_close != NULL)
 	parms->data_conn_tls_close(request);
 
+      GFTP_PROBE2 (data__close, request->hostname, parms->data_connection);
       close (parms->data_connection);
       parms->data_connection = -1;
     }
@@ -676,12 +683,17 @@ rfc959_close_data_connection (gftp_request * request)
 static void
 rfc959_disconnect (gftp_request * request)
 {
+  rfc959_parms * parms;
+
   g_return_if_fail (request != NULL);
 
   if (request->datafd > 0)
     {
       rfc959_close_data_connection (request);
 
+      parms = request->protocol_data;
+      parms->data_sockopts_logged = 0;
+
       request->logging_function (gftp_logging_misc, request,
 				 _("Disconnecting from site %s\n"),
 				 request->hostname);
@@ -728,6 +740,8 @@ rfc959_ipv4_data_connection_new (gftp_request * request)
       return (GFTP_ERETRYABLE);
     }
 
+  gftp_set_socket_options (request, parms->data_connection, 0);
+
   data_addr_len = sizeof (data_addr);
   memset (&data_addr, 0, data_addr_len);
   data_addr.sin_family = AF_INET;
@@ -777,8 +791,9 @@ rfc959_ipv4_data_connection_new (gftp_request * request)
                                   &ignore_pasv_address);
       if (ignore_pasv_address)
 	{
-          memcpy (&data_addr.sin_addr, request->remote_addr,
-                  request->remote_addr_len);
+          memcpy (&data_addr.sin_addr,
+                  &((struct sockaddr_in *) request->remote_addr)->sin_addr,
+                  sizeof (data_addr.sin_addr));
 
           pos = (char *) &data_addr.sin_addr;
           request->logging_function (gftp_logging_error, request,
@@ -896,6 +911,8 @@ rfc959_ipv6_data_connection_new (gftp_request * request)
       return (GFTP_ERETRYABLE);
     }
 
+  gftp_set_socket_options (request, parms->data_connection, 0);
+
   /* This condition shouldn't happen. We better check anyway... */
   if (sizeof (data_addr) != request->remote_addr_len) 
     {
@@ -1022,6 +1039,7 @@ rfc959_ipv6_data_connection_new (gftp_request * request)
 static int
 rfc959_data_connection_new (gftp_request * request, int dont_try_to_reconnect)
 {
+  rfc959_parms * parms;
   int ret;
 
   g_return_val_if_fail (request != NULL, GFTP_EFATAL);
@@ -1034,14 +1052,28 @@ rfc959_data_connection_new (gftp_request * request, int dont_try_to_reconnect)
 
   if (ret == GFTP_ETIMEDOUT && !dont_try_to_reconnect)
     {
+      GFTP_PROBE2 (reconnect, request->hostname, ret);
       ret = gftp_connect (request);
       if (ret < 0)
         return (ret);
 
       return (rfc959_data_connection_new (request, 1));
     }
-  else
-    return (ret);
+  else if (ret == 0)
+    {
+      parms = request->protocol_data;
+      GFTP_PROBE2 (data__open, request->hostname, parms->data_connection);
+
+      /* Once per control connection, they are the same every time */
+      if (!parms->data_sockopts_logged)
+        {
+          gftp_log_socket_options (request, parms->data_connection,
+                                   _("Data connection"));
+          parms->data_sockopts_logged = 1;
+        }
+    }
+
+  return (ret);
 }
 
 
@@ -1096,29 +1128,17 @@ rfc959_accept_active_connection (gftp_request * request)
 static unsigned int
 rfc959_is_ascii_transfer (gftp_request * request, const char *filename)
 {
-  gftp_config_list_vars * tmplistvar;
   gftp_file_extensions * tempext;
   intptr_t ascii_transfers;
-  GList * templist;
-  size_t stlen;
   
-  gftp_lookup_global_option ("ext", &tmplistvar);
   gftp_lookup_request_option (request, "ascii_transfers", &ascii_transfers);
 
-  stlen = strlen (filename);
-  for (templist = tmplistvar->list; templist != NULL; templist = templist->next)
+  if ((tempext = gftp_lookup_file_extension (filename)) != NULL)
     {
-      tempext = templist->data;
-
-      if (stlen >= tempext->stlen &&
-          strcmp (&filename[stlen - tempext->stlen], tempext->ext) == 0)
-        {
-          if (toupper (*tempext->ascii_binary == 'A'))
-            ascii_transfers = 1; 
-          else if (toupper (*tempext->ascii_binary == 'B'))
-            ascii_transfers = 0; 
-          break;
-        }
+      if (toupper (*tempext->ascii_binary == 'A'))
+        ascii_transfers = 1; 
+      else if (toupper (*tempext->ascii_binary == 'B'))
+        ascii_transfers = 0; 
     }
 
   return (ascii_transfers);
@@ -1578,21 +1598,18 @@ rfc959_get_next_dirlist_line (gftp_request * request, int fd,
 int
 rfc959_get_next_file (gftp_request * request, gftp_file * fle, int fd)
 {
+  ssize_t (*oldread_func) (gftp_request * request, void *ptr, size_t size,
+                           int fd);
   rfc959_parms * parms;
-  char tempstr[1024];
-  size_t stlen;
+  size_t linelen;
   ssize_t len;
+  char *line;
+  int vms;
 
   g_return_val_if_fail (request != NULL, GFTP_EFATAL);
   g_return_val_if_fail (fle != NULL, GFTP_EFATAL);
   g_return_val_if_fail (fd > 0, GFTP_EFATAL);
 
-  if (request->last_dir_entry)
-    {
-      g_free (request->last_dir_entry);
-      request->last_dir_entry = NULL;
-    }
-
   parms = request->protocol_data;
 
   if (fd == request->datafd)
@@ -1600,21 +1617,32 @@ rfc959_get_next_file (gftp_request * request, gftp_file * fle, int fd)
 
   do
     {
-      len = rfc959_get_next_dirlist_line (request, fd, tempstr,
-                                          sizeof (tempstr));
+      oldread_func = request->read_function;
+      request->read_function = parms->data_conn_read;
+      len = gftp_get_line_view (request, &parms->dataconn_rbuf, &line,
+                                &linelen, fd);
+      request->read_function = oldread_func;
+
       if (len <= 0)
 	{
           gftp_file_destroy (fle, 0);
 	  return (len);
 	} 
 
-      if (gftp_parse_ls (request, tempstr, fle, fd) != 0)
+      /* A VMS entry can span two lines. Reading the second one may move or
+         free the buffer that line points into, so whether the parser takes
+         the line as VMS is found out before it runs, the same way it does */
+      vms = gftp_get_listing_type (request, line, strlen (line)) ==
+            GFTP_DIRTYPE_VMS;
+
+      if (gftp_parse_ls (request, line, fle, fd) != 0)
 	{
-	  if (strncmp (tempstr, "total", strlen ("total")) != 0 &&
-	      strncmp (tempstr, _("total"), strlen (_("total"))) != 0)
+	  if (!vms && parms->dataconn_rbuf != NULL &&
+	      strncmp (line, "total", strlen ("total")) != 0 &&
+	      strncmp (line, _("total"), strlen (_("total"))) != 0)
 	    request->logging_function (gftp_logging_error, request,
 				       _("Warning: Cannot parse listing %s\n"),
-				       tempstr);
+				       line);
 	  gftp_file_destroy (fle, 0);
 	  continue;
 	}
@@ -1623,12 +1651,6 @@ rfc959_get_next_file (gftp_request * request, gftp_file * fle, int fd)
     }
   while (1);
 
-  stlen = strlen (tempstr);
-  if (!request->cached)
-    {
-      request->last_dir_entry = g_strdup_printf ("%s\n", tempstr);
-      request->last_dir_entry_len = stlen + 1;
-    }
   return (len);
 }
 
@@ -18,11 +18,106 @@
 /*****************************************************************************/
 
 #include "gftp.h"
+#include <poll.h>
+
+/* Addresses of hosts that were looked up recently, shared by all requests
+   so that reconnects and retries do not resolve the host again. getaddrinfo
+   does not give the TTL of the records, so the dns_cache_ttl option is used
+   instead */
+
+typedef struct gftp_dns_entry_tag
+{
+  char *key;
+  struct addrinfo *addrs;
+  gint64 expires;
+  gint refcount;
+} gftp_dns_entry;
+
+/* Delay between starting connections to the addresses of a host (RFC 8305) */
+#define GFTP_CONNECT_ATTEMPT_DELAY	250	/* ms */
+
+static GMutex dns_cache_lock;
+static GHashTable * dns_cache = NULL;
+
+
+static void
+_gftp_dns_entry_unref (gpointer data)
+{
+  gftp_dns_entry * entry;
+
+  entry = data;
+  if (!g_atomic_int_dec_and_test (&entry->refcount))
+    return;
+
+  freeaddrinfo (entry->addrs);
+  g_free (entry->key);
+  g_free (entry);
+}
+
+
+static gftp_dns_entry *
+_gftp_dns_cache_lookup (const char *key)
+{
+  gftp_dns_entry * entry;
+
+  g_mutex_lock (&dns_cache_lock);
+
+  if (dns_cache != NULL &&
+      (entry = g_hash_table_lookup (dns_cache, key)) != NULL)
+    {
+      if (entry->expires > g_get_monotonic_time ())
+        g_atomic_int_inc (&entry->refcount);
+      else
+        {
+          g_hash_table_remove (dns_cache, key);
+          entry = NULL;
+        }
+    }
+  else
+    entry = NULL;
+
+  g_mutex_unlock (&dns_cache_lock);
+  return (entry);
+}
+
+
+static void
+_gftp_dns_cache_add (gftp_dns_entry * entry)
+{
+  g_mutex_lock (&dns_cache_lock);
+
+  if (dns_cache == NULL)
+    dns_cache = g_hash_table_new_full (g_str_hash, g_str_equal, NULL,
+                                       _gftp_dns_entry_unref);
+
+  g_atomic_int_inc (&entry->refcount);
+  g_hash_table_replace (dns_cache, entry->key, entry);
+
+  g_mutex_unlock (&dns_cache_lock);
+}
+
+
+/* Called when none of the addresses could be connected to, in case the host
+   has moved */
+static void
+_gftp_dns_cache_forget (gftp_dns_entry * entry)
+{
+  g_mutex_lock (&dns_cache_lock);
+
+  if (dns_cache != NULL && g_hash_table_lookup (dns_cache, entry->key) == entry)
+    g_hash_table_remove (dns_cache, entry->key);
+
+  g_mutex_unlock (&dns_cache_lock);
+}
+
 
 static int
 get_port (struct addrinfo *addr)
 {
   struct sockaddr_in * saddr;
+#ifdef AF_INET6
+  struct sockaddr_in6 * saddr6;
+#endif
   int port;
 
   if (addr->ai_family == AF_INET)
@@ -30,6 +125,13 @@ get_port (struct addrinfo *addr)
       saddr = (struct sockaddr_in *) addr->ai_addr;
       port = ntohs (saddr->sin_port);
     }
+#ifdef AF_INET6
+  else if (addr->ai_family == AF_INET6)
+    {
+      saddr6 = (struct sockaddr_in6 *) addr->ai_addr;
+      port = ntohs (saddr6->sin6_port);
+    }
+#endif
   else
     port = 0;
 
@@ -37,14 +139,15 @@ get_port (struct addrinfo *addr)
 }
 
 
-static struct addrinfo *
+static gftp_dns_entry *
 lookup_host (gftp_request *request, char *service,
                               char *proxy_hostname, int proxy_port)
 {
   struct addrinfo hints, *hostp;
-  intptr_t enable_ipv6;
-  char serv[8], *connect_host;
+  intptr_t enable_ipv6, dns_cache_ttl;
+  char serv[8], *connect_host, *key;
   int ret, connect_port;
+  gftp_dns_entry * entry;
 
   if (request->use_proxy)
     {
@@ -58,6 +161,7 @@ lookup_host (gftp_request *request, char *service,
     }
 
   gftp_lookup_request_option (request, "enable_ipv6", &enable_ipv6);
+  gftp_lookup_request_option (request, "dns_cache_ttl", &dns_cache_ttl);
 
   memset (&hints, 0, sizeof (hints));
   hints.ai_flags = AI_CANONNAME;
@@ -70,6 +174,13 @@ lookup_host (gftp_request *request, char *service,
   else
     snprintf (serv, sizeof (serv), "%d", connect_port);
 
+  key = g_strdup_printf ("%s %s %d", connect_host, serv, hints.ai_family);
+  if (dns_cache_ttl > 0 && (entry = _gftp_dns_cache_lookup (key)) != NULL)
+    {
+      g_free (key);
+      return (entry);
+    }
+
   request->logging_function (gftp_logging_misc, request,
                              _("Looking up %s\n"), connect_host);
   if ((ret = getaddrinfo (connect_host, serv, &hints, 
@@ -78,77 +189,307 @@ lookup_host (gftp_request *request, char *service,
       request->logging_function (gftp_logging_error, request,
                                  _("Cannot look up hostname %s: %s\n"),
                                  connect_host, gai_strerror (ret));
+      g_free (key);
       return (NULL);
     }
 
-  return (hostp);
+  entry = g_malloc0 (sizeof (*entry));
+  entry->key = key;
+  entry->addrs = hostp;
+  entry->expires = g_get_monotonic_time () +
+                   (gint64) dns_cache_ttl * G_USEC_PER_SEC;
+  entry->refcount = 1;
+
+  if (dns_cache_ttl > 0)
+    _gftp_dns_cache_add (entry);
+
+  return (entry);
 }
 
 
+/* Puts the addresses in the order they are tried in, alternating between
+   the address families and starting with the family of the first address
+   (RFC 8305, section 4) */
+static struct addrinfo **
+_gftp_order_addresses (struct addrinfo *hostp, size_t *num)
+{
+  struct addrinfo *res, *first, *other, **addrs;
+  size_t i, n;
+
+  n = 0;
+  for (res = hostp; res != NULL; res = res->ai_next)
+    n++;
+
+  addrs = g_malloc0 (n * sizeof (*addrs));
+  first = other = hostp;
+  for (i = 0; i < n; )
+    {
+      while (first != NULL && first->ai_family != hostp->ai_family)
+        first = first->ai_next;
+      if (first != NULL)
+        {
+          addrs[i++] = first;
+          first = first->ai_next;
+        }
+
+      while (other != NULL && other->ai_family == hostp->ai_family)
+        other = other->ai_next;
+      if (other != NULL)
+        {
+          addrs[i++] = other;
+          other = other->ai_next;
+        }
+    }
+
+  *num = n;
+  return (addrs);
+}
+
+
+static void
+_gftp_address_string (struct addrinfo *addr, char *buf, size_t size)
+{
+  if (getnameinfo (addr->ai_addr, addr->ai_addrlen, buf, size, NULL, 0,
+                   NI_NUMERICHOST) != 0)
+    g_strlcpy (buf, "?", size);
+}
+
+
+/* Starts a non blocking connection to addr. Returns the socket, or -1 if
+   the connection failed right away */
 static int
-gftp_connect_server_with_getaddrinfo (gftp_request * request, char *service,
-                                      char *proxy_hostname,
-                                      unsigned int proxy_port)
+_gftp_start_connect (gftp_request * request, struct addrinfo *addr, 
+                     int *connected)
 {
-  struct addrinfo *res, *hostp, *current_hostp;
-  unsigned int port;
-  int sock = -1;
+  char addrstr[INET6_ADDRSTRLEN];
+  int sock;
 
-  hostp = lookup_host (request, service, proxy_hostname,
-                                        proxy_port);
-  if (hostp == NULL)
-    return (GFTP_ERETRYABLE);
+  _gftp_address_string (addr, addrstr, sizeof (addrstr));
 
-  for (res = hostp; res != NULL; res = res->ai_next)
+  if ((sock = socket (addr->ai_family, addr->ai_socktype, 
+                      addr->ai_protocol)) < 0)
     {
-      port = get_port (res);
-      if (!request->use_proxy)
-        request->port = port;
+      request->logging_function (gftp_logging_error, request,
+                                 _("Failed to create a socket: %s\n"),
+                                 g_strerror (errno));
+      return (-1);
+    } 
 
-      if ((sock = socket (res->ai_family, res->ai_socktype, 
-                          res->ai_protocol)) < 0)
+  if (gftp_fd_set_sockblocking (request, sock, 1) < 0)
+    {
+      close (sock);
+      return (-1);
+    }
+
+  gftp_set_socket_options (request, sock, 1);
+
+  request->logging_function (gftp_logging_misc, request,
+                             _("Trying %s:%d\n"), addrstr, get_port (addr));
+
+  if (connect (sock, addr->ai_addr, addr->ai_addrlen) == 0)
+    *connected = 1;
+  else if (errno == EINPROGRESS)
+    *connected = 0;
+  else
+    {
+      request->logging_function (gftp_logging_error, request,
+                                 _("Cannot connect to %s: %s\n"),
+                                 addrstr, g_strerror (errno));
+      close (sock);
+      return (-1);
+    }
+
+  return (sock);
+}
+
+
+/* Connects to the first address that answers. A new connection is started
+   every GFTP_CONNECT_ATTEMPT_DELAY ms, or as soon as one fails, while the
+   earlier ones are still pending, so an address that does not answer costs
+   250ms instead of the whole network_timeout. */
+static int
+_gftp_connect_addresses (gftp_request * request, struct addrinfo *hostp,
+                         struct addrinfo **connected_addr)
+{
+  char addrstr[INET6_ADDRSTRLEN], hoststr[INET6_ADDRSTRLEN];
+  struct addrinfo **addrs, **pending_addrs;
+  gint64 now, deadline, next_attempt;
+  size_t num_addrs, next, num_pending, i;
+  intptr_t network_timeout;
+  struct pollfd * pending;
+  int sock, connected, timeout, err;
+  const char *host;
+  socklen_t errlen;
+
+  gftp_lookup_request_option (request, "network_timeout", &network_timeout);
+
+  _gftp_address_string (hostp, hoststr, sizeof (hoststr));
+  host = hostp->ai_canonname != NULL ? hostp->ai_canonname : hoststr;
+
+  addrs = _gftp_order_addresses (hostp, &num_addrs);
+  pending = g_malloc0 (num_addrs * sizeof (*pending));
+  pending_addrs = g_malloc0 (num_addrs * sizeof (*pending_addrs));
+  num_pending = 0;
+  next = 0;
+  sock = -1;
+
+  now = g_get_monotonic_time ();
+  deadline = network_timeout > 0 ?
+                now + (gint64) network_timeout * G_USEC_PER_SEC : -1;
+  next_attempt = now;
+
+  while (sock == -1 && !request->cancel)
+    {
+      now = g_get_monotonic_time ();
+
+      if (next < num_addrs && now >= next_attempt)
+        {
+          i = next++;
+          next_attempt = now + GFTP_CONNECT_ATTEMPT_DELAY * 1000;
+
+          if ((sock = _gftp_start_connect (request, addrs[i], &connected)) < 0)
+            {
+              next_attempt = now;
+              sock = -1;
+            }
+          else if (connected)
+            *connected_addr = addrs[i];
+          else
+            {
+              pending[num_pending].fd = sock;
+              pending[num_pending].events = POLLOUT;
+              pending_addrs[num_pending] = addrs[i];
+              num_pending++;
+              sock = -1;
+            }
+          continue;
+        }
+
+      if (num_pending == 0)
+        {
+          if (next < num_addrs)
+            continue;
+          break;
+        }
+
+      if (deadline != -1 && now >= deadline)
         {
           request->logging_function (gftp_logging_error, request,
-                                     _("Failed to create a socket: %s\n"),
-                                     g_strerror (errno));
-          continue; 
-        } 
+                                     _("Connection to %s timed out\n"),
+                                     host);
+          break;
+        }
 
-      request->logging_function (gftp_logging_misc, request,
-                                 _("Trying %s:%d\n"), res[0].ai_canonname,
-                                 port);
+      if (next < num_addrs)
+        timeout = (next_attempt - now + 999) / 1000;
+      else
+        timeout = -1;
 
-      if (connect (sock, res->ai_addr, res->ai_addrlen) == -1)
+      if (deadline != -1 &&
+          (timeout == -1 || deadline - now < (gint64) timeout * 1000))
+        timeout = (deadline - now + 999) / 1000;
+
+      if (poll (pending, num_pending, timeout) < 0)
         {
+          if (errno == EINTR)
+            continue;
+
           request->logging_function (gftp_logging_error, request,
                                      _("Cannot connect to %s: %s\n"),
-                                     res[0].ai_canonname, g_strerror (errno));
-          close (sock);
-          continue;
+                                     host, g_strerror (errno));
+          break;
         }
 
-      current_hostp = res;
-      request->ai_family = res->ai_family;
-      break;
+      for (i = 0; i < num_pending && sock == -1; )
+        {
+          if (pending[i].revents == 0)
+            {
+              i++;
+              continue;
+            }
+
+          errlen = sizeof (err);
+          if (getsockopt (pending[i].fd, SOL_SOCKET, SO_ERROR, &err,
+                          &errlen) < 0)
+            err = errno;
+
+          if (err == 0)
+            {
+              sock = pending[i].fd;
+              *connected_addr = pending_addrs[i];
+            }
+          else
+            {
+              _gftp_address_string (pending_addrs[i], addrstr,
+                                    sizeof (addrstr));
+              request->logging_function (gftp_logging_error, request,
+                                         _("Cannot connect to %s: %s\n"),
+                                         addrstr, g_strerror (err));
+              close (pending[i].fd);
+              next_attempt = g_get_monotonic_time ();
+            }
+
+          num_pending--;
+          pending[i] = pending[num_pending];
+          pending_addrs[i] = pending_addrs[num_pending];
+        }
     }
 
-  if (res == NULL)
+  for (i = 0; i < num_pending; i++)
+    close (pending[i].fd);
+
+  g_free (pending_addrs);
+  g_free (pending);
+  g_free (addrs);
+
+  return (sock);
+}
+
+
+static int
+gftp_connect_server_with_getaddrinfo (gftp_request * request, char *service,
+                                      char *proxy_hostname,
+                                      unsigned int proxy_port)
+{
+  struct addrinfo *current_hostp;
+  char addrstr[INET6_ADDRSTRLEN];
+  gftp_dns_entry * entry;
+  unsigned int port;
+  int sock;
+
+  entry = lookup_host (request, service, proxy_hostname, proxy_port);
+  if (entry == NULL)
+    return (GFTP_ERETRYABLE);
+
+  current_hostp = NULL;
+  sock = _gftp_connect_addresses (request, entry->addrs, &current_hostp);
+  if (sock < 0)
     {
-      if (hostp != NULL)
-        freeaddrinfo (hostp);
-      
+      if (!request->cancel)
+        _gftp_dns_cache_forget (entry);
+
+      _gftp_dns_entry_unref (entry);
       return (GFTP_ERETRYABLE);
     }
 
+  port = get_port (current_hostp);
+  if (!request->use_proxy)
+    request->port = port;
+
+  request->ai_family = current_hostp->ai_family;
   request->remote_addr_len = current_hostp->ai_addrlen;
+  if (request->remote_addr != NULL)
+    g_free (request->remote_addr);
   request->remote_addr = g_malloc0 (request->remote_addr_len);
-  memcpy (request->remote_addr, &((struct sockaddr_in *) current_hostp->ai_addr)->sin_addr,
+  memcpy (request->remote_addr, current_hostp->ai_addr,
           request->remote_addr_len);
 
+  _gftp_address_string (current_hostp, addrstr, sizeof (addrstr));
   request->logging_function (gftp_logging_misc, request,
-                             _("Connected to %s:%d\n"), res[0].ai_canonname,
-                             port);
+                             _("Connected to %s:%d\n"), addrstr, port);
+  gftp_log_socket_options (request, sock, _("Control connection"));
 
+  _gftp_dns_entry_unref (entry);
   return (sock);
 }
 
@@ -195,9 +536,12 @@ gftp_need_proxy (gftp_request * request, char *service, char *proxy_hostname,
              }
         }
 
-      if (hostname->ipv4_network_address != 0)
+      if (hostname->ipv4_network_address != 0 &&
+          request->ai_family == AF_INET && request->remote_addr != NULL)
         {
-          memcpy (addy, request->remote_addr, sizeof (*addy));
+          memcpy (addy,
+                  &((struct sockaddr_in *) request->remote_addr)->sin_addr,
+                  sizeof (addy));
           netaddr =
             (((addy[0] & 0xff) << 24) | ((addy[1] & 0xff) << 16) |
              ((addy[2] & 0xff) << 8) | (addy[3] & 0xff)) & 
@@ -219,13 +563,17 @@ gftp_connect_server (gftp_request * request, char *service,
   void *connect_data;
   int sock, ret;
 
-  if ((ret = gftp_need_proxy (request, service, proxy_hostname,
-                              proxy_port, &connect_data)) < 0)
+  connect_data = NULL;
+  ret = gftp_need_proxy (request, service, proxy_hostname, proxy_port,
+                         &connect_data);
+  if (connect_data != NULL)
+    _gftp_dns_entry_unref (connect_data);
+
+  if (ret < 0)
     return (ret);
   request->use_proxy = ret;
 
-  /* FIXME - pass connect_data to these functions. This is to bypass a
-     second DNS lookup */
+  /* A host that gftp_need_proxy () looked up is found in the DNS cache */
   sock = gftp_connect_server_with_getaddrinfo (request, service, proxy_hostname,
                                                proxy_port);
   if (sock < 0)
@@ -240,12 +588,6 @@ gftp_connect_server (gftp_request * request, char *service,
       return (GFTP_ERETRYABLE);
     }
 
-  if (gftp_fd_set_sockblocking (request, sock, 1) < 0)
-    {
-      close (sock);
-      return (GFTP_ERETRYABLE);
-    }
-
   request->datafd = sock;
 
   if (request->post_connect != NULL)
@@ -18,16 +18,24 @@
 /*****************************************************************************/
 
 #include "gftp.h"
-
+#include <netinet/tcp.h>
+
+/* Returns the next line in the stream without copying it. *line points into
+   the read buffer and stays valid until the next call on rbuf. The line
+   ending (\n or \r\n) is replaced by a '\0', but since *linelen is returned
+   the line may also contain NUL bytes of its own. A line that is longer than
+   the buffer is returned in pieces. The return value is the number of bytes
+   consumed from the stream, 0 at the end of the stream or one of the GFTP_E*
+   errors. */
 ssize_t
-gftp_get_line (gftp_request * request, gftp_getline_buffer ** rbuf, 
-               char * str, size_t len, int fd)
+gftp_get_line_view (gftp_request * request, gftp_getline_buffer ** rbuf, 
+                    char ** line, size_t * linelen, int fd)
 {
   ssize_t (*read_function) (gftp_request * request, void *ptr, size_t size,
                             int fd);
-  char *pos, *nextpos;
-  size_t rlen, nslen;
-  int end_of_buffer;
+  gftp_getline_buffer * buf;
+  char *pos, *endpos;
+  size_t nslen;
   ssize_t ret;
 
   if (request == NULL || request->read_function == NULL)
@@ -38,102 +46,99 @@ gftp_get_line (gftp_request * request, gftp_getline_buffer ** rbuf,
   if (*rbuf == NULL)
     {
       *rbuf = g_malloc0 (sizeof (**rbuf));
-      (*rbuf)->max_bufsize = len;
-      (*rbuf)->buffer = g_malloc0 ((gulong) ((*rbuf)->max_bufsize + 1));
-
-      if ((ret = read_function (request, (*rbuf)->buffer, 
-                                (*rbuf)->max_bufsize, fd)) <= 0)
-        {
-          gftp_free_getline_buffer (rbuf);
-          return (ret);
-        }
-      (*rbuf)->buffer[ret] = '\0';
-      (*rbuf)->cur_bufsize = ret;
+      (*rbuf)->max_bufsize = GFTP_GETLINE_BUFSIZE;
+      /* The extra byte is for the '\0' after a line that fills the buffer */
+      (*rbuf)->buffer = g_malloc ((gulong) ((*rbuf)->max_bufsize + 1));
       (*rbuf)->curpos = (*rbuf)->buffer;
     }
 
-  ret = 0;
+  buf = *rbuf;
   while (1)
     {
-      pos = strchr ((*rbuf)->curpos, '\n');
-      end_of_buffer = (*rbuf)->curpos == (*rbuf)->buffer && 
-            ((*rbuf)->max_bufsize == (*rbuf)->cur_bufsize || (*rbuf)->eof);
-
-      if ((*rbuf)->cur_bufsize > 0 && (pos != NULL || end_of_buffer))
+      /* Only the bytes that arrived since the last look need searching */
+      if (buf->cur_bufsize > buf->scanned &&
+          (pos = memchr (buf->curpos + buf->scanned, '\n', 
+                         buf->cur_bufsize - buf->scanned)) != NULL)
         {
-          if (pos != NULL)
-            {
-              nslen = pos - (*rbuf)->curpos + 1;
-              nextpos = pos + 1;
-              if (pos > (*rbuf)->curpos && *(pos - 1) == '\r')
-                pos--;
-              *pos = '\0';
-            }
-          else
-            {
-              nslen = (*rbuf)->cur_bufsize;
-              nextpos = NULL;
-
-              /* This is not an overflow since we allocated one extra byte to
-                 buffer above */
-              ((*rbuf)->buffer)[nslen] = '\0';
-            }
+          nslen = pos - buf->curpos + 1;
+          endpos = pos;
+          if (endpos > buf->curpos && *(endpos - 1) == '\r')
+            endpos--;
+          *endpos = '\0';
+
+          *line = buf->curpos;
+          *linelen = endpos - buf->curpos;
+
+          buf->curpos = pos + 1;
+          buf->cur_bufsize -= nslen;
+          buf->scanned = 0;
+          return (nslen);
+        }
 
-          strncpy (str, (*rbuf)->curpos, len);
-          str[len - 1] = '\0';
-          (*rbuf)->cur_bufsize -= nslen;
+      buf->scanned = buf->cur_bufsize;
+      if (buf->cur_bufsize == buf->max_bufsize ||
+          (buf->eof && buf->cur_bufsize > 0))
+        {
+          /* Either the line does not fit in the buffer or the stream does
+             not end with a newline */
+          nslen = buf->cur_bufsize;
+          buf->curpos[nslen] = '\0';
+
+          *line = buf->curpos;
+          *linelen = nslen;
+
+          buf->curpos += nslen;
+          buf->cur_bufsize = 0;
+          buf->scanned = 0;
+          return (nslen);
+        }
+      else if (buf->eof)
+        {
+          gftp_free_getline_buffer (rbuf);
+          return (0);
+        }
 
-          if (nextpos != NULL)
-            (*rbuf)->curpos = nextpos;
-          else
-            (*rbuf)->cur_bufsize = 0;
+      /* Move the partial line to the front. This is at most one line per
+         read, instead of the rest of the buffer on every line. */
+      if (buf->curpos != buf->buffer)
+        {
+          if (buf->cur_bufsize > 0)
+            memmove (buf->buffer, buf->curpos, buf->cur_bufsize);
+          buf->curpos = buf->buffer;
+        }
 
-          ret = nslen;
-          break;
+      ret = read_function (request, buf->buffer + buf->cur_bufsize, 
+                           buf->max_bufsize - buf->cur_bufsize, fd);
+      if (ret < 0)
+        {
+          gftp_free_getline_buffer (rbuf);
+          return (ret);
         }
+      else if (ret == 0)
+        buf->eof = 1;
       else
-        {
-          if ((*rbuf)->cur_bufsize == 0 || *(*rbuf)->curpos == '\0')
-            {
-              rlen = (*rbuf)->max_bufsize;
-              pos = (*rbuf)->buffer;
-            }
-          else
-            {
-              memmove ((*rbuf)->buffer, (*rbuf)->curpos, (*rbuf)->cur_bufsize);
-              pos = (*rbuf)->buffer + (*rbuf)->cur_bufsize;
-              rlen = (*rbuf)->max_bufsize - (*rbuf)->cur_bufsize;
-            }
+        buf->cur_bufsize += ret;
+    }
+}
 
-          (*rbuf)->curpos = (*rbuf)->buffer;
 
-          if ((*rbuf)->eof)
-            ret = 0;
-          else
-            {
-              ret = read_function (request, pos, rlen, fd);
-              if (ret < 0)
-                {
-                  gftp_free_getline_buffer (rbuf);
-                  return (ret);
-                }
-            }
+ssize_t
+gftp_get_line (gftp_request * request, gftp_getline_buffer ** rbuf, 
+               char * str, size_t len, int fd)
+{
+  size_t linelen;
+  char *line;
+  ssize_t ret;
 
-          if (ret == 0)
-            {
-              if ((*rbuf)->cur_bufsize == 0)
-                {
-                  gftp_free_getline_buffer (rbuf);
-                  return (ret);
-                }
+  g_return_val_if_fail (len > 0, GFTP_EFATAL);
 
-              (*rbuf)->eof = 1;
-            }
+  if ((ret = gftp_get_line_view (request, rbuf, &line, &linelen, fd)) <= 0)
+    return (ret);
 
-          (*rbuf)->cur_bufsize += ret;
-          (*rbuf)->buffer[(*rbuf)->cur_bufsize] = '\0';
-        }
-    }
+  if (linelen >= len)
+    linelen = len - 1;
+  memcpy (str, line, linelen);
+  str[linelen] = '\0';
 
   return (ret);
 }
@@ -376,6 +381,135 @@ gftp_fd_set_sockblocking (gftp_request * request, int fd, int non_blocking)
 }
 
 
+static void
+_gftp_set_int_sockopt (gftp_request * request, int fd, int level, int name,
+                       int value, const char *descr)
+{
+  if (setsockopt (fd, level, name, &value, sizeof (value)) == -1)
+    request->logging_function (gftp_logging_error, request,
+                               _("Cannot set socket option %s: %s\n"),
+                               descr, g_strerror (errno));
+}
+
+
+/* Applies the socket options of the request (or its bookmark) to fd. The
+   buffer sizes and congestion control have to be set before the socket
+   connects or listens, because the TCP window scale is agreed on then.
+   Errors are logged but otherwise ignored, the kernel defaults are used
+   instead */
+void
+gftp_set_socket_options (gftp_request * request, int fd, int control)
+{
+  intptr_t send_buffer, receive_buffer, nodelay, notsent_lowat, keepalive;
+  char *congestion;
+
+  g_return_if_fail (fd >= 0);
+
+  gftp_lookup_request_option (request, "socket_send_buffer", &send_buffer);
+  gftp_lookup_request_option (request, "socket_receive_buffer",
+                              &receive_buffer);
+  gftp_lookup_request_option (request, "tcp_nodelay", &nodelay);
+  gftp_lookup_request_option (request, "tcp_notsent_lowat", &notsent_lowat);
+  gftp_lookup_request_option (request, "tcp_congestion", &congestion);
+  gftp_lookup_request_option (request, "tcp_keepalive", &keepalive);
+
+  if (send_buffer > 0)
+    _gftp_set_int_sockopt (request, fd, SOL_SOCKET, SO_SNDBUF,
+                           send_buffer * 1024, "SO_SNDBUF");
+
+  if (receive_buffer > 0)
+    _gftp_set_int_sockopt (request, fd, SOL_SOCKET, SO_RCVBUF,
+                           receive_buffer * 1024, "SO_RCVBUF");
+
+  if (control && nodelay)
+    _gftp_set_int_sockopt (request, fd, IPPROTO_TCP, TCP_NODELAY, 1,
+                           "TCP_NODELAY");
+
+#ifdef TCP_NOTSENT_LOWAT
+  if (notsent_lowat > 0)
+    _gftp_set_int_sockopt (request, fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT,
+                           notsent_lowat * 1024, "TCP_NOTSENT_LOWAT");
+#endif
+
+#ifdef TCP_CONGESTION
+  if (congestion != NULL && *congestion != '\0' &&
+      setsockopt (fd, IPPROTO_TCP, TCP_CONGESTION, congestion,
+                  strlen (congestion)) == -1)
+    request->logging_function (gftp_logging_error, request,
+                               _("Cannot set socket option %s: %s\n"),
+                               "TCP_CONGESTION", g_strerror (errno));
+#endif
+
+  if (keepalive > 0)
+    {
+      _gftp_set_int_sockopt (request, fd, SOL_SOCKET, SO_KEEPALIVE, 1,
+                             "SO_KEEPALIVE");
+#ifdef TCP_KEEPIDLE
+      _gftp_set_int_sockopt (request, fd, IPPROTO_TCP, TCP_KEEPIDLE,
+                             keepalive, "TCP_KEEPIDLE");
+#endif
+#ifdef TCP_KEEPINTVL
+      _gftp_set_int_sockopt (request, fd, IPPROTO_TCP, TCP_KEEPINTVL,
+                             keepalive, "TCP_KEEPINTVL");
+#endif
+    }
+}
+
+
+static int
+_gftp_get_int_sockopt (int fd, int level, int name)
+{
+  socklen_t len;
+  int value;
+
+  len = sizeof (value);
+  if (getsockopt (fd, level, name, &value, &len) == -1)
+    return (-1);
+
+  return (value);
+}
+
+
+/* Logs the values the kernel actually uses for fd, which can differ from
+   the ones asked for (Linux doubles the buffer sizes and caps them at
+   net.core.wmem_max and rmem_max) */
+void
+gftp_log_socket_options (gftp_request * request, int fd, const char *descr)
+{
+  char congestion[32];
+  int notsent_lowat;
+#ifdef TCP_CONGESTION
+  socklen_t len;
+#endif
+
+  g_return_if_fail (fd >= 0);
+
+  strcpy (congestion, "-");
+#ifdef TCP_CONGESTION
+  len = sizeof (congestion) - 1;
+  if (getsockopt (fd, IPPROTO_TCP, TCP_CONGESTION, congestion, &len) == 0)
+    congestion[len] = '\0';
+#endif
+
+#ifdef TCP_NOTSENT_LOWAT
+  notsent_lowat = _gftp_get_int_sockopt (fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT);
+#else
+  notsent_lowat = -1;
+#endif
+
+  request->logging_function (gftp_logging_misc, request,
+                             _("%s: send buffer %d, receive buffer %d, TCP_NODELAY %d, TCP_NOTSENT_LOWAT %d, congestion control %s, keepalive %d\n"),
+                             descr,
+                             _gftp_get_int_sockopt (fd, SOL_SOCKET, SO_SNDBUF),
+                             _gftp_get_int_sockopt (fd, SOL_SOCKET, SO_RCVBUF),
+                             _gftp_get_int_sockopt (fd, IPPROTO_TCP,
+                                                    TCP_NODELAY),
+                             notsent_lowat, congestion,
+                             _gftp_get_int_sockopt (fd, SOL_SOCKET,
+                                                    SO_KEEPALIVE));
+}
+
+
 struct servent *
 r_getservbyname (const char *name, const char *proto,
                  struct servent *result_buf, int *h_errnop)
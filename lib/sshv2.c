@@ -19,8 +19,14 @@
 
 #include "gftp.h"
 
+#ifdef USE_LIBSSH2
+#include <libssh2.h>
+#endif
+
 #define SSH_MAX_HANDLE_SIZE		256
 #define SSH_MAX_STRING_SIZE		34000
+#define SSH_MAX_DATA_SIZE		32768	/* Per READ and WRITE request */
+#define SSH_MAX_PIPELINE_DEPTH		64
 
 static gftp_config_vars config_vars[] =
 {
@@ -39,6 +45,38 @@ static gftp_config_vars config_vars[] =
    GFTP_CVARS_FLAGS_SHOW_BOOKMARK,
    N_("Require a username/password for SSH connections"), GFTP_PORT_ALL, NULL},
 
+  {"ssh_use_control_master", N_("Share SSH connections"), 
+   gftp_option_type_checkbox, GINT_TO_POINTER(0), NULL, 
+   GFTP_CVARS_FLAGS_SHOW_BOOKMARK,
+   N_("Pass ControlMaster/ControlPath to SSH so that all SFTP sessions to the same host share a single authenticated connection"), GFTP_PORT_ALL, NULL},
+  {"ssh_control_path", N_("SSH Control Path:"), 
+   gftp_option_type_text, "~/.gftp/ssh-%r@%h:%p", NULL, 0,  
+   N_("The socket path passed to SSH as the ControlPath when sharing connections"), GFTP_PORT_ALL, NULL},
+  {"ssh_control_persist", N_("SSH Control Persist:"), 
+   gftp_option_type_int, GINT_TO_POINTER(60), NULL, 0,  
+   N_("The number of seconds the shared SSH connection stays open after the last session exits"), GFTP_PORT_ALL, NULL},
+  {"ssh_batch_mode", N_("SSH Batch Mode (key/agent auth)"), 
+   gftp_option_type_checkbox, GINT_TO_POINTER(0), NULL, 
+   GFTP_CVARS_FLAGS_SHOW_BOOKMARK,
+   N_("Run SSH with BatchMode=yes and without a pty. Only use this when public key or agent authentication is set up, since no password prompts will be answered"), GFTP_PORT_ALL, NULL},
+  {"ssh_pipeline_depth", N_("SFTP Requests In Flight:"), 
+   gftp_option_type_int, GINT_TO_POINTER(8), NULL, 
+   GFTP_CVARS_FLAGS_SHOW_BOOKMARK,
+   N_("The number of read or write requests that are sent to the server before waiting for a reply during a transfer. Higher values help on high latency links"), GFTP_PORT_ALL, NULL},
+
+#ifdef USE_LIBSSH2
+  {"ssh_use_libssh2", N_("Use built in SSH transport"), 
+   gftp_option_type_checkbox, GINT_TO_POINTER(0), NULL, 
+   GFTP_CVARS_FLAGS_SHOW_BOOKMARK,
+   N_("Talk to the SSH server directly with libssh2 instead of running the SSH program"), GFTP_PORT_ALL, NULL},
+  {"ssh_window_size", N_("SSH Window Size (KB):"), 
+   gftp_option_type_int, GINT_TO_POINTER(4096), NULL, 0,  
+   N_("The channel window size used by the built in SSH transport. Larger windows help on high latency links"), GFTP_PORT_ALL, NULL},
+  {"ssh_known_hosts", N_("SSH Known Hosts File:"), 
+   gftp_option_type_text, "~/.ssh/known_hosts", NULL, 0,  
+   N_("The known_hosts file the built in SSH transport checks host keys against. Keys you accept are added to it"), GFTP_PORT_ALL, NULL},
+#endif
+
   {NULL, NULL, 0, NULL, NULL, 0, NULL, 0, NULL}
 };
 
@@ -52,6 +90,15 @@ typedef struct sshv2_message_tag
        *end;
 } sshv2_message;
 
+typedef struct sshv2_pending_read_tag
+{
+  guint32 id,
+          len;
+  guint64 offset;
+  sshv2_message message;	/* The reply, once it has arrived */
+  guint32 used;			/* Bytes of the reply already returned */
+} sshv2_pending_read;
+
 typedef struct sshv2_params_tag
 {
   char handle[SSH_MAX_HANDLE_SIZE + 4], /* We'll encode the ID in here too */
@@ -66,8 +113,29 @@ typedef struct sshv2_params_tag
                dont_log_status : 1;              /* For uploading files */
 
   guint64 offset;
+
+  /* The READs that were sent and not returned yet, oldest first. The
+     WRITEs only need to be counted */
+  sshv2_pending_read pending_reads[SSH_MAX_PIPELINE_DEPTH];
+  guint pending_head,
+        num_pending_reads,
+        num_pending_writes;
+  guint64 read_offset;		/* Where the next READ starts */
+  unsigned int read_eof : 1;
+  guint pipeline_depth;		/* Set by the autotuner, 0 for the option */
+
+  int stderr_fd;		/* ssh's stderr when it runs without a pty */
+
+#ifdef USE_LIBSSH2
+  LIBSSH2_SESSION * ssh_session;
+  LIBSSH2_CHANNEL * ssh_channel;
+#endif
 } sshv2_params;
 
+#ifdef USE_LIBSSH2
+static int sshv2_libssh2_initialized = 0;
+#endif
+
 
 #define SSH_MY_VERSION              3
 
@@ -327,6 +395,7 @@ sshv2_add_exec_args (char **logstr, size_t *logstr_len, char ***args,
 static char **
 sshv2_gen_exec_args (gftp_request * request)
 {
+  intptr_t use_control_master, control_persist, batch_mode;
   size_t logstr_len, args_len, args_cur;
   char **args, *tempstr, *logstr;
 
@@ -350,6 +419,28 @@ sshv2_gen_exec_args (gftp_request * request)
   sshv2_add_exec_args (&logstr, &logstr_len, &args, &args_len, &args_cur,
                        " -e none");
 
+  gftp_lookup_request_option (request, "ssh_use_control_master",
+                              &use_control_master);
+  gftp_lookup_request_option (request, "ssh_control_path", &tempstr);
+  if (use_control_master && tempstr != NULL && *tempstr != '\0')
+    {
+      gftp_lookup_request_option (request, "ssh_control_persist",
+                                  &control_persist);
+
+      sshv2_add_exec_args (&logstr, &logstr_len, &args, &args_len, &args_cur,
+                           " -o \"ControlPath=%s\" -o ControlMaster=auto",
+                           tempstr);
+      if (control_persist > 0)
+        sshv2_add_exec_args (&logstr, &logstr_len, &args, &args_len,
+                             &args_cur, " -o ControlPersist=%d",
+                             (int) control_persist);
+    }
+
+  gftp_lookup_request_option (request, "ssh_batch_mode", &batch_mode);
+  if (batch_mode)
+    sshv2_add_exec_args (&logstr, &logstr_len, &args, &args_len, &args_cur,
+                         " -o BatchMode=yes");
+
   if (request->username && *request->username != '\0')
     sshv2_add_exec_args (&logstr, &logstr_len, &args, &args_len, &args_cur,
                          " -l %s", request->username);
@@ -575,6 +666,9 @@ sshv2_log_command (gftp_request * request, gftp_logging_level level,
   char *descr, *pos, oldchar;
   sshv2_params * params;
 
+  if (!gftp_logging_wanted (level))
+    return;
+
   params = request->protocol_data;
   memcpy (&id, message, 4);
   id = ntohl (id);
@@ -761,14 +855,43 @@ sshv2_send_command (gftp_request * request, char type, char *command,
 #endif
 
   sshv2_log_command (request, gftp_logging_send, type, buf + 5, len);
+  GFTP_PROBE3 (sftp__send, request->hostname, type, len);
 
-  if ((ret = gftp_fd_write (request, buf, len + 5, request->datafd)) < 0)
+  if ((ret = request->write_function (request, buf, len + 5,
+                                     request->datafd)) < 0)
     return (ret);
 
   return (0);
 }
 
 
+/* Logs what ssh has written on stderr so far. Only used when it runs
+   without a pty, the pty output is read by the login sequence */
+static void
+sshv2_log_ssh_stderr (gftp_request * request)
+{
+  sshv2_params * params;
+  char buf[1024];
+  ssize_t rd;
+
+  params = request->protocol_data;
+  if (params->stderr_fd < 0)
+    return;
+
+  while ((rd = read (params->stderr_fd, buf, sizeof (buf) - 1)) > 0)
+    {
+      buf[rd] = '\0';
+      request->logging_function (gftp_logging_recv, request, "%s", buf);
+    }
+
+  if (rd == 0)
+    {
+      close (params->stderr_fd);
+      params->stderr_fd = -1;
+    }
+}
+
+
 static int
 sshv2_read_response (gftp_request * request, sshv2_message * message,
                      int fd)
@@ -787,8 +910,11 @@ sshv2_read_response (gftp_request * request, sshv2_message * message,
   rem = 5;
   while (rem > 0)
     {
-      if ((numread = gftp_fd_read (request, pos, rem, fd)) < 0)
-        return (numread);
+      if ((numread = request->read_function (request, pos, rem, fd)) < 0)
+        {
+          sshv2_log_ssh_stderr (request);
+          return (numread);
+        }
       rem -= numread;
       pos += numread;
     }
@@ -811,6 +937,15 @@ sshv2_read_response (gftp_request * request, sshv2_message * message,
 
           request->logging_function (gftp_logging_error, request, "%s", buf);
 
+          /* Anything else the ssh program printed is still waiting on the
+             socket. There is nothing readable left over with libssh2 */
+          if (request->read_function != gftp_fd_read)
+            {
+              memset (message, 0, sizeof (*message));
+              gftp_disconnect (request);
+              return (GFTP_EFATAL);
+            }
+
           if (gftp_fd_set_sockblocking (request, fd, 0) == -1)
             return (GFTP_EFATAL);
 
@@ -839,8 +974,11 @@ sshv2_read_response (gftp_request * request, sshv2_message * message,
   rem = message->length - 1;
   while (rem > 0)
     {
-      if ((numread = gftp_fd_read (request, pos, rem, fd)) < 0)
-        return (numread);
+      if ((numread = request->read_function (request, pos, rem, fd)) < 0)
+        {
+          sshv2_log_ssh_stderr (request);
+          return (numread);
+        }
       rem -= numread;
       pos += numread;
     }
@@ -856,6 +994,8 @@ sshv2_read_response (gftp_request * request, sshv2_message * message,
 
   sshv2_log_command (request, gftp_logging_recv, message->command, 
                      message->buffer, message->length);
+  GFTP_PROBE3 (sftp__recv, request->hostname, message->command,
+               message->length);
   
   return (message->command);
 }
@@ -1122,44 +1262,31 @@ sshv2_free_args (char **args)
 
 
 static int
-sshv2_connect (gftp_request * request)
+sshv2_spawn_ssh (gftp_request * request)
 {
-  struct servent serv_struct;
   sshv2_params * params;
-  sshv2_message message;
   int ret, fdm, ptymfd;
+  intptr_t batch_mode;
   guint32 version;
   char **args;
   pid_t child;
 
-  g_return_val_if_fail (request != NULL, GFTP_EFATAL);
-  g_return_val_if_fail (request->protonum == GFTP_SSHV2_NUM, GFTP_EFATAL);
-  g_return_val_if_fail (request->hostname != NULL, GFTP_EFATAL);
-  
-  if (request->datafd > 0)
-    return (0);
-
   params = request->protocol_data;
+  request->read_function = gftp_fd_read;
+  request->write_function = gftp_fd_write;
 
-  request->logging_function (gftp_logging_misc, request,
-			     _("Opening SSH connection to %s\n"),
-                             request->hostname);
+  args = sshv2_gen_exec_args (request);
 
-  if (request->port == 0)
+  /* With BatchMode ssh never prompts, so there is no need for a pty or for
+     scanning its output for password prompts */
+  gftp_lookup_request_option (request, "ssh_batch_mode", &batch_mode);
+  if (batch_mode)
     {
-      if (!r_getservbyname ("ssh", "tcp", &serv_struct, NULL))
-        {
-         request->logging_function (gftp_logging_error, request,
-                                    _("Cannot look up service name %s/tcp. Please check your services file\n"),
-                                    "ssh");
-        }
-      else
-        request->port = ntohs (serv_struct.s_port);
+      ptymfd = -1;
+      child = gftp_exec_without_pty (request, &fdm, &params->stderr_fd, args);
     }
-
-  args = sshv2_gen_exec_args (request);
-
-  child = gftp_exec (request, &fdm, &ptymfd, args);
+  else
+    child = gftp_exec (request, &fdm, &ptymfd, args);
 
   if (child == 0)
     exit (0);
@@ -1176,183 +1303,974 @@ sshv2_connect (gftp_request * request)
                                  &version, 4)) < 0)
     return (ret);
 
-  ret = sshv2_start_login_sequence (request, fdm, ptymfd);
-  if (ret < 0)
-    return (ret);
-
-  memset (&message, 0, sizeof (message));
-  ret = sshv2_read_response (request, &message, -1);
-  if (ret < 0)
+  if (batch_mode)
     {
-      sshv2_message_free (&message);
-      return (ret);
+      if (gftp_fd_set_sockblocking (request, fdm, 1) == -1)
+        return (GFTP_ERETRYABLE);
     }
-  else if (ret != SSH_FXP_VERSION)
-    return (sshv2_wrong_response (request, &message));
+  else if ((ret = sshv2_start_login_sequence (request, fdm, ptymfd)) < 0)
+    return (ret);
 
-  sshv2_message_free (&message);
+  return (0);
+}
 
-  params->initialized = 1;
-  request->logging_function (gftp_logging_misc, request,
-                             _("Successfully logged into SSH server %s\n"),
-                             request->hostname);
 
-  if (sshv2_getcwd (request) < 0)
-    {
-      if (request->directory)
-        g_free (request->directory);
+#ifdef USE_LIBSSH2
 
-      request->directory = g_strdup (".");
-      if ((ret = sshv2_getcwd (request)) < 0)
-        {
-          gftp_disconnect (request);
-          return (ret);
-        }
-    }
+static void
+sshv2_libssh2_log_error (gftp_request * request, const char *msg)
+{
+  sshv2_params * params;
+  char *errmsg;
 
-  return (0);
+  params = request->protocol_data;
+
+  errmsg = NULL;
+  if (params->ssh_session != NULL)
+    libssh2_session_last_error (params->ssh_session, &errmsg, NULL, 0);
+
+  request->logging_function (gftp_logging_error, request, "%s: %s\n", msg,
+                             errmsg != NULL ? errmsg : _("Unknown error"));
 }
 
 
 static void
-sshv2_disconnect (gftp_request * request)
+sshv2_libssh2_close (gftp_request * request)
 {
   sshv2_params * params;
 
-  g_return_if_fail (request != NULL);
-  g_return_if_fail (request->protonum == GFTP_SSHV2_NUM);
-
   params = request->protocol_data;
 
-  if (request->datafd > 0)
+  if (params->ssh_channel != NULL)
     {
-      request->logging_function (gftp_logging_misc, request,
-			         _("Disconnecting from site %s\n"),
-                                 request->hostname);
-
-      if (close (request->datafd) < 0)
-        request->logging_function (gftp_logging_error, request,
-                                   _("Error closing file descriptor: %s\n"),
-                                   g_strerror (errno));
-
-      request->datafd = -1;
+      libssh2_channel_close (params->ssh_channel);
+      libssh2_channel_free (params->ssh_channel);
+      params->ssh_channel = NULL;
     }
 
-  if (params->message.buffer != NULL)
+  if (params->ssh_session != NULL)
     {
-      sshv2_message_free (&params->message);
-      params->message.buffer = NULL;
+      libssh2_session_disconnect (params->ssh_session, "Normal Shutdown");
+      libssh2_session_free (params->ssh_session);
+      params->ssh_session = NULL;
     }
 }
 
 
-static int
-sshv2_end_transfer (gftp_request * request)
+static ssize_t
+sshv2_libssh2_read (gftp_request * request, void *ptr, size_t size, int fd)
 {
   sshv2_params * params;
-  sshv2_message message;
-  guint32 len;
-  int ret;
-
-  g_return_val_if_fail (request != NULL, GFTP_EFATAL);
-  g_return_val_if_fail (request->protonum == GFTP_SSHV2_NUM, GFTP_EFATAL);
+  ssize_t ret;
 
   params = request->protocol_data;
-  if (params->message.buffer != NULL)
+  if (params->ssh_channel == NULL)
+    return (GFTP_ERETRYABLE);
+
+  ret = libssh2_channel_read (params->ssh_channel, ptr, size);
+  if (ret == LIBSSH2_ERROR_TIMEOUT)
     {
-      sshv2_message_free (&params->message);
-      params->message.buffer = NULL;
-      params->count = 0;
+      request->logging_function (gftp_logging_error, request,
+                                 _("Connection to %s timed out\n"),
+                                 request->hostname);
+      gftp_disconnect (request);
+      return (GFTP_ERETRYABLE);
     }
-
-  if (params->handle_len > 0)
+  else if (ret < 0)
     {
-      len = htonl (params->id++);
-      memcpy (params->handle, &len, 4);
+      sshv2_libssh2_log_error (request, _("Error: Could not read from socket"));
+      gftp_disconnect (request);
+      return (GFTP_ERETRYABLE);
+    }
+  else if (ret == 0 && libssh2_channel_eof (params->ssh_channel))
+    {
+      request->logging_function (gftp_logging_error, request,
+                                 _("Error: The SSH server closed the connection\n"));
+      gftp_disconnect (request);
+      return (GFTP_ERETRYABLE);
+    }
 
-      if ((ret = sshv2_send_command (request, SSH_FXP_CLOSE, params->handle, 
-                                     params->handle_len)) < 0)
-        return (ret);
+  return (ret);
+}
 
-      ret = sshv2_read_status_response (request, &message, -1, 0,
-                                         SSH_FXP_STATUS);
-      if (ret < 0)
-        return (ret);
 
-      sshv2_message_free (&message);
-      params->handle_len = 0;
-    }  
+static ssize_t
+sshv2_libssh2_write (gftp_request * request, const char *ptr, size_t size,
+                     int fd)
+{
+  sshv2_params * params;
+  ssize_t ret;
+  size_t rem;
 
-  if (params->transfer_buffer != NULL)
+  params = request->protocol_data;
+  if (params->ssh_channel == NULL)
+    return (GFTP_ERETRYABLE);
+
+  rem = size;
+  while (rem > 0)
     {
-      g_free (params->transfer_buffer);
-      params->transfer_buffer = NULL;
+      ret = libssh2_channel_write (params->ssh_channel, ptr, rem);
+      if (ret == LIBSSH2_ERROR_TIMEOUT)
+        {
+          request->logging_function (gftp_logging_error, request,
+                                     _("Connection to %s timed out\n"),
+                                     request->hostname);
+          gftp_disconnect (request);
+          return (GFTP_ERETRYABLE);
+        }
+      else if (ret < 0)
+        {
+          sshv2_libssh2_log_error (request,
+                                   _("Error: Could not write to socket"));
+          gftp_disconnect (request);
+          return (GFTP_ERETRYABLE);
+        }
+
+      ptr += ret;
+      rem -= ret;
     }
 
-  return (0);
+  return (size);
 }
 
 
 static int
-sshv2_list_files (gftp_request * request)
+sshv2_libssh2_key_type (int type)
 {
-  sshv2_params * params;
-  sshv2_message message;
-  char *tempstr;
-  size_t msglen;
-  int ret;
-
-  g_return_val_if_fail (request != NULL, GFTP_EFATAL);
-  g_return_val_if_fail (request->protonum == GFTP_SSHV2_NUM, GFTP_EFATAL);
-  g_return_val_if_fail (request->datafd > 0, GFTP_EFATAL);
-
-  params = request->protocol_data;
+  switch (type)
+    {
+      case LIBSSH2_HOSTKEY_TYPE_RSA:
+        return (LIBSSH2_KNOWNHOST_KEY_SSHRSA);
+      case LIBSSH2_HOSTKEY_TYPE_DSS:
+        return (LIBSSH2_KNOWNHOST_KEY_SSHDSS);
+#ifdef LIBSSH2_HOSTKEY_TYPE_ECDSA_256
+      case LIBSSH2_HOSTKEY_TYPE_ECDSA_256:
+        return (LIBSSH2_KNOWNHOST_KEY_ECDSA_256);
+      case LIBSSH2_HOSTKEY_TYPE_ECDSA_384:
+        return (LIBSSH2_KNOWNHOST_KEY_ECDSA_384);
+      case LIBSSH2_HOSTKEY_TYPE_ECDSA_521:
+        return (LIBSSH2_KNOWNHOST_KEY_ECDSA_521);
+#endif
+#ifdef LIBSSH2_HOSTKEY_TYPE_ED25519
+      case LIBSSH2_HOSTKEY_TYPE_ED25519:
+        return (LIBSSH2_KNOWNHOST_KEY_ED25519);
+#endif
+      default:
+        return (0);
+    }
+}
 
-  request->logging_function (gftp_logging_misc, request,
-			     _("Retrieving directory listing...\n"));
 
-  msglen = 0;
-  tempstr = sshv2_initialize_buffer_with_i18n_string (request,
-                                                      request->directory,
-                                                      &msglen);
-  ret = sshv2_send_command (request, SSH_FXP_OPENDIR, tempstr, msglen);
-  g_free (tempstr);
-  if (ret < 0)
-    return (ret);
+static char *
+sshv2_libssh2_fingerprint (gftp_request * request)
+{
+  sshv2_params * params;
+  const char *hash;
+  char *ret, *pos;
+  int i;
 
-  ret = sshv2_read_status_response (request, &message, -1, SSH_FXP_STATUS,
-                                    SSH_FXP_HANDLE);
-  if (ret < 0)
-    return (ret);
+  params = request->protocol_data;
 
-  if (message.length - 4 > SSH_MAX_HANDLE_SIZE)
+#ifdef LIBSSH2_HOSTKEY_HASH_SHA256
+  if ((hash = libssh2_hostkey_hash (params->ssh_session,
+                                    LIBSSH2_HOSTKEY_HASH_SHA256)) != NULL)
     {
-      request->logging_function (gftp_logging_error, request,
-                             _("Error: Message size %d too big from server\n"),
-                             message.length - 4);
-      sshv2_message_free (&message);
-      gftp_disconnect (request);
-      return (GFTP_EFATAL);
+      /* Same form as the ssh program prints, without the base64 padding */
+      pos = g_base64_encode ((const guchar *) hash, 32);
+      if ((ret = strchr (pos, '=')) != NULL)
+        *ret = '\0';
+      ret = g_strconcat ("SHA256:", pos, NULL);
+      g_free (pos);
+      return (ret);
     }
+#endif
 
-  memset (params->handle, 0, 4);
-  memcpy (params->handle + 4, message.buffer + 4, message.length - 5);
-  params->handle_len = message.length - 1;
-  sshv2_message_free (&message);
-  params->count = 0;
-  return (0);
+  if ((hash = libssh2_hostkey_hash (params->ssh_session,
+                                    LIBSSH2_HOSTKEY_HASH_SHA1)) == NULL)
+    return (g_strdup ("?"));
+
+  ret = pos = g_malloc (20 * 3);
+  for (i=0; i<20; i++)
+    pos += g_snprintf (pos, 4, i == 0 ? "%02x" : ":%02x", 
+                       (unsigned char) hash[i]);
+  return (ret);
 }
 
 
 static int
-sshv2_decode_file_attributes (gftp_request * request, sshv2_message * message,
-                              gftp_file * fle)
+sshv2_libssh2_add_host_key (gftp_request * request, LIBSSH2_KNOWNHOSTS * hosts,
+                            const char *filename, const char *key, size_t len,
+                            int type)
 {
-  guint32 attrs, num, count, i;
+  char *hostname;
   int ret;
 
-  if ((ret = sshv2_buffer_get_int32 (request, message, 0, 0, &attrs)) < 0)
-    return (ret);
+  if (request->port != 0 && request->port != 22)
+    hostname = g_strdup_printf ("[%s]:%d", request->hostname, request->port);
+  else
+    hostname = g_strdup (request->hostname);
+
+  ret = libssh2_knownhost_addc (hosts, hostname, NULL, key, len, NULL, 0,
+                                LIBSSH2_KNOWNHOST_TYPE_PLAIN |
+                                LIBSSH2_KNOWNHOST_KEYENC_RAW |
+                                sshv2_libssh2_key_type (type), NULL);
+  g_free (hostname);
+
+  if (ret == 0)
+    ret = libssh2_knownhost_writefile (hosts, filename,
+                                       LIBSSH2_KNOWNHOST_FILE_OPENSSH);
+
+  if (ret != 0)
+    request->logging_function (gftp_logging_error, request,
+                               _("Warning: Cannot add the host key for %s to %s\n"),
+                               request->hostname, filename);
+  else
+    request->logging_function (gftp_logging_misc, request,
+                               _("Added the host key for %s to %s\n"),
+                               request->hostname, filename);
+  return (ret);
+}
+
+
+static int
+sshv2_libssh2_check_host_key (gftp_request * request)
+{
+  LIBSSH2_KNOWNHOSTS * hosts;
+  char *filename, *tempstr, *fingerprint;
+  sshv2_params * params;
+  const char *key;
+  int type, ret;
+  intptr_t port;
+  size_t len;
+
+  params = request->protocol_data;
+
+  if ((key = libssh2_session_hostkey (params->ssh_session, &len, &type)) == NULL)
+    {
+      sshv2_libssh2_log_error (request,
+                               _("Error: Cannot get the SSH host key"));
+      return (GFTP_ERETRYABLE);
+    }
+
+  if ((hosts = libssh2_knownhost_init (params->ssh_session)) == NULL)
+    return (GFTP_ERETRYABLE);
+
+  gftp_lookup_request_option (request, "ssh_known_hosts", &tempstr);
+  if (tempstr == NULL || *tempstr == '\0')
+    tempstr = "~/.ssh/known_hosts";
+  filename = gftp_expand_path (request, tempstr);
+  libssh2_knownhost_readfile (hosts, filename, LIBSSH2_KNOWNHOST_FILE_OPENSSH);
+
+  port = request->port != 0 ? request->port : 22;
+  ret = libssh2_knownhost_checkp (hosts, request->hostname, port,
+                                  key, len, LIBSSH2_KNOWNHOST_TYPE_PLAIN |
+                                            LIBSSH2_KNOWNHOST_KEYENC_RAW,
+                                  NULL);
+
+  switch (ret)
+    {
+      case LIBSSH2_KNOWNHOST_CHECK_MATCH:
+        ret = 0;
+        break;
+      case LIBSSH2_KNOWNHOST_CHECK_MISMATCH:
+        request->logging_function (gftp_logging_error, request,
+                                   _("Error: The host key for %s does not match the one in your known_hosts file\n"),
+                                   request->hostname);
+        ret = GFTP_EFATAL;
+        break;
+      case LIBSSH2_KNOWNHOST_CHECK_NOTFOUND:
+        fingerprint = sshv2_libssh2_fingerprint (request);
+        tempstr = g_strdup_printf (_("The authenticity of host '%s' can't be established.\nThe key fingerprint is %s.\nAre you sure you want to continue connecting (yes/no)?"),
+                                   request->hostname, fingerprint);
+        g_free (fingerprint);
+
+        if (gftpui_protocol_ask_yes_no (request, request->hostname, tempstr))
+          {
+            sshv2_libssh2_add_host_key (request, hosts, filename, key, len,
+                                        type);
+            ret = 0;
+          }
+        else
+          {
+            request->logging_function (gftp_logging_error, request,
+                                       _("Error: The host key for %s was not accepted\n"),
+                                       request->hostname);
+            ret = GFTP_EFATAL;
+          }
+        g_free (tempstr);
+        break;
+      default:
+        sshv2_libssh2_log_error (request,
+                                 _("Error: Cannot check the SSH host key"));
+        ret = GFTP_EFATAL;
+        break;
+    }
+
+  libssh2_knownhost_free (hosts);
+  g_free (filename);
+  return (ret);
+}
+
+
+static int
+sshv2_libssh2_auth_agent (gftp_request * request, const char *username)
+{
+  struct libssh2_agent_publickey * identity, * prev;
+  sshv2_params * params;
+  LIBSSH2_AGENT * agent;
+  int ret;
+
+  params = request->protocol_data;
+
+  if ((agent = libssh2_agent_init (params->ssh_session)) == NULL)
+    return (-1);
+
+  ret = -1;
+  if (libssh2_agent_connect (agent) == 0 &&
+      libssh2_agent_list_identities (agent) == 0)
+    {
+      prev = NULL;
+      while (libssh2_agent_get_identity (agent, &identity, prev) == 0)
+        {
+          if (libssh2_agent_userauth (agent, username, identity) == 0)
+            {
+              ret = 0;
+              break;
+            }
+          prev = identity;
+        }
+      libssh2_agent_disconnect (agent);
+    }
+
+  libssh2_agent_free (agent);
+  return (ret);
+}
+
+
+static int
+sshv2_libssh2_auth (gftp_request * request)
+{
+  static char *keyfiles[] = { "~/.ssh/id_ed25519",
+                              "~/.ssh/id_ecdsa",
+                              "~/.ssh/id_rsa",
+                              NULL };
+  sshv2_params * params;
+  char *username, *filename;
+  int i;
+
+  params = request->protocol_data;
+
+  if (request->username != NULL && *request->username != '\0')
+    username = request->username;
+  else
+    username = (char *) g_get_user_name ();
+
+  if (sshv2_libssh2_auth_agent (request, username) == 0)
+    return (0);
+
+  for (i=0; keyfiles[i] != NULL; i++)
+    {
+      filename = gftp_expand_path (request, keyfiles[i]);
+      if (access (filename, R_OK) == 0 &&
+          libssh2_userauth_publickey_fromfile (params->ssh_session, username,
+                                               NULL, filename, 
+                                               request->password) == 0)
+        {
+          g_free (filename);
+          return (0);
+        }
+      g_free (filename);
+    }
+
+  if (request->password != NULL &&
+      libssh2_userauth_password (params->ssh_session, username,
+                                 request->password) == 0)
+    return (0);
+
+  sshv2_libssh2_log_error (request, _("Error: SSH authentication failed"));
+  return (GFTP_EFATAL);
+}
+
+
+static int
+sshv2_libssh2_connect (gftp_request * request)
+{
+  intptr_t network_timeout, window_size;
+  sshv2_params * params;
+  guint32 version;
+  int ret;
+
+  params = request->protocol_data;
+
+  if (!sshv2_libssh2_initialized)
+    {
+      request->logging_function (gftp_logging_error, request,
+                                 _("Error: Cannot initialize libssh2\n"));
+      return (GFTP_EFATAL);
+    }
+
+  if ((ret = gftp_connect_server (request, "ssh", NULL, 0)) < 0)
+    return (ret);
+
+  gftp_lookup_request_option (request, "network_timeout", &network_timeout);
+  gftp_lookup_request_option (request, "ssh_window_size", &window_size);
+  if (window_size <= 0)
+    window_size = 256;
+
+  params->ssh_session = libssh2_session_init ();
+  if (params->ssh_session == NULL)
+    {
+      gftp_disconnect (request);
+      return (GFTP_ERETRYABLE);
+    }
+
+  libssh2_session_set_blocking (params->ssh_session, 1);
+  libssh2_session_set_timeout (params->ssh_session, network_timeout * 1000);
+
+  if (libssh2_session_handshake (params->ssh_session, request->datafd) != 0)
+    {
+      sshv2_libssh2_log_error (request, _("Error: SSH handshake failed"));
+      gftp_disconnect (request);
+      return (GFTP_ERETRYABLE);
+    }
+
+  if ((ret = sshv2_libssh2_check_host_key (request)) < 0 ||
+      (ret = sshv2_libssh2_auth (request)) < 0)
+    {
+      gftp_disconnect (request);
+      return (ret);
+    }
+
+  params->ssh_channel = libssh2_channel_open_ex (params->ssh_session,
+                                                 "session",
+                                                 sizeof ("session") - 1,
+                                                 window_size * 1024,
+                                                 LIBSSH2_CHANNEL_PACKET_DEFAULT,
+                                                 NULL, 0);
+  if (params->ssh_channel == NULL ||
+      libssh2_channel_subsystem (params->ssh_channel, "sftp") != 0)
+    {
+      sshv2_libssh2_log_error (request,
+                               _("Error: Cannot start the SFTP subsystem"));
+      gftp_disconnect (request);
+      return (GFTP_ERETRYABLE);
+    }
+
+  request->read_function = sshv2_libssh2_read;
+  request->write_function = sshv2_libssh2_write;
+
+  version = htonl (SSH_MY_VERSION);
+  return (sshv2_send_command (request, SSH_FXP_INIT, (char *) &version, 4));
+}
+
+#endif
+
+
+static int
+sshv2_connect (gftp_request * request)
+{
+  struct servent serv_struct;
+  sshv2_params * params;
+  sshv2_message message;
+#ifdef USE_LIBSSH2
+  intptr_t use_libssh2;
+#endif
+  int ret;
+
+  g_return_val_if_fail (request != NULL, GFTP_EFATAL);
+  g_return_val_if_fail (request->protonum == GFTP_SSHV2_NUM, GFTP_EFATAL);
+  g_return_val_if_fail (request->hostname != NULL, GFTP_EFATAL);
+  
+  if (request->datafd > 0)
+    return (0);
+
+  params = request->protocol_data;
+
+  request->logging_function (gftp_logging_misc, request,
+			     _("Opening SSH connection to %s\n"),
+                             request->hostname);
+
+  if (request->port == 0)
+    {
+      if (!r_getservbyname ("ssh", "tcp", &serv_struct, NULL))
+        {
+         request->logging_function (gftp_logging_error, request,
+                                    _("Cannot look up service name %s/tcp. Please check your services file\n"),
+                                    "ssh");
+        }
+      else
+        request->port = ntohs (serv_struct.s_port);
+    }
+
+#ifdef USE_LIBSSH2
+  gftp_lookup_request_option (request, "ssh_use_libssh2", &use_libssh2);
+  if (use_libssh2)
+    ret = sshv2_libssh2_connect (request);
+  else
+#endif
+    ret = sshv2_spawn_ssh (request);
+
+  if (ret < 0)
+    return (ret);
+
+  memset (&message, 0, sizeof (message));
+  ret = sshv2_read_response (request, &message, -1);
+  if (ret < 0)
+    {
+      sshv2_message_free (&message);
+      return (ret);
+    }
+  else if (ret != SSH_FXP_VERSION)
+    return (sshv2_wrong_response (request, &message));
+
+  sshv2_message_free (&message);
+  sshv2_log_ssh_stderr (request);
+
+  params->initialized = 1;
+  request->logging_function (gftp_logging_misc, request,
+                             _("Successfully logged into SSH server %s\n"),
+                             request->hostname);
+
+  if (sshv2_getcwd (request) < 0)
+    {
+      if (request->directory)
+        g_free (request->directory);
+
+      request->directory = g_strdup (".");
+      if ((ret = sshv2_getcwd (request)) < 0)
+        {
+          gftp_disconnect (request);
+          return (ret);
+        }
+    }
+
+  return (0);
+}
+
+
+static void
+sshv2_setup_file_offset (sshv2_params * params, char *buf, guint64 offset)
+{
+  guint32 hinum, lownum;
+  hinum = htonl(offset >> 32);
+  lownum = htonl((guint32) offset);
+
+  memcpy (buf + params->handle_len, &hinum, 4);
+  memcpy (buf + params->handle_len + 4, &lownum, 4);
+}
+
+
+static guint
+sshv2_get_pipeline_depth (gftp_request * request)
+{
+  sshv2_params * params;
+  intptr_t depth;
+
+  params = request->protocol_data;
+  if (params->pipeline_depth > 0)
+    depth = params->pipeline_depth;
+  else
+    gftp_lookup_request_option (request, "ssh_pipeline_depth", &depth);
+
+  if (depth < 1)
+    return (1);
+  else if (depth > SSH_MAX_PIPELINE_DEPTH)
+    return (SSH_MAX_PIPELINE_DEPTH);
+  else
+    return (depth);
+}
+
+
+static void
+sshv2_clear_pending (sshv2_params * params)
+{
+  guint i;
+
+  for (i = 0; i < SSH_MAX_PIPELINE_DEPTH; i++)
+    sshv2_message_free (&params->pending_reads[i].message);
+
+  params->pending_head = 0;
+  params->num_pending_reads = 0;
+  params->num_pending_writes = 0;
+  params->read_offset = 0;
+  params->read_eof = 0;
+}
+
+
+/* Sends a READ and queues it behind the others, or in front of them when
+   the rest of a short read is asked for */
+static int
+sshv2_send_read (gftp_request * request, guint64 offset, guint32 len,
+                 int at_head)
+{
+  sshv2_pending_read * pending;
+  sshv2_params * params;
+  guint32 num;
+  guint slot;
+  int ret;
+
+  params = request->protocol_data;
+
+  num = htonl (params->id);
+  memcpy (params->transfer_buffer, &num, 4);
+
+  sshv2_setup_file_offset (params, params->transfer_buffer, offset);
+
+  num = htonl (len);
+  memcpy (params->transfer_buffer + params->handle_len + 8, &num, 4);
+
+  if ((ret = sshv2_send_command (request, SSH_FXP_READ, params->transfer_buffer,
+                                 params->handle_len + 12)) < 0)
+    return (ret);
+
+  if (at_head)
+    {
+      params->pending_head = (params->pending_head + SSH_MAX_PIPELINE_DEPTH - 1)
+                             % SSH_MAX_PIPELINE_DEPTH;
+      slot = params->pending_head;
+    }
+  else
+    slot = (params->pending_head + params->num_pending_reads)
+           % SSH_MAX_PIPELINE_DEPTH;
+
+  pending = &params->pending_reads[slot];
+  memset (pending, 0, sizeof (*pending));
+  pending->id = params->id++;
+  pending->offset = offset;
+  pending->len = len;
+  params->num_pending_reads++;
+
+  return (0);
+}
+
+
+/* Reads the reply to one of the outstanding READs. The server does not
+   have to answer them in order */
+static int
+sshv2_read_pending_reply (gftp_request * request)
+{
+  sshv2_pending_read * pending;
+  sshv2_params * params;
+  sshv2_message message;
+  guint32 id;
+  guint i;
+  int ret;
+
+  params = request->protocol_data;
+
+  memset (&message, 0, sizeof (message));
+  if ((ret = sshv2_read_response (request, &message, -1)) < 0)
+    return (ret);
+
+  if (message.length < 9)
+    return (sshv2_wrong_response (request, &message));
+
+  memcpy (&id, message.buffer, 4);
+  id = ntohl (id);
+
+  for (i = 0; i < params->num_pending_reads; i++)
+    {
+      pending = &params->pending_reads[(params->pending_head + i) %
+                                       SSH_MAX_PIPELINE_DEPTH];
+      if (pending->id == id && pending->message.buffer == NULL)
+        {
+          memcpy (&pending->message, &message, sizeof (message));
+          return (0);
+        }
+    }
+
+  return (sshv2_wrong_response (request, &message));
+}
+
+
+static void
+sshv2_pop_pending_read (sshv2_params * params)
+{
+  sshv2_message_free (&params->pending_reads[params->pending_head].message);
+  params->pending_head = (params->pending_head + 1) % SSH_MAX_PIPELINE_DEPTH;
+  params->num_pending_reads--;
+}
+
+
+/* Waits for the replies to the READs that are still outstanding and
+   throws them away */
+static int
+sshv2_drain_pending_reads (gftp_request * request)
+{
+  sshv2_params * params;
+  int ret;
+
+  params = request->protocol_data;
+  while (params->num_pending_reads > 0)
+    {
+      while (params->pending_reads[params->pending_head].message.buffer == NULL)
+        {
+          if ((ret = sshv2_read_pending_reply (request)) < 0)
+            {
+              sshv2_clear_pending (params);
+              return (ret);
+            }
+        }
+
+      sshv2_pop_pending_read (params);
+    }
+
+  return (0);
+}
+
+
+/* The oldest READ got a status or an empty DATA back. Nothing after it
+   will be returned, so the replies to the later READs are thrown away */
+static int
+sshv2_finish_reads (gftp_request * request)
+{
+  sshv2_params * params;
+  sshv2_message message;
+  int ret;
+
+  params = request->protocol_data;
+
+  memcpy (&message, &params->pending_reads[params->pending_head].message,
+          sizeof (message));
+  memset (&params->pending_reads[params->pending_head].message, 0,
+          sizeof (message));
+  sshv2_pop_pending_read (params);
+  params->read_eof = 1;
+
+  if ((ret = sshv2_drain_pending_reads (request)) < 0)
+    {
+      sshv2_message_free (&message);
+      return (ret);
+    }
+
+  if (message.command == SSH_FXP_DATA)
+    {
+      sshv2_message_free (&message);
+      return (0);
+    }
+  else if (message.command != SSH_FXP_STATUS)
+    return (sshv2_wrong_response (request, &message));
+
+  message.pos += 4;
+  ret = sshv2_buffer_get_int32 (request, &message, SSH_FX_EOF, 1, NULL);
+  sshv2_message_free (&message);
+  return (ret);
+}
+
+
+/* Takes the status of one of the outstanding WRITEs */
+static int
+sshv2_read_write_status (gftp_request * request, guint32 * status)
+{
+  sshv2_params * params;
+  sshv2_message message;
+  int ret;
+
+  params = request->protocol_data;
+  params->num_pending_writes--;
+
+  memset (&message, 0, sizeof (message));
+  params->dont_log_status = 1;
+  ret = sshv2_read_response (request, &message, -1);
+  params->dont_log_status = 0;
+  if (ret < 0)
+    return (ret);
+
+  if (ret != SSH_FXP_STATUS)
+    return (sshv2_wrong_response (request, &message));
+
+  message.pos += 4;
+  ret = sshv2_buffer_get_int32 (request, &message, 0, 0, status);
+  sshv2_message_free (&message);
+  return (ret);
+}
+
+
+static void
+sshv2_disconnect (gftp_request * request)
+{
+  sshv2_params * params;
+
+  g_return_if_fail (request != NULL);
+  g_return_if_fail (request->protonum == GFTP_SSHV2_NUM);
+
+  params = request->protocol_data;
+
+#ifdef USE_LIBSSH2
+  sshv2_libssh2_close (request);
+#endif
+
+  if (request->datafd > 0)
+    {
+      request->logging_function (gftp_logging_misc, request,
+			         _("Disconnecting from site %s\n"),
+                                 request->hostname);
+
+      if (close (request->datafd) < 0)
+        request->logging_function (gftp_logging_error, request,
+                                   _("Error closing file descriptor: %s\n"),
+                                   g_strerror (errno));
+
+      request->datafd = -1;
+    }
+
+  if (params->stderr_fd >= 0)
+    {
+      sshv2_log_ssh_stderr (request);
+      if (params->stderr_fd >= 0)
+        close (params->stderr_fd);
+      params->stderr_fd = -1;
+    }
+
+  if (params->message.buffer != NULL)
+    {
+      sshv2_message_free (&params->message);
+      params->message.buffer = NULL;
+    }
+
+  if (params->transfer_buffer != NULL)
+    {
+      g_free (params->transfer_buffer);
+      params->transfer_buffer = NULL;
+      params->transfer_buffer_len = 0;
+    }
+
+  params->handle_len = 0;
+  sshv2_clear_pending (params);
+}
+
+
+static int
+sshv2_end_transfer (gftp_request * request)
+{
+  sshv2_params * params;
+  sshv2_message message;
+  guint32 len, status;
+  int ret, write_ret;
+
+  g_return_val_if_fail (request != NULL, GFTP_EFATAL);
+  g_return_val_if_fail (request->protonum == GFTP_SSHV2_NUM, GFTP_EFATAL);
+
+  params = request->protocol_data;
+  if (params->message.buffer != NULL)
+    {
+      sshv2_message_free (&params->message);
+      params->message.buffer = NULL;
+      params->count = 0;
+    }
+
+  write_ret = 0;
+  if (params->handle_len > 0)
+    {
+      if ((ret = sshv2_drain_pending_reads (request)) < 0)
+        return (ret);
+
+      while (params->num_pending_writes > 0)
+        {
+          if ((ret = sshv2_read_write_status (request, &status)) < 0)
+            return (ret);
+
+          if (status != SSH_FX_OK && write_ret == 0)
+            write_ret = sshv2_response_return_code (request, NULL, status);
+        }
+
+      len = htonl (params->id++);
+      memcpy (params->handle, &len, 4);
+
+      if ((ret = sshv2_send_command (request, SSH_FXP_CLOSE, params->handle, 
+                                     params->handle_len)) < 0)
+        return (ret);
+
+      ret = sshv2_read_status_response (request, &message, -1, 0,
+                                         SSH_FXP_STATUS);
+      if (ret < 0)
+        return (ret);
+
+      sshv2_message_free (&message);
+      params->handle_len = 0;
+    }  
+
+  if (params->transfer_buffer != NULL)
+    {
+      g_free (params->transfer_buffer);
+      params->transfer_buffer = NULL;
+      params->transfer_buffer_len = 0;
+    }
+
+  sshv2_clear_pending (params);
+  return (write_ret);
+}
+
+
+static int
+sshv2_list_files (gftp_request * request)
+{
+  sshv2_params * params;
+  sshv2_message message;
+  char *tempstr;
+  size_t msglen;
+  int ret;
+
+  g_return_val_if_fail (request != NULL, GFTP_EFATAL);
+  g_return_val_if_fail (request->protonum == GFTP_SSHV2_NUM, GFTP_EFATAL);
+  g_return_val_if_fail (request->datafd > 0, GFTP_EFATAL);
+
+  params = request->protocol_data;
+
+  request->logging_function (gftp_logging_misc, request,
+			     _("Retrieving directory listing...\n"));
+
+  msglen = 0;
+  tempstr = sshv2_initialize_buffer_with_i18n_string (request,
+                                                      request->directory,
+                                                      &msglen);
+  ret = sshv2_send_command (request, SSH_FXP_OPENDIR, tempstr, msglen);
+  g_free (tempstr);
+  if (ret < 0)
+    return (ret);
+
+  ret = sshv2_read_status_response (request, &message, -1, SSH_FXP_STATUS,
+                                    SSH_FXP_HANDLE);
+  if (ret < 0)
+    return (ret);
+
+  if (message.length - 4 > SSH_MAX_HANDLE_SIZE)
+    {
+      request->logging_function (gftp_logging_error, request,
+                             _("Error: Message size %d too big from server\n"),
+                             message.length - 4);
+      sshv2_message_free (&message);
+      gftp_disconnect (request);
+      return (GFTP_EFATAL);
+    }
+
+  memset (params->handle, 0, 4);
+  memcpy (params->handle + 4, message.buffer + 4, message.length - 5);
+  params->handle_len = message.length - 1;
+  sshv2_message_free (&message);
+
+  /* The transfer buffer holds a copy of the handle */
+  if (params->transfer_buffer != NULL)
+    {
+      g_free (params->transfer_buffer);
+      params->transfer_buffer = NULL;
+      params->transfer_buffer_len = 0;
+    }
+  sshv2_clear_pending (params);
+  params->count = 0;
+  return (0);
+}
+
+
+static int
+sshv2_decode_file_attributes (gftp_request * request, sshv2_message * message,
+                              gftp_file * fle)
+{
+  guint32 attrs, num, count, i;
+  int ret;
+
+  if ((ret = sshv2_buffer_get_int32 (request, message, 0, 0, &attrs)) < 0)
+    return (ret);
 
   if (attrs & SSH_FILEXFER_ATTR_SIZE)
     {
@@ -1430,47 +2348,26 @@ sshv2_get_next_file (gftp_request * request, gftp_file * fle, int fd)
   g_return_val_if_fail (fle != NULL, GFTP_EFATAL);
 
   params = request->protocol_data;
-
-  if (request->last_dir_entry)
-    {
-      g_free (request->last_dir_entry);
-      request->last_dir_entry = NULL;
-      request->last_dir_entry_len = 0;
-    }
   retsize = 0;
 
   if (params->count > 0)
     ret = SSH_FXP_NAME;
   else
     {
-      if (!request->cached)
-        {
-          if (params->message.buffer != NULL)
-            sshv2_message_free (&params->message);
+      if (params->message.buffer != NULL)
+        sshv2_message_free (&params->message);
 
-          len = htonl (params->id++);
-          memcpy (params->handle, &len, 4);
+      len = htonl (params->id++);
+      memcpy (params->handle, &len, 4);
 
-          if ((ret = sshv2_send_command (request, SSH_FXP_READDIR,  
-                                         params->handle,
-                                         params->handle_len)) < 0)
-            return (ret);
-        }
+      if ((ret = sshv2_send_command (request, SSH_FXP_READDIR,  
+                                     params->handle,
+                                     params->handle_len)) < 0)
+        return (ret);
 
       if ((ret = sshv2_read_response (request, &params->message, fd)) < 0)
         return (ret);
 
-      if (!request->cached)
-        {
-          request->last_dir_entry = g_malloc0 (params->message.length + 4);
-          len = htonl (params->message.length);
-          memcpy (request->last_dir_entry, &len, 4);
-          request->last_dir_entry[4] = params->message.command;
-          memcpy (request->last_dir_entry + 5, params->message.buffer, 
-                  params->message.length - 1);
-          request->last_dir_entry_len = params->message.length + 4;
-        }
-
       if (ret == SSH_FXP_NAME)
         {
           params->message.pos = params->message.buffer + 4;
@@ -1868,24 +2765,17 @@ sshv2_put_file (gftp_request * request, const char *file,
 }
 
 
-static void
-sshv2_setup_file_offset (sshv2_params * params, char *buf)
-{
-  guint32 hinum, lownum;
-  hinum = htonl(params->offset >> 32);
-  lownum = htonl((guint32) params->offset);
-
-  memcpy (buf + params->handle_len, &hinum, 4);
-  memcpy (buf + params->handle_len + 4, &lownum, 4);
-}
-
-
+/* Keeps up to ssh_pipeline_depth READs outstanding, so that the server
+   does not sit idle for a round trip between blocks. The data is returned
+   in file order no matter which order the replies come back in */
 static ssize_t 
 sshv2_get_next_file_chunk (gftp_request * request, char *buf, size_t size)
 {
+  sshv2_pending_read * pending;
   sshv2_params * params;
-  sshv2_message message;
-  guint32 num;
+  guint32 num, copylen;
+  guint64 gap_offset;
+  guint depth;
   int ret;
 
   g_return_val_if_fail (request != NULL, GFTP_EFATAL);
@@ -1895,66 +2785,85 @@ sshv2_get_next_file_chunk (gftp_request * request, char *buf, size_t size)
 
   params = request->protocol_data;
 
+  if (size > SSH_MAX_DATA_SIZE)
+    size = SSH_MAX_DATA_SIZE;
+
   if (params->transfer_buffer == NULL)
     {
       params->transfer_buffer_len = params->handle_len + 12;
       params->transfer_buffer = g_malloc0 (params->transfer_buffer_len);
       memcpy (params->transfer_buffer, params->handle, params->handle_len);
+
+      params->read_offset = params->offset;
+      params->read_eof = 0;
     }
 
-  num = htonl (params->id++);
-  memcpy (params->transfer_buffer, &num, 4);
+  depth = sshv2_get_pipeline_depth (request);
+  while (!params->read_eof && params->num_pending_reads < depth)
+    {
+      if ((ret = sshv2_send_read (request, params->read_offset, size, 0)) < 0)
+        return (ret);
 
-  sshv2_setup_file_offset (params, params->transfer_buffer);
+      params->read_offset += size;
+    }
 
-  num = htonl (size);
-  memcpy (params->transfer_buffer + params->handle_len + 8, &num, 4);
-  
-  if ((ret = sshv2_send_command (request, SSH_FXP_READ, params->transfer_buffer,
-                                 params->handle_len + 12)) < 0)
-    return (ret);
+  if (params->num_pending_reads == 0)
+    return (0);
 
-  memset (&message, 0, sizeof (message));
-  if ((ret = sshv2_read_response (request, &message, -1)) != SSH_FXP_DATA)
+  pending = &params->pending_reads[params->pending_head];
+  while (pending->message.buffer == NULL)
     {
-      if (ret < 0)
+      if ((ret = sshv2_read_pending_reply (request)) < 0)
         return (ret);
-
-      message.pos += 4;
-      if ((ret = sshv2_buffer_get_int32 (request, &message, SSH_FX_EOF, 1,
-                                         NULL)) < 0)
-        return (ret); 
-
-      sshv2_message_free (&message);
-      return (0);
     }
 
-  memcpy (&num, message.buffer + 4, 4);
+  if (pending->message.command != SSH_FXP_DATA)
+    return (sshv2_finish_reads (request));
+
+  memcpy (&num, pending->message.buffer + 4, 4);
   num = ntohl (num);
-  if (num > size)
+  if (num > pending->len || num > pending->message.length - 9)
     {
       request->logging_function (gftp_logging_error, request,
                              _("Error: Message size %d too big from server\n"),
                              num);
-      sshv2_message_free (&message);
       gftp_disconnect (request);
       return (GFTP_ERETRYABLE);
-        
     }
+  else if (num == 0)
+    return (sshv2_finish_reads (request));
 
-  memcpy (buf, message.buffer + 8, num);
-  sshv2_message_free (&message);
-  params->offset += num;
-  return (num);
+  copylen = MIN (num - pending->used, size);
+  memcpy (buf, pending->message.buffer + 8 + pending->used, copylen);
+  pending->used += copylen;
+  params->offset += copylen;
+
+  if (pending->used == num)
+    {
+      gap_offset = pending->offset + num;
+      num = pending->len - num;
+      sshv2_pop_pending_read (params);
+
+      /* A short read. Ask for the rest before anything after it */
+      if (num > 0 &&
+          (ret = sshv2_send_read (request, gap_offset, num, 1)) < 0)
+        return (ret);
+    }
+
+  return (copylen);
 }
 
 
+/* Sends the WRITE without waiting for its status, as long as fewer than
+   ssh_pipeline_depth are outstanding. A failed WRITE is reported by a later
+   call or by sshv2_end_transfer () */
 static ssize_t 
 sshv2_put_next_file_chunk (gftp_request * request, char *buf, size_t size)
 {
   sshv2_params * params;
-  sshv2_message message;
-  guint32 num;
+  guint32 num, status;
+  guint depth;
+  size_t len;
   int ret;
 
   g_return_val_if_fail (request != NULL, GFTP_EFATAL);
@@ -1964,47 +2873,41 @@ sshv2_put_next_file_chunk (gftp_request * request, char *buf, size_t size)
 
   params = request->protocol_data;
 
-  if (params->transfer_buffer == NULL)
+  if (size > SSH_MAX_DATA_SIZE)
+    size = SSH_MAX_DATA_SIZE;
+
+  len = params->handle_len + 12 + size;
+  if (params->transfer_buffer_len < len)
     {
-      params->transfer_buffer_len = params->handle_len + size + 12;
-      params->transfer_buffer = g_malloc0 (params->transfer_buffer_len);
+      params->transfer_buffer = g_realloc (params->transfer_buffer, len);
+      params->transfer_buffer_len = len;
       memcpy (params->transfer_buffer, params->handle, params->handle_len);
     }
 
+  depth = sshv2_get_pipeline_depth (request);
+  while (params->num_pending_writes >= depth)
+    {
+      if ((ret = sshv2_read_write_status (request, &status)) < 0)
+        return (ret);
+
+      if (status != SSH_FX_OK)
+        return (sshv2_response_return_code (request, NULL, status));
+    }
+
   num = htonl (params->id++);
   memcpy (params->transfer_buffer, &num, 4);
 
-  sshv2_setup_file_offset (params, params->transfer_buffer);
+  sshv2_setup_file_offset (params, params->transfer_buffer, params->offset);
 
   num = htonl (size);
   memcpy (params->transfer_buffer + params->handle_len + 8, &num, 4);
   memcpy (params->transfer_buffer + params->handle_len + 12, buf, size);
   
   if ((ret = sshv2_send_command (request, SSH_FXP_WRITE,
-                                 params->transfer_buffer,
-                                 params->transfer_buffer_len)) < 0)
+                                 params->transfer_buffer, len)) < 0)
     return (ret);
 
-  memset (&message, 0, sizeof (message));
-  params->dont_log_status = 1;
-  ret = sshv2_read_response (request, &message, -1);
-  if (ret < 0)
-    return (ret);
-
-  params->dont_log_status = 0;
-  if (ret != SSH_FXP_STATUS)
-    return (sshv2_wrong_response (request, &message));
-
-  message.pos += 4;
-  if ((ret = sshv2_buffer_get_int32 (request, &message, SSH_FX_OK, 1, &num)) < 0)
-    {
-      if (num == SSH_FX_EOF)
-        return (0);
-
-      return (ret);
-    }
-
-  sshv2_message_free (&message);
+  params->num_pending_writes++;
   params->offset += size;
   return (size);
 }
@@ -2013,11 +2916,12 @@ sshv2_put_next_file_chunk (gftp_request * request, char *buf, size_t size)
 static int
 sshv2_set_config_options (gftp_request * request)
 {
-  intptr_t ssh_need_userpass;
+  intptr_t ssh_need_userpass, batch_mode;
 
   gftp_lookup_request_option (request, "ssh_need_userpass", &ssh_need_userpass);
+  gftp_lookup_request_option (request, "ssh_batch_mode", &batch_mode);
   request->need_username = ssh_need_userpass;
-  request->need_password = ssh_need_userpass;
+  request->need_password = ssh_need_userpass && !batch_mode;
   return (0);
 }
 
@@ -2030,6 +2934,24 @@ sshv2_swap_socks (gftp_request * dest, gftp_request * source)
   sparams = source->protocol_data;
   dparams = dest->protocol_data;
   dparams->id = sparams->id;
+  if (dparams->stderr_fd >= 0 && dparams->stderr_fd != sparams->stderr_fd)
+    close (dparams->stderr_fd);
+  dparams->stderr_fd = sparams->stderr_fd;
+  if (source->datafd == -1)
+    sparams->stderr_fd = -1;
+
+#ifdef USE_LIBSSH2
+  dparams->ssh_session = sparams->ssh_session;
+  dparams->ssh_channel = sparams->ssh_channel;
+  dest->read_function = source->read_function;
+  dest->write_function = source->write_function;
+
+  if (source->datafd == -1)
+    {
+      sparams->ssh_session = NULL;
+      sparams->ssh_channel = NULL;
+    }
+#endif
 }
 
 
@@ -2037,6 +2959,42 @@ void
 sshv2_register_module (void)
 {
   gftp_register_config_vars (config_vars);
+
+#ifdef USE_LIBSSH2
+  /* libssh2_init () is not thread safe, so it is done once here while the
+     program is starting instead of from the connecting threads */
+  if (!sshv2_libssh2_initialized && libssh2_init (0) == 0)
+    sshv2_libssh2_initialized = 1;
+#endif
+}
+
+
+void
+sshv2_shutdown (void)
+{
+#ifdef USE_LIBSSH2
+  if (sshv2_libssh2_initialized)
+    {
+      libssh2_exit ();
+      sshv2_libssh2_initialized = 0;
+    }
+#endif
+}
+
+
+/* Overrides ssh_pipeline_depth for this request only. Used by the transfer
+   autotuner, which must not change the request's options while they are
+   being read. 0 goes back to the option */
+void
+sshv2_set_pipeline_depth (gftp_request * request, guint depth)
+{
+  sshv2_params * params;
+
+  g_return_if_fail (request != NULL);
+  g_return_if_fail (request->protonum == GFTP_SSHV2_NUM);
+
+  params = request->protocol_data;
+  params->pipeline_depth = depth;
 }
 
 
@@ -2069,6 +3027,7 @@ sshv2_copy_param_options (gftp_request * dest_request,
     }
   else
     dparms->transfer_buffer = NULL;
+  dparms->transfer_buffer_len = sparms->transfer_buffer_len;
 
   sshv2_copy_message (&sparms->message, &dparms->message);
 
@@ -2078,6 +3037,7 @@ sshv2_copy_param_options (gftp_request * dest_request,
   dparms->initialized = sparms->initialized;
   dparms->dont_log_status = sparms->dont_log_status;
   dparms->offset = sparms->offset;
+  dparms->pipeline_depth = sparms->pipeline_depth;
 }
 
 
@@ -2132,6 +3092,7 @@ sshv2_init (gftp_request * request)
 
   params = request->protocol_data;
   params->id = 1;
+  params->stderr_fd = -1;
 
   return (gftp_set_config_options (request));
 }
@@ -40,6 +40,10 @@ static gftp_config_vars config_vars[] =
   {"verify_ssl_peer", N_("Verify SSL Peer"),
   gftp_option_type_checkbox, GINT_TO_POINTER(1), NULL, 0,
    N_("Verify SSL Peer"), GFTP_PORT_ALL, NULL},
+  {"ssl_session_cache_file", N_("SSL Session Cache File:"), 
+   gftp_option_type_text, "", NULL, 0, 
+   N_("If set, SSL sessions are saved to this file so that they can be resumed the next time gFTP is started. Leave it empty to only keep them in memory"), 
+   GFTP_PORT_ALL, 0},
 
   {NULL, NULL, 0, NULL, NULL, 0, NULL, 0, NULL}
 };  
@@ -47,7 +51,16 @@ static gftp_config_vars config_vars[] =
 static GMutex * gftp_ssl_mutexes = NULL;
 static volatile int gftp_ssl_initialized = 0;
 static SSL_CTX * ctx = NULL;
-static GHashTable * gftp_ssl_map = NULL;
+
+/* host:port -> SSL_SESSION of the last control connection to that host. Only
+   touched during handshakes, never from the read/write paths */
+static GHashTable * gftp_ssl_sessions = NULL;
+static GMutex gftp_ssl_sessions_mutex;
+static int gftp_ssl_sessions_dirty = 0;
+
+/* Serializes writers of the session cache file. Never held with the mutex
+   above, so handshakes don't wait on the disk */
+static GMutex gftp_ssl_sessions_file_mutex;
 
 struct CRYPTO_dynlock_value
 { 
@@ -67,24 +80,15 @@ ssl_register_module (void)
     }
 }
 
-static SSL*
-gftp_get_ssl_for_fd (int fd)
-{
-  SSL* ssl= gftp_ssl_map?(SSL*)g_hash_table_lookup (gftp_ssl_map, &fd):NULL;
-  return ssl;
-}
-
-static void
-gftp_set_ssl_for_fd (int fd, SSL* ssl)
+/* The control connection always lives on request->datafd, any other fd is
+   the data connection that is currently open */
+static SSL **
+gftp_ssl_for_fd (gftp_request * request, int fd)
 {
-  if (ssl)
-    {
-      int *key = g_new (gint, 1);
-      *key = fd;
-      g_hash_table_insert (gftp_ssl_map, key, ssl);
-    }
+  if (fd == request->datafd)
+    return (&request->ssl);
   else
-    g_hash_table_remove (gftp_ssl_map, &fd);
+    return (&request->data_ssl);
 }
 
 static int
@@ -140,7 +144,7 @@ gftp_ssl_post_connection_check (gftp_request * request)
   X509_EXTENSION *ext;
   X509_NAME *subj;
   X509 *cert;
-  SSL* ssl = gftp_get_ssl_for_fd (request->datafd);
+  SSL* ssl = request->ssl;
  
   ok = 0;
   if (!(cert = SSL_get_peer_certificate (ssl)))
@@ -300,6 +304,191 @@ _gftp_ssl_thread_setup (void)
 } 
 
 
+static char *
+gftp_ssl_session_key (gftp_request * request)
+{
+  return (g_strdup_printf ("%s:%d", request->hostname, request->port));
+}
+
+
+static void
+gftp_ssl_save_session (gpointer key, gpointer value, gpointer data)
+{
+  unsigned char *buf, *pos;
+  char *encoded;
+  int len;
+
+  if ((len = i2d_SSL_SESSION (value, NULL)) <= 0)
+    return;
+
+  pos = buf = g_malloc (len);
+  i2d_SSL_SESSION (value, &pos);
+  encoded = g_base64_encode (buf, len);
+  g_string_append_printf (data, "%s\t%s\n", (char *) key, encoded);
+  g_free (encoded);
+  g_free (buf);
+}
+
+
+/* Writes the sessions out if any were added since the last time. Only the
+   encoding is done under gftp_ssl_sessions_mutex. request may be NULL */
+static void
+gftp_ssl_save_sessions (gftp_request * request)
+{
+  char *filename, *tempstr;
+  GString * sessions;
+  ssize_t ret;
+  size_t pos;
+  int fd;
+
+  if (request != NULL)
+    gftp_lookup_request_option (request, "ssl_session_cache_file", &tempstr);
+  else
+    gftp_lookup_global_option ("ssl_session_cache_file", &tempstr);
+  if (tempstr == NULL || *tempstr == '\0')
+    return;
+
+  if ((filename = gftp_expand_path (request, tempstr)) == NULL)
+    return;
+
+  g_mutex_lock (&gftp_ssl_sessions_file_mutex);
+
+  g_mutex_lock (&gftp_ssl_sessions_mutex);
+  if (!gftp_ssl_sessions_dirty)
+    {
+      g_mutex_unlock (&gftp_ssl_sessions_mutex);
+      g_mutex_unlock (&gftp_ssl_sessions_file_mutex);
+      g_free (filename);
+      return;
+    }
+
+  sessions = g_string_new (NULL);
+  g_hash_table_foreach (gftp_ssl_sessions, gftp_ssl_save_session, sessions);
+  gftp_ssl_sessions_dirty = 0;
+  g_mutex_unlock (&gftp_ssl_sessions_mutex);
+
+  /* The file holds session secrets, so keep it private */
+  if ((fd = open (filename, O_WRONLY | O_CREAT | O_TRUNC, 
+                  S_IRUSR | S_IWUSR)) == -1)
+    {
+      if (request != NULL)
+        request->logging_function (gftp_logging_error, request,
+                                   _("Error: Cannot open local file %s: %s\n"),
+                                   filename, g_strerror (errno));
+    }
+  else
+    {
+      for (pos = 0; pos < sessions->len; pos += ret)
+        {
+          if ((ret = write (fd, sessions->str + pos,
+                            sessions->len - pos)) <= 0)
+            {
+              if (ret < 0 && errno == EINTR)
+                {
+                  ret = 0;
+                  continue;
+                }
+              break;
+            }
+        }
+      close (fd);
+    }
+
+  g_mutex_unlock (&gftp_ssl_sessions_file_mutex);
+  g_string_free (sessions, TRUE);
+  g_free (filename);
+}
+
+
+static void
+gftp_ssl_load_sessions (gftp_request * request)
+{
+  char *filename, *tempstr, *pos, buf[16384];
+  const unsigned char *derpos;
+  unsigned char *der;
+  SSL_SESSION * sess;
+  gsize len;
+  FILE * fd;
+
+  gftp_lookup_request_option (request, "ssl_session_cache_file", &tempstr);
+  if (tempstr == NULL || *tempstr == '\0')
+    return;
+
+  if ((filename = gftp_expand_path (request, tempstr)) == NULL)
+    return;
+
+  fd = fopen (filename, "r");
+  g_free (filename);
+  if (fd == NULL)
+    return;
+
+  while (fgets (buf, sizeof (buf), fd) != NULL)
+    {
+      if ((pos = strchr (buf, '\t')) == NULL)
+        continue;
+      *pos++ = '\0';
+
+      der = g_base64_decode (pos, &len);
+      derpos = der;
+      sess = d2i_SSL_SESSION (NULL, &derpos, len);
+      g_free (der);
+
+      if (sess == NULL)
+        continue;
+
+      if (SSL_SESSION_get_time (sess) + SSL_SESSION_get_timeout (sess) < 
+          time (NULL))
+        {
+          SSL_SESSION_free (sess);
+          continue;
+        }
+
+      g_hash_table_replace (gftp_ssl_sessions, g_strdup (buf), sess);
+    }
+
+  fclose (fd);
+}
+
+
+static int
+gftp_ssl_new_session (SSL * ssl, SSL_SESSION * sess)
+{
+  gftp_request * request;
+
+  /* Data connections resume the control connection's session, so only the
+     sessions negotiated on the control connection are worth keeping */
+  request = SSL_get_ex_data (ssl, gftp_ssl_get_index ());
+  if (request == NULL || request->hostname == NULL ||
+      SSL_get_fd (ssl) != request->datafd)
+    return (0);
+
+  g_mutex_lock (&gftp_ssl_sessions_mutex);
+  g_hash_table_replace (gftp_ssl_sessions, gftp_ssl_session_key (request),
+                        sess);
+  gftp_ssl_sessions_dirty = 1;
+  g_mutex_unlock (&gftp_ssl_sessions_mutex);
+
+  return (1);
+}
+
+
+static void
+gftp_ssl_resume_session (gftp_request * request, SSL * ssl)
+{
+  SSL_SESSION * sess;
+  char *key;
+
+  key = gftp_ssl_session_key (request);
+
+  g_mutex_lock (&gftp_ssl_sessions_mutex);
+  if ((sess = g_hash_table_lookup (gftp_ssl_sessions, key)) != NULL)
+    SSL_set_session (ssl, sess);
+  g_mutex_unlock (&gftp_ssl_sessions_mutex);
+
+  g_free (key);
+}
+
+
 int
 gftp_ssl_startup (gftp_request * request)
 {
@@ -354,7 +543,19 @@ gftp_ssl_startup (gftp_request * request)
       return (GFTP_EFATAL);
     }
 
-  gftp_ssl_map = g_hash_table_new_full (g_int_hash, g_int_equal, g_free, NULL);
+  /* Keep client sessions ourselves so they survive reconnects and can be
+     shared by every connection to the same host. With TLS 1.3 the session
+     tickets only arrive after the handshake, so they have to be picked up
+     through the new session callback */
+  SSL_CTX_set_session_cache_mode (ctx, SSL_SESS_CACHE_CLIENT |
+                                       SSL_SESS_CACHE_NO_INTERNAL_STORE);
+  SSL_CTX_sess_set_new_cb (ctx, gftp_ssl_new_session);
+
+  g_mutex_init (&gftp_ssl_sessions_mutex);
+  g_mutex_init (&gftp_ssl_sessions_file_mutex);
+  gftp_ssl_sessions = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                             (GDestroyNotify) SSL_SESSION_free);
+  gftp_ssl_load_sessions (request);
 
   return (0);
 }
@@ -373,11 +574,12 @@ gftp_ssl_session_setup_ex (gftp_request * request, int fd)
   intptr_t verify_ssl_peer;
   BIO * bio;
   long ret;
-  SSL* ssl = gftp_get_ssl_for_fd (fd);
+  SSL ** slot = gftp_ssl_for_fd (request, fd);
+  SSL* ssl;
 
   /* ensure the data socket is open and tls is not yet started on it */
   g_return_val_if_fail (fd > 0, GFTP_EFATAL);
-  g_return_val_if_fail (ssl == 0, GFTP_EFATAL);
+  g_return_val_if_fail (*slot == NULL, GFTP_EFATAL);
 
   if (!gftp_ssl_initialized)
     {
@@ -424,18 +626,25 @@ gftp_ssl_session_setup_ex (gftp_request * request, int fd)
   /*
    * for secondary connections, reuse the session ID from the
    * primary connection.  this is required for FTPS data connections,
-   * which must reuse the control channel's session.
+   * which must reuse the control channel's session. The control
+   * connection tries to resume the last session to the same host.
    */
   if (fd != request->datafd)
-    SSL_set_session (ssl, SSL_get1_session (gftp_get_ssl_for_fd (request->datafd)));
+    SSL_set_session (ssl, SSL_get_session (request->ssl));
+  else
+    {
+      SSL_set_tlsext_host_name (ssl, request->hostname);
+      gftp_ssl_resume_session (request, ssl);
+    }
 
   if (SSL_connect (ssl) <= 0)
     {
+      SSL_free (ssl);
       gftp_ssl_abort (request, fd);
       return (GFTP_EFATAL);
     }
 
-  gftp_set_ssl_for_fd (fd, ssl);
+  *slot = ssl;
 
   /* perform cert check only on the main (control) channel */
   if (fd == request->datafd)
@@ -455,10 +664,11 @@ gftp_ssl_session_setup_ex (gftp_request * request, int fd)
     }
   
   request->logging_function (gftp_logging_misc, request,
-                             "SSL%s connection established using %s (%s)\n", 
+                             "SSL%s connection established using %s (%s)%s\n", 
                              fd == request->datafd?"":" data", 
                              SSL_get_cipher_version (ssl), 
-                             SSL_get_cipher_name (ssl));
+                             SSL_get_cipher_name (ssl),
+                             SSL_session_reused (ssl) ? ", session resumed" : "");
 
   /* restore the socket's previous blocking state */
   if (non_blocking &&
@@ -480,12 +690,17 @@ gftp_ssl_session_setup (gftp_request * request)
 void
 gftp_ssl_session_close_ex (gftp_request * request, int fd)
 {
-  SSL* ssl = gftp_get_ssl_for_fd (fd);
-  if(ssl)
+  SSL ** slot = gftp_ssl_for_fd (request, fd);
+  if(*slot)
     {
-      SSL_shutdown (ssl);
-      SSL_free (ssl);
-      gftp_set_ssl_for_fd(fd, NULL);
+      SSL_shutdown (*slot);
+      SSL_free (*slot);
+      *slot = NULL;
+
+      /* The control connection is done with its handshakes, so this is a
+         quiet time to write out the tickets it picked up */
+      if (fd == request->datafd)
+        gftp_ssl_save_sessions (request);
     }
 }
 
@@ -495,12 +710,29 @@ gftp_ssl_session_close (gftp_request * request)
   gftp_ssl_session_close_ex (request, request->datafd);
 }
 
+void
+gftp_ssl_shutdown (void)
+{
+  if (!gftp_ssl_initialized || gftp_ssl_sessions == NULL)
+    return;
+
+  gftp_ssl_save_sessions (NULL);
+}
+
+void
+gftp_ssl_swap_socks (gftp_request * dest, gftp_request * source)
+{
+  dest->ssl = source->ssl;
+  if (dest->ssl != NULL)
+    SSL_set_ex_data (dest->ssl, gftp_ssl_get_index (), dest);
+}
+
 ssize_t 
 gftp_ssl_read (gftp_request * request, void *ptr, size_t size, int fd)
 {
   int ret;
   int err;
-  SSL* ssl = gftp_get_ssl_for_fd (fd);
+  SSL* ssl = *gftp_ssl_for_fd (request, fd);
 
   g_return_val_if_fail (ssl != NULL, GFTP_EFATAL);
 
@@ -549,7 +781,7 @@ ssize_t
 gftp_ssl_write (gftp_request * request, const char *ptr, size_t size, int fd)
 {
   int ret, w_ret;
-  SSL* ssl = gftp_get_ssl_for_fd (fd);
+  SSL* ssl = *gftp_ssl_for_fd (request, fd);
  
   g_return_val_if_fail (ssl != NULL, GFTP_EFATAL);
 
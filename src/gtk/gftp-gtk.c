@@ -37,7 +37,6 @@ GHashTable * pixbuf_hash_table = NULL;
 GtkActionGroup * menus = NULL;
 GtkUIManager * factory = NULL;
 
-pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
 pthread_t main_thread_id;
 GList * viewedit_processes = NULL;
 
@@ -45,18 +44,6 @@ static gboolean on_key_press_combo_toolbar(GtkWidget *widget, GdkEventKey *event
 static void on_combo_protocol_change_cb (GtkComboBox *cb, gpointer data);
 static int combo_key_pressed = 0;
 
-static int
-get_column (GtkCListColumn * col)
-{
-  if (col->auto_resize)
-    return (0);
-  else if (!col->visible)
-    return (-1);
-  else
-    return (col->width);
-}
-
-
 static void
 _gftp_exit (GtkWidget * widget, gpointer data)
 {
@@ -77,8 +64,7 @@ _gftp_exit (GtkWidget * widget, gpointer data)
 
   listbox_save_column_width (&window1, &window2);
 
-  ret = get_column (&GTK_CLIST (dlwdw)->column[0]);
-  gftp_set_global_option ("file_trans_column", GINT_TO_POINTER (ret));
+  lb_save_cwidth (GTK_TREE_VIEW (dlwdw), 0, "file_trans_column");
 
   tempstr = gtk_combo_box_text_get_active_text(GTK_COMBO_BOX_TEXT(hostedit));
   gftp_set_global_option ("host_value", tempstr);
@@ -112,6 +98,9 @@ _gftp_exit (GtkWidget * widget, gpointer data)
      g_hash_table_destroy (pixbuf_hash_table);
   }
 
+  gftp_gtk_prefetch_shutdown (&window1);
+  gftp_gtk_prefetch_shutdown (&window2);
+
   gftp_shutdown ();
 
   exit (0);
@@ -1111,9 +1100,8 @@ on_key_press_transfer (GtkWidget * widget, GdkEventButton * event, gpointer data
 static GtkWidget *
 CreateFTPWindows (GtkWidget * ui)
 {
-  GtkWidget *box, *dlbox, *winpane, *dlpane, *logpane, *mainvbox, *tempwid;
+  GtkWidget *box, *dlbox, *queuebox, *winpane, *dlpane, *logpane, *mainvbox, *tempwid;
   gftp_config_list_vars * tmplistvar;
-  char *dltitles[2];
   intptr_t tmplookup;
   GtkTextBuffer * textbuf;
   GtkTextIter iter;
@@ -1188,22 +1176,16 @@ CreateFTPWindows (GtkWidget * ui)
   gtk_scrolled_window_set_policy (GTK_SCROLLED_WINDOW (transfer_scroll),
 				  GTK_POLICY_AUTOMATIC, GTK_POLICY_AUTOMATIC);
 
-  dltitles[0] = _("Filename");
-  dltitles[1] = _("Progress");
-  dlwdw = gtk_ctree_new_with_titles (2, 0, dltitles);
-  gtk_clist_set_selection_mode (GTK_CLIST (dlwdw), GTK_SELECTION_SINGLE);
-  gtk_clist_set_reorderable (GTK_CLIST (dlwdw), 0);
-
-  gftp_lookup_global_option ("file_trans_column", &tmplookup);
-  if (tmplookup == 0)
-    gtk_clist_set_column_auto_resize (GTK_CLIST (dlwdw), 0, TRUE);
-  else
-    gtk_clist_set_column_width (GTK_CLIST (dlwdw), 0, tmplookup);
-
+  dlwdw = transfer_queue_new ();
   gtk_container_add (GTK_CONTAINER (transfer_scroll), dlwdw);
   g_signal_connect (G_OBJECT (dlwdw), "button_press_event",
         G_CALLBACK (on_key_press_transfer), NULL);
-  gtk_paned_pack2 (GTK_PANED (dlpane), transfer_scroll, 1, 1);
+
+  queuebox = gtk_vbox_new (FALSE, 0);
+  gtk_box_pack_start (GTK_BOX (queuebox), transfer_queue_filter_new (),
+                      FALSE, FALSE, 0);
+  gtk_box_pack_start (GTK_BOX (queuebox), transfer_scroll, TRUE, TRUE, 0);
+  gtk_paned_pack2 (GTK_PANED (dlpane), queuebox, 1, 1);
 
   logpane = gtk_vpaned_new ();
   gtk_paned_pack1 (GTK_PANED (logpane), dlpane, 1, 1);
@@ -1542,6 +1524,7 @@ main (int argc, char **argv)
   gftpui_common_about (ftp_log, NULL);
 
   g_timeout_add (1000, update_downloads, NULL);
+  g_timeout_add (1000 / TRANSFER_PROGRESS_RATE, update_transfer_progress, NULL);
 
   _setup_window1 ();
   _setup_window2 (argc, argv);
@@ -28,6 +28,8 @@
 #include <gdk/gdkkeysyms.h>
 #include <pthread.h>
 
+#define TRANSFER_PROGRESS_RATE	30	/* Progress updates per second */
+
 #define GFTP_MENU_ITEM_ASCII	1
 #define GFTP_MENU_ITEM_BINARY	2
 #define GFTP_MENU_ITEM_WIN1	3
@@ -58,6 +60,21 @@ typedef enum gftp_dialog_button_tag
   gftp_dialog_button_ok
 } gftp_dialog_button;
 
+typedef struct gftp_prefetch_data_tag gftp_prefetch_data;
+
+
+/* The states the files in the transfer window can be filtered by, in the
+   order they are listed in the filter combo box */
+
+typedef enum transfer_queue_state_tag
+{
+  transfer_queue_all,
+  transfer_queue_pending,
+  transfer_queue_active,
+  transfer_queue_failed,
+  transfer_queue_done
+} transfer_queue_state;
+
 typedef struct gftp_window_data_tag
 {
   GtkWidget *combo, 		/* Entry widget/history for the user to enter 
@@ -68,13 +85,19 @@ typedef struct gftp_window_data_tag
                show_selected : 1, /* Show only selected files */
                *histlen;	/* Pointer to length of history */
   char *filespec;		/* Filespec for the listbox */
+  gftp_filespec * compiled_filespec; /* filespec, compiled */
   gftp_request * request;	/* The host that we are connected to */
   GList * files,		/* Files in the listbox */
         ** history;		/* History of the directories */
+  gftp_sort_array * sort_array;	/* Sort keys of files */
   GtkUIManager *ifactory; 	/* This is for the menus that will
                                    come up when you right click */
   pthread_t tid;		/* Thread for the stop button */
   char *prefix_col_str;
+  struct gftp_prefetch_data_tag * prefetch; /* Background listing of the
+                                               subdirectories */
+  struct gftp_list_stream_tag * list_stream; /* Listing that is shown while
+                                                it is received */
 } gftp_window_data;
 
 
@@ -161,7 +184,6 @@ extern GHashTable * pixbuf_hash_table;
 extern GtkActionGroup * menus;
 extern GtkUIManager * factory;
 
-extern pthread_mutex_t log_mutex;
 extern pthread_t main_thread_id;
 extern GList * viewedit_processes;
 
@@ -224,6 +246,9 @@ void listbox_select_row      (gftp_window_data *wdata, int n);
 void listbox_update_filelist (gftp_window_data *wdata);
 int  listbox_num_selected    (gftp_window_data *wdata);
 void listbox_clear           (gftp_window_data *wdata);
+void listbox_hold_files      (gftp_window_data *wdata);
+void listbox_add_files       (gftp_window_data *wdata, GList *files);
+void listbox_add_files_done  (gftp_window_data *wdata);
 void listbox_select_all      (gftp_window_data *wdata);
 void listbox_deselect_all    (gftp_window_data *wdata);
 
@@ -358,14 +383,26 @@ void gftp_gtk_save_bookmark_options 		( void );
 /* platform_specific.c */
 void gftp_gtk_platform_specific_init		( void );
 
+/* prefetch.c */
+void gftp_gtk_prefetch_subdirs			( gftp_window_data * wdata );
+
+void gftp_gtk_prefetch_stop			( gftp_window_data * wdata,
+						  int disconnect );
+
+void gftp_gtk_prefetch_shutdown			( gftp_window_data * wdata );
+
 /* transfer.c */
 int ftp_list_files				( gftp_window_data * wdata );
 
+int gftp_gtk_num_transfers			( void );
+
 int ftp_connect					( gftp_window_data * wdata,
 						  gftp_request * request );
 
 gint update_downloads 				( gpointer data );
 
+gint update_transfer_progress			( gpointer data );
+
 void get_files 					( gpointer data );
 
 void put_files 					( gpointer data );
@@ -389,6 +426,41 @@ void move_transfer_up				( gpointer data );
 
 void move_transfer_down				( gpointer data );
 
+/* transfer_queue.c */
+GtkWidget * transfer_queue_new			( void );
+
+GtkWidget * transfer_queue_filter_new		( void );
+
+void transfer_queue_set_filter			( transfer_queue_state filter );
+
+void transfer_queue_add				( gftp_transfer * tdata );
+
+void transfer_queue_remove			( gftp_transfer * tdata );
+
+void transfer_queue_set_status			( gftp_transfer * tdata,
+						  const char * status );
+
+void transfer_queue_set_progress		( gftp_transfer * tdata,
+						  gftp_file * fle,
+						  const char * progress );
+
+void transfer_queue_file_added			( gftp_transfer * tdata,
+						  GList * curfle );
+
+void transfer_queue_file_finished		( gftp_transfer * tdata,
+						  gftp_file * fle );
+
+void transfer_queue_file_changed		( gftp_transfer * tdata,
+						  gftp_file * fle );
+
+void transfer_queue_file_moved			( gftp_transfer * tdata,
+						  GList * curfle,
+						  GList * other );
+
+int transfer_queue_get_selected			( gftpui_common_curtrans_data * transdata );
+
+int transfer_queue_is_visible			( gftp_transfer * tdata );
+
 /* view_dialog.c */
 void edit_dialog 				( gpointer data );
 
@@ -64,7 +64,7 @@ gftpui_refresh (void *uidata, int clear_cache_entry)
       return;
     }
 
-  remove_files_window (wdata);
+  listbox_hold_files (wdata);
 
   ftp_list_files (wdata);
 
@@ -455,6 +455,7 @@ gftpui_disconnect (void *uidata)
   gftp_window_data * wdata;
 
   wdata = uidata;
+  gftp_gtk_prefetch_stop (wdata, 1);
   gftp_delete_cache_entry (wdata->request, NULL, 1);
   gftp_disconnect (wdata->request);
   remove_files_window (wdata);
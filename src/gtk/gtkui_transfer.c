@@ -56,27 +56,7 @@ gftpui_start_transfer (gftp_transfer * tdata)
 void
 gftpui_add_file_to_transfer (gftp_transfer * tdata, GList * curfle)
 {
-  gftpui_common_curtrans_data * transdata;
-  char *text[2];
-  gftp_file * fle;
-
-  fle = curfle->data;
-  text[0] = gftpui_gtk_get_utf8_file_pos (fle);
-
-  if (fle->transfer_action == GFTP_TRANS_ACTION_SKIP)
-    text[1] = _("Skipped");
-  else
-    text[1] = _("Waiting...");
-
-  fle->user_data = gtk_ctree_insert_node (GTK_CTREE (dlwdw),
-                                          tdata->user_data, NULL, text, 5,
-                                          NULL, NULL, NULL, NULL,
-                                          FALSE, FALSE);
-  transdata = g_malloc0 (sizeof (*transdata));
-  transdata->transfer = tdata;
-  transdata->curfle = curfle;
-
-  gtk_ctree_node_set_row_data (GTK_CTREE (dlwdw), fle->user_data, transdata);
+  transfer_queue_file_added (tdata, curfle);
 }
 
 
@@ -27,17 +27,6 @@
 
 #include "gftp-gtk.h"
 
-typedef struct
-{
-   GdkPixbuf *icon;
-   gchar *filename;
-   gchar *size;
-   gchar *date;
-   gchar *user;
-   gchar *group;
-   gchar *attribs;
-} listbox_columns;
-
 enum
 {
    LISTBOX_COL_ICON,
@@ -50,6 +39,530 @@ enum
    LISTBOX_NUM_COLUMNS
 };
 
+/* ============================================================== *
+ * ListboxModel
+ * ============================================================== */
+
+/*
+  A GtkTreeModel over an array of the gftp_file's that are shown.
+  Nothing is copied into the model, the cells are formatted from the
+  gftp_file when the view asks for them, and the view only asks for
+  the rows that are on screen.
+
+  A refresh of the same directory is applied as a diff (removed rows,
+  a reorder of the rows that are kept, new rows and changed rows), so
+  the selection and the scroll position are kept. The old list is
+  held by the model until the new one has replaced it.
+
+  A listing that is still coming in is merged into the rows batch by
+  batch. The new rows go into a gap that moves from the start to the
+  end of the array, so each batch is one pass over the rows, and the
+  view sees a consistent model after every inserted row.
+*/
+
+#define LISTBOX_DIFF_MAX   1024  /* more changes than this: rebuild */
+
+typedef struct
+{
+   GObject parent;
+   GPtrArray *rows;      /* gftp_file's that are shown */
+   guint gap, gap_len;   /* unused part of rows while merging */
+   GList *held_files;    /* list being refreshed, still in rows */
+   char *directory;      /* directory the rows belong to */
+   gint stamp;
+} ListboxModel;
+
+typedef struct
+{
+   GObjectClass parent_class;
+} ListboxModelClass;
+
+static void listbox_model_tree_model_init (GtkTreeModelIface *iface);
+
+G_DEFINE_TYPE_WITH_CODE (ListboxModel, listbox_model, G_TYPE_OBJECT,
+                         G_IMPLEMENT_INTERFACE (GTK_TYPE_TREE_MODEL,
+                                                listbox_model_tree_model_init))
+
+#define LISTBOX_MODEL(obj) ((ListboxModel *) (obj))
+
+static void
+listbox_model_init (ListboxModel *model)
+{
+   model->rows  = g_ptr_array_new ();
+   model->stamp = g_random_int ();
+}
+
+static void
+listbox_model_finalize (GObject *object)
+{
+   ListboxModel *model = LISTBOX_MODEL (object);
+
+   g_ptr_array_free (model->rows, TRUE);
+   free_file_list (model->held_files);
+   g_free (model->directory);
+
+   G_OBJECT_CLASS (listbox_model_parent_class)->finalize (object);
+}
+
+static void
+listbox_model_class_init (ListboxModelClass *klass)
+{
+   G_OBJECT_CLASS (klass)->finalize = listbox_model_finalize;
+}
+
+static guint
+listbox_model_len (ListboxModel *model)
+{
+   return (model->rows->len - model->gap_len);
+}
+
+static gftp_file *
+listbox_model_row (ListboxModel *model, guint n)
+{
+   if (n >= model->gap) {
+      n += model->gap_len;
+   }
+   return (g_ptr_array_index (model->rows, n));
+}
+
+static gboolean
+listbox_model_set_iter (ListboxModel *model, GtkTreeIter *iter, guint n)
+{
+   if (n >= listbox_model_len (model)) {
+      iter->stamp = 0;
+      return FALSE;
+   }
+   iter->stamp     = model->stamp;
+   iter->user_data = GUINT_TO_POINTER (n);
+   return TRUE;
+}
+
+static GtkTreeModelFlags
+listbox_model_get_flags (GtkTreeModel *tree_model)
+{
+   return (GTK_TREE_MODEL_LIST_ONLY);
+}
+
+static gint
+listbox_model_get_n_columns (GtkTreeModel *tree_model)
+{
+   return (LISTBOX_NUM_COLUMNS);
+}
+
+static GType
+listbox_model_get_column_type (GtkTreeModel *tree_model, gint column)
+{
+   if (column == LISTBOX_COL_ICON) {
+      return (GDK_TYPE_PIXBUF);
+   }
+   return (G_TYPE_STRING);
+}
+
+static gboolean
+listbox_model_get_iter (GtkTreeModel *tree_model, GtkTreeIter *iter,
+                        GtkTreePath *path)
+{
+   if (gtk_tree_path_get_depth (path) != 1) {
+      return FALSE;
+   }
+   return (listbox_model_set_iter (LISTBOX_MODEL (tree_model), iter,
+                                   gtk_tree_path_get_indices (path)[0]));
+}
+
+static GtkTreePath *
+listbox_model_get_path (GtkTreeModel *tree_model, GtkTreeIter *iter)
+{
+   return (gtk_tree_path_new_from_indices (GPOINTER_TO_UINT (iter->user_data),
+                                           -1));
+}
+
+static GdkPixbuf *
+listbox_file_icon (gftp_file * fle)
+{
+   gftp_file_extensions *tempext;
+   GdkPixbuf *icon = NULL;
+
+   if (strcmp (fle->file, "..") == 0) {
+      icon = gftp_get_pixbuf ("dotdot.xpm");
+   } else if (S_ISLNK (fle->st_mode) && S_ISDIR (fle->st_mode)) {
+      icon = gftp_get_pixbuf ("linkdir.xpm");
+   } else if (S_ISLNK (fle->st_mode)) {
+      icon = gftp_get_pixbuf ("linkfile.xpm");
+   } else if (S_ISDIR (fle->st_mode)) {
+      icon = gftp_get_pixbuf ("dir.xpm");
+   } else if ((fle->st_mode & S_IXUSR) ||
+           (fle->st_mode & S_IXGRP) ||
+           (fle->st_mode & S_IXOTH)) {
+      icon = gftp_get_pixbuf ("exe.xpm");
+   } else if ((tempext = gftp_lookup_file_extension (fle->file)) != NULL) {
+      icon = gftp_get_pixbuf (tempext->filename);
+   }
+
+   if (!icon) {
+      icon = gftp_get_pixbuf ("doc.xpm");
+   }
+   return (icon);
+}
+
+static char *
+listbox_file_size_str (gftp_file * fle)
+{
+   if (strcmp (fle->file, "..") == 0 || S_ISDIR (fle->st_mode)) {
+      return (NULL);
+   }
+   if (GFTP_IS_SPECIAL_DEVICE (fle->st_mode)) {
+      return (g_strdup_printf ("%d, %d", major (fle->size),
+                               minor (fle->size)));
+   }
+   return (insert_commas (fle->size, NULL, 0));
+}
+
+static char *
+listbox_file_date_str (gftp_file * fle)
+{
+   char time_str[80] = "";
+   char *zeroseconds;
+   struct tm timeinfo;
+
+   if (!localtime_r (&fle->datetime, &timeinfo)) {
+      return (NULL);
+   }
+   strftime (time_str, sizeof (time_str), "%Y/%m/%d %H:%M:%S ", &timeinfo);
+   zeroseconds = strstr (time_str, ":00 ");
+   if (zeroseconds) *zeroseconds = 0;
+   return (g_strdup (time_str));
+}
+
+static void
+listbox_model_get_value (GtkTreeModel *tree_model, GtkTreeIter *iter,
+                         gint column, GValue *value)
+{
+   ListboxModel *model = LISTBOX_MODEL (tree_model);
+   guint n = GPOINTER_TO_UINT (iter->user_data);
+   gftp_file *fle;
+
+   g_value_init (value, listbox_model_get_column_type (tree_model, column));
+   g_return_if_fail (iter->stamp == model->stamp && n < listbox_model_len (model));
+
+   fle = listbox_model_row (model, n);
+   switch (column)
+   {
+      case LISTBOX_COL_ICON:
+         g_value_set_object (value, listbox_file_icon (fle));
+         break;
+      case LISTBOX_COL_FILENAME:
+         g_value_set_string (value, fle->file);
+         break;
+      case LISTBOX_COL_SIZE:
+         g_value_take_string (value, listbox_file_size_str (fle));
+         break;
+      case LISTBOX_COL_DATE:
+         g_value_take_string (value, listbox_file_date_str (fle));
+         break;
+      case LISTBOX_COL_USER:
+         g_value_set_string (value, fle->user);
+         break;
+      case LISTBOX_COL_GROUP:
+         g_value_set_string (value, fle->group);
+         break;
+      case LISTBOX_COL_ATTRIBS:
+         g_value_take_string (value,
+                              gftp_convert_attributes_from_mode_t (fle->st_mode));
+         break;
+   }
+}
+
+static gboolean
+listbox_model_iter_next (GtkTreeModel *tree_model, GtkTreeIter *iter)
+{
+   return (listbox_model_set_iter (LISTBOX_MODEL (tree_model), iter,
+                                   GPOINTER_TO_UINT (iter->user_data) + 1));
+}
+
+static gboolean
+listbox_model_iter_nth_child (GtkTreeModel *tree_model, GtkTreeIter *iter,
+                              GtkTreeIter *parent, gint n)
+{
+   if (parent != NULL || n < 0) {
+      return FALSE;
+   }
+   return (listbox_model_set_iter (LISTBOX_MODEL (tree_model), iter, n));
+}
+
+static gboolean
+listbox_model_iter_children (GtkTreeModel *tree_model, GtkTreeIter *iter,
+                             GtkTreeIter *parent)
+{
+   return (listbox_model_iter_nth_child (tree_model, iter, parent, 0));
+}
+
+static gboolean
+listbox_model_iter_has_child (GtkTreeModel *tree_model, GtkTreeIter *iter)
+{
+   return FALSE;
+}
+
+static gint
+listbox_model_iter_n_children (GtkTreeModel *tree_model, GtkTreeIter *iter)
+{
+   if (iter != NULL) {
+      return 0;
+   }
+   return (listbox_model_len (LISTBOX_MODEL (tree_model)));
+}
+
+static gboolean
+listbox_model_iter_parent (GtkTreeModel *tree_model, GtkTreeIter *iter,
+                           GtkTreeIter *child)
+{
+   return FALSE;
+}
+
+static void
+listbox_model_tree_model_init (GtkTreeModelIface *iface)
+{
+   iface->get_flags       = listbox_model_get_flags;
+   iface->get_n_columns   = listbox_model_get_n_columns;
+   iface->get_column_type = listbox_model_get_column_type;
+   iface->get_iter        = listbox_model_get_iter;
+   iface->get_path        = listbox_model_get_path;
+   iface->get_value       = listbox_model_get_value;
+   iface->iter_next       = listbox_model_iter_next;
+   iface->iter_children   = listbox_model_iter_children;
+   iface->iter_has_child  = listbox_model_iter_has_child;
+   iface->iter_n_children = listbox_model_iter_n_children;
+   iface->iter_nth_child  = listbox_model_iter_nth_child;
+   iface->iter_parent     = listbox_model_iter_parent;
+}
+
+static ListboxModel *
+listbox_get_model (gftp_window_data *wdata)
+{
+   return (LISTBOX_MODEL (gtk_tree_view_get_model (GTK_TREE_VIEW (wdata->listbox))));
+}
+
+static gftp_file *
+listbox_model_get_file (ListboxModel *model, GtkTreeIter *iter)
+{
+   guint n = GPOINTER_TO_UINT (iter->user_data);
+
+   g_return_val_if_fail (iter->stamp == model->stamp, NULL);
+   if (n >= listbox_model_len (model)) {
+      return NULL;
+   }
+   return (listbox_model_row (model, n));
+}
+
+static void
+listbox_model_emit (ListboxModel *model, guint n, gboolean inserted)
+{
+   GtkTreePath *path = gtk_tree_path_new_from_indices (n, -1);
+   GtkTreeIter iter;
+
+   listbox_model_set_iter (model, &iter, n);
+   if (inserted) {
+      gtk_tree_model_row_inserted (GTK_TREE_MODEL (model), path, &iter);
+   } else {
+      gtk_tree_model_row_changed (GTK_TREE_MODEL (model), path, &iter);
+   }
+   gtk_tree_path_free (path);
+}
+
+/* replace all of the rows. The model is taken off the view while the
+ * rows change, so the view builds its rows once instead of handling
+ * a signal per row */
+static void
+listbox_model_reset (gftp_window_data *wdata, GPtrArray *newrows)
+{
+   GtkTreeView  *tree  = GTK_TREE_VIEW (wdata->listbox);
+   ListboxModel *model = listbox_get_model (wdata);
+   GPtrArray *oldrows;
+
+   g_object_ref (model);
+   gtk_tree_view_set_model (tree, NULL);
+
+   oldrows = model->rows;
+   model->rows = newrows;
+   g_ptr_array_free (oldrows, TRUE);
+   model->stamp++;
+
+   gtk_tree_view_set_model (tree, GTK_TREE_MODEL (model));
+   g_object_unref (model);
+}
+
+static int
+listbox_file_changed (gftp_file *oldfle, gftp_file *newfle)
+{
+   return (oldfle->size != newfle->size ||
+           oldfle->datetime != newfle->datetime ||
+           oldfle->st_mode != newfle->st_mode ||
+           g_strcmp0 (oldfle->user, newfle->user) != 0 ||
+           g_strcmp0 (oldfle->group, newfle->group) != 0);
+}
+
+/* apply the difference between the rows and newrows, where rows with
+ * the same file name are the same row. Returns 0 when there are too
+ * many changes, and nothing was done */
+static int
+listbox_model_diff (ListboxModel *model, GPtrArray *newrows)
+{
+   GPtrArray *rows = model->rows;
+   GHashTable *oldpos;
+   gint *oldidx, *keep, *new_order;
+   gftp_file *fle, *oldfle;
+   guint i, j, k, old_len, num_kept, changes;
+   gpointer value, *kept;
+   GtkTreePath *path;
+   int reordered;
+
+   /* match the new rows to the old ones by name */
+   oldpos = g_hash_table_new (g_str_hash, g_str_equal);
+   for (i = 0; i < rows->len; i++) {
+      fle = g_ptr_array_index (rows, i);
+      g_hash_table_insert (oldpos, fle->file, GUINT_TO_POINTER (i + 1));
+   }
+
+   oldidx = g_new (gint, newrows->len + 1);
+   num_kept = 0;
+   for (j = 0; j < newrows->len; j++) {
+      fle = g_ptr_array_index (newrows, j);
+      value = g_hash_table_lookup (oldpos, fle->file);
+      oldidx[j] = GPOINTER_TO_UINT (value) - 1;
+      if (value != NULL) {
+         g_hash_table_remove (oldpos, fle->file);
+         num_kept++;
+      }
+   }
+   g_hash_table_destroy (oldpos);
+
+   changes = (rows->len - num_kept) + (newrows->len - num_kept);
+   if (changes > LISTBOX_DIFF_MAX) {
+      g_free (oldidx);
+      return 0;
+   }
+
+   /* 1. removed rows, from the end so the indexes stay valid */
+   old_len = rows->len;
+   keep = g_new0 (gint, old_len + 1);
+   for (j = 0; j < newrows->len; j++) {
+      if (oldidx[j] >= 0) {
+         keep[oldidx[j]] = 1;
+      }
+   }
+   for (i = old_len; i-- > 0; ) {
+      if (!keep[i]) {
+         g_ptr_array_remove_index (rows, i);
+         model->stamp++;
+         path = gtk_tree_path_new_from_indices (i, -1);
+         gtk_tree_model_row_deleted (GTK_TREE_MODEL (model), path);
+         gtk_tree_path_free (path);
+      }
+   }
+
+   /* oldidx[] becomes the index in the rows that are left */
+   for (i = 0, k = 0; i < old_len; i++) {
+      keep[i] = keep[i] ? (gint) k++ : -1;
+   }
+   for (j = 0; j < newrows->len; j++) {
+      if (oldidx[j] >= 0) {
+         oldidx[j] = keep[oldidx[j]];
+      }
+   }
+   g_free (keep);
+
+   /* 2. the kept rows in their new order */
+   new_order = g_new (gint, num_kept + 1);
+   reordered = 0;
+   for (i = 0, j = 0; j < newrows->len; j++) {
+      if (oldidx[j] >= 0) {
+         new_order[i] = oldidx[j];
+         if (new_order[i] != (gint) i) {
+            reordered = 1;
+         }
+         i++;
+      }
+   }
+   if (reordered) {
+      kept = g_new (gpointer, num_kept + 1);
+      for (i = 0; i < num_kept; i++) {
+         kept[i] = g_ptr_array_index (rows, new_order[i]);
+      }
+      memcpy (rows->pdata, kept, num_kept * sizeof (gpointer));
+      g_free (kept);
+      model->stamp++;
+      path = gtk_tree_path_new ();
+      gtk_tree_model_rows_reordered (GTK_TREE_MODEL (model), path, NULL,
+                                     new_order);
+      gtk_tree_path_free (path);
+   }
+   g_free (new_order);
+
+   /* 3. new rows, in order so each one goes in at its final index */
+   for (j = 0; j < newrows->len; j++) {
+      if (oldidx[j] < 0) {
+         g_ptr_array_add (rows, NULL);
+         memmove (&rows->pdata[j + 1], &rows->pdata[j],
+                  (rows->len - j - 1) * sizeof (gpointer));
+         rows->pdata[j] = g_ptr_array_index (newrows, j);
+         model->stamp++;
+         listbox_model_emit (model, j, TRUE);
+      }
+   }
+
+   /* 4. the kept rows now point to the new gftp_file's */
+   for (j = 0; j < newrows->len; j++) {
+      oldfle = g_ptr_array_index (rows, j);
+      fle = g_ptr_array_index (newrows, j);
+      rows->pdata[j] = fle;
+      if (oldidx[j] >= 0 && oldfle != fle && listbox_file_changed (oldfle, fle)) {
+         listbox_model_emit (model, j, FALSE);
+      }
+   }
+
+   g_free (oldidx);
+   g_ptr_array_free (newrows, TRUE);
+   return 1;
+}
+
+/* insert the num_new files of files that are shown and are not rows
+ * yet. files must have the rows in the same order. The walk stops at the
+ * last new row */
+static void
+listbox_model_merge (ListboxModel *model, GList *files, guint num_new)
+{
+   GPtrArray *rows = model->rows;
+   GList *templist;
+   gftp_file *fle;
+   guint old_len;
+
+   /* the shown rows go to the end, the gap is in front of them */
+   old_len = rows->len;
+   g_ptr_array_set_size (rows, old_len + num_new);
+   memmove (&rows->pdata[num_new], rows->pdata, old_len * sizeof (gpointer));
+   model->gap = 0;
+   model->gap_len = num_new;
+
+   for (templist = files; templist != NULL && model->gap_len > 0;
+        templist = templist->next) {
+      fle = templist->data;
+      if (model->gap + model->gap_len < rows->len &&
+          rows->pdata[model->gap + model->gap_len] == fle) {
+         /* a shown row, it moves to the front of the gap */
+         rows->pdata[model->gap++] = fle;
+      } else if (fle->shown) {
+         rows->pdata[model->gap++] = fle;
+         model->gap_len--;
+         model->stamp++;
+         listbox_model_emit (model, model->gap - 1, TRUE);
+      }
+   }
+
+   if (model->gap_len > 0) {
+      g_ptr_array_remove_range (rows, model->gap, model->gap_len);
+   }
+   model->gap = model->gap_len = 0;
+}
+
 /* ============================================================== *
  * create_listbox()
  * ============================================================== */
@@ -62,19 +575,7 @@ create_listbox(gftp_window_data *wdata) {
    GtkTreeSelection *tree_sel;
 
    /* model defines data types and number of "columns" */
-   // see gtk_list_store_set
-   GtkListStore *store;
-   store = gtk_list_store_new (LISTBOX_NUM_COLUMNS,
-                               GDK_TYPE_PIXBUF,
-                               G_TYPE_STRING,
-                               G_TYPE_STRING,
-                               G_TYPE_STRING,
-                               G_TYPE_STRING,
-                               G_TYPE_STRING,
-                               G_TYPE_STRING,
-                               G_TYPE_UINT);
-
-   tree_model = GTK_TREE_MODEL (store);
+   tree_model = g_object_new (listbox_model_get_type (), NULL);
 
    //-------------------------------------------------------------------
    treeview = GTK_TREE_VIEW (gtk_tree_view_new_with_model (tree_model));
@@ -256,10 +757,41 @@ listbox_add_columns (gftp_window_data *wdata)
  * listbox_sort_rows()
  * ============================================================== */
 
+static void
+listbox_set_sort_icon (gftp_window_data *wdata, intptr_t sortasds)
+{
+   GtkTreeView *listbox = GTK_TREE_VIEW (wdata->listbox);
+   GtkWidget *icon0;
+
+   if (sortasds) {
+      icon0 = gtk_image_new_from_icon_name ("view-sort-ascending",
+                                          GTK_ICON_SIZE_SMALL_TOOLBAR);
+   } else {
+      icon0 = gtk_image_new_from_icon_name ("view-sort-descending",
+                                          GTK_ICON_SIZE_SMALL_TOOLBAR);
+   }
+   gtk_tree_view_column_set_widget (gtk_tree_view_get_column (listbox,0), icon0);
+   gtk_widget_show (icon0);
+}
+
+static void
+listbox_lookup_sort (gftp_window_data *wdata, intptr_t *sortcol,
+                     intptr_t *sortasds)
+{
+   char option_name[25];
+
+   g_snprintf (option_name, sizeof (option_name), "%s_sortcol",
+              wdata->prefix_col_str);
+   gftp_lookup_global_option (option_name, sortcol);
+   g_snprintf (option_name, sizeof (option_name), "%s_sortasds",
+              wdata->prefix_col_str);
+   gftp_lookup_global_option (option_name, sortasds);
+}
+
 void
 listbox_sort_rows (gpointer data, gint column)
 {
-   /* gftp_sort_filelist() does the job, then listbox_update_filelist()
+   /* gftp_sort_array_sort() does the job, then listbox_update_filelist()
     * populates the listbox with the new info from wdata->files */
 
    //fprintf(stderr, "listbox_sort_rows\n");
@@ -267,16 +799,13 @@ listbox_sort_rows (gpointer data, gint column)
    char sortasds_name[25];
    gftp_window_data * wdata = data;
    intptr_t sortcol, sortasds;
-   GtkWidget * icon0;
    int swap_col;
-   GtkTreeView *listbox = GTK_TREE_VIEW (wdata->listbox);
 
    g_snprintf (sortcol_name, sizeof (sortcol_name), "%s_sortcol",
               wdata->prefix_col_str);
-   gftp_lookup_global_option (sortcol_name, &sortcol);
    g_snprintf (sortasds_name, sizeof (sortasds_name), "%s_sortasds",
               wdata->prefix_col_str);
-   gftp_lookup_global_option (sortasds_name, &sortasds);
+   listbox_lookup_sort (wdata, &sortcol, &sortasds);
 
    if (column == -1)
       column = sortcol;
@@ -291,16 +820,7 @@ listbox_sort_rows (gpointer data, gint column)
 
    if (swap_col || !wdata->sorted)
    {
-      icon0 = gtk_tree_view_column_get_widget (gtk_tree_view_get_column (listbox,0));
-      if (sortasds) {
-         icon0 = gtk_image_new_from_icon_name ("view-sort-ascending",
-                                             GTK_ICON_SIZE_SMALL_TOOLBAR);
-      } else {
-         icon0 = gtk_image_new_from_icon_name ("view-sort-descending",
-                                             GTK_ICON_SIZE_SMALL_TOOLBAR);
-      }
-      gtk_tree_view_column_set_widget (gtk_tree_view_get_column (listbox,0), icon0);
-      gtk_widget_show (icon0);
+      listbox_set_sort_icon (wdata, sortasds);
    }
    else {
       sortcol = column;
@@ -310,7 +830,17 @@ listbox_sort_rows (gpointer data, gint column)
    if (!GFTP_IS_CONNECTED (wdata->request))
       return;
 
-   wdata->files = gftp_sort_filelist (wdata->files, sortcol, sortasds);
+   /* The sort keys are kept until the listing changes, so clicking on
+    * another column does not build them again */
+   if (wdata->sort_array != NULL &&
+       gftp_sort_array_get_list (wdata->sort_array) != wdata->files) {
+      gftp_sort_array_free (wdata->sort_array);
+      wdata->sort_array = NULL;
+   }
+   if (wdata->sort_array == NULL)
+      wdata->sort_array = gftp_sort_array_new (wdata->files);
+
+   wdata->files = gftp_sort_array_sort (wdata->sort_array, sortcol, sortasds);
 
    listbox_update_filelist(wdata);
 
@@ -318,130 +848,32 @@ listbox_sort_rows (gpointer data, gint column)
 }
 
 /* ============================================================== *
- *     listbox_add_file() + listbox_update_filelist()
+ *     listbox_update_filelist()
  * ============================================================== */ 
 
-static void
-listbox_add_file (gftp_window_data * wdata, gftp_file * fle)
+static int
+listbox_file_is_shown (gftp_window_data * wdata, gftp_file * fle)
 {
-   char time_str[80] = "";
-   struct tm timeinfo;
-   gftp_config_list_vars *tmplistvar;
-   gftp_file_extensions  *tempext;
-   GList                 *templist;
-   size_t stlen;
-   int empty_size = 0;
-
-   GtkTreeView  *tree  = GTK_TREE_VIEW(wdata->listbox);
-   GtkListStore *store = GTK_LIST_STORE (gtk_tree_view_get_model (tree));
-   GtkTreeIter  iter;
-
-   listbox_columns col_data;
-   memset(&col_data, 0, sizeof(col_data));
-
    if (wdata->show_selected) {
       fle->shown = fle->was_sel;
-      if (!fle->shown) {
-         return;
-      }
-   } else if (!gftp_match_filespec (wdata->request, fle->file, wdata->filespec)) {
+   } else if (!gftp_filespec_match_file (wdata->compiled_filespec, fle)) {
       fle->shown = 0;
       fle->was_sel = 0;
-      return;
    } else {
       fle->shown = 1;
    }
-
-   gtk_list_store_append (store, &iter);
-
-   if (strcmp (fle->file, "..") == 0) {
-      col_data.icon = gftp_get_pixbuf("dotdot.xpm");
-      empty_size = 1;
-   } else if (S_ISLNK (fle->st_mode) && S_ISDIR (fle->st_mode)) {
-      col_data.icon = gftp_get_pixbuf("linkdir.xpm");
-      empty_size = 1;
-   } else if (S_ISLNK (fle->st_mode)) {
-      col_data.icon = gftp_get_pixbuf("linkfile.xpm");
-   } else if (S_ISDIR (fle->st_mode)) {
-      col_data.icon = gftp_get_pixbuf("dir.xpm");
-      empty_size = 1;
-   } else if ((fle->st_mode & S_IXUSR) ||
-           (fle->st_mode & S_IXGRP) ||
-           (fle->st_mode & S_IXOTH)) {
-      col_data.icon = gftp_get_pixbuf("exe.xpm");
-   } else {
-      stlen = strlen (fle->file);
-      gftp_lookup_global_option ("ext", &tmplistvar);
-      templist = tmplistvar->list;
-      while (templist != NULL)
-      {
-         tempext = templist->data;
-         if (stlen >= tempext->stlen &&
-             strcmp (&fle->file[stlen - tempext->stlen], tempext->ext) == 0)
-         {
-            col_data.icon = gftp_get_pixbuf(tempext->filename);
-            break;
-         }
-         templist = templist->next;
-      }
-   }
-
-   if (!col_data.icon) {
-      col_data.icon = gftp_get_pixbuf ("doc.xpm");
-   }
-
-   if (fle->file) {
-      col_data.filename = fle->file;
-   }
-
-   if (empty_size) {
-      col_data.size = NULL;
-   }
-   else {
-      if (GFTP_IS_SPECIAL_DEVICE (fle->st_mode)) {
-         col_data.size = g_strdup_printf ("%d, %d", major (fle->size),
-                               minor (fle->size));
-      }else{
-         col_data.size = insert_commas (fle->size, NULL, 0);
-      }
-   }
-
-   if (localtime_r( &fle->datetime, &timeinfo )) {
-      strftime(time_str, sizeof(time_str), "%Y/%m/%d %H:%M:%S ", &timeinfo);
-      char *zeroseconds = strstr(time_str, ":00 ");
-      if (zeroseconds) *zeroseconds = 0;
-      col_data.date = time_str;
-   }
-
-   if (fle->user) {
-      col_data.user = fle->user;
-   }
-   if (fle->group) {
-      col_data.group = fle->group;
-   }
-
-   col_data.attribs = gftp_convert_attributes_from_mode_t (fle->st_mode);
-
-   gtk_list_store_set (store, &iter,
-                       LISTBOX_COL_ICON,     col_data.icon,
-                       LISTBOX_COL_FILENAME, col_data.filename,
-                       LISTBOX_COL_SIZE,     col_data.size,
-                       LISTBOX_COL_DATE,     col_data.date,
-                       LISTBOX_COL_USER,     col_data.user,
-                       LISTBOX_COL_GROUP,    col_data.group,
-                       LISTBOX_COL_ATTRIBS,  col_data.attribs,
-                      -1);
-
-   if (col_data.size)    g_free (col_data.size);
-   if (col_data.attribs) g_free (col_data.attribs);
+   return (fle->shown);
 }
 
 void
 listbox_update_filelist(gftp_window_data * wdata)
 {
    // use wdata->files to populate the listbox
+   ListboxModel *model = listbox_get_model (wdata);
    GList     *templist, *igl;
+   GPtrArray *newrows;
    gftp_file *gftpFile;
+   char      *directory;
    int        only_selected = 0;
 
    if (wdata->show_selected == 1 && listbox_num_selected(wdata) > 0) {
@@ -463,22 +895,141 @@ listbox_update_filelist(gftp_window_data * wdata)
       g_list_free (templist);
    }
 
-   listbox_clear(wdata);
+   // the files remember whether they matched, so this is only compiled
+   // again when the filespec or the options change
+   wdata->compiled_filespec = gftp_filespec_update (wdata->request,
+                                                    wdata->compiled_filespec,
+                                                    wdata->filespec);
 
-   // fill listbox again
-   templist = wdata->files; 
-   while (templist)
+   newrows = g_ptr_array_sized_new (model->rows->len + 1);
+   for (templist = wdata->files; templist != NULL; templist = templist->next)
    {
       gftpFile = (gftp_file *) templist->data;
-      listbox_add_file (wdata, gftpFile);
-      templist = templist->next;
+      if (listbox_file_is_shown (wdata, gftpFile)) {
+         g_ptr_array_add (newrows, gftpFile);
+      }
+   }
+
+   // same directory: only apply what changed, so the selection and the
+   // scroll position are kept. Otherwise start over
+   directory = wdata->request != NULL ? wdata->request->directory : NULL;
+   if (model->rows->len == 0 || newrows->len == 0 ||
+       g_strcmp0 (model->directory, directory) != 0 ||
+       !listbox_model_diff (model, newrows)) {
+      listbox_model_reset (wdata, newrows);
    }
 
+   g_free (model->directory);
+   model->directory = g_strdup (directory);
+   free_file_list (model->held_files);
+   model->held_files = NULL;
+
    if (only_selected) {
       listbox_select_all (wdata);
    }
 }
 
+/* keep showing the files while the directory is listed again. The
+ * next listbox_update_filelist() compares the new listing to them */
+void
+listbox_hold_files (gftp_window_data *wdata)
+{
+   ListboxModel *model = listbox_get_model (wdata);
+
+   wdata->show_selected = 0;
+   gftp_sort_array_free (wdata->sort_array);
+   wdata->sort_array = NULL;
+   model->held_files = g_list_concat (wdata->files, model->held_files);
+   wdata->files = NULL;
+}
+
+/* add a batch of a listing that is still coming in. The files go into
+ * wdata->files in the sort order, and are shown right away unless they
+ * are a refresh of the files that the listbox holds */
+void
+listbox_add_files (gftp_window_data *wdata, GList *files)
+{
+   ListboxModel *model = listbox_get_model (wdata);
+   intptr_t sortcol, sortasds;
+   GPtrArray *newfiles;
+   GList *templist;
+   char *directory;
+   guint i, num_new;
+   int keeps_order;
+
+   listbox_lookup_sort (wdata, &sortcol, &sortasds);
+   if (!wdata->sorted) {
+      listbox_set_sort_icon (wdata, sortasds);
+      wdata->sorted = 1;
+   }
+
+   if (wdata->sort_array != NULL &&
+       gftp_sort_array_get_list (wdata->sort_array) != wdata->files) {
+      gftp_sort_array_free (wdata->sort_array);
+      wdata->sort_array = NULL;
+   }
+   if (wdata->sort_array == NULL) {
+      wdata->sort_array = gftp_sort_array_new (wdata->files);
+   }
+
+   /* the batch is linked into wdata->files by the sort, so its files
+    * are kept aside to look at only them afterwards */
+   newfiles = g_ptr_array_new ();
+   for (templist = files; templist != NULL; templist = templist->next) {
+      g_ptr_array_add (newfiles, templist->data);
+   }
+
+   keeps_order = gftp_sort_array_keeps_order (wdata->sort_array, sortcol,
+                                              sortasds);
+   wdata->files = gftp_sort_array_add (wdata->sort_array, files, sortcol,
+                                       sortasds);
+
+   /* a refresh is diffed against the held files when it is complete.
+    * Another directory replaces them with the first batch, and a new
+    * order of the files that are shown is applied as a diff */
+   directory = wdata->request != NULL ? wdata->request->directory : NULL;
+   if (model->held_files != NULL && g_strcmp0 (model->directory, directory) == 0) {
+      g_ptr_array_free (newfiles, TRUE);
+      return;
+   }
+   if (model->rows->len == 0 || g_strcmp0 (model->directory, directory) != 0 ||
+       !keeps_order) {
+      g_ptr_array_free (newfiles, TRUE);
+      listbox_update_filelist (wdata);
+      return;
+   }
+
+   wdata->compiled_filespec = gftp_filespec_update (wdata->request,
+                                                    wdata->compiled_filespec,
+                                                    wdata->filespec);
+
+   num_new = 0;
+   for (i = 0; i < newfiles->len; i++) {
+      if (listbox_file_is_shown (wdata, g_ptr_array_index (newfiles, i))) {
+         num_new++;
+      }
+   }
+   g_ptr_array_free (newfiles, TRUE);
+
+   if (num_new > 0) {
+      listbox_model_merge (model, wdata->files, num_new);
+   }
+}
+
+/* the listing that listbox_add_files() got is complete */
+void
+listbox_add_files_done (gftp_window_data *wdata)
+{
+   ListboxModel *model = listbox_get_model (wdata);
+   char *directory;
+
+   directory = wdata->request != NULL ? wdata->request->directory : NULL;
+   if (model->held_files != NULL ||
+       g_strcmp0 (model->directory, directory) != 0) {
+      listbox_update_filelist (wdata);
+   }
+}
+
 // ==============================================================
 
 int
@@ -490,9 +1041,12 @@ listbox_num_selected (gftp_window_data *wdata) {
 }
 
 void listbox_clear (gftp_window_data *wdata) {
-   GtkTreeView  *tree  = GTK_TREE_VIEW  (wdata->listbox);
-   GtkListStore *store = GTK_LIST_STORE (gtk_tree_view_get_model (tree));
-   gtk_list_store_clear (store);
+   ListboxModel *model = listbox_get_model (wdata);
+   listbox_model_reset (wdata, g_ptr_array_new ());
+   free_file_list (model->held_files);
+   model->held_files = NULL;
+   g_free (model->directory);
+   model->directory = NULL;
 }
 
 void
@@ -592,25 +1146,24 @@ selected_1_foreach_func (GtkTreeModel *model,
                             GtkTreeIter  *iter,
                             gpointer      userdata)
 {
-   char **filename = (char **) userdata;
-   gtk_tree_model_get (model, iter, LISTBOX_COL_FILENAME, filename, -1);
+   gftp_file **gftpFile = (gftp_file **) userdata;
+   *gftpFile = listbox_model_get_file (LISTBOX_MODEL (model), iter);
 }
 
 gftp_file *
 listbox_get_selected_file1 (gftp_window_data *wdata)
 {
-   // retrieve selected file name from listbox
-   char *filename = NULL;
+   // retrieve the selected file from the listbox model
+   gftp_file *gftpFile = NULL;
    GtkTreeView      *tree = GTK_TREE_VIEW (wdata->listbox);
    GtkTreeSelection *tsel = gtk_tree_view_get_selection (tree);
 
-   gtk_tree_selection_selected_foreach(tsel, selected_1_foreach_func, &filename);
-   if (!filename) {
+   gtk_tree_selection_selected_foreach(tsel, selected_1_foreach_func, &gftpFile);
+   if (!gftpFile) {
       fprintf(stderr, "listbox.c: ERROR, could not retrieve filename...\n");
    }
 
-   // find the corresponding gftp_file
-   return (find_gftp_file_by_name (wdata->files, filename, FALSE));
+   return (gftpFile);
 }
 
 /* listbox_get_selected_files() */
@@ -628,7 +1181,6 @@ listbox_get_selected_files (gftp_window_data *wdata)
    GtkTreeModel    *model = GTK_TREE_MODEL (gtk_tree_view_get_model (tree));
    GtkTreeIter       iter;
    GtkTreePath     *tpath = NULL;
-   char         *filename = NULL;
 
    gftp_file    *gftpFile = NULL;
    GList    *out_filelist = NULL;
@@ -637,24 +1189,20 @@ listbox_get_selected_files (gftp_window_data *wdata)
    {
       tpath = (GtkTreePath *) i->data;
 
-      gtk_tree_model_get_iter (model, &iter, tpath);
-      gtk_tree_model_get      (model, &iter,
-                               LISTBOX_COL_FILENAME, &filename, -1);
-      //fprintf(stderr, "list: %s\n", filename);
-
-      // find the corresponding gftp_file
-      gftpFile = find_gftp_file_by_name (wdata->files, filename, FALSE);
-      if (gftpFile) {
-         out_filelist = g_list_append(out_filelist, gftpFile);
+      // the rows point to the gftp_file, no need to look it up by name
+      if (gtk_tree_model_get_iter (model, &iter, tpath)) {
+         gftpFile = listbox_model_get_file (LISTBOX_MODEL (model), &iter);
+         if (gftpFile) {
+            out_filelist = g_list_prepend (out_filelist, gftpFile);
+         }
       }
 
-      g_free(filename);
       i = i->next;
    }
 
    g_list_free_full (selrows, (GDestroyNotify) gtk_tree_path_free);
 
-   return (out_filelist);
+   return (g_list_reverse (out_filelist));
 }
 
 // ==============================================================
@@ -667,7 +1215,9 @@ listbox_set_default_column_width (gftp_window_data *wdata)
 
    char tempstr[50];
    int colwidth;
+   int autosize = 0;
    GtkTreeViewColumn *tcol;
+   GdkPixbuf *icon;
 
    static char *column_str[LISTBOX_NUM_COLUMNS] = {
       "icon", "file", "size", "date", "user", "group", "attribs"
@@ -693,12 +1243,25 @@ listbox_set_default_column_width (gftp_window_data *wdata)
       }
       else if (colwidth == 0) {
          gtk_tree_view_column_set_sizing (tcol, GTK_TREE_VIEW_COLUMN_AUTOSIZE);
+         autosize = 1;
       }
       else if (colwidth == -1) {
          // make column invisible
+         gtk_tree_view_column_set_sizing (tcol, GTK_TREE_VIEW_COLUMN_FIXED);
          gtk_tree_view_column_set_visible (tcol, FALSE);
       }
    }
+
+   // with no auto sized column all rows have the same height, and the
+   // view does not have to measure the rows that are not on screen
+   if (!autosize) {
+      icon = gftp_get_pixbuf ("doc.xpm");
+      tcol = gtk_tree_view_get_column (tree, LISTBOX_COL_ICON);
+      gtk_tree_view_column_set_sizing (tcol, GTK_TREE_VIEW_COLUMN_FIXED);
+      gtk_tree_view_column_set_fixed_width (tcol,
+                                            icon ? gdk_pixbuf_get_width (icon) + 8 : 24);
+      gtk_tree_view_set_fixed_height_mode (tree, TRUE);
+   }
 }
 
 // ==============================================================
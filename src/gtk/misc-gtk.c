@@ -26,27 +26,103 @@ remove_files_window (gftp_window_data * wdata)
 {
   wdata->show_selected = 0;
   listbox_clear(wdata);
+  gftp_sort_array_free (wdata->sort_array);
+  wdata->sort_array = NULL;
   free_file_list (wdata->files);
   wdata->files = NULL;
 }
 
 
+/* Appends a batch of messages to the log window and the log file. The
+   window is scrolled and trimmed once for the whole batch */
+static void
+_ftp_log_show (GList * logs)
+{
+  uintptr_t max_log_window_size;
+  GtkTextBuffer * textbuf;
+  GtkTextIter iter, iter2;
+  gftp_log * templog;
+  GList * templist;
+  const char *descr;
+  gint delsize;
+  size_t len;
+  int upd;
+
+  for (templist = logs; templist != NULL; templist = templist->next)
+    {
+      templog = templist->data;
+      gftp_log_file_write (templog->type, templog->msg);
+    }
+  gftp_log_file_flush ();
+
+  upd = logwdw_vadj->upper - logwdw_vadj->page_size == logwdw_vadj->value;
+
+  gftp_lookup_global_option ("max_log_window_size", &max_log_window_size);
+
+  textbuf = gtk_text_view_get_buffer (GTK_TEXT_VIEW (logwdw));
+  len = gtk_text_buffer_get_char_count (textbuf);
+  gtk_text_buffer_get_iter_at_offset (textbuf, &iter, len);
+
+  for (templist = logs; templist != NULL; templist = templist->next)
+    {
+      templog = templist->data;
+      switch (templog->type)
+        {
+          case gftp_logging_send:
+            descr = "send";
+            break;
+          case gftp_logging_recv:
+            descr = "recv";
+            break;
+          case gftp_logging_error:
+            descr = "error";
+            break;
+          default:
+            descr = "misc";
+            break;
+        }
+
+      /* The iter is moved to the end of the inserted text */
+      gtk_text_buffer_insert_with_tags_by_name (textbuf, &iter, templog->msg,
+                                                -1, descr, NULL);
+      len += g_utf8_strlen (templog->msg, -1);
+    }
+
+  if (upd)
+    {
+      gtk_text_buffer_move_mark (textbuf, logwdw_textmark, &iter);
+      gtk_text_view_scroll_to_mark (GTK_TEXT_VIEW (logwdw), logwdw_textmark,
+                                     0, 1, 1, 1);
+    }
+
+  if (max_log_window_size > 0)
+    {
+      delsize = len - max_log_window_size;
+
+      if (delsize > 0)
+        {
+          gtk_text_buffer_get_iter_at_offset (textbuf, &iter, 0);
+          gtk_text_buffer_get_iter_at_offset (textbuf, &iter2, delsize);
+          gtk_text_buffer_delete (textbuf, &iter, &iter2);
+        }
+    }
+}
+
+
 void
 ftp_log (gftp_logging_level level, gftp_request * request, 
          const char *string, ...)
 {
-  uintptr_t max_log_window_size;
-  int upd, free_logstr;
-  gftp_log * newlog;
-  gint delsize;
+  int free_logstr;
+  gftp_log newlog;
   char *logstr;
   va_list argp;
-  size_t len;
-  GtkTextBuffer * textbuf;
-  GtkTextIter iter, iter2;
-  const char *descr;
   char *utf8_str;
   size_t destlen;
+  GList logs;
+
+  if (!gftp_logging_wanted (level))
+    return;
 
   va_start (argp, string);
   if (strcmp (string, "%s") == 0)
@@ -73,81 +149,18 @@ ftp_log (gftp_logging_level level, gftp_request * request,
 
   if (pthread_self () != main_thread_id)
     {
-      newlog = g_malloc0 (sizeof (*newlog));
-      newlog->type = level;
-      if (free_logstr)
-        newlog->msg = logstr;
-      else
-        newlog->msg = g_strdup (logstr);
-
-      pthread_mutex_lock (&log_mutex);
-      gftp_file_transfer_logs = g_list_append (gftp_file_transfer_logs, newlog);
-      pthread_mutex_unlock (&log_mutex);
+      gftp_log_queue (level, free_logstr ? logstr : g_strdup (logstr));
       return;
     }
 
-  if (gftp_logfd != NULL && level != gftp_logging_misc_nolog)
-    {
-      if (fwrite (logstr, strlen (logstr), 1, gftp_logfd) != 1)
-        {
-          fclose (gftp_logfd);
-          gftp_logfd = NULL;
-        }
-      else
-        {
-          fflush (gftp_logfd);
-          if (ferror (gftp_logfd))
-            {
-              fclose (gftp_logfd);
-              gftp_logfd = NULL;
-            }
-        }
-    }
+  /* Whatever the other threads logged comes first */
+  display_cached_logs ();
 
-  upd = logwdw_vadj->upper - logwdw_vadj->page_size == logwdw_vadj->value;
-
-  gftp_lookup_global_option ("max_log_window_size", &max_log_window_size);
-
-  switch (level)
-    {
-      case gftp_logging_send:
-        descr = "send";
-        break;
-      case gftp_logging_recv:
-        descr = "recv";
-        break;
-      case gftp_logging_error:
-        descr = "error";
-        break;
-      default:
-        descr = "misc";
-        break;
-    }
-
-  textbuf = gtk_text_view_get_buffer (GTK_TEXT_VIEW (logwdw));
-  len = gtk_text_buffer_get_char_count (textbuf);
-  gtk_text_buffer_get_iter_at_offset (textbuf, &iter, len);
-  gtk_text_buffer_insert_with_tags_by_name (textbuf, &iter, logstr, -1, 
-                                            descr, NULL);
-
-  if (upd)
-    {
-      gtk_text_buffer_move_mark (textbuf, logwdw_textmark, &iter);
-      gtk_text_view_scroll_to_mark (GTK_TEXT_VIEW (logwdw), logwdw_textmark,
-                                     0, 1, 1, 1);
-    }
-
-  if (max_log_window_size > 0)
-    {
-      delsize = len + g_utf8_strlen (logstr, -1) - max_log_window_size;
-
-      if (delsize > 0)
-        {
-          gtk_text_buffer_get_iter_at_offset (textbuf, &iter, 0);
-          gtk_text_buffer_get_iter_at_offset (textbuf, &iter2, delsize);
-          gtk_text_buffer_delete (textbuf, &iter, &iter2);
-        }
-    }
+  newlog.type = level;
+  newlog.msg = logstr;
+  logs.data = &newlog;
+  logs.next = logs.prev = NULL;
+  _ftp_log_show (&logs);
 
   if (free_logstr)
     g_free (logstr);
@@ -869,22 +882,20 @@ void
 display_cached_logs (void)
 {
   gftp_log * templog;
-  GList * templist; 
+  GList * templist, * logs;
 
-  pthread_mutex_lock (&log_mutex);
-  templist = gftp_file_transfer_logs;
-  while (templist != NULL)
-    { 
-      templog = (gftp_log *) templist->data;
-      ftp_log (templog->type, NULL, "%s", templog->msg);
+  if ((logs = gftp_log_get_queued ()) == NULL)
+    return;
+
+  _ftp_log_show (logs);
+
+  for (templist = logs; templist != NULL; templist = templist->next)
+    {
+      templog = templist->data;
       g_free (templog->msg);
-      g_free (templog); 
-      templist->data = NULL;
-      templist = templist->next;
+      g_free (templog);
     }
-  g_list_free (gftp_file_transfer_logs);
-  gftp_file_transfer_logs = NULL;
-  pthread_mutex_unlock (&log_mutex);
+  g_list_free (logs);
 }
 
 char *
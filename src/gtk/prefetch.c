@@ -0,0 +1,335 @@
+/*****************************************************************************/
+/*  prefetch.c - fetch the listings of subdirectories in the background      */
+/*                                                                           */
+/*  This program is free software; you can redistribute it and/or modify     */
+/*  it under the terms of the GNU General Public License as published by     */
+/*  the Free Software Foundation; either version 2 of the License, or        */
+/*  (at your option) any later version.                                      */
+/*                                                                           */
+/*  This program is distributed in the hope that it will be useful,          */
+/*  but WITHOUT ANY WARRANTY; without even the implied warranty of           */
+/*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the            */
+/*  GNU General Public License for more details.                             */
+/*                                                                           */
+/*  You should have received a copy of the GNU General Public License        */
+/*  along with this program; if not, write to the Free Software              */
+/*  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.                */
+/*****************************************************************************/
+
+#include "gftp-gtk.h"
+
+/* After a remote directory is listed, the first few subdirectories in it are
+   listed in the background and stored in the directory cache, so changing
+   into one of them does not have to wait for the server. Each window has at
+   most one prefetch thread, with its own connection to the server that is
+   kept open between directories. The prefetch is stopped as soon as a file
+   transfer starts, and the listings are read no faster than
+   prefetch_max_kbs. The thread is joined when the next one is started and
+   when gFTP exits. */
+
+struct gftp_prefetch_data_tag
+{
+  GMutex mutex;
+  gftp_request * request,	/* Connection used by the prefetch thread */
+               * newrequest;	/* Replaces request when the window connects
+                                   to another site */
+  GList * dirs;			/* Directories that are left to fetch */
+  pthread_t tid;
+  unsigned int running : 1,	/* Is the prefetch thread running? */
+               started : 1,	/* Has tid not been joined yet? */
+               stop : 1;	/* Close the connection when done */
+};
+
+
+static void
+_prefetch_log (gftp_logging_level level, gftp_request * request,
+               const char *string, ...)
+{
+  /* The prefetch is best effort, so there is nothing worth logging */
+}
+
+
+static void
+_prefetch_free_dirs (gftp_prefetch_data * pf)
+{
+  GList * templist;
+
+  for (templist = pf->dirs; templist != NULL; templist = templist->next)
+    g_free (templist->data);
+
+  g_list_free (pf->dirs);
+  pf->dirs = NULL;
+}
+
+
+/* Sleeps until reading total bytes since start fits in max_kbs. This is
+   done as the listing is read, so that a large directory is throttled too.
+   The sleep is cut short when the prefetch is cancelled */
+static void
+_prefetch_throttle (gftp_request * request, struct timeval * start,
+                    off_t total, intptr_t max_kbs)
+{
+  struct timeval now;
+  double elapsed, wanted;
+  gulong usecs;
+
+  while (!request->cancel)
+    {
+      gettimeofday (&now, NULL);
+      elapsed = (now.tv_sec - start->tv_sec) +
+                (now.tv_usec - start->tv_usec) / 1000000.0;
+      wanted = (double) total / (max_kbs * 1024.0);
+      if (wanted <= elapsed)
+        break;
+
+      usecs = (gulong) ((wanted - elapsed) * G_USEC_PER_SEC);
+      g_usleep (MIN (usecs, G_USEC_PER_SEC / 10));
+    }
+}
+
+
+static int
+_prefetch_directory (gftp_request * request, const char *dir)
+{
+  struct timeval start;
+  intptr_t max_kbs;
+  gftp_file fle;
+  off_t total;
+  int ret, got;
+
+  if (request->directory != NULL)
+    g_free (request->directory);
+  request->directory = g_strdup (dir);
+
+  if ((ret = gftp_find_cache_entry (request)) > 0)
+    {
+      close (ret);
+      return (0);
+    }
+
+  if (!GFTP_IS_CONNECTED (request) && (ret = gftp_connect (request)) < 0)
+    return (ret);
+
+  if ((ret = gftp_set_directory (request, dir)) < 0)
+    return (ret);
+
+  gftp_lookup_request_option (request, "prefetch_max_kbs", &max_kbs);
+
+  gettimeofday (&start, NULL);
+  if ((ret = gftp_list_files (request)) < 0)
+    return (ret);
+
+  total = 0;
+  memset (&fle, 0, sizeof (fle));
+  while ((got = gftp_get_next_file (request, NULL, &fle)) > 0 ||
+         got == GFTP_ERETRYABLE)
+    {
+      if (got > 0)
+        {
+          total += got;
+          if (max_kbs > 0)
+            _prefetch_throttle (request, &start, total, max_kbs);
+        }
+      gftp_file_destroy (&fle, 0);
+    }
+
+  gftp_end_transfer (request);
+  if (got < 0)
+    return (got);
+
+  return (0);
+}
+
+
+static void *
+_prefetch_thread (void *data)
+{
+  gftp_prefetch_data * pf;
+  int ret, was_connected;
+  char *dir;
+
+  pf = data;
+  while (1)
+    {
+      g_mutex_lock (&pf->mutex);
+      if (pf->newrequest != NULL)
+        {
+          if (pf->request != NULL)
+            {
+              gftp_disconnect (pf->request);
+              gftp_request_destroy (pf->request, 1);
+            }
+
+          pf->request = pf->newrequest;
+          pf->newrequest = NULL;
+        }
+
+      if (pf->dirs == NULL)
+        {
+          if (pf->stop && pf->request != NULL)
+            gftp_disconnect (pf->request);
+
+          pf->running = 0;
+          g_mutex_unlock (&pf->mutex);
+          break;
+        }
+
+      dir = pf->dirs->data;
+      pf->dirs = g_list_delete_link (pf->dirs, pf->dirs);
+      pf->request->cancel = 0;
+      g_mutex_unlock (&pf->mutex);
+
+      was_connected = GFTP_IS_CONNECTED (pf->request);
+      ret = _prefetch_directory (pf->request, dir);
+      if (ret < 0 && was_connected && !pf->request->cancel &&
+          ret != GFTP_EFATAL)
+        {
+          /* The server may have dropped the connection while it was idle */
+          gftp_disconnect (pf->request);
+          ret = _prefetch_directory (pf->request, dir);
+        }
+
+      if (ret < 0 || pf->request->cancel)
+        gftp_disconnect (pf->request);
+
+      g_free (dir);
+    }
+
+  return (NULL);
+}
+
+
+void
+gftp_gtk_prefetch_subdirs (gftp_window_data * wdata)
+{
+  intptr_t prefetch_subdirs;
+  gftp_prefetch_data * pf;
+  GList * templist, * dirs;
+  gftp_file * fle;
+  int num;
+
+  if (!GFTP_IS_CONNECTED (wdata->request) || !wdata->request->use_cache ||
+      wdata->request->directory == NULL || gftp_gtk_num_transfers () > 0)
+    return;
+
+  gftp_lookup_request_option (wdata->request, "prefetch_subdirs",
+                              &prefetch_subdirs);
+  if (prefetch_subdirs <= 0)
+    return;
+
+  dirs = NULL;
+  num = 0;
+  for (templist = wdata->files;
+       templist != NULL && num < prefetch_subdirs;
+       templist = templist->next)
+    {
+      fle = templist->data;
+      if (!S_ISDIR (fle->st_mode) || strcmp (fle->file, ".") == 0 ||
+          strcmp (fle->file, "..") == 0)
+        continue;
+
+      dirs = g_list_append (dirs, gftp_build_path (wdata->request,
+                                                   wdata->request->directory,
+                                                   fle->file, NULL));
+      num++;
+    }
+
+  if (dirs == NULL)
+    return;
+
+  if ((pf = wdata->prefetch) == NULL)
+    {
+      pf = wdata->prefetch = g_malloc0 (sizeof (*pf));
+      g_mutex_init (&pf->mutex);
+    }
+
+  g_mutex_lock (&pf->mutex);
+
+  _prefetch_free_dirs (pf);
+  pf->dirs = dirs;
+  pf->stop = 0;
+
+  if (pf->request == NULL || !compare_request (pf->request, wdata->request, 0))
+    {
+      if (pf->newrequest != NULL)
+        gftp_request_destroy (pf->newrequest, 1);
+
+      pf->newrequest = gftp_copy_request (wdata->request);
+      pf->newrequest->logging_function = _prefetch_log;
+    }
+  else if (pf->running)
+    /* Whatever the thread is fetching now is no longer wanted */
+    pf->request->cancel = 1;
+
+  if (!pf->running)
+    {
+      /* The last thread has already given up the mutex for good, so this
+         does not block */
+      if (pf->started)
+        {
+          pthread_join (pf->tid, NULL);
+          pf->started = 0;
+        }
+
+      if (pthread_create (&pf->tid, NULL, _prefetch_thread, pf) == 0)
+        pf->running = pf->started = 1;
+      else
+        _prefetch_free_dirs (pf);
+    }
+
+  g_mutex_unlock (&pf->mutex);
+}
+
+
+void
+gftp_gtk_prefetch_stop (gftp_window_data * wdata, int disconnect)
+{
+  gftp_prefetch_data * pf;
+
+  if ((pf = wdata->prefetch) == NULL)
+    return;
+
+  g_mutex_lock (&pf->mutex);
+
+  _prefetch_free_dirs (pf);
+  if (pf->running)
+    {
+      if (pf->request != NULL)
+        pf->request->cancel = 1;
+      if (disconnect)
+        pf->stop = 1;
+    }
+  else if (disconnect && pf->request != NULL)
+    gftp_disconnect (pf->request);
+
+  g_mutex_unlock (&pf->mutex);
+}
+
+
+/* Called when gFTP exits. Stops the prefetch thread, waits for it and frees
+   everything it used */
+void
+gftp_gtk_prefetch_shutdown (gftp_window_data * wdata)
+{
+  gftp_prefetch_data * pf;
+
+  if ((pf = wdata->prefetch) == NULL)
+    return;
+
+  gftp_gtk_prefetch_stop (wdata, 1);
+  if (pf->started)
+    pthread_join (pf->tid, NULL);
+
+  if (pf->request != NULL)
+    {
+      gftp_disconnect (pf->request);
+      gftp_request_destroy (pf->request, 1);
+    }
+
+  if (pf->newrequest != NULL)
+    gftp_request_destroy (pf->newrequest, 1);
+
+  g_mutex_clear (&pf->mutex);
+  g_free (pf);
+  wdata->prefetch = NULL;
+}
@@ -21,10 +21,86 @@
 
 static int num_transfers_in_progress = 0;
 
+/* A listing that is shown while it is received. The listing thread queues
+   the batches of files, and a timeout adds them to the listbox */
+typedef struct gftp_list_stream_tag
+{
+  gftp_window_data * wdata;
+  GMutex lock;
+  GList * batches;		/* Lists of files not shown yet, newest first */
+  guint64 num_files;		/* Files shown so far */
+} gftp_list_stream;
+
+/* Transfers that were asked for while one of the windows was receiving a
+   listing. They are set up when the listing is done */
+typedef struct gftp_deferred_transfer_tag
+{
+  gftp_window_data * fromwdata,
+                   * towdata;
+  char * fromdir,
+       * todir;
+  GList * files;
+} gftp_deferred_transfer;
+
+static GList * deferred_transfers = NULL;
+
+static gboolean _start_deferred_transfers (gpointer data);
+
+
+static void
+_ftp_list_files_batch (gftpui_callback_data * cdata, GList * files)
+{
+  gftp_list_stream * stream;
+
+  stream = cdata->user_data;
+
+  g_mutex_lock (&stream->lock);
+  stream->batches = g_list_prepend (stream->batches, files);
+  g_mutex_unlock (&stream->lock);
+}
+
+
+static void
+_ftp_list_files_show (gftp_list_stream * stream)
+{
+  GList * batches, * templist, * files;
+
+  g_mutex_lock (&stream->lock);
+  batches = stream->batches;
+  stream->batches = NULL;
+  g_mutex_unlock (&stream->lock);
+
+  if (batches == NULL)
+    return;
+
+  files = NULL;
+  for (templist = batches; templist != NULL; templist = templist->next)
+    {
+      stream->num_files += g_list_length (templist->data);
+      files = g_list_concat (templist->data, files);
+    }
+  g_list_free (batches);
+
+  listbox_add_files (stream->wdata, files);
+}
+
+
+static gboolean
+_ftp_list_files_timeout (gpointer data)
+{
+  _ftp_list_files_show (data);
+  return (TRUE);
+}
+
+
 int
 ftp_list_files (gftp_window_data * wdata)
 {
   gftpui_callback_data * cdata;
+  gftp_list_stream * stream;
+  intptr_t stream_listings;
+  guint timeout_num;
+  int ret;
 
   gtk_label_set_text (GTK_LABEL (wdata->hoststxt), _("Receiving file names..."));
 
@@ -34,14 +110,56 @@ ftp_list_files (gftp_window_data * wdata)
   cdata->run_function = gftpui_common_run_ls;
   cdata->dont_refresh = 1;
 
-  if(gftpui_common_run_callback_function (cdata) == GFTP_ECANIGNORE)
+  gftp_lookup_request_option (wdata->request, "stream_listings",
+                              &stream_listings);
+  stream = NULL;
+  timeout_num = 0;
+  if (stream_listings)
+    {
+      stream = g_malloc0 (sizeof (*stream));
+      stream->wdata = wdata;
+      g_mutex_init (&stream->lock);
+      cdata->user_data = stream;
+      cdata->files_function = _ftp_list_files_batch;
+
+      gftp_sort_array_free (wdata->sort_array);
+      wdata->sort_array = NULL;
+      wdata->sorted = 0;
+      wdata->list_stream = stream;
+      timeout_num = g_timeout_add (200, _ftp_list_files_timeout, stream);
+    }
+
+  ret = gftpui_common_run_callback_function (cdata);
+
+  if (stream != NULL)
+    {
+      g_source_remove (timeout_num);
+      _ftp_list_files_show (stream);
+      wdata->list_stream = NULL;
+      g_mutex_clear (&stream->lock);
+      g_free (stream);
+    }
+
+  if (deferred_transfers != NULL)
+    g_idle_add (_start_deferred_transfers, NULL);
+
+  if (ret == GFTP_ECANIGNORE)
   {
      g_free(cdata);
+     if (stream != NULL)
+        remove_files_window (wdata);
+     else
+        listbox_clear (wdata);
      update_window(wdata);
      return (1);
   }
 
-  wdata->files = cdata->files;
+  if (stream == NULL)
+    {
+      gftp_sort_array_free (wdata->sort_array);
+      wdata->sort_array = NULL;
+      wdata->files = cdata->files;
+    }
   g_free (cdata);
   
   if (wdata->files == NULL || !GFTP_IS_CONNECTED (wdata->request))
@@ -50,13 +168,27 @@ ftp_list_files (gftp_window_data * wdata)
       return (0);
     }
 
-  wdata->sorted = 0;
-  listbox_sort_rows ((gpointer) wdata, -1);
+  if (stream == NULL)
+    {
+      wdata->sorted = 0;
+      listbox_sort_rows ((gpointer) wdata, -1);
+    }
+  else
+    listbox_add_files_done (wdata);
+
+  gftp_gtk_prefetch_subdirs (wdata);
 
   return (1);
 }
 
 
+int
+gftp_gtk_num_transfers (void)
+{
+  return (num_transfers_in_progress);
+}
+
+
 int
 ftp_connect (gftp_window_data * wdata, gftp_request * request)
 {
@@ -81,46 +213,65 @@ put_files (gpointer data)
 }
 
 
-void
-transfer_window_files (gftp_window_data * fromwdata, gftp_window_data * towdata)
+static GList *
+_get_selected_files (gftp_window_data * wdata)
 {
   gftp_file * tempfle, * newfle;
-  GList * templist, * igl;
+  GList * templist, * igl, * files;
+
+  files = NULL;
+  templist = listbox_get_selected_files (wdata);
+  for (igl = templist; igl != NULL; igl = igl->next)
+  {
+     tempfle = (gftp_file *) igl->data;
+     if (strcmp (tempfle->file, "..") == 0) //||
+         //strcmp (tempfle->file, ".") == 0)
+            continue;
+     newfle = copy_fdata (tempfle);
+     files = g_list_append (files, newfle);
+  }
+  g_list_free (templist);
+
+  return (files);
+}
+
+
+/* files is NULL to transfer the files that are selected in fromwdata */
+static void
+_transfer_window_files (gftp_window_data * fromwdata,
+                        gftp_window_data * towdata, GList * files)
+{
   gftp_transfer * transfer;
   int ret, disconnect;
 
-  if (!check_status (_("Transfer Files"), fromwdata, 1, 0, 1,
+  if (!check_status (_("Transfer Files"), fromwdata, 1, 0, files == NULL,
        towdata->request->put_file != NULL && fromwdata->request->get_file != NULL))
-    return;
+    {
+      free_file_list (files);
+      return;
+    }
 
   if (!GFTP_IS_CONNECTED (fromwdata->request) || 
       !GFTP_IS_CONNECTED (towdata->request))
     {
       ftp_log (gftp_logging_error, NULL,
                _("Retrieve Files: Not connected to a remote site\n"));
+      free_file_list (files);
       return;
     }
 
   if (check_reconnect (fromwdata) < 0 || check_reconnect (towdata) < 0)
-    return;
+    {
+      free_file_list (files);
+      return;
+    }
 
   transfer = g_malloc0 (sizeof (*transfer));
   transfer->fromreq = gftp_copy_request (fromwdata->request);
   transfer->toreq = gftp_copy_request (towdata->request);
   transfer->fromwdata = fromwdata;
   transfer->towdata = towdata;
-
-  templist = listbox_get_selected_files (fromwdata);
-  for (igl = templist; igl != NULL; igl = igl->next)
-  {
-     tempfle = (gftp_file *) igl->data;
-     if (strcmp (tempfle->file, "..") == 0) //||
-         //strcmp (tempfle->file, ".") == 0)
-            continue;
-     newfle = copy_fdata (tempfle);
-     transfer->files = g_list_append (transfer->files, newfle);
-  }
-  g_list_free (templist);
+  transfer->files = files != NULL ? files : _get_selected_files (fromwdata);
 
   if (transfer->files != NULL)
     {
@@ -167,6 +318,71 @@ transfer_window_files (gftp_window_data * fromwdata, gftp_window_data * towdata)
 }
 
 
+static gboolean
+_start_deferred_transfers (gpointer data)
+{
+  gftp_deferred_transfer * deferred;
+  GList * templist, * next;
+
+  for (templist = deferred_transfers; templist != NULL; templist = next)
+    {
+      next = templist->next;
+      deferred = templist->data;
+      if (deferred->fromwdata->list_stream != NULL ||
+          deferred->towdata->list_stream != NULL)
+        continue;
+
+      deferred_transfers = g_list_delete_link (deferred_transfers, templist);
+
+      if (g_strcmp0 (deferred->fromdir,
+                     deferred->fromwdata->request->directory) != 0 ||
+          g_strcmp0 (deferred->todir,
+                     deferred->towdata->request->directory) != 0)
+        {
+          ftp_log (gftp_logging_error, NULL,
+                   _("Transfer Files: The directory changed before the listing was done, the files were not queued\n"));
+          free_file_list (deferred->files);
+        }
+      else
+        _transfer_window_files (deferred->fromwdata, deferred->towdata,
+                                deferred->files);
+
+      g_free (deferred->fromdir);
+      g_free (deferred->todir);
+      g_free (deferred);
+    }
+
+  return (FALSE);
+}
+
+
+void
+transfer_window_files (gftp_window_data * fromwdata, gftp_window_data * towdata)
+{
+  gftp_deferred_transfer * deferred;
+
+  /* The files that are already shown can be picked while the rest of the
+     listing comes in. The connection is busy until then */
+  if ((fromwdata->list_stream != NULL || towdata->list_stream != NULL) &&
+      listbox_num_selected (fromwdata) > 0)
+    {
+      deferred = g_malloc0 (sizeof (*deferred));
+      deferred->fromwdata = fromwdata;
+      deferred->towdata = towdata;
+      deferred->fromdir = g_strdup (fromwdata->request->directory);
+      deferred->todir = g_strdup (towdata->request->directory);
+      deferred->files = _get_selected_files (fromwdata);
+      deferred_transfers = g_list_append (deferred_transfers, deferred);
+
+      ftp_log (gftp_logging_misc, NULL,
+               _("Transfer Files: The files will be queued when the directory listing is done\n"));
+      return;
+    }
+
+  _transfer_window_files (fromwdata, towdata, NULL);
+}
+
+
 static int
 gftpui_gtk_tdata_connect (gftpui_callback_data * cdata)
 {
@@ -467,20 +683,18 @@ on_next_transfer (gftp_transfer * tdata)
       else if (tempfle->done_rm)
 	tdata->fromreq->rmfile (tdata->fromreq, tempfle->file);
       
-      if (tempfle->transfer_action == GFTP_TRANS_ACTION_SKIP)
-        gtk_ctree_node_set_text (GTK_CTREE (dlwdw), tempfle->user_data, 1,
-  			         _("Skipped"));
-      else
-        gtk_ctree_node_set_text (GTK_CTREE (dlwdw), tempfle->user_data, 1,
-  			         _("Finished"));
+      transfer_queue_file_finished (tdata, tempfle);
     }
 
+  if (tdata->curfle != NULL)
+    transfer_queue_file_changed (tdata, tdata->curfle->data);
+
   gftp_lookup_request_option (tdata->fromreq, "refresh_files", &refresh_files);
 
   if (refresh_files && tdata->curfle && tdata->curfle->next &&
       compare_request (tdata->toreq, 
                        ((gftp_window_data *) tdata->towdata)->request, 1))
-    gftpui_refresh (tdata->towdata, 1);
+    gftpui_refresh (tdata->towdata, 0);
 }
 
 
@@ -505,28 +719,9 @@ cancel_get_trans_password (gftp_transfer * tdata, gftp_dialog_data * ddata)
 static void
 show_transfer (gftp_transfer * tdata)
 {
-  GdkPixmap * closedir_pixmap, * opendir_pixmap;
-  GdkBitmap * closedir_bitmap, * opendir_bitmap;
-  gftpui_common_curtrans_data * transdata;
   gftp_file * tempfle;
   GList * templist;
-  char *text[2];
-
-  gftp_get_pixmap (dlwdw, "open_dir.xpm", &opendir_pixmap, &opendir_bitmap);
-  gftp_get_pixmap (dlwdw, "dir.xpm", &closedir_pixmap, &closedir_bitmap);
-
-  text[0] = tdata->fromreq->hostname;
-  text[1] = _("Waiting...");
-  tdata->user_data = gtk_ctree_insert_node (GTK_CTREE (dlwdw), NULL, NULL, 
-                                       text, 5,
-                                       closedir_pixmap, closedir_bitmap, 
-                                       opendir_pixmap, opendir_bitmap, 
-                                       FALSE, 
-                                       tdata->numdirs + tdata->numfiles < 50);
-  transdata = g_malloc0 (sizeof (*transdata));
-  transdata->transfer = tdata;
-  transdata->curfle = NULL;
-  gtk_ctree_node_set_row_data (GTK_CTREE (dlwdw), tdata->user_data, transdata);
+
   tdata->show = 0;
   tdata->curfle = tdata->updfle = tdata->files;
 
@@ -534,27 +729,13 @@ show_transfer (gftp_transfer * tdata)
   for (templist = tdata->files; templist != NULL; templist = templist->next)
     {
       tempfle = templist->data;
-
-      text[0] = gftpui_gtk_get_utf8_file_pos (tempfle);
-      if (tempfle->transfer_action == GFTP_TRANS_ACTION_SKIP)
-        text[1] = _("Skipped");
-      else
-        {
-          tdata->total_bytes += tempfle->size;
-          text[1] = _("Waiting...");
-        }
-
-      tempfle->user_data = gtk_ctree_insert_node (GTK_CTREE (dlwdw), 
-                                             tdata->user_data, 
-                                             NULL, text, 5, NULL, NULL, NULL, 
-                                             NULL, FALSE, FALSE);
-      transdata = g_malloc0 (sizeof (*transdata));
-      transdata->transfer = tdata;
-      transdata->curfle = templist;
-      gtk_ctree_node_set_row_data (GTK_CTREE (dlwdw), tempfle->user_data, 
-                                   transdata);
+      tempfle->user_data = NULL;
+      if (tempfle->transfer_action != GFTP_TRANS_ACTION_SKIP)
+        tdata->total_bytes += tempfle->size;
     }
 
+  transfer_queue_add (tdata);
+
   if (!tdata->toreq->stopable && gftp_need_password (tdata->toreq))
     {
       tdata->toreq->stopable = 1;
@@ -580,10 +761,7 @@ show_transfer (gftp_transfer * tdata)
 static void
 transfer_done (GList * node)
 {
-  gftpui_common_curtrans_data * transdata;
   gftp_transfer * tdata;
-  gftp_file * tempfle;
-  GList * templist;
 
   tdata = node->data;
   if (tdata->started)
@@ -612,30 +790,12 @@ transfer_done (GList * node)
 
       if (tdata->towdata != NULL && compare_request (tdata->toreq,
                            ((gftp_window_data *) tdata->towdata)->request, 1))
-        gftpui_refresh (tdata->towdata, 1);
+        gftpui_refresh (tdata->towdata, 0);
 
       num_transfers_in_progress--;
     }
 
-  if ((!tdata->show && tdata->started) ||
-      (tdata->done && !tdata->started))
-    {
-      transdata = gtk_ctree_node_get_row_data (GTK_CTREE (dlwdw), 
-                                               tdata->user_data);
-      if (transdata != NULL)
-        g_free (transdata);
-
-      for (templist = tdata->files; templist != NULL; templist = templist->next)
-        {
-          tempfle = templist->data;
-          transdata = gtk_ctree_node_get_row_data (GTK_CTREE (dlwdw), 
-                                                   tempfle->user_data);
-          if (transdata != NULL)
-            g_free (transdata);
-        }
-          
-      gtk_ctree_remove_node (GTK_CTREE (dlwdw), tdata->user_data);
-    }
+  transfer_queue_remove (tdata);
 
   g_mutex_lock (&gftpui_common_transfer_mutex);
   gftp_file_transfers = g_list_remove_link (gftp_file_transfers, node);
@@ -681,11 +841,14 @@ create_transfer (gftp_transfer * tdata)
       update_window (tdata->towdata);
     }
 
+  /* Don't let the directory prefetch compete with the transfer */
+  gftp_gtk_prefetch_stop (&window1, 0);
+  gftp_gtk_prefetch_stop (&window2, 0);
+
   num_transfers_in_progress++;
   tdata->started = 1;
-  tdata->stalled = 1;
-  gtk_ctree_node_set_text (GTK_CTREE (dlwdw), tdata->user_data, 1,
-                           _("Connecting..."));
+  g_atomic_int_set (&tdata->stalled, 1);
+  transfer_queue_set_status (tdata, _("Connecting..."));
 
   if (tdata->thread_id == NULL)
     tdata->thread_id = g_malloc0 (sizeof (pthread_t));
@@ -696,8 +859,8 @@ create_transfer (gftp_transfer * tdata)
 
 
 static void
-_setup_dlstr (gftp_transfer * tdata, gftp_file * fle, char *dlstr,
-              size_t dlstr_len)
+_setup_dlstr (gftp_transfer * tdata, gftp_transfer_stats * stats,
+              gftp_file * fle, char *dlstr, size_t dlstr_len)
 {
   int hours, mins, secs, stalled, usesentdescr;
   unsigned long remaining_secs, lkbs;
@@ -709,13 +872,13 @@ _setup_dlstr (gftp_transfer * tdata, gftp_file * fle, char *dlstr,
   usesentdescr = (tdata->fromreq->protonum == GFTP_LOCAL_NUM);
 
   insert_commas (fle->size, ofstr, sizeof (ofstr));
-  insert_commas (tdata->curtrans + tdata->curresumed, gotstr, sizeof (gotstr));
+  insert_commas (stats->curtrans + stats->curresumed, gotstr, sizeof (gotstr));
 
-  if (tv.tv_sec - tdata->lasttime.tv_sec <= 5)
+  if (tv.tv_sec - stats->lasttime.tv_sec <= 5)
     {
-      remaining_secs = (fle->size - tdata->curtrans - tdata->curresumed) / 1024;
+      remaining_secs = (fle->size - stats->curtrans - stats->curresumed) / 1024;
 
-      lkbs = (unsigned long) tdata->kbs;
+      lkbs = (unsigned long) stats->kbs;
       if (lkbs > 0)
         remaining_secs /= lkbs;
 
@@ -731,19 +894,20 @@ _setup_dlstr (gftp_transfer * tdata, gftp_file * fle, char *dlstr,
           if (usesentdescr)
             {
               g_snprintf (dlstr, dlstr_len,
-                          _("Sent %s of %s at %.2fKB/s, %02d:%02d:%02d est. time remaining"), gotstr, ofstr, tdata->kbs, hours, mins, secs);
+                          _("Sent %s of %s at %.2fKB/s, %02d:%02d:%02d est. time remaining"), gotstr, ofstr, stats->kbs, hours, mins, secs);
             }
           else
             {
               g_snprintf (dlstr, dlstr_len,
-                          _("Recv %s of %s at %.2fKB/s, %02d:%02d:%02d est. time remaining"), gotstr, ofstr, tdata->kbs, hours, mins, secs);
+                          _("Recv %s of %s at %.2fKB/s, %02d:%02d:%02d est. time remaining"), gotstr, ofstr, stats->kbs, hours, mins, secs);
             }
         }
     }
 
   if (stalled)
     {
-      tdata->stalled = 1;
+      g_atomic_int_set (&tdata->stalled, 1);
+
       if (usesentdescr)
         {
           g_snprintf (dlstr, dlstr_len,
@@ -767,14 +931,21 @@ update_file_status (gftp_transfer * tdata)
   unsigned long remaining_secs, lkbs;
   int hours, mins, secs, pcent;
   intptr_t show_trans_in_title;
+  gftp_transfer_stats stats;
   gftp_file * tempfle;
-  
-  g_mutex_lock (&tdata->statmutex);
-  tempfle = tdata->curfle->data;
+  GList * curfle;
+
+  /* The transfer thread moves curfle along the list, but the list itself
+     is only freed by transfer_done () in this thread */
+  if ((curfle = g_atomic_pointer_get (&tdata->curfle)) == NULL)
+    return;
+  tempfle = curfle->data;
+
+  gftp_transfer_get_stats (tdata, &stats);
 
-  remaining_secs = (tdata->total_bytes - tdata->trans_bytes - tdata->resumed_bytes) / 1024;
+  remaining_secs = (stats.total_bytes - stats.trans_bytes - stats.resumed_bytes) / 1024;
 
-  lkbs = (unsigned long) tdata->kbs;
+  lkbs = (unsigned long) stats.kbs;
   if (lkbs > 0)
     remaining_secs /= lkbs;
 
@@ -785,33 +956,28 @@ update_file_status (gftp_transfer * tdata)
   secs = remaining_secs;
 
   if (hours < 0 || mins < 0 || secs < 0)
-    {
-      g_mutex_unlock (&tdata->statmutex);
-      return;
-    }
+    return;
 
-  if ((double) tdata->total_bytes > 0)
-    pcent = (int) ((double) (tdata->trans_bytes + tdata->resumed_bytes) / (double) tdata->total_bytes * 100.0);
+  if ((double) stats.total_bytes > 0)
+    pcent = (int) ((double) (stats.trans_bytes + stats.resumed_bytes) / (double) stats.total_bytes * 100.0);
   else
     pcent = 0;
 
   if (pcent > 100)
     g_snprintf (totstr, sizeof (totstr),
 	_("Unknown percentage complete. (File %ld of %ld)"),
-	tdata->current_file_number, tdata->numdirs + tdata->numfiles);
+	stats.current_file_number, tdata->numdirs + tdata->numfiles);
   else
     g_snprintf (totstr, sizeof (totstr),
 	_("%d%% complete, %02d:%02d:%02d est. time remaining. (File %ld of %ld)"),
-	pcent, hours, mins, secs, tdata->current_file_number,
+	pcent, hours, mins, secs, stats.current_file_number,
 	tdata->numdirs + tdata->numfiles);
 
   *dlstr = '\0';
-  if (!tdata->stalled)
-    _setup_dlstr (tdata, tempfle, dlstr, sizeof (dlstr));
+  if (!g_atomic_int_get (&tdata->stalled))
+    _setup_dlstr (tdata, &stats, tempfle, dlstr, sizeof (dlstr));
 
-  g_mutex_unlock (&tdata->statmutex);
-
-  gtk_ctree_node_set_text (GTK_CTREE (dlwdw), tdata->user_data, 1, totstr);
+  transfer_queue_set_status (tdata, totstr);
   
   gftp_lookup_global_option ("show_trans_in_title", &show_trans_in_title);
   if (gftp_file_transfers->data == tdata && show_trans_in_title)
@@ -822,20 +988,31 @@ update_file_status (gftp_transfer * tdata)
     }
 
   if (*dlstr != '\0')
-    gtk_ctree_node_set_text (GTK_CTREE (dlwdw), tempfle->user_data, 1, dlstr);
+    transfer_queue_set_progress (tdata, tempfle, dlstr);
 }
 
 
 static void
 update_window_transfer_bytes (gftp_window_data * wdata)
 {
-  char *tempstr, *temp1str;
+  char *tempstr, *temp1str, *temp2str;
 
   if (wdata->request->gotbytes == -1)
     {
       update_window (wdata);
       wdata->request->gotbytes = 0;
     }
+  else if (wdata->list_stream != NULL)
+    {
+      tempstr = insert_commas (wdata->request->gotbytes, NULL, 0);
+      temp2str = insert_commas (wdata->list_stream->num_files, NULL, 0);
+      temp1str = g_strdup_printf (_("Retrieving file names...%s files, %s bytes"),
+                                  temp2str, tempstr);
+      gtk_label_set_text (GTK_LABEL (wdata->hoststxt), temp1str);
+      g_free (tempstr);
+      g_free (temp1str);
+      g_free (temp2str);
+    }
   else
     {
       tempstr = insert_commas (wdata->request->gotbytes, NULL, 0);
@@ -855,8 +1032,7 @@ update_downloads (gpointer data)
   GList * templist, * next;
   gftp_transfer * tdata;
 
-  if (gftp_file_transfer_logs != NULL)
-    display_cached_logs ();
+  display_cached_logs ();
 
   if (window1.request->gotbytes != 0)
     update_window_transfer_bytes (&window1);
@@ -869,10 +1045,22 @@ update_downloads (gpointer data)
   for (templist = gftp_file_transfers; templist != NULL;)
     {
       tdata = templist->data;
-      if (tdata->ready)
-        {
-          g_mutex_lock (&tdata->structmutex);
 
+      /* The transfer thread changes the flags under structmutex. It is
+         only held by this thread for a moment */
+      g_mutex_lock (&tdata->structmutex);
+      if (!tdata->ready)
+        g_mutex_unlock (&tdata->structmutex);
+      else if (tdata->started &&
+               !tdata->next_file && !tdata->show && !tdata->done)
+        {
+          /* Nothing to do but show the progress. Ask for it once a second
+             so the time left and stalled transfers are kept current */
+          g_atomic_int_set (&tdata->progress_pending, 1);
+          g_mutex_unlock (&tdata->structmutex);
+        }
+      else
+        {
 	  if (tdata->next_file)
 	    on_next_transfer (tdata);
      	  else if (tdata->show) 
@@ -897,7 +1085,7 @@ update_downloads (gpointer data)
                 create_transfer (tdata);
 
 	      if (tdata->started)
-                update_file_status (tdata);
+                g_atomic_int_set (&tdata->progress_pending, 1);
 	    }
           g_mutex_unlock (&tdata->structmutex);
         }
@@ -909,84 +1097,119 @@ update_downloads (gpointer data)
 }
 
 
+/* Runs TRANSFER_PROGRESS_RATE times a second and shows the progress of the
+   transfers whose counters changed, so the transfer threads never wait
+   for the UI and many small updates are shown as one. The messages the
+   other threads logged are shown here as well. */
+
+gint
+update_transfer_progress (gpointer data)
+{
+  intptr_t show_trans_in_title;
+  gftp_transfer * tdata;
+  GList * templist;
+  int running;
+
+  display_cached_logs ();
+
+  gftp_lookup_global_option ("show_trans_in_title", &show_trans_in_title);
+
+  for (templist = gftp_file_transfers; templist != NULL;
+       templist = templist->next)
+    {
+      tdata = templist->data;
+      if (g_atomic_int_get (&tdata->progress_pending) == 0)
+        continue;
+
+      g_mutex_lock (&tdata->structmutex);
+      running = tdata->ready && tdata->started && !tdata->done;
+      g_mutex_unlock (&tdata->structmutex);
+      if (!running)
+        continue;
+
+      /* Leave the update pending until the row is scrolled into view,
+         unless it also goes in the window title */
+      if (!transfer_queue_is_visible (tdata) &&
+          !(templist == gftp_file_transfers && show_trans_in_title))
+        continue;
+
+      if (g_atomic_int_compare_and_exchange (&tdata->progress_pending, 1, 0))
+        update_file_status (tdata);
+    }
+
+  return (TRUE);
+}
+
+
 void
 start_transfer (gpointer data)
 {
-  gftpui_common_curtrans_data * transdata;
-  GtkCTreeNode * node;
+  gftpui_common_curtrans_data seldata;
 
-  if (GTK_CLIST (dlwdw)->selection == NULL)
+  if (!transfer_queue_get_selected (&seldata))
     {
       ftp_log (gftp_logging_error, NULL,
 	       _("There are no file transfers selected\n"));
       return;
     }
-  node = GTK_CLIST (dlwdw)->selection->data;
-  transdata = gtk_ctree_node_get_row_data (GTK_CTREE (dlwdw), node);
 
-  g_mutex_lock (&transdata->transfer->structmutex);
-  if (!transdata->transfer->started)
-    create_transfer (transdata->transfer);
-  g_mutex_unlock (&transdata->transfer->structmutex);
+  g_mutex_lock (&seldata.transfer->structmutex);
+  if (!seldata.transfer->started)
+    create_transfer (seldata.transfer);
+  g_mutex_unlock (&seldata.transfer->structmutex);
 }
 
 
 void
 stop_transfer (gpointer data)
 {
-  gftpui_common_curtrans_data * transdata;
-  GtkCTreeNode * node;
+  gftpui_common_curtrans_data seldata;
 
-  if (GTK_CLIST (dlwdw)->selection == NULL)
+  if (!transfer_queue_get_selected (&seldata))
     {
       ftp_log (gftp_logging_error, NULL,
 	      _("There are no file transfers selected\n"));
       return;
     }
 
-  node = GTK_CLIST (dlwdw)->selection->data;
-  transdata = gtk_ctree_node_get_row_data (GTK_CTREE (dlwdw), node);
-  gftpui_common_cancel_file_transfer (transdata->transfer);
+  gftpui_common_cancel_file_transfer (seldata.transfer);
 }
 
 
 void
 skip_transfer (gpointer data)
 {
-  gftpui_common_curtrans_data * transdata;
-  GtkCTreeNode * node;
+  gftpui_common_curtrans_data seldata;
 
-  if (GTK_CLIST (dlwdw)->selection == NULL)
+  if (!transfer_queue_get_selected (&seldata))
     {
       ftp_log (gftp_logging_error, NULL,
 	      _("There are no file transfers selected\n"));
       return;
     }
 
-  node = GTK_CLIST (dlwdw)->selection->data;
-  transdata = gtk_ctree_node_get_row_data (GTK_CTREE (dlwdw), node);
+  if (seldata.transfer->curfle == NULL)
+    return;
 
-  gftpui_common_skip_file_transfer (transdata->transfer,
-                                    transdata->transfer->curfle->data);
+  gftpui_common_skip_file_transfer (seldata.transfer,
+                                    seldata.transfer->curfle->data);
 }
 
 
 void
 remove_file_transfer (gpointer data)
 {
-  gftpui_common_curtrans_data * transdata;
-  GtkCTreeNode * node;
+  gftpui_common_curtrans_data seldata, * transdata;
   gftp_file * curfle;
 
-  if (GTK_CLIST (dlwdw)->selection == NULL)
+  if (!transfer_queue_get_selected (&seldata))
     {
       ftp_log (gftp_logging_error, NULL,
               _("There are no file transfers selected\n"));
       return;
     }
 
-  node = GTK_CLIST (dlwdw)->selection->data;
-  transdata = gtk_ctree_node_get_row_data (GTK_CTREE (dlwdw), node);
+  transdata = &seldata;
 
   if (transdata->curfle == NULL || transdata->curfle->data == NULL)
     return;
@@ -994,8 +1217,7 @@ remove_file_transfer (gpointer data)
   curfle = transdata->curfle->data;
   gftpui_common_skip_file_transfer (transdata->transfer, curfle);
 
-  gtk_ctree_node_set_text (GTK_CTREE (dlwdw), curfle->user_data, 1,
-                           _("Skipped"));
+  transfer_queue_file_changed (transdata->transfer, curfle);
 }
 
 
@@ -1003,17 +1225,15 @@ void
 move_transfer_up (gpointer data)
 {
   GList * firstentry, * secentry, * lastentry;
-  gftpui_common_curtrans_data * transdata;
-  GtkCTreeNode * node;
+  gftpui_common_curtrans_data seldata, * transdata;
 
-  if (GTK_CLIST (dlwdw)->selection == NULL)
+  if (!transfer_queue_get_selected (&seldata))
     {
       ftp_log (gftp_logging_error, NULL,
 	      _("There are no file transfers selected\n"));
       return;
     }
-  node = GTK_CLIST (dlwdw)->selection->data;
-  transdata = gtk_ctree_node_get_row_data (GTK_CTREE (dlwdw), node);
+  transdata = &seldata;
 
   if (transdata->curfle == NULL)
     return;
@@ -1049,11 +1269,8 @@ move_transfer_up (gpointer data)
             lastentry->prev = secentry;
         }
 
-      gtk_ctree_move (GTK_CTREE (dlwdw), 
-                      ((gftp_file *) transdata->curfle->data)->user_data,
-                      transdata->transfer->user_data, 
-                      transdata->curfle->next != NULL ?
-                          ((gftp_file *) transdata->curfle->next->data)->user_data: NULL);
+      transfer_queue_file_moved (transdata->transfer, transdata->curfle,
+                                 transdata->curfle->next);
     }
   g_mutex_unlock (&transdata->transfer->structmutex);
 }
@@ -1063,17 +1280,15 @@ void
 move_transfer_down (gpointer data)
 {
   GList * firstentry, * secentry, * lastentry;
-  gftpui_common_curtrans_data * transdata;
-  GtkCTreeNode * node;
+  gftpui_common_curtrans_data seldata, * transdata;
 
-  if (GTK_CLIST (dlwdw)->selection == NULL)
+  if (!transfer_queue_get_selected (&seldata))
     {
       ftp_log (gftp_logging_error, NULL,
 	      _("There are no file transfers selected\n"));
       return;
     }
-  node = GTK_CLIST (dlwdw)->selection->data;
-  transdata = gtk_ctree_node_get_row_data (GTK_CTREE (dlwdw), node);
+  transdata = &seldata;
 
   if (transdata->curfle == NULL)
     return;
@@ -1109,11 +1324,8 @@ move_transfer_down (gpointer data)
             lastentry->prev = transdata->curfle;
         }
 
-      gtk_ctree_move (GTK_CTREE (dlwdw), 
-                      ((gftp_file *) transdata->curfle->data)->user_data,
-                      transdata->transfer->user_data, 
-                      transdata->curfle->next != NULL ?
-                          ((gftp_file *) transdata->curfle->next->data)->user_data: NULL);
+      transfer_queue_file_moved (transdata->transfer, transdata->curfle,
+                                 transdata->curfle->prev);
     }
   g_mutex_unlock (&transdata->transfer->structmutex);
 }
@@ -0,0 +1,967 @@
+/*****************************************************************************/
+/*  transfer_queue.c - GtkTreeView showing the queued file transfers         */
+/*                                                                           */
+/*  This program is free software; you can redistribute it and/or modify     */
+/*  it under the terms of the GNU General Public License as published by     */
+/*  the Free Software Foundation; either version 2 of the License, or        */
+/*  (at your option) any later version.                                      */
+/*                                                                           */
+/*  This program is distributed in the hope that it will be useful,          */
+/*  but WITHOUT ANY WARRANTY; without even the implied warranty of           */
+/*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the            */
+/*  GNU General Public License for more details.                             */
+/*                                                                           */
+/*  You should have received a copy of the GNU General Public License        */
+/*  along with this program; if not, write to the Free Software              */
+/*  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.                */
+/*****************************************************************************/
+
+/*
+  A GtkTreeModel with one top level row per transfer and one child row
+  per queued file. Nothing is stored per file: the rows point at the
+  GList nodes of tdata->files and the text is made from the gftp_file
+  when the view asks for it.
+
+  The child rows of a transfer only exist while it is expanded. They
+  are collected when the row is expanded, keeping only the files that
+  match the state filter, and dropped again when it is collapsed, so a
+  transfer with a million files costs one row until it is opened.
+
+  The file list of a transfer is only changed by this thread (the
+  transfer thread just moves tdata->curfle along it), so it is walked
+  here without taking tdata->structmutex.
+*/
+
+#include "gftp-gtk.h"
+
+enum
+{
+  TRANSFER_QUEUE_COL_ICON,
+  TRANSFER_QUEUE_COL_NAME,
+  TRANSFER_QUEUE_COL_PROGRESS,
+  TRANSFER_QUEUE_NUM_COLUMNS
+};
+
+typedef struct transfer_queue_row_tag
+{
+  gftp_transfer * tdata;
+  guint index;			/* Position in the top level */
+  GPtrArray * files;		/* GList nodes of the shown files, NULL
+				   until the row is expanded */
+  char * status,		/* Text of the transfer row */
+       * progress;		/* Text of the file being transferred */
+  int open;			/* Expanded, kept when the filter hides all
+				   of the files */
+  gulong num_done,
+         num_failed,
+         num_skipped;
+} transfer_queue_row;
+
+typedef struct
+{
+  GObject parent;
+  GPtrArray * rows;		/* transfer_queue_row's */
+  transfer_queue_state filter;
+  gint stamp;
+} TransferQueueModel;
+
+typedef struct
+{
+  GObjectClass parent_class;
+} TransferQueueModelClass;
+
+static void transfer_queue_model_tree_model_init (GtkTreeModelIface * iface);
+
+G_DEFINE_TYPE_WITH_CODE (TransferQueueModel, transfer_queue_model,
+                         G_TYPE_OBJECT,
+                         G_IMPLEMENT_INTERFACE (GTK_TYPE_TREE_MODEL,
+                                                transfer_queue_model_tree_model_init))
+
+#define TRANSFER_QUEUE_MODEL(obj) ((TransferQueueModel *) (obj))
+
+/* Child iters carry the index of the file + 1 in user_data2, transfer
+   rows carry 0 */
+#define TRANSFER_QUEUE_ITER_ROW(iter)   ((transfer_queue_row *) (iter)->user_data)
+#define TRANSFER_QUEUE_ITER_CHILD(iter) GPOINTER_TO_UINT ((iter)->user_data2)
+
+static TransferQueueModel *
+transfer_queue_get_model (void)
+{
+  return (TRANSFER_QUEUE_MODEL (gtk_tree_view_get_model (GTK_TREE_VIEW (dlwdw))));
+}
+
+
+static transfer_queue_state
+transfer_queue_file_state (transfer_queue_row * row, GList * node)
+{
+  gftp_file * fle;
+
+  fle = node->data;
+  if (node == g_atomic_pointer_get (&row->tdata->curfle) &&
+      row->tdata->started && !row->tdata->done)
+    return (transfer_queue_active);
+  else if (fle->transfer_action == GFTP_TRANS_ACTION_SKIP)
+    return (transfer_queue_done);
+  else if (fle->transfer_failed)
+    return (transfer_queue_failed);
+  else if (fle->transfer_done)
+    return (transfer_queue_done);
+  else
+    return (transfer_queue_pending);
+}
+
+
+static const char *
+transfer_queue_file_status (transfer_queue_row * row, GList * node)
+{
+  gftp_file * fle;
+
+  fle = node->data;
+  switch (transfer_queue_file_state (row, node))
+    {
+      case transfer_queue_active:
+        return (row->progress != NULL ? row->progress : _("Waiting..."));
+      case transfer_queue_failed:
+        return (_("Failed"));
+      case transfer_queue_done:
+        if (fle->transfer_action == GFTP_TRANS_ACTION_SKIP)
+          return (_("Skipped"));
+        return (_("Finished"));
+      default:
+        return (_("Waiting..."));
+    }
+}
+
+
+static void
+transfer_queue_row_forget_files (transfer_queue_row * row)
+{
+  guint i;
+
+  if (row->files == NULL)
+    return;
+
+  for (i = 0; i < row->files->len; i++)
+    ((gftp_file *) ((GList *) g_ptr_array_index (row->files, i))->data)->user_data = NULL;
+
+  g_ptr_array_free (row->files, TRUE);
+  row->files = NULL;
+}
+
+
+/* Collects the child rows of a transfer. The position of each shown file
+   is kept in fle->user_data so a change to one file finds its row
+   without a search */
+
+static GPtrArray *
+transfer_queue_row_files (TransferQueueModel * model, transfer_queue_row * row)
+{
+  GList * templist;
+
+  if (row->files != NULL)
+    return (row->files);
+
+  row->files = g_ptr_array_new ();
+  for (templist = row->tdata->files; templist != NULL;
+       templist = templist->next)
+    {
+      if (model->filter != transfer_queue_all &&
+          transfer_queue_file_state (row, templist) != model->filter)
+        continue;
+
+      g_ptr_array_add (row->files, templist);
+      ((gftp_file *) templist->data)->user_data =
+        GUINT_TO_POINTER (row->files->len);
+    }
+
+  return (row->files);
+}
+
+
+static void
+transfer_queue_row_free (transfer_queue_row * row)
+{
+  transfer_queue_row_forget_files (row);
+  g_free (row->status);
+  g_free (row->progress);
+  g_free (row);
+}
+
+
+static void
+transfer_queue_model_init (TransferQueueModel * model)
+{
+  model->rows = g_ptr_array_new ();
+  model->filter = transfer_queue_all;
+  model->stamp = g_random_int ();
+}
+
+
+static void
+transfer_queue_model_finalize (GObject * object)
+{
+  TransferQueueModel * model;
+  guint i;
+
+  model = TRANSFER_QUEUE_MODEL (object);
+  for (i = 0; i < model->rows->len; i++)
+    transfer_queue_row_free (g_ptr_array_index (model->rows, i));
+  g_ptr_array_free (model->rows, TRUE);
+
+  G_OBJECT_CLASS (transfer_queue_model_parent_class)->finalize (object);
+}
+
+
+static void
+transfer_queue_model_class_init (TransferQueueModelClass * klass)
+{
+  G_OBJECT_CLASS (klass)->finalize = transfer_queue_model_finalize;
+}
+
+
+static gboolean
+transfer_queue_model_set_iter (TransferQueueModel * model, GtkTreeIter * iter,
+                               transfer_queue_row * row, guint child)
+{
+  if (row == NULL ||
+      (child > 0 && (row->files == NULL || child > row->files->len)))
+    {
+      iter->stamp = 0;
+      return (FALSE);
+    }
+
+  iter->stamp = model->stamp;
+  iter->user_data = row;
+  iter->user_data2 = GUINT_TO_POINTER (child);
+  return (TRUE);
+}
+
+
+static transfer_queue_row *
+transfer_queue_model_nth_row (TransferQueueModel * model, gint n)
+{
+  if (n < 0 || (guint) n >= model->rows->len)
+    return (NULL);
+  return (g_ptr_array_index (model->rows, n));
+}
+
+
+static GtkTreeModelFlags
+transfer_queue_model_get_flags (GtkTreeModel * tree_model)
+{
+  return (0);
+}
+
+
+static gint
+transfer_queue_model_get_n_columns (GtkTreeModel * tree_model)
+{
+  return (TRANSFER_QUEUE_NUM_COLUMNS);
+}
+
+
+static GType
+transfer_queue_model_get_column_type (GtkTreeModel * tree_model, gint column)
+{
+  if (column == TRANSFER_QUEUE_COL_ICON)
+    return (GDK_TYPE_PIXBUF);
+  return (G_TYPE_STRING);
+}
+
+
+static gboolean
+transfer_queue_model_get_iter (GtkTreeModel * tree_model, GtkTreeIter * iter,
+                               GtkTreePath * path)
+{
+  TransferQueueModel * model;
+  transfer_queue_row * row;
+  gint depth, * indices;
+
+  model = TRANSFER_QUEUE_MODEL (tree_model);
+  depth = gtk_tree_path_get_depth (path);
+  indices = gtk_tree_path_get_indices (path);
+
+  if (depth < 1 || depth > 2 ||
+      (row = transfer_queue_model_nth_row (model, indices[0])) == NULL)
+    {
+      iter->stamp = 0;
+      return (FALSE);
+    }
+
+  if (depth == 1)
+    return (transfer_queue_model_set_iter (model, iter, row, 0));
+
+  if (indices[1] < 0)
+    {
+      iter->stamp = 0;
+      return (FALSE);
+    }
+
+  transfer_queue_row_files (model, row);
+  return (transfer_queue_model_set_iter (model, iter, row, indices[1] + 1));
+}
+
+
+static GtkTreePath *
+transfer_queue_model_get_path (GtkTreeModel * tree_model, GtkTreeIter * iter)
+{
+  transfer_queue_row * row;
+  guint child;
+
+  row = TRANSFER_QUEUE_ITER_ROW (iter);
+  child = TRANSFER_QUEUE_ITER_CHILD (iter);
+  if (child == 0)
+    return (gtk_tree_path_new_from_indices (row->index, -1));
+  return (gtk_tree_path_new_from_indices (row->index, child - 1, -1));
+}
+
+
+static char *
+transfer_queue_row_status (transfer_queue_row * row)
+{
+  const char * status;
+
+  status = row->status != NULL ? row->status : _("Waiting...");
+  if (row->num_failed > 0 && row->num_skipped > 0)
+    return (g_strdup_printf (_("%s (%lu failed, %lu skipped)"), status,
+                             row->num_failed, row->num_skipped));
+  else if (row->num_failed > 0)
+    return (g_strdup_printf (_("%s (%lu failed)"), status, row->num_failed));
+  else if (row->num_skipped > 0)
+    return (g_strdup_printf (_("%s (%lu skipped)"), status,
+                             row->num_skipped));
+  else
+    return (g_strdup (status));
+}
+
+
+static void
+transfer_queue_model_get_value (GtkTreeModel * tree_model, GtkTreeIter * iter,
+                                gint column, GValue * value)
+{
+  TransferQueueModel * model;
+  transfer_queue_row * row;
+  GList * node;
+  guint child;
+
+  model = TRANSFER_QUEUE_MODEL (tree_model);
+  g_value_init (value, transfer_queue_model_get_column_type (tree_model,
+                                                             column));
+  g_return_if_fail (iter->stamp == model->stamp);
+
+  row = TRANSFER_QUEUE_ITER_ROW (iter);
+  child = TRANSFER_QUEUE_ITER_CHILD (iter);
+
+  if (child == 0)
+    {
+      switch (column)
+        {
+          case TRANSFER_QUEUE_COL_ICON:
+            g_value_set_object (value, gftp_get_pixbuf ("dir.xpm"));
+            break;
+          case TRANSFER_QUEUE_COL_NAME:
+            g_value_set_string (value, row->tdata->fromreq->hostname);
+            break;
+          case TRANSFER_QUEUE_COL_PROGRESS:
+            g_value_take_string (value, transfer_queue_row_status (row));
+            break;
+        }
+      return;
+    }
+
+  g_return_if_fail (row->files != NULL && child <= row->files->len);
+  node = g_ptr_array_index (row->files, child - 1);
+
+  switch (column)
+    {
+      case TRANSFER_QUEUE_COL_NAME:
+        g_value_set_string (value, gftpui_gtk_get_utf8_file_pos (node->data));
+        break;
+      case TRANSFER_QUEUE_COL_PROGRESS:
+        g_value_set_string (value, transfer_queue_file_status (row, node));
+        break;
+    }
+}
+
+
+static gboolean
+transfer_queue_model_iter_next (GtkTreeModel * tree_model, GtkTreeIter * iter)
+{
+  TransferQueueModel * model;
+  transfer_queue_row * row;
+  guint child;
+
+  model = TRANSFER_QUEUE_MODEL (tree_model);
+  row = TRANSFER_QUEUE_ITER_ROW (iter);
+  child = TRANSFER_QUEUE_ITER_CHILD (iter);
+
+  if (child == 0)
+    return (transfer_queue_model_set_iter (model, iter,
+                                           transfer_queue_model_nth_row (model, row->index + 1),
+                                           0));
+  return (transfer_queue_model_set_iter (model, iter, row, child + 1));
+}
+
+
+static gboolean
+transfer_queue_model_iter_nth_child (GtkTreeModel * tree_model,
+                                     GtkTreeIter * iter, GtkTreeIter * parent,
+                                     gint n)
+{
+  TransferQueueModel * model;
+  transfer_queue_row * row;
+
+  model = TRANSFER_QUEUE_MODEL (tree_model);
+  if (parent == NULL)
+    return (transfer_queue_model_set_iter (model, iter,
+                                           transfer_queue_model_nth_row (model, n),
+                                           0));
+
+  row = TRANSFER_QUEUE_ITER_ROW (parent);
+  if (TRANSFER_QUEUE_ITER_CHILD (parent) != 0 || n < 0)
+    {
+      iter->stamp = 0;
+      return (FALSE);
+    }
+
+  transfer_queue_row_files (model, row);
+  return (transfer_queue_model_set_iter (model, iter, row, n + 1));
+}
+
+
+static gboolean
+transfer_queue_model_iter_children (GtkTreeModel * tree_model,
+                                    GtkTreeIter * iter, GtkTreeIter * parent)
+{
+  return (transfer_queue_model_iter_nth_child (tree_model, iter, parent, 0));
+}
+
+
+/* A collapsed transfer claims children if it has any files at all.
+   transfer_queue_test_expand () refuses to open it when none of them pass
+   the filter */
+
+static gboolean
+transfer_queue_model_iter_has_child (GtkTreeModel * tree_model,
+                                     GtkTreeIter * iter)
+{
+  transfer_queue_row * row;
+
+  if (TRANSFER_QUEUE_ITER_CHILD (iter) != 0)
+    return (FALSE);
+
+  row = TRANSFER_QUEUE_ITER_ROW (iter);
+  if (row->files != NULL)
+    return (row->files->len > 0);
+  return (row->tdata->files != NULL);
+}
+
+
+static gint
+transfer_queue_model_iter_n_children (GtkTreeModel * tree_model,
+                                      GtkTreeIter * iter)
+{
+  TransferQueueModel * model;
+
+  model = TRANSFER_QUEUE_MODEL (tree_model);
+  if (iter == NULL)
+    return (model->rows->len);
+  else if (TRANSFER_QUEUE_ITER_CHILD (iter) != 0)
+    return (0);
+
+  return (transfer_queue_row_files (model, TRANSFER_QUEUE_ITER_ROW (iter))->len);
+}
+
+
+static gboolean
+transfer_queue_model_iter_parent (GtkTreeModel * tree_model,
+                                  GtkTreeIter * iter, GtkTreeIter * child)
+{
+  if (TRANSFER_QUEUE_ITER_CHILD (child) == 0)
+    {
+      iter->stamp = 0;
+      return (FALSE);
+    }
+
+  return (transfer_queue_model_set_iter (TRANSFER_QUEUE_MODEL (tree_model),
+                                         iter, TRANSFER_QUEUE_ITER_ROW (child),
+                                         0));
+}
+
+
+static void
+transfer_queue_model_tree_model_init (GtkTreeModelIface * iface)
+{
+  iface->get_flags       = transfer_queue_model_get_flags;
+  iface->get_n_columns   = transfer_queue_model_get_n_columns;
+  iface->get_column_type = transfer_queue_model_get_column_type;
+  iface->get_iter        = transfer_queue_model_get_iter;
+  iface->get_path        = transfer_queue_model_get_path;
+  iface->get_value       = transfer_queue_model_get_value;
+  iface->iter_next       = transfer_queue_model_iter_next;
+  iface->iter_children   = transfer_queue_model_iter_children;
+  iface->iter_has_child  = transfer_queue_model_iter_has_child;
+  iface->iter_n_children = transfer_queue_model_iter_n_children;
+  iface->iter_nth_child  = transfer_queue_model_iter_nth_child;
+  iface->iter_parent     = transfer_queue_model_iter_parent;
+}
+
+
+static void
+transfer_queue_emit_changed (TransferQueueModel * model,
+                             transfer_queue_row * row, guint child)
+{
+  GtkTreePath * path;
+  GtkTreeIter iter;
+
+  transfer_queue_model_set_iter (model, &iter, row, child);
+  path = transfer_queue_model_get_path (GTK_TREE_MODEL (model), &iter);
+  gtk_tree_model_row_changed (GTK_TREE_MODEL (model), path, &iter);
+  gtk_tree_path_free (path);
+}
+
+
+/* Position + 1 of the child row showing fle, or 0 if it isn't shown */
+
+static guint
+transfer_queue_file_child (transfer_queue_row * row, gftp_file * fle)
+{
+  guint child;
+
+  child = GPOINTER_TO_UINT (fle->user_data);
+  if (row->files == NULL || child == 0 || child > row->files->len ||
+      ((GList *) g_ptr_array_index (row->files, child - 1))->data != fle)
+    return (0);
+  return (child);
+}
+
+
+static gboolean
+transfer_queue_test_expand (GtkTreeView * tree, GtkTreeIter * iter,
+                            GtkTreePath * path, gpointer data)
+{
+  TransferQueueModel * model;
+  transfer_queue_row * row;
+
+  model = transfer_queue_get_model ();
+  row = TRANSFER_QUEUE_ITER_ROW (iter);
+  if (transfer_queue_row_files (model, row)->len > 0)
+    {
+      row->open = 1;
+      return (FALSE);
+    }
+
+  /* Stay collapsed, so that files added later are not put under a row
+     that the view thinks has no children */
+  row->open = 0;
+  transfer_queue_row_forget_files (row);
+  return (TRUE);
+}
+
+
+static void
+transfer_queue_collapsed (GtkTreeView * tree, GtkTreeIter * iter,
+                          GtkTreePath * path, gpointer data)
+{
+  transfer_queue_row * row;
+
+  row = TRANSFER_QUEUE_ITER_ROW (iter);
+  row->open = 0;
+  transfer_queue_row_forget_files (row);
+}
+
+
+static void
+transfer_queue_filter_changed (GtkComboBox * cb, gpointer data)
+{
+  transfer_queue_set_filter (gtk_combo_box_get_active (cb));
+}
+
+
+GtkWidget *
+transfer_queue_new (void)
+{
+  GtkTreeViewColumn * column;
+  GtkCellRenderer * renderer;
+  GtkTreeModel * model;
+  GtkWidget * tree;
+  intptr_t width;
+
+  model = g_object_new (transfer_queue_model_get_type (), NULL);
+  tree = gtk_tree_view_new_with_model (model);
+  g_object_unref (model);
+
+  gtk_tree_selection_set_mode (gtk_tree_view_get_selection (GTK_TREE_VIEW (tree)),
+                               GTK_SELECTION_SINGLE);
+
+  column = gtk_tree_view_column_new ();
+  gtk_tree_view_column_set_title (column, _("Filename"));
+  gtk_tree_view_column_set_resizable (column, TRUE);
+  renderer = gtk_cell_renderer_pixbuf_new ();
+  gtk_tree_view_column_pack_start (column, renderer, FALSE);
+  gtk_tree_view_column_add_attribute (column, renderer, "pixbuf",
+                                      TRANSFER_QUEUE_COL_ICON);
+  renderer = gtk_cell_renderer_text_new ();
+  gtk_tree_view_column_pack_start (column, renderer, TRUE);
+  gtk_tree_view_column_add_attribute (column, renderer, "text",
+                                      TRANSFER_QUEUE_COL_NAME);
+  gtk_tree_view_append_column (GTK_TREE_VIEW (tree), column);
+
+  gftp_lookup_global_option ("file_trans_column", &width);
+  if (width > 0)
+    {
+      gtk_tree_view_column_set_sizing (column, GTK_TREE_VIEW_COLUMN_FIXED);
+      gtk_tree_view_column_set_fixed_width (column, width);
+    }
+  else
+    gtk_tree_view_column_set_sizing (column, GTK_TREE_VIEW_COLUMN_AUTOSIZE);
+
+  column = gtk_tree_view_column_new ();
+  gtk_tree_view_column_set_title (column, _("Progress"));
+  gtk_tree_view_column_set_sizing (column, GTK_TREE_VIEW_COLUMN_FIXED);
+  renderer = gtk_cell_renderer_text_new ();
+  gtk_tree_view_column_pack_start (column, renderer, TRUE);
+  gtk_tree_view_column_add_attribute (column, renderer, "text",
+                                      TRANSFER_QUEUE_COL_PROGRESS);
+  gtk_tree_view_append_column (GTK_TREE_VIEW (tree), column);
+
+  /* All rows are the same height, so the view doesn't have to measure the
+     rows that are not on screen */
+  if (width > 0)
+    gtk_tree_view_set_fixed_height_mode (GTK_TREE_VIEW (tree), TRUE);
+
+  g_signal_connect (G_OBJECT (tree), "test-expand-row",
+                    G_CALLBACK (transfer_queue_test_expand), NULL);
+  g_signal_connect (G_OBJECT (tree), "row-collapsed",
+                    G_CALLBACK (transfer_queue_collapsed), NULL);
+
+  return (tree);
+}
+
+
+GtkWidget *
+transfer_queue_filter_new (void)
+{
+  GtkWidget * box, * label, * combo;
+
+  box = gtk_hbox_new (FALSE, 5);
+
+  label = gtk_label_new (_("Show:"));
+  gtk_box_pack_start (GTK_BOX (box), label, FALSE, FALSE, 0);
+
+  /* In the order of transfer_queue_state */
+  combo = gtk_combo_box_text_new ();
+  gtk_combo_box_text_append_text (GTK_COMBO_BOX_TEXT (combo), _("All"));
+  gtk_combo_box_text_append_text (GTK_COMBO_BOX_TEXT (combo), _("Pending"));
+  gtk_combo_box_text_append_text (GTK_COMBO_BOX_TEXT (combo), _("Active"));
+  gtk_combo_box_text_append_text (GTK_COMBO_BOX_TEXT (combo), _("Failed"));
+  gtk_combo_box_text_append_text (GTK_COMBO_BOX_TEXT (combo), _("Done"));
+  gtk_combo_box_set_active (GTK_COMBO_BOX (combo), transfer_queue_all);
+  g_signal_connect (G_OBJECT (combo), "changed",
+                    G_CALLBACK (transfer_queue_filter_changed), NULL);
+  gtk_box_pack_start (GTK_BOX (box), combo, FALSE, FALSE, 0);
+
+  return (box);
+}
+
+
+/* Only the files that match the filter are shown under the transfers.
+   The model is taken off the view while the child rows are dropped, the
+   transfers that were open are opened again with the new filter */
+
+void
+transfer_queue_set_filter (transfer_queue_state filter)
+{
+  TransferQueueModel * model;
+  transfer_queue_row * row;
+  GtkTreePath * path;
+  guint i;
+
+  model = transfer_queue_get_model ();
+  if (model->filter == filter)
+    return;
+
+  g_object_ref (model);
+  gtk_tree_view_set_model (GTK_TREE_VIEW (dlwdw), NULL);
+
+  for (i = 0; i < model->rows->len; i++)
+    transfer_queue_row_forget_files (g_ptr_array_index (model->rows, i));
+  model->filter = filter;
+  model->stamp++;
+
+  gtk_tree_view_set_model (GTK_TREE_VIEW (dlwdw), GTK_TREE_MODEL (model));
+  g_object_unref (model);
+
+  for (i = 0; i < model->rows->len; i++)
+    {
+      row = g_ptr_array_index (model->rows, i);
+      if (!row->open)
+        continue;
+
+      path = gtk_tree_path_new_from_indices (i, -1);
+      gtk_tree_view_expand_row (GTK_TREE_VIEW (dlwdw), path, FALSE);
+      gtk_tree_path_free (path);
+    }
+}
+
+
+void
+transfer_queue_add (gftp_transfer * tdata)
+{
+  TransferQueueModel * model;
+  transfer_queue_row * row;
+  GtkTreePath * path;
+  GtkTreeIter iter;
+
+  model = transfer_queue_get_model ();
+
+  row = g_malloc0 (sizeof (*row));
+  row->tdata = tdata;
+  row->index = model->rows->len;
+  g_ptr_array_add (model->rows, row);
+  tdata->user_data = row;
+
+  transfer_queue_model_set_iter (model, &iter, row, 0);
+  path = gtk_tree_path_new_from_indices (row->index, -1);
+  gtk_tree_model_row_inserted (GTK_TREE_MODEL (model), path, &iter);
+  if (tdata->files != NULL)
+    gtk_tree_model_row_has_child_toggled (GTK_TREE_MODEL (model), path, &iter);
+
+  if (tdata->numdirs + tdata->numfiles < 50)
+    gtk_tree_view_expand_row (GTK_TREE_VIEW (dlwdw), path, FALSE);
+  gtk_tree_path_free (path);
+}
+
+
+void
+transfer_queue_remove (gftp_transfer * tdata)
+{
+  TransferQueueModel * model;
+  transfer_queue_row * row;
+  GtkTreePath * path;
+  guint i;
+
+  if ((row = tdata->user_data) == NULL)
+    return;
+
+  model = transfer_queue_get_model ();
+  g_ptr_array_remove_index (model->rows, row->index);
+  for (i = row->index; i < model->rows->len; i++)
+    ((transfer_queue_row *) g_ptr_array_index (model->rows, i))->index = i;
+
+  path = gtk_tree_path_new_from_indices (row->index, -1);
+  gtk_tree_model_row_deleted (GTK_TREE_MODEL (model), path);
+  gtk_tree_path_free (path);
+
+  tdata->user_data = NULL;
+  transfer_queue_row_free (row);
+}
+
+
+void
+transfer_queue_set_status (gftp_transfer * tdata, const char * status)
+{
+  transfer_queue_row * row;
+
+  if ((row = tdata->user_data) == NULL)
+    return;
+
+  g_free (row->status);
+  row->status = g_strdup (status);
+  transfer_queue_emit_changed (transfer_queue_get_model (), row, 0);
+}
+
+
+void
+transfer_queue_set_progress (gftp_transfer * tdata, gftp_file * fle,
+                             const char * progress)
+{
+  transfer_queue_row * row;
+  guint child;
+
+  if ((row = tdata->user_data) == NULL)
+    return;
+
+  g_free (row->progress);
+  row->progress = g_strdup (progress);
+
+  if ((child = transfer_queue_file_child (row, fle)) > 0)
+    transfer_queue_emit_changed (transfer_queue_get_model (), row, child);
+}
+
+
+void
+transfer_queue_file_added (gftp_transfer * tdata, GList * curfle)
+{
+  TransferQueueModel * model;
+  transfer_queue_row * row;
+  GtkTreePath * path;
+  GtkTreeIter iter;
+
+  if ((row = tdata->user_data) == NULL)
+    return;
+
+  model = transfer_queue_get_model ();
+  ((gftp_file *) curfle->data)->user_data = NULL;
+
+  if (row->files == NULL)
+    {
+      /* Collapsed, only the expander can change */
+      if (tdata->files == curfle)
+        {
+          transfer_queue_model_set_iter (model, &iter, row, 0);
+          path = gtk_tree_path_new_from_indices (row->index, -1);
+          gtk_tree_model_row_has_child_toggled (GTK_TREE_MODEL (model),
+                                                path, &iter);
+          gtk_tree_path_free (path);
+        }
+      return;
+    }
+
+  /* The new files are added to the end of tdata->files one at a time */
+  if (model->filter != transfer_queue_all &&
+      transfer_queue_file_state (row, curfle) != model->filter)
+    return;
+
+  g_ptr_array_add (row->files, curfle);
+  ((gftp_file *) curfle->data)->user_data = GUINT_TO_POINTER (row->files->len);
+
+  transfer_queue_model_set_iter (model, &iter, row, row->files->len);
+  path = gtk_tree_path_new_from_indices (row->index, row->files->len - 1, -1);
+  gtk_tree_model_row_inserted (GTK_TREE_MODEL (model), path, &iter);
+  gtk_tree_path_free (path);
+
+  if (row->files->len == 1)
+    {
+      transfer_queue_model_set_iter (model, &iter, row, 0);
+      path = gtk_tree_path_new_from_indices (row->index, -1);
+      gtk_tree_model_row_has_child_toggled (GTK_TREE_MODEL (model),
+                                            path, &iter);
+      gtk_tree_path_free (path);
+    }
+}
+
+
+/* Called for each file the transfer thread is finished with. A file stays
+   shown until the filter is changed or the transfer is opened again, even
+   if it no longer matches the filter */
+
+void
+transfer_queue_file_finished (gftp_transfer * tdata, gftp_file * fle)
+{
+  transfer_queue_row * row;
+
+  if ((row = tdata->user_data) == NULL)
+    return;
+
+  if (fle->transfer_action == GFTP_TRANS_ACTION_SKIP)
+    row->num_skipped++;
+  else if (fle->transfer_failed)
+    row->num_failed++;
+  else
+    row->num_done++;
+
+  transfer_queue_file_changed (tdata, fle);
+}
+
+
+void
+transfer_queue_file_changed (gftp_transfer * tdata, gftp_file * fle)
+{
+  transfer_queue_row * row;
+  guint child;
+
+  if ((row = tdata->user_data) == NULL)
+    return;
+
+  if ((child = transfer_queue_file_child (row, fle)) > 0)
+    transfer_queue_emit_changed (transfer_queue_get_model (), row, child);
+}
+
+
+/* curfle was swapped with its neighbour other in tdata->files. If both
+   are shown next to each other their rows are swapped and the selection
+   follows curfle */
+
+void
+transfer_queue_file_moved (gftp_transfer * tdata, GList * curfle,
+                           GList * other)
+{
+  TransferQueueModel * model;
+  transfer_queue_row * row;
+  guint child, otherchild;
+  GtkTreeIter iter;
+
+  if ((row = tdata->user_data) == NULL)
+    return;
+
+  child = transfer_queue_file_child (row, curfle->data);
+  otherchild = transfer_queue_file_child (row, other->data);
+  if (child == 0 || otherchild == 0 ||
+      (child != otherchild + 1 && otherchild != child + 1))
+    return;
+
+  model = transfer_queue_get_model ();
+  g_ptr_array_index (row->files, child - 1) = other;
+  g_ptr_array_index (row->files, otherchild - 1) = curfle;
+  ((gftp_file *) curfle->data)->user_data = GUINT_TO_POINTER (otherchild);
+  ((gftp_file *) other->data)->user_data = GUINT_TO_POINTER (child);
+
+  transfer_queue_emit_changed (model, row, child);
+  transfer_queue_emit_changed (model, row, otherchild);
+
+  transfer_queue_model_set_iter (model, &iter, row, otherchild);
+  gtk_tree_selection_select_iter (gtk_tree_view_get_selection (GTK_TREE_VIEW (dlwdw)),
+                                  &iter);
+}
+
+
+/* Fills in the transfer and, for a file row, the file that is selected.
+   Returns FALSE if no row is selected */
+
+int
+transfer_queue_get_selected (gftpui_common_curtrans_data * transdata)
+{
+  TransferQueueModel * model;
+  transfer_queue_row * row;
+  GtkTreeModel * tree_model;
+  GtkTreeIter iter;
+  guint child;
+
+  if (!gtk_tree_selection_get_selected (gtk_tree_view_get_selection (GTK_TREE_VIEW (dlwdw)),
+                                        &tree_model, &iter))
+    return (FALSE);
+
+  model = TRANSFER_QUEUE_MODEL (tree_model);
+  g_return_val_if_fail (iter.stamp == model->stamp, FALSE);
+
+  row = TRANSFER_QUEUE_ITER_ROW (&iter);
+  child = TRANSFER_QUEUE_ITER_CHILD (&iter);
+
+  transdata->transfer = row->tdata;
+  transdata->curfle = child > 0 ? g_ptr_array_index (row->files, child - 1)
+                                : NULL;
+  return (TRUE);
+}
+
+
+/* Is the transfer row, or one of its files, on the screen? */
+
+int
+transfer_queue_is_visible (gftp_transfer * tdata)
+{
+  GtkTreePath * start, * end;
+  transfer_queue_row * row;
+  int ret;
+
+  if ((row = tdata->user_data) == NULL ||
+      !gtk_tree_view_get_visible_range (GTK_TREE_VIEW (dlwdw), &start, &end))
+    return (FALSE);
+
+  ret = row->index >= (guint) gtk_tree_path_get_indices (start)[0] &&
+        row->index <= (guint) gtk_tree_path_get_indices (end)[0];
+
+  gtk_tree_path_free (start);
+  gtk_tree_path_free (end);
+  return (ret);
+}
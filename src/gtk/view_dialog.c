@@ -222,12 +222,9 @@ view_file (char *filename, int fd, unsigned int viewedit, unsigned int del_file,
 {
   GtkWidget * dialog, * view, * table, * tempwid;
   char buf[8192], *view_program, *edit_program;
-  gftp_config_list_vars * tmplistvar;
   gftp_file_extensions * tempext;
   gftp_viewedit_data * newproc;
   GtkAdjustment * vadj;
-  GList * templist;
-  size_t stlen;
   int doclose;
   ssize_t n;
   char * non_utf8;
@@ -235,22 +232,14 @@ view_file (char *filename, int fd, unsigned int viewedit, unsigned int del_file,
   GtkTextIter iter;
 
   doclose = 1;
-  stlen = strlen (filename);
-  gftp_lookup_global_option ("ext", &tmplistvar);
-  for (templist = tmplistvar->list; templist != NULL; templist = templist->next)
+  if ((tempext = gftp_lookup_file_extension (filename)) != NULL &&
+      *tempext->view_program != '\0')
     {
-      tempext = templist->data;
-      if (stlen >= tempext->stlen &&
-          strcmp (&filename[stlen - tempext->stlen], tempext->ext) == 0)
-        {
-          if (*tempext->view_program == '\0')
-            break;
-          ftp_log (gftp_logging_misc, NULL, _("Opening %s with %s\n"),
-                   filename, tempext->view_program);
-          fork_process (tempext->view_program, filename, fd, remote_filename,
-                        viewedit, del_file, dontupload, wdata);
-          return;
-        }
+      ftp_log (gftp_logging_misc, NULL, _("Opening %s with %s\n"),
+               filename, tempext->view_program);
+      fork_process (tempext->view_program, filename, fd, remote_filename,
+                    viewedit, del_file, dontupload, wdata);
+      return;
     }
 
   if (wdata != NULL)
@@ -95,6 +95,9 @@ gftp_text_log (gftp_logging_level level, gftp_request * request,
 
   g_return_if_fail (string != NULL);
 
+  if (!gftp_logging_wanted (level))
+    return;
+
   switch (level)
     {
       case gftp_logging_send:
@@ -115,17 +118,8 @@ gftp_text_log (gftp_logging_level level, gftp_request * request,
   g_vsnprintf (tempstr, sizeof (tempstr), string, argp);
   va_end (argp);
 
-  if (gftp_logfd != NULL && level != gftp_logging_misc_nolog)
-    {
-      fwrite (tempstr, 1, strlen (tempstr), gftp_logfd);
-      if (ferror (gftp_logfd))
-        {
-          fclose (gftp_logfd);
-          gftp_logfd = NULL;
-        }
-      else
-        fflush (gftp_logfd);
-    }
+  gftp_log_file_write (level, tempstr);
+  gftp_log_file_flush ();
 
   if (level == gftp_logging_misc_nolog)
     printf ("%s", tempstr);
@@ -560,15 +560,59 @@ gftpui_common_set_show_subhelp (const char *topic)
 }   
 
 
+static void
+_gftpui_common_print_files (gftp_request * request, GList * files)
+{
+  char *startcolor, *endcolor, *tempstr;
+  GList * templist;
+  gftp_file * fle;
+
+  for (templist = files; templist != NULL; templist = templist->next)
+    {
+      fle = templist->data;
+
+      gftpui_lookup_file_colors (fle, &startcolor, &endcolor);
+      tempstr = gftp_gen_ls_string (request, fle, startcolor, endcolor);
+      request->logging_function (gftp_logging_misc_nolog, request, "%s\n",
+                                 tempstr);
+      g_free (tempstr);
+      gftp_file_destroy (fle, 1);
+    }
+
+  g_list_free (files);
+}
+
+
+/* A batch of a listing that is still being received. It is printed right
+   away, so the files are only sorted within the batch */
+static void
+_gftpui_common_ls_batch (gftpui_callback_data * cdata, GList * files)
+{
+  intptr_t sortcol, sortasds;
+
+  if (cdata->request->protonum == GFTP_LOCAL_NUM)
+    {
+      gftp_lookup_global_option ("local_sortcol", &sortcol);
+      gftp_lookup_global_option ("local_sortasds", &sortasds);
+    }
+  else
+    {
+      gftp_lookup_global_option ("remote_sortcol", &sortcol);
+      gftp_lookup_global_option ("remote_sortasds", &sortasds);
+    }
+
+  files = gftp_sort_filelist (files, sortcol, sortasds);
+  _gftpui_common_print_files (cdata->request, files);
+}
+
+
 static int
 gftpui_common_cmd_ls (void *uidata, gftp_request * request,
                       void *other_uidata, gftp_request * other_request,
                       const char *command)
 {
-  char *startcolor, *endcolor, *tempstr;
   gftpui_callback_data * cdata;
-  GList * templist;
-  gftp_file * fle;
+  intptr_t stream_listings;
 
   if (!GFTP_IS_CONNECTED (request))
     {
@@ -577,33 +621,23 @@ gftpui_common_cmd_ls (void *uidata, gftp_request * request,
       return (1);
     }
 
+  /* A terminal cannot reorder lines that were already printed, so ls is
+     only streamed when the user asks for it */
+  gftp_lookup_request_option (request, "text_stream_listings",
+                              &stream_listings);
+
   cdata = g_malloc0 (sizeof (*cdata));
   cdata->request = request;
   cdata->uidata = uidata;
   cdata->source_string = *command != '\0' ? (char *) command : NULL;
   cdata->run_function = gftpui_common_run_ls;
+  if (stream_listings)
+    cdata->files_function = _gftpui_common_ls_batch;
   cdata->dont_refresh = 1;
 
   gftpui_common_run_callback_function (cdata);
 
-  templist = cdata->files;
-  while (templist != NULL)
-    {
-      fle = templist->data;
-
-      gftpui_lookup_file_colors (fle, &startcolor, &endcolor);
-      tempstr = gftp_gen_ls_string (request, fle, startcolor, endcolor);
-      request->logging_function (gftp_logging_misc_nolog, request, "%s\n",
-                                 tempstr);
-      g_free (tempstr);
-
-      templist = templist->next;
-      gftp_file_destroy (fle, 1);
-    }
-
-
-  if (cdata->files != NULL)
-    g_list_free (cdata->files);
+  _gftpui_common_print_files (request, cdata->files);
   g_free (cdata);
 
   return (1);
@@ -1004,6 +1038,8 @@ gftpui_common_methods gftpui_common_commands[] = {
          gftpui_common_set_show_subhelp},
         {N_("site"),    2, gftpui_common_cmd_site, gftpui_common_request_remote,
          N_("Run a site specific command"), NULL},
+        {N_("speedtest"), 2, gftpui_common_cmd_speedtest, gftpui_common_request_remote,
+         N_("Measures the transfer speed to the remote site with a scratch file"), NULL},
         {NULL,          0, NULL,                gftpui_common_request_none,
 	 NULL, NULL}};
 
@@ -1257,24 +1293,55 @@ int
 _gftpui_common_do_transfer_file (gftp_transfer * tdata, gftp_file * curfle)
 {
   struct timeval updatetime;
-  intptr_t trans_blksize;
+  size_t trans_blksize, bufsize;
+  intptr_t blksize_option;
+  gint64 blockstart;
   ssize_t num_trans;
   char *buf;
   int ret;
 
-  gftp_lookup_request_option (tdata->fromreq, "trans_blksize", &trans_blksize);
-  buf = g_malloc0 (trans_blksize);
+  if (tdata->autotune == NULL)
+    tdata->autotune = gftp_autotune_new (tdata);
+
+  if (tdata->autotune != NULL)
+    trans_blksize = gftp_autotune_get_blksize (tdata->autotune);
+  else
+    {
+      gftp_lookup_request_option (tdata->fromreq, "trans_blksize",
+                                  &blksize_option);
+      trans_blksize = blksize_option;
+    }
+
+  bufsize = trans_blksize;
+  buf = g_malloc0 (bufsize);
 
   memset (&updatetime, 0, sizeof (updatetime));
   gftpui_start_current_file_in_transfer (tdata);
 
   num_trans = 0;
-  while (!tdata->cancel &&
-         (num_trans = _do_transfer_block (tdata, curfle, buf,
-                                          trans_blksize)) > 0)
+  blockstart = 0;
+  while (!tdata->cancel)
     {
+      if (tdata->autotune != NULL)
+        blockstart = g_get_monotonic_time ();
+
+      if ((num_trans = _do_transfer_block (tdata, curfle, buf,
+                                           trans_blksize)) <= 0)
+        break;
+
       gftp_calc_kbs (tdata, num_trans);
 
+      if (tdata->autotune != NULL)
+        {
+          trans_blksize = gftp_autotune_block_done (tdata, num_trans,
+                                    g_get_monotonic_time () - blockstart);
+          if (trans_blksize > bufsize)
+            {
+              bufsize = trans_blksize;
+              buf = g_realloc (buf, bufsize);
+            }
+        }
+
       if (tdata->lasttime.tv_sec - updatetime.tv_sec >= 1 ||
           tdata->curtrans >= tdata->tot_file_trans)
         {
@@ -1370,7 +1437,9 @@ _gftpui_common_next_file_in_trans (gftp_transfer * tdata)
   if (g_thread_supported ())
     g_mutex_lock (&tdata->structmutex);
 
+  gftp_transfer_stats_begin (tdata);
   tdata->curtrans = 0;
+  gftp_transfer_stats_end (tdata);
   tdata->next_file = 1;
 
   curfle = tdata->curfle->data;
@@ -1422,7 +1491,7 @@ _gftpui_common_preserve_perm_time (gftp_transfer * tdata, gftp_file * curfle)
 static int
 _gftpui_common_trans_file_or_dir (gftp_transfer * tdata)
 {
-  gftp_file * curfle;
+  gftp_file * curfle, fle;
   int ret;
 
   if (g_thread_supported ())
@@ -1486,9 +1555,11 @@ _gftpui_common_trans_file_or_dir (gftp_transfer * tdata)
           if (g_thread_supported ())
             g_mutex_lock (&tdata->structmutex);
 
+          gftp_transfer_stats_begin (tdata);
           tdata->curtrans = 0;
           tdata->curresumed = curfle->transfer_action == GFTP_TRANS_ACTION_RESUME ? curfle->startsize : 0;
           tdata->resumed_bytes += tdata->curresumed;
+          gftp_transfer_stats_end (tdata);
 
           if (g_thread_supported ())
             g_mutex_unlock (&tdata->structmutex);
@@ -1497,10 +1568,28 @@ _gftpui_common_trans_file_or_dir (gftp_transfer * tdata)
         }
     }
 
+  curfle->transfer_failed = ret != 0;
   if (ret == 0)
-    ret = _gftpui_common_preserve_perm_time (tdata, curfle);
+    {
+      if (!S_ISDIR (curfle->st_mode) && tdata->toreq->use_cache)
+        {
+          /* Add the new file to the cached listing of the destination
+             directory. The permissions and time are fixed up below if they
+             are being preserved. */
+          memset (&fle, 0, sizeof (fle));
+          fle.st_mode = (curfle->st_mode & ~S_IFMT) | S_IFREG;
+          fle.size = curfle->size;
+          fle.datetime = time (NULL);
+          gftp_cache_file_added (tdata->toreq, curfle->destfile, &fle);
+        }
+
+      ret = _gftpui_common_preserve_perm_time (tdata, curfle);
+    }
   else
     {
+      if (!S_ISDIR (curfle->st_mode) && tdata->toreq->use_cache)
+        gftp_cache_file_added (tdata->toreq, curfle->destfile, NULL);
+
       curfle->retry_transfer = 1;
       tdata->fromreq->logging_function (gftp_logging_error, tdata->fromreq,
                                         _("Could not download %s from %s\n"),
@@ -1514,13 +1603,22 @@ _gftpui_common_trans_file_or_dir (gftp_transfer * tdata)
 int
 gftpui_common_transfer_files (gftp_transfer * tdata)
 {
+  intptr_t refresh_files;
   int ret, skipped_files;
 
   tdata->curfle = tdata->files;
   gftpui_common_num_child_threads++;
 
+  gftp_transfer_stats_begin (tdata);
   gettimeofday (&tdata->starttime, NULL);
   memcpy (&tdata->lasttime, &tdata->starttime, sizeof (tdata->lasttime));
+  gftp_transfer_stats_end (tdata);
+
+  /* Every uploaded file is added to the cached listing of its directory.
+     Doing that once at the end saves rewriting the listing per file, unless
+     the UI shows the listing again after each file */
+  gftp_lookup_request_option (tdata->fromreq, "refresh_files", &refresh_files);
+  gftp_cache_begin_batch (tdata->toreq);
 
   skipped_files = 0;
   while (tdata->curfle != NULL)
@@ -1544,6 +1642,9 @@ gftpui_common_transfer_files (gftp_transfer * tdata)
           break;
         }
 
+      if (refresh_files)
+        gftp_cache_flush_batch (tdata->toreq);
+
       _gftpui_common_next_file_in_trans (tdata);
 
       if (tdata->cancel)
@@ -1562,6 +1663,8 @@ gftpui_common_transfer_files (gftp_transfer * tdata)
                                       _("There were %d files or directories that could not be transferred. Check the log for which items were not properly transferred."),
                                       skipped_files);
 
+  gftp_cache_end_batch (tdata->toreq);
+
   tdata->done = 1;
   gftpui_common_num_child_threads--;
 
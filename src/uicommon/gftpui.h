@@ -38,6 +38,7 @@ struct _gftpui_callback_data
   int (*run_function) (gftpui_callback_data * cdata);
   int (*connect_function) (gftpui_callback_data * cdata);
   void (*disconnect_function) (gftpui_callback_data * cdata);
+  void (*files_function) (gftpui_callback_data * cdata, GList * files);
   unsigned int dont_check_connection : 1,
                dont_refresh : 1,
                dont_clear_cache : 1,
@@ -142,6 +143,13 @@ void gftpui_common_cancel_file_transfer	( gftp_transfer * tdata );
 
 int gftpui_common_transfer_files 	( gftp_transfer * tdata );
 
+/* gftpuispeedtest.c */
+int gftpui_common_cmd_speedtest 	( void *uidata,
+					  gftp_request * request,
+					  void *other_uidata,
+					  gftp_request * other_request,
+					  const char *command );
+
 /* gftpuicallback.c */
 int gftpui_common_run_mkdir 		( gftpui_callback_data * cdata );
 
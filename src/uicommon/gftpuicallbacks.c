@@ -23,6 +23,8 @@
 int
 gftpui_common_run_mkdir (gftpui_callback_data * cdata)
 {
+  /* The library patches the cached listing when the directory is made */
+  cdata->dont_clear_cache = 1;
   return (gftp_make_directory (cdata->request, cdata->input_string));
 }
 
@@ -30,6 +32,7 @@ gftpui_common_run_mkdir (gftpui_callback_data * cdata)
 int
 gftpui_common_run_rename (gftpui_callback_data * cdata)
 {
+  cdata->dont_clear_cache = 1;
   return (gftp_rename_file (cdata->request, cdata->source_string,
                             cdata->input_string));
 }
@@ -52,18 +55,40 @@ gftpui_common_run_chdir (gftpui_callback_data * cdata)
 int
 gftpui_common_run_chmod (gftpui_callback_data * cdata)
 {
+  cdata->dont_clear_cache = 1;
   return (gftp_chmod (cdata->request, cdata->source_string,
                       strtol (cdata->input_string, NULL, 10)));
 }
 
 
+/* When cdata->files_function is set, the files are handed to it in batches
+   while they are received, and the UI does the sorting */
+#define GFTPUI_LS_BATCH_USEC	150000
+#define GFTPUI_LS_BATCH_MAX	8192
+
+static gftp_file *
+_gftpui_common_new_dotdot (void)
+{
+  gftp_file * fle;
+
+  fle = g_malloc0 (sizeof (*fle));
+  fle->file = g_strdup ("..");
+  fle->user = g_malloc0 (1);
+  fle->group = g_malloc0 (1);
+  fle->st_mode = S_IFDIR | S_IRUSR | S_IWUSR | S_IXUSR;
+  return (fle);
+}
+
+
 int
 gftpui_common_run_ls (gftpui_callback_data * cdata)
 {
   int got, matched_filespec, have_dotdot, ret;
   char *sortcol_var, *sortasds_var;
   intptr_t sortcol, sortasds;
+  gint64 last_batch, now;
   gftp_file * fle;
+  guint num_batch;
 
   ret = gftp_list_files (cdata->request);
   if (ret < 0)
@@ -72,6 +97,19 @@ gftpui_common_run_ls (gftpui_callback_data * cdata)
   have_dotdot = 0;
   cdata->request->gotbytes = 0;
   cdata->files = NULL;
+  num_batch = 0;
+
+  /* A streamed listing cannot wait for the end to see whether the server
+     sent a .., so it always starts with one of its own */
+  if (cdata->files_function != NULL)
+    {
+      cdata->files = g_list_prepend (cdata->files,
+                                     _gftpui_common_new_dotdot ());
+      have_dotdot = 1;
+      num_batch++;
+    }
+
+  last_batch = g_get_monotonic_time ();
   fle = g_malloc0 (sizeof (*fle));
   while ((got = gftp_get_next_file (cdata->request, NULL, fle)) > 0 ||
          got == GFTP_ERETRYABLE)
@@ -82,7 +120,8 @@ gftpui_common_run_ls (gftpui_callback_data * cdata)
         matched_filespec = gftp_match_filespec (cdata->request, fle->file,
                                                 cdata->source_string);
 
-      if (got < 0 || strcmp (fle->file, ".") == 0 || !matched_filespec)
+      if (got < 0 || strcmp (fle->file, ".") == 0 || !matched_filespec ||
+          (cdata->files_function != NULL && strcmp (fle->file, "..") == 0))
         {
           gftp_file_destroy (fle, 0);
           continue;
@@ -93,6 +132,19 @@ gftpui_common_run_ls (gftpui_callback_data * cdata)
       cdata->request->gotbytes += got;
       cdata->files = g_list_prepend (cdata->files, fle);
       fle = g_malloc0 (sizeof (*fle));
+
+      if (cdata->files_function != NULL)
+        {
+          now = g_get_monotonic_time ();
+          if (++num_batch >= GFTPUI_LS_BATCH_MAX ||
+              now - last_batch >= GFTPUI_LS_BATCH_USEC)
+            {
+              cdata->files_function (cdata, g_list_reverse (cdata->files));
+              cdata->files = NULL;
+              num_batch = 0;
+              last_batch = now;
+            }
+        }
     }
   g_free (fle);
 
@@ -100,16 +152,15 @@ gftpui_common_run_ls (gftpui_callback_data * cdata)
   cdata->request->gotbytes = -1;
 
   if (!have_dotdot)
+    cdata->files = g_list_prepend (cdata->files, _gftpui_common_new_dotdot ());
+
+  if (cdata->files_function != NULL)
     {
-      fle = g_malloc0 (sizeof (*fle));
-      fle->file = g_strdup ("..");
-      fle->user = g_malloc0 (1);
-      fle->group = g_malloc0 (1);
-      fle->st_mode = S_IFDIR | S_IRUSR | S_IWUSR | S_IXUSR;
-      cdata->files = g_list_prepend (cdata->files, fle);
+      if (cdata->files != NULL)
+        cdata->files_function (cdata, g_list_reverse (cdata->files));
+      cdata->files = NULL;
     }
-
-  if (cdata->files != NULL)
+  else if (cdata->files != NULL)
     {
       if (cdata->request->protonum == GFTP_LOCAL_NUM)
         {
@@ -132,21 +183,10 @@ gftpui_common_run_ls (gftpui_callback_data * cdata)
 }
 
 
-static void
-_gftpui_common_del_purge_cache (gpointer key, gpointer value,
-                                gpointer user_data)
-{
-  gftp_delete_cache_entry (NULL, key, 0);
-  g_free (key);
-}
-
-
 static int
 _gftpui_common_rm_list (gftpui_callback_data * cdata)
 {
-  char *tempstr, description[BUFSIZ];
   gftp_file * tempfle;
-  GHashTable * rmhash;
   GList * templist;
   int success, ret;
 
@@ -154,12 +194,8 @@ _gftpui_common_rm_list (gftpui_callback_data * cdata)
        templist->next != NULL;
        templist = templist->next); 
 
-  if (cdata->request->use_cache)
-    rmhash = g_hash_table_new (string_hash_function, string_hash_compare);
-  else
-    rmhash = NULL;
-
   ret = 0;
+  gftp_cache_begin_batch (cdata->request);
   for (; templist != NULL; templist = templist->prev)
     { 
       tempfle = templist->data;
@@ -171,26 +207,11 @@ _gftpui_common_rm_list (gftpui_callback_data * cdata)
 
       if (success < 0)
         ret = success;
-      else if (rmhash != NULL)
-        {
-          gftp_generate_cache_description (cdata->request, description,
-                                           sizeof (description), 0);
-          if (g_hash_table_lookup (rmhash, description) == NULL)
-            {
-              tempstr = g_strdup (description);
-              g_hash_table_insert (rmhash, tempstr, NULL);
-            }
-        }
 
       if (!GFTP_IS_CONNECTED (cdata->request))
         break;
     }
-
-  if (rmhash != NULL)
-    {
-      g_hash_table_foreach (rmhash, _gftpui_common_del_purge_cache, NULL);
-      g_hash_table_destroy (rmhash);
-    }
+  gftp_cache_end_batch (cdata->request);
 
   return (ret);
 }
@@ -201,6 +222,7 @@ gftpui_common_run_delete (gftpui_callback_data * cdata)
 {
   int ret;
 
+  cdata->dont_clear_cache = 1;
   if (cdata->files != NULL)
     ret = _gftpui_common_rm_list (cdata);
   else
@@ -215,6 +237,7 @@ gftpui_common_run_rmdir (gftpui_callback_data * cdata)
 {
   int ret;
 
+  cdata->dont_clear_cache = 1;
   if (cdata->files != NULL)
     ret = _gftpui_common_rm_list (cdata);
   else
@@ -0,0 +1,466 @@
+/*****************************************************************************/
+/*  gftpuispeedtest.c - measure the raw throughput to the remote site        */
+/*                                                                           */
+/*  This program is free software; you can redistribute it and/or modify     */
+/*  it under the terms of the GNU General Public License as published by     */
+/*  the Free Software Foundation; either version 2 of the License, or        */
+/*  (at your option) any later version.                                      */
+/*                                                                           */
+/*  This program is distributed in the hope that it will be useful,          */
+/*  but WITHOUT ANY WARRANTY; without even the implied warranty of           */
+/*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the            */
+/*  GNU General Public License for more details.                             */
+/*                                                                           */
+/*  You should have received a copy of the GNU General Public License        */
+/*  along with this program; if not, write to the Free Software              */
+/*  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111 USA      */
+/*****************************************************************************/
+
+#include "gftpui.h"
+#include <pthread.h>
+#include <sys/resource.h>
+
+/* The speedtest command uploads zeros to a scratch file in the current
+   remote directory and downloads it again, once for every combination of
+   block size and number of parallel streams it is given. Each stream has
+   its own connection and its own scratch file, and the total size is split
+   between the streams. Nothing is written locally.
+
+   The test runs through gftpui_common_run_callback_function (), so the GTK
+   port runs it in the background and its stop button cancels it. */
+
+#define SPEEDTEST_DEFAULT_SIZE		"16M"
+#define SPEEDTEST_DEFAULT_BLKSIZES	"4K,32K,256K"
+#define SPEEDTEST_DEFAULT_STREAMS	"1,4"
+#define SPEEDTEST_MAX_STREAMS		32
+
+typedef struct _gftpui_speedtest_args
+{
+  GList * blksizes,
+        * numstreams;
+  off_t size;
+} gftpui_speedtest_args;
+
+typedef struct _gftpui_speedtest_stream
+{
+  gftp_request * request,
+               * parent;	/* Its cancel stops every stream */
+  char *filename;
+  int upload;
+  size_t blksize;
+  off_t size;
+  double *latencies;		/* Time each block took, in ms */
+  size_t num_latencies,
+         max_latencies;
+  int ret;
+  unsigned int uploaded : 1;	/* Is there a scratch file to remove? */
+} gftpui_speedtest_stream;
+
+
+static double
+_speedtest_now (void)
+{
+  struct timeval tv;
+
+  gettimeofday (&tv, NULL);
+  return (tv.tv_sec + tv.tv_usec / 1000000.0);
+}
+
+
+static double
+_speedtest_cpu_time (void)
+{
+  struct rusage ru;
+
+  if (getrusage (RUSAGE_SELF, &ru) != 0)
+    return (0.0);
+
+  return (ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1000000.0 +
+          ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1000000.0);
+}
+
+
+static int
+_speedtest_compare_double (const void *a, const void *b)
+{
+  double x, y;
+
+  x = *(const double *) a;
+  y = *(const double *) b;
+  return (x < y ? -1 : x > y);
+}
+
+
+/* Parses 4096, 64K, 16M or 1G */
+static int
+_speedtest_parse_size (const char *str, off_t *size)
+{
+  char *endpos;
+  long long val;
+
+  val = strtoll (str, &endpos, 10);
+  switch (toupper ((unsigned char) *endpos))
+    {
+      case 'G':
+        val *= 1024;
+        /* FALLTHROUGH */
+      case 'M':
+        val *= 1024;
+        /* FALLTHROUGH */
+      case 'K':
+        val *= 1024;
+        endpos++;
+        break;
+    }
+
+  if (endpos == str || *endpos != '\0' || val <= 0)
+    return (0);
+
+  *size = val;
+  return (1);
+}
+
+
+static GList *
+_speedtest_parse_list (const char *str, off_t max)
+{
+  char **values;
+  GList * ret;
+  off_t val;
+  int i;
+
+  ret = NULL;
+  values = g_strsplit (str, ",", 0);
+  for (i = 0; values[i] != NULL; i++)
+    {
+      if (!_speedtest_parse_size (values[i], &val) || val > max)
+        {
+          g_list_free (ret);
+          ret = NULL;
+          break;
+        }
+
+      ret = g_list_append (ret, GINT_TO_POINTER ((int) val));
+    }
+
+  g_strfreev (values);
+  return (ret);
+}
+
+
+static void *
+_speedtest_run_stream (void *data)
+{
+  gftpui_speedtest_stream * stream;
+  ssize_t num;
+  double start;
+  off_t done;
+  char *buf;
+
+  stream = data;
+  buf = g_malloc0 (stream->blksize);
+  stream->num_latencies = 0;
+
+  if (stream->upload)
+    {
+      stream->ret = gftp_put_file (stream->request, stream->filename, 0,
+                                   stream->size);
+      if (stream->ret >= 0)
+        stream->uploaded = 1;
+    }
+  else
+    stream->ret = gftp_get_file (stream->request, stream->filename, 0) < 0 ?
+                  GFTP_ERETRYABLE : 0;
+
+  done = 0;
+  while (stream->ret >= 0 && !stream->request->cancel &&
+         !stream->parent->cancel)
+    {
+      start = _speedtest_now ();
+      if (stream->upload)
+        {
+          if (done >= stream->size)
+            break;
+
+          num = MIN ((off_t) stream->blksize, stream->size - done);
+          num = gftp_put_next_file_chunk (stream->request, buf, num);
+        }
+      else if ((num = gftp_get_next_file_chunk (stream->request, buf,
+                                                stream->blksize)) == 0)
+        break;
+
+      if (num < 0)
+        {
+          stream->ret = num;
+          break;
+        }
+
+      done += num;
+      if (stream->num_latencies == stream->max_latencies)
+        {
+          stream->max_latencies *= 2;
+          stream->latencies = g_realloc (stream->latencies,
+                                         stream->max_latencies *
+                                         sizeof (*stream->latencies));
+        }
+      stream->latencies[stream->num_latencies++] =
+        (_speedtest_now () - start) * 1000.0;
+    }
+
+  if (stream->ret >= 0)
+    stream->ret = gftp_end_transfer (stream->request);
+  else
+    gftp_abort_transfer (stream->request);
+
+  if (stream->ret >= 0 && done != stream->size)
+    {
+      stream->request->logging_function (gftp_logging_error, stream->request,
+                     _("Error: Only %lld of %lld bytes of %s were transferred\n"),
+                     (long long) done, (long long) stream->size,
+                     stream->filename);
+      stream->ret = GFTP_ERETRYABLE;
+    }
+
+  g_free (buf);
+  return (NULL);
+}
+
+
+static int
+_speedtest_run (gftp_request * request, gftpui_speedtest_stream * streams,
+                int num_streams, int upload, size_t blksize, off_t size)
+{
+  pthread_t tids[SPEEDTEST_MAX_STREAMS];
+  int started[SPEEDTEST_MAX_STREAMS];
+  double start, elapsed, cpu, *latencies;
+  size_t num_latencies, i;
+  int ret, s;
+
+  for (s = 0; s < num_streams; s++)
+    {
+      streams[s].upload = upload;
+      streams[s].blksize = blksize;
+      streams[s].size = size / num_streams +
+                        (s < size % num_streams ? 1 : 0);
+      streams[s].max_latencies = streams[s].size / blksize + 16;
+      streams[s].latencies = g_malloc (streams[s].max_latencies *
+                                       sizeof (*streams[s].latencies));
+    }
+
+  cpu = _speedtest_cpu_time ();
+  start = _speedtest_now ();
+
+  for (s = 1; s < num_streams; s++)
+    {
+      started[s] = pthread_create (&tids[s], NULL, _speedtest_run_stream,
+                                   &streams[s]) == 0;
+      if (!started[s])
+        {
+          streams[s].ret = GFTP_EFATAL;
+          streams[s].num_latencies = 0;
+        }
+    }
+
+  _speedtest_run_stream (&streams[0]);
+
+  for (s = 1; s < num_streams; s++)
+    if (started[s])
+      pthread_join (tids[s], NULL);
+
+  elapsed = MAX (_speedtest_now () - start, 0.000001);
+  cpu = _speedtest_cpu_time () - cpu;
+
+  ret = 0;
+  num_latencies = 0;
+  for (s = 0; s < num_streams; s++)
+    {
+      if (streams[s].ret < 0)
+        ret = streams[s].ret;
+      num_latencies += streams[s].num_latencies;
+    }
+
+  /* Percentiles are taken over the blocks of all streams together */
+  latencies = g_malloc ((num_latencies + 1) * sizeof (*latencies));
+  num_latencies = 0;
+  for (s = 0; s < num_streams; s++)
+    {
+      memcpy (latencies + num_latencies, streams[s].latencies,
+              streams[s].num_latencies * sizeof (*latencies));
+      num_latencies += streams[s].num_latencies;
+      g_free (streams[s].latencies);
+      streams[s].latencies = NULL;
+    }
+
+  if (ret == 0 && num_latencies > 0)
+    {
+      qsort (latencies, num_latencies, sizeof (*latencies),
+             _speedtest_compare_double);
+      i = num_latencies - 1;
+
+      request->logging_function (gftp_logging_misc_nolog, request,
+                     "%-8s %8lu %7d %9.2f %8.3f %8.3f %8.3f %8.3f %5.0f%%\n",
+                     upload ? _("upload") : _("download"),
+                     (unsigned long) blksize, num_streams,
+                     size / (1024.0 * 1024.0) / elapsed,
+                     latencies[i * 50 / 100], latencies[i * 90 / 100],
+                     latencies[i * 99 / 100], latencies[i],
+                     cpu * 100.0 / elapsed);
+    }
+
+  g_free (latencies);
+  return (ret);
+}
+
+
+static int
+_speedtest_connect_streams (gftp_request * request,
+                            gftpui_speedtest_stream * streams,
+                            int num_streams, int *connected)
+{
+  char *name;
+  int ret;
+
+  for (; *connected < num_streams; (*connected)++)
+    {
+      streams[*connected].request = gftp_copy_request (request);
+      streams[*connected].parent = request;
+      name = g_strdup_printf (".gftp-speedtest-%d-%d", getpid (),
+                              *connected);
+      streams[*connected].filename = gftp_build_path (request,
+                                                      request->directory,
+                                                      name, NULL);
+      g_free (name);
+
+      if ((ret = gftp_connect (streams[*connected].request)) < 0)
+        {
+          gftp_request_destroy (streams[*connected].request, 1);
+          g_free (streams[*connected].filename);
+          return (ret);
+        }
+    }
+
+  return (0);
+}
+
+
+static int
+_speedtest_run_all (gftpui_callback_data * cdata)
+{
+  gftpui_speedtest_stream streams[SPEEDTEST_MAX_STREAMS];
+  gftpui_speedtest_args * args;
+  gftp_request * request;
+  int connected, max_streams, ret, i;
+  GList * b, * n;
+
+  request = cdata->request;
+  args = cdata->user_data;
+
+  max_streams = 0;
+  for (n = args->numstreams; n != NULL; n = n->next)
+    max_streams = MAX (max_streams, GPOINTER_TO_INT (n->data));
+
+  memset (streams, 0, sizeof (streams));
+  connected = 0;
+  ret = _speedtest_connect_streams (request, streams, max_streams,
+                                    &connected);
+
+  if (ret == 0)
+    request->logging_function (gftp_logging_misc_nolog, request,
+                   "%-8s %8s %7s %9s %8s %8s %8s %8s %6s\n",
+                   _("Test"), _("Block"), _("Streams"), _("MB/s"),
+                   _("p50 ms"), _("p90 ms"), _("p99 ms"), _("max ms"),
+                   _("CPU"));
+
+  for (n = args->numstreams; ret == 0 && n != NULL; n = n->next)
+    for (b = args->blksizes; ret == 0 && b != NULL; b = b->next)
+      {
+        ret = _speedtest_run (request, streams, GPOINTER_TO_INT (n->data), 1,
+                              GPOINTER_TO_INT (b->data), args->size);
+        if (ret == 0)
+          ret = _speedtest_run (request, streams, GPOINTER_TO_INT (n->data),
+                                0, GPOINTER_TO_INT (b->data), args->size);
+      }
+
+  for (i = 0; i < connected; i++)
+    {
+      /* The scratch files are removed even when the test was stopped */
+      streams[i].request->cancel = 0;
+      if (streams[i].uploaded &&
+          (GFTP_IS_CONNECTED (streams[i].request) ||
+           gftp_connect (streams[i].request) == 0))
+        gftp_remove_file (streams[i].request, streams[i].filename);
+
+      gftp_disconnect (streams[i].request);
+      gftp_request_destroy (streams[i].request, 1);
+      g_free (streams[i].filename);
+    }
+
+  if (ret < 0 && !request->cancel)
+    request->logging_function (gftp_logging_error, request,
+                               _("The speed test was stopped\n"));
+
+  /* Each failed stream was already logged, so the test is not run again */
+  return (ret < 0 ? GFTP_EFATAL : 0);
+}
+
+
+int
+gftpui_common_cmd_speedtest (void *uidata, gftp_request * request,
+                             void *other_uidata, gftp_request * other_request,
+                             const char *command)
+{
+  gftpui_callback_data * cdata;
+  gftpui_speedtest_args args;
+  const char *argv[4];
+  int i, argc;
+  char **words;
+
+  if (!GFTP_IS_CONNECTED (request))
+    {
+      request->logging_function (gftp_logging_error, request,
+                                 _("Error: Not connected to a remote site\n"));
+      return (1);
+    }
+
+  argv[0] = SPEEDTEST_DEFAULT_SIZE;
+  argv[1] = SPEEDTEST_DEFAULT_BLKSIZES;
+  argv[2] = SPEEDTEST_DEFAULT_STREAMS;
+
+  words = g_strsplit_set (command, " \t", 0);
+  for (i = 0, argc = 0; words[i] != NULL; i++)
+    if (*words[i] != '\0' && argc++ < 3)
+      argv[argc - 1] = words[i];
+
+  args.blksizes = args.numstreams = NULL;
+  if (argc > 3 || !_speedtest_parse_size (argv[0], &args.size) ||
+      (args.blksizes = _speedtest_parse_list (argv[1], G_MAXINT)) == NULL ||
+      (args.numstreams = _speedtest_parse_list (argv[2],
+                                                SPEEDTEST_MAX_STREAMS)) == NULL)
+    {
+      request->logging_function (gftp_logging_error, request,
+                     _("usage: speedtest [size [block size,... [streams,...]]]\n"
+                       "       default: speedtest %s %s %s\n"),
+                     SPEEDTEST_DEFAULT_SIZE, SPEEDTEST_DEFAULT_BLKSIZES,
+                     SPEEDTEST_DEFAULT_STREAMS);
+      g_strfreev (words);
+      g_list_free (args.blksizes);
+      return (1);
+    }
+
+  g_strfreev (words);
+
+  cdata = g_malloc0 (sizeof (*cdata));
+  cdata->request = request;
+  cdata->uidata = uidata;
+  cdata->user_data = &args;
+  cdata->run_function = _speedtest_run_all;
+  cdata->dont_refresh = 1;
+
+  gftpui_common_run_callback_function (cdata);
+
+  g_free (cdata);
+  g_list_free (args.blksizes);
+  g_list_free (args.numstreams);
+
+  return (1);
+}